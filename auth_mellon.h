@@ -113,6 +113,13 @@
 #define SESSION_STATE_NODE_NAME "MellonSessionState"
 #define SESSION_STATE_VERSION "1.0"
 
+#define SESSION_STATE_BINARY_MAGIC "AMSB"
+#define SESSION_STATE_BINARY_MAGIC_LEN 4
+#define SESSION_STATE_BINARY_VERSION 3
+
+#define SESSION_LOGOUT_STATE_BINARY_MAGIC "AMSL"
+#define SESSION_LOGOUT_STATE_BINARY_VERSION 1
+
 #define SESSION_STATE_NS_PREFIX "amss"
 #define SESSION_STATE_NS_HREF "mod_auth_mellon"
 
@@ -145,6 +152,22 @@ typedef enum {
  */
 #define AM_ID_LENGTH 32
 
+/* With MellonSessionIdSecretFile set a session id is a random id of
+ * AM_ID_LENGTH characters followed by a MAC of this many hexadecimal
+ * characters, see am_generate_session_id().
+ */
+#define AM_SESSION_ID_MAC_LENGTH 32
+#define AM_SESSION_ID_LENGTH (AM_ID_LENGTH + AM_SESSION_ID_MAC_LENGTH)
+/* Minimum length of a secret in MellonSessionIdSecretFile */
+#define AM_SESSION_ID_SECRET_MIN_LENGTH 32
+
+/* A sealed session (MellonSessionStorage cookie) is split over cookies
+ * holding at most this many characters each, and at most this many
+ * cookies.
+ */
+#define AM_SEALED_COOKIE_CHUNK_SIZE 3800
+#define AM_SEALED_COOKIE_MAX_CHUNKS 8
+
 #define MEDIA_TYPE_PAOS "application/vnd.paos+xml"
 
 #define am_get_srv_cfg(s) (am_srv_cfg_rec *)ap_get_module_config((s)->module_config, &auth_mellon_module)
@@ -159,6 +182,81 @@ typedef enum {
 #define am_get_diag_cfg(s) (&(am_get_srv_cfg((s)))->diag_cfg)
 #endif
 
+/* One key of a batched socache operation, see am_cache_batch_provider_t */
+typedef struct am_cache_batch_item_t {
+    const char *what;          /* type of the entry, used for logging */
+    const unsigned char *key;
+    unsigned int key_len;
+    apr_time_t expiry;         /* store only */
+    unsigned char *data;       /* data to store, or buffer to retrieve into */
+    unsigned int data_len;     /* on retrieve: buffer size in, length out */
+    bool probe;                /* retrieve only: the entry is not needed,
+                                * APR_ENOSPC is expected */
+    apr_status_t status;       /* outcome for this key */
+} am_cache_batch_item_t;
+
+/*
+ * Socache providers able to handle several keys in one round trip
+ * register this interface under their socache provider name in the
+ * AM_CACHE_BATCH_PROVIDER_GROUP group. Each function must set the
+ * status of every item, with the same meaning as the status returned
+ * by the ap_socache_provider_t function of the same name, and returns
+ * APR_SUCCESS unless the batch as a whole failed. Any function may be
+ * NULL, Mellon then falls back to the regular socache calls.
+ *
+ * add stores only the entries which are not present yet, atomically
+ * for each key, and sets the status of an item already present to
+ * APR_EEXIST.
+ */
+#define AM_CACHE_BATCH_PROVIDER_GROUP "mellon_socache_batch"
+#define AM_CACHE_BATCH_PROVIDER_VERSION "0"
+
+typedef struct am_cache_batch_provider_t {
+    apr_status_t (*retrieve)(ap_socache_instance_t *instance, server_rec *s,
+                             am_cache_batch_item_t *items, int n_items,
+                             apr_pool_t *pool);
+    apr_status_t (*store)(ap_socache_instance_t *instance, server_rec *s,
+                          am_cache_batch_item_t *items, int n_items,
+                          apr_pool_t *pool);
+    apr_status_t (*remove)(ap_socache_instance_t *instance, server_rec *s,
+                           am_cache_batch_item_t *items, int n_items,
+                           apr_pool_t *pool);
+    apr_status_t (*add)(ap_socache_instance_t *instance, server_rec *s,
+                        am_cache_batch_item_t *items, int n_items,
+                        apr_pool_t *pool);
+} am_cache_batch_provider_t;
+
+/* Where the session state is kept, see MellonSessionStorage */
+typedef enum {
+    AM_SESSION_STORAGE_STORE,
+    AM_SESSION_STORAGE_COOKIE
+} am_session_storage_t;
+
+/*
+ * The entries of a per-process cache by key, in order of use. An entry
+ * starts with its am_lru_link_t, the functions take and return
+ * pointers to entries. The cache serializes calls with its own mutex.
+ * See am_lru_init().
+ */
+typedef struct am_lru_link_t {
+    struct am_lru_link_t *prev; /* more recently used */
+    struct am_lru_link_t *next; /* less recently used */
+    const char *key;            /* owned by the entry */
+} am_lru_link_t;
+
+typedef struct am_lru_t {
+    apr_hash_t *entries;        /* key -> entry */
+    am_lru_link_t *head;        /* most recently used */
+    am_lru_link_t *tail;        /* least recently used */
+    int count;
+} am_lru_t;
+
+/* A secret from MellonSessionIdSecretFile */
+typedef struct am_session_id_key_t {
+    const unsigned char *secret;
+    apr_size_t len;
+} am_session_id_key_t;
+
 typedef struct am_mod_cfg_rec {
     const char *post_dir;
     apr_time_t post_ttl;
@@ -174,7 +272,62 @@ typedef struct am_mod_cfg_rec {
     const char *socache_provider_args;
     ap_socache_provider_t *socache_provider;
     ap_socache_instance_t *socache_instance;
+    /* Batch interface of the socache provider, NULL if it has none */
+    const am_cache_batch_provider_t *socache_batch_provider;
     int socache_session_state_entry_size;
+    /* Session entries of at least this many bytes are stored
+     * compressed. 0 disables compression.
+     */
+    int socache_compress_threshold;
+
+    /* Per-process cache of decoded session state placed in front of
+     * the socache. A size of 0 disables it.
+     */
+    int session_cache_size;
+    int session_cache_ttl;
+
+    /* Per-process cache of MellonRequire/MellonCond decisions. A size
+     * of 0 disables it.
+     */
+    int authz_cache_size;
+    int authz_cache_ttl;
+
+    /* Percentage of MellonSessionIdleTimeout which has to elapse
+     * before the idle deadline of a session is pushed forward.
+     */
+    int session_idle_refresh;
+
+    /* Size in bytes of each generation of the shared filter in front
+     * of the Assertion ID replay records. 0 disables the filter.
+     */
+    int assertion_id_filter_size;
+
+    /* Seconds between sweeps of the session reaper, 0 disables it. */
+    int session_reaper_interval;
+
+    /* Secrets session ids are authenticated with, the first one signs
+     * new ids. NULL if session ids carry no MAC.
+     */
+    apr_array_header_t *session_id_keys;
+
+    /* Sessions may be sealed into cookies of at most
+     * session_cookie_max_size characters in total, larger sessions
+     * and the logout state are kept in the session store.
+     */
+    am_session_storage_t session_storage;
+    int session_cookie_max_size;
+
+    /* Attribute names "MellonAttributeFilter auto" keeps, collected
+     * from every configuration section. NULL unless a section uses
+     * "auto".
+     */
+    apr_hash_t *attribute_filter_auto_names;
+
+    /* The MellonIdentityHeader selections of every configuration
+     * section, keyed by identity_header_key, each mapping to a section
+     * using it. The JSON of each is stored with a new session.
+     */
+    apr_hash_t *identity_header_selections;
 } am_mod_cfg_rec;
 
 
@@ -200,6 +353,20 @@ typedef enum {
     am_enable_auth
 } am_enable_t;
 
+typedef enum {
+    AM_ATTRIBUTE_FILTER_DEFAULT,
+    AM_ATTRIBUTE_FILTER_OFF,    /* Store every attribute */
+    AM_ATTRIBUTE_FILTER_ALLOW,  /* Store the listed attributes */
+    AM_ATTRIBUTE_FILTER_DENY,   /* Store all but the listed attributes */
+    AM_ATTRIBUTE_FILTER_AUTO    /* Store the attributes the config uses */
+} am_attribute_filter_t;
+
+typedef enum {
+    AM_ENV_EXPORT_DEFAULT,
+    AM_ENV_EXPORT_ALL,          /* Export every attribute */
+    AM_ENV_EXPORT_DECLARED      /* Export renamed and listed attributes */
+} am_env_export_t;
+
 typedef enum {
   am_samesite_default,
   am_samesite_lax,
@@ -249,14 +416,70 @@ typedef struct am_file_data_t {
                              read from path */
 } am_file_data_t;
 
+/* A regular expression compiled with the PCRE2 JIT */
+typedef struct am_regex_jit_t am_regex_jit_t;
+
 typedef struct {
     const char *varname;
     int flags;
     const char *str; 
     ap_regex_t *regex; 
+    const am_regex_jit_t *jit;  /* regex with the PCRE2 JIT, or NULL */
     const char *directive;
 } am_cond_t;
 
+/* Op of a compiled condition program continuing with the next op, or
+ * denying access when a condition fails outside of an [OR] group */
+#define AM_COND_OP_DENY -1
+
+typedef enum {
+    AM_COND_OP_TEST,        /* Evaluate a single condition */
+    AM_COND_OP_EQUAL_SET,   /* Value equal to one of a run of conditions */
+    AM_COND_OP_SUBSTR_SET,  /* Value containing one of a run of conditions */
+} am_cond_op_type_t;
+
+/* Aho-Corasick automaton of an AM_COND_OP_SUBSTR_SET op */
+typedef struct am_cond_acm_t am_cond_acm_t;
+
+/*
+ * A condition of a compiled program. Ignored conditions are left out,
+ * so ops are indexes into the program's ops, where nops means the
+ * conditions are satisfied.
+ *
+ * A run of literal [OR] conditions on the same attribute with the same
+ * flags is compiled into a single op testing the nconds conditions
+ * starting at cond at once, with a hash set of the values or, for
+ * [SUB], an Aho-Corasick automaton. Values of [NC] runs are folded to
+ * lower case.
+ */
+typedef struct am_cond_op_t {
+    am_cond_op_type_t type;
+    const am_cond_t *cond;
+    int nconds;
+    apr_hash_t *set;            /* AM_COND_OP_EQUAL_SET, value -> cond */
+    const am_cond_acm_t *acm;   /* AM_COND_OP_SUBSTR_SET */
+    int slot;       /* attribute compared, index into the program names */
+    int on_match;   /* op to continue with if the condition holds */
+    int on_fail;    /* op to continue with otherwise, or AM_COND_OP_DENY */
+} am_cond_op_t;
+
+/*
+ * The MellonRequire and MellonCond conditions of a directory
+ * configuration, compiled by am_cond_compile() as the directives are
+ * read. Attribute names are interned into slots, so a request looks up
+ * each attribute once. Slots of conditions with the MAP flag are
+ * mapped through the MellonSetEnv of the request's configuration when
+ * they are looked up.
+ */
+typedef struct am_cond_program_t {
+    const am_cond_op_t *ops;
+    int nops;
+    const char **names;
+    const bool *mapped;
+    int nslots;
+    bool has_fstr;  /* a condition depends on the request */
+} am_cond_program_t;
+
 typedef struct am_metadata {
     am_file_data_t *metadata; /* Metadata file with one or many IdP */
     am_file_data_t *chain;    /* Validating chain */
@@ -277,10 +500,27 @@ typedef struct am_dir_cfg_rec {
     const char *cookie_path;
     am_samesite_t cookie_samesite;
     apr_array_header_t *cond;
+    /* cond compiled, NULL if there are no conditions */
+    const am_cond_program_t *cond_program;
+    apr_pool_t *cond_pool;
     apr_hash_t *envattr;
     const char *env_prefix;
+    /* MellonEnvExport, the names are a set of attribute names */
+    am_env_export_t env_export;
+    apr_hash_t *env_export_names;
+    /* MellonIdentityHeader, "" when turned off. The names are a set of
+     * attribute names, NULL for every attribute. The key identifies the
+     * selection in the session record. */
+    const char *identity_header;
+    apr_hash_t *identity_header_names;
+    const char *identity_header_key;
     const char *userattr;
     const char *idpattr;
+    /* MellonAttributeFilter, the names are a set of attribute names */
+    am_attribute_filter_t attribute_filter;
+    apr_hash_t *attribute_filter_names;
+    /* Merged only from sections am_attribute_filter_init() walked */
+    bool attribute_names_known;
     LassoSignatureMethod signature_method;
     int dump_session;
     int dump_saml_response;
@@ -361,6 +601,12 @@ typedef struct am_dir_cfg_rec {
     /* Enabled the session invalidate endpoint. */
     int enabled_invalidation_session;
 
+    /* Enable the session store statistics endpoint. */
+    int stats_endpoint;
+
+    /* Enable the session revocation endpoint. */
+    int revoke_endpoint;
+
     /* Send Expect Header. */
     int send_expect_header;
 
@@ -376,6 +622,11 @@ typedef enum {
 
 typedef struct am_req_cfg_rec {
     char *cookie_value;
+    char *sealed_cookie_value;
+    /* The session of this request once am_get_request_session() has
+     * looked it up, NULL if there is none. */
+    bool session_loaded;
+    struct am_session_state_t *session;
 #ifdef HAVE_ECP
     bool ecp_authn_req;
     ECPServiceOptions ecp_service_options;
@@ -394,20 +645,49 @@ typedef struct am_session_state_t {
     apr_hash_t *env_attrs;
     apr_time_t expires;
     apr_time_t idle_timeout;
+    /* Global and IdP generation the session was created under */
+    apr_uint64_t generation;
+    apr_uint64_t idp_generation;
     int logged_in;
     const char *user;
     const char *cookie_token;
+    /*
+     * The Lasso dumps and the SAML response are only needed by the
+     * logout and dump paths. They are kept in a separate cache record
+     * and are not valid until logout_state_loaded is set, see
+     * am_session_load_logout_state().
+     */
+    bool logout_state_loaded;
     const char *lasso_identity_dump;
     const char *lasso_session_dump;
     const char *saml_response;
+    /* Carried in sealed cookies rather than the session store */
+    bool sealed;
+    /*
+     * The attributes serialized for MellonIdentityHeader, keyed by the
+     * identity_header_key of the selection they were serialized for.
+     * Those of the configured selections are stored with the session.
+     */
+    apr_hash_t *identity_json;
 } am_session_state_t;
 
+/* Number of indexed variable names (NAME_0, NAME_1, ...) prepared for
+ * each MellonSetEnv attribute, higher indexes are formatted per request.
+ */
+#define AM_ENVATTR_INDEXED_NAMES 8
+
 /* Type for configuring environment variable names */
 typedef struct am_envattr_conf_t {
     // Name of the variable
     const char *name;
     // Should a prefix be added
     int prefixed;
+    // Name of the variable as exported, with the prefix if any
+    const char *prefixed_name;
+    // Exported names with the _0 to _7 suffixes for multiple values
+    const char *indexed_names[AM_ENVATTR_INDEXED_NAMES];
+    // Exported name with the _N suffix for the number of values
+    const char *count_name;
 } am_envattr_conf_t;
 
 extern const command_rec auth_mellon_commands[];
@@ -447,6 +727,14 @@ static const int inherit_send_cache_control_header = -1;
 static const int default_post_replay = 0;
 static const int inherit_post_replay = -1;
 
+/* Default and inherit values for MellonStatsEndpoint option. */
+static const int default_stats_endpoint = 0;
+static const int inherit_stats_endpoint = -1;
+
+/* Default and inherit values for MellonRevokeEndpoint option. */
+static const int default_revoke_endpoint = 0;
+static const int inherit_revoke_endpoint = -1;
+
 /* Whether to send an ECP client a list of IdP's */
 static const int default_ecp_send_idplist = 0;
 static const int inherit_ecp_send_idplist = -1;
@@ -464,12 +752,18 @@ void *auth_mellon_dir_config(apr_pool_t *p, char *d);
 void *auth_mellon_dir_merge(apr_pool_t *p, void *base, void *add);
 void *auth_mellon_server_config(apr_pool_t *p, server_rec *s);
 void *auth_mellon_srv_merge(apr_pool_t *p, void *base, void *add);
+void am_attribute_filter_add_names(apr_pool_t *p, const am_dir_cfg_rec *d,
+                                   apr_hash_t *names);
+void am_attribute_filter_init(apr_pool_t *p, server_rec *s);
 
 
 const char *am_cookie_get(request_rec *r);
 void am_cookie_set(request_rec *r, const char *id);
 void am_cookie_delete(request_rec *r);
 const char *am_cookie_token(request_rec *r);
+const char *am_cookie_get_sealed(request_rec *r);
+void am_cookie_set_sealed(request_rec *r, const char *value);
+void am_cookie_delete_sealed(request_rec *r);
 
 
 apr_status_t
@@ -477,12 +771,66 @@ am_get_socache_provider(apr_pool_t *pool, const char *name,
                         ap_socache_provider_t **socache_provider_out,
                         const char **errmsg_out);
 
-void am_cache_update_expires(request_rec *r, am_cache_entry_t *t, apr_time_t expires);
-void am_cache_update_idle_timeout(request_rec *r, am_cache_entry_t *t, int session_idle_timeout);
-
 apr_status_t
 am_socache_init(apr_pool_t *pool, apr_pool_t *tmp_pool, server_rec *s);
 
+apr_status_t
+am_cache_child_init(apr_pool_t *p, server_rec *s);
+
+apr_status_t
+am_cache_reaper_start(apr_pool_t *p, server_rec *s);
+
+bool
+am_cache_reaper_active(server_rec *s);
+
+/* Per-process counters of the session entry compression */
+typedef struct am_cache_compress_stats_t {
+    apr_uint64_t compressed;      /* entries stored compressed */
+    apr_uint64_t incompressible;  /* entries not worth compressing */
+    apr_uint64_t decompressed;    /* compressed entries read back */
+    apr_uint64_t bytes_in;        /* uncompressed size of compressed entries */
+    apr_uint64_t bytes_out;       /* compressed size of those entries */
+    apr_interval_time_t compress_time;
+    apr_interval_time_t decompress_time;
+} am_cache_compress_stats_t;
+
+void
+am_cache_get_compress_stats(am_cache_compress_stats_t *stats);
+
+/* Operations taking the socache lock, for the lock statistics */
+typedef enum {
+    AM_CACHE_OP_LOAD_SESSION,
+    AM_CACHE_OP_LOAD_BY_NAME_ID,
+    AM_CACHE_OP_LOAD_LOGOUT,
+    AM_CACHE_OP_STORE,
+    AM_CACHE_OP_DELETE,
+    AM_CACHE_OP_LOAD_TOUCH,
+    AM_CACHE_OP_TOUCH,
+    AM_CACHE_OP_ASSERTION_ID,
+    AM_CACHE_OP_LOAD_GENERATION,
+    AM_CACHE_OP_STORE_GENERATION,
+    AM_CACHE_OP_CREATE_GENERATION,
+    AM_CACHE_OP_MAX
+} am_cache_op_t;
+
+/* Per-process socache lock counters of one type of operation */
+typedef struct am_cache_lock_stats_t {
+    apr_uint64_t count;
+    apr_interval_time_t wait_time;
+    apr_interval_time_t wait_max;
+    apr_interval_time_t hold_time;
+    apr_interval_time_t hold_max;
+} am_cache_lock_stats_t;
+
+const char *
+am_cache_op_name(am_cache_op_t op);
+
+void
+am_cache_get_lock_stats(am_cache_lock_stats_t stats[AM_CACHE_OP_MAX]);
+
+apr_status_t
+am_cache_write_stats(request_rec *r, bool prometheus);
+
 
 /*--------------------------------- typedefs ---------------------------------*/
 /*--------------------------------- defines ----------------------------------*/
@@ -500,8 +848,62 @@ am_cache_store_session_entries(request_rec *r,
                                LassoSaml2NameID *name_id,
                                LassoSaml2NameID *issuer,
                                apr_time_t expiration,
-                               const char *session_xml);
+                               const char *session_data,
+                               apr_size_t session_data_len,
+                               const char *logout_data,
+                               apr_size_t logout_data_len);
+
+const char *
+am_cache_load_session_logout_data(request_rec *r, const char *session_id,
+                                  apr_size_t *data_len_out);
+
+apr_status_t
+am_cache_load_session_touch(request_rec *r, const char *session_id,
+                            apr_time_t *idle_timeout_out);
+
+apr_status_t
+am_cache_store_session_touch(request_rec *r, const char *session_id,
+                             apr_time_t expiration, apr_time_t idle_timeout);
 
+bool
+am_cache_get_session_touch(request_rec *r, const char *session_id,
+                           apr_time_t *idle_timeout_out);
+
+apr_status_t
+am_cache_revoke_sealed_session(request_rec *r, const char *session_id,
+                               apr_time_t expiration);
+
+apr_status_t
+am_cache_sealed_session_revoked(request_rec *r, const char *session_id,
+                                bool *revoked);
+
+const char *
+am_cache_load_session_id_by_name_id(request_rec *r,
+                                    LassoSaml2NameID *name_id,
+                                    LassoSaml2NameID *issuer);
+
+apr_status_t
+am_cache_load_generations(request_rec *r, const char *idp,
+                          apr_uint64_t *generation,
+                          apr_uint64_t *idp_generation);
+
+apr_status_t
+am_cache_bump_generation(request_rec *r, const char *idp,
+                         apr_uint64_t *generation_out);
+
+apr_status_t
+am_cache_store_assertion_id(request_rec *r, const char *assertion_id,
+                            apr_time_t issued, apr_time_t expiration);
+
+bool
+am_cache_authz_get(request_rec *r, const char *key, int *decision_out);
+
+void
+am_cache_authz_put(request_rec *r, const char *key, int decision);
+
+void
+am_cache_session_identity_put(request_rec *r, const char *session_id,
+                              const char *key, const char *json);
 
 
 am_session_state_t *
@@ -527,11 +929,30 @@ am_cache_load_diag_dir(request_rec *r, const char *diag_dir);
 /*-------------------------- auth_mellon_diagnostics -------------------------*/
 /*--------------------------- auth_mellon_handler ----------------------------*/
 /*-------------------------- auth_mellon_httpclient --------------------------*/
+/*------------------------------ auth_mellon_shm -----------------------------*/
+
+void
+am_shm_register_provider(apr_pool_t *p);
+
+/*----------------------------- auth_mellon_redis ----------------------------*/
+
+void
+am_redis_register_provider(apr_pool_t *p);
+
+apr_status_t
+am_redis_child_init(apr_pool_t *p, server_rec *s);
+
 /*---------------------------- auth_mellon_session ---------------------------*/
 
 apr_status_t
 am_session_store(request_rec *r, am_session_state_t *session);
 
+apr_status_t
+am_session_load_logout_state(request_rec *r, am_session_state_t *session);
+
+void
+am_session_touch(request_rec *r, am_session_state_t *session);
+
 void am_session_update_expires(request_rec *r, am_session_state_t *session,
                                apr_time_t expires);
 
@@ -554,9 +975,32 @@ apr_time_t am_parse_timestamp(request_rec *r, const char *timestamp);
 am_session_state_t *
 am_session_state_new(request_rec *r);
 
+am_session_state_t *
+am_session_state_copy(apr_pool_t *pool, const am_session_state_t *src);
+
 am_session_state_t *
 am_session_state_from_xml(request_rec *r, xmlDocPtr doc);
 
+const char *
+am_session_state_to_binary(request_rec *r, am_session_state_t *ss,
+                           apr_size_t *len_out);
+
+bool
+am_session_state_is_binary(const char *data, apr_size_t len);
+
+bool
+am_session_state_peek_times(const char *data, apr_size_t len,
+                            apr_time_t *expires_out,
+                            apr_time_t *idle_timeout_out);
+
+am_session_state_t *
+am_session_state_from_binary(request_rec *r, const char *data,
+                             apr_size_t len);
+
+const char *
+am_session_logout_state_to_binary(request_rec *r, am_session_state_t *ss,
+                                  apr_size_t *len_out);
+
 apr_array_header_t *
 am_session_set_env_attr_name(request_rec *r, am_session_state_t *ss,
                                  const char *name);
@@ -587,12 +1031,18 @@ char *
 am_str_join(apr_pool_t *pool, apr_array_header_t *strings,
             const char *separator);
 
+char *
+am_json_quote(apr_pool_t *pool, const char *str);
+
 xmlNodePtr
 am_xml_get_first_child(xmlNodePtr node, const char *name, const char *ns_href);
 
 char *
 am_time_t_to_8601(apr_pool_t *pool, apr_time_t t);
 
+apr_uint32_t
+am_process_start_time(pid_t pid);
+
 const char *
 am_mapped_env_attr_name(request_rec *r, const char *attr_name,
                         const char **prefixed_out);
@@ -622,10 +1072,24 @@ am_session_state_t *am_get_request_session_by_assertion_id(request_rec *r,
 am_session_state_t *am_new_request_session(request_rec *r);
 void am_release_request_session(request_rec *r, am_session_state_t **session_var);
 void am_session_delete(request_rec *r, am_session_state_t *session);
+void am_session_revoke_sealed_by_name_id(request_rec *r,
+                                         LassoSaml2NameID *name_id,
+                                         LassoSaml2NameID *issuer);
 
 
 char *am_reconstruct_url(request_rec *r);
 int am_validate_redirect_url(request_rec *r, const char *url);
+const am_regex_jit_t *am_regex_jit_compile(apr_pool_t *p,
+                                           const char *pattern, int cflags);
+apr_status_t am_cond_regex_cache_init(apr_pool_t *p, server_rec *s);
+void am_lru_init(am_lru_t *lru, apr_pool_t *pool);
+void *am_lru_get(am_lru_t *lru, const char *key);
+void am_lru_use(am_lru_t *lru, void *entry);
+void am_lru_add(am_lru_t *lru, void *entry, const char *key);
+void am_lru_remove(am_lru_t *lru, void *entry);
+void *am_lru_oldest(am_lru_t *lru);
+const am_cond_program_t *am_cond_compile(apr_pool_t *p,
+                                         const apr_array_header_t *cond);
 int am_check_permissions(request_rec *r, am_session_state_t *session);
 void am_set_cache_control_headers(request_rec *r);
 int am_read_post_data(request_rec *r, char **data, apr_size_t *length);
@@ -636,6 +1100,12 @@ char *am_urlencode(apr_pool_t *pool, const char *str);
 int am_urldecode(char *data);
 int am_check_url(request_rec *r, const char *url);
 char *am_generate_id(request_rec *r);
+char *am_generate_session_id(request_rec *r);
+bool am_session_id_valid(request_rec *r, const char *session_id);
+char *am_seal_data(request_rec *r, const char *data, apr_size_t len,
+                   const char *aad);
+char *am_unseal_data(request_rec *r, const char *sealed, const char *aad,
+                     apr_size_t *len_out);
 am_file_data_t *am_file_data_new(apr_pool_t *pool, const char *path);
 am_file_data_t *am_file_data_copy(apr_pool_t *pool,
                                   am_file_data_t *src_file_data);
@@ -21,6 +21,15 @@
 
 #include "auth_mellon.h"
 
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "apr_atomic.h"
+#include "apr_thread_proc.h"
+#include "apr_version.h"
+
 #ifdef APLOG_USE_MODULE
 APLOG_USE_MODULE(auth_mellon);
 #endif
@@ -31,11 +40,75 @@ APLOG_USE_MODULE(auth_mellon);
 #define DIAG_DIR_ENTRY_SIZE 16
 
 #define SESSION_KEY_PREFIX "session_id"
+#define SESSION_LOGOUT_KEY_PREFIX "session_logout"
+#define SESSION_TOUCH_KEY_PREFIX "session_touch"
+#define SESSION_REVOKED_KEY_PREFIX "session_revoked"
 #define NAMEID_KEY_PREFIX "name_id"
 #define ASSERTIONID_KEY_PREFIX "assertion_id"
 #define DIAG_DIR_KEY_PREFIX "diag_dir"
+#define GENERATION_KEY_PREFIX "generation"
+
+#define COMPRESSED_ENTRY_MAGIC "AMSZ"
+#define COMPRESSED_ENTRY_MAGIC_LEN 4
+#define COMPRESSED_ENTRY_HEADER_LEN (COMPRESSED_ENTRY_MAGIC_LEN + 4)
+/* Refuse to inflate an entry claiming to be larger than this */
+#define COMPRESSED_ENTRY_MAX_SIZE (16 * 1024 * 1024)
+
+/* A touch record is the magic followed by the idle deadline (int64 BE) */
+#define SESSION_TOUCH_MAGIC "AMST"
+#define SESSION_TOUCH_MAGIC_LEN 4
+#define SESSION_TOUCH_ENTRY_SIZE (SESSION_TOUCH_MAGIC_LEN + 8)
+/* Idle deadlines of recently touched sessions remembered by a process */
+#define SESSION_TOUCH_CACHE_SIZE 1024
+/* Seconds a process relies on a sealed session not being revoked */
+#define SESSION_REVOKED_CACHE_TTL 5
+
+/* A generation record is the magic, the generation and when it was
+ * written (both int64 BE) */
+#define GENERATION_MAGIC "AMGN"
+#define GENERATION_MAGIC_LEN 4
+#define GENERATION_ENTRY_SIZE (GENERATION_MAGIC_LEN + 16)
+/* Seconds a process relies on the generations it read */
+#define GENERATION_CACHE_TTL 5
+/* Maximum number of generations cached by a process */
+#define GENERATION_CACHE_SIZE 1024
+/* Seconds after which a generation record read is written again */
+#define GENERATION_REFRESH 3600
+/* Expiry of a generation record, in seconds. memcached reads an
+ * expiry of more than 30 days as an absolute time, keep below. */
+#define GENERATION_LIFETIME (29 * 86400)
+
+/* Seconds each generation of the replay filter covers */
+#define REPLAY_FILTER_PERIOD 900
+/* Bits set in the replay filter per Assertion ID */
+#define REPLAY_FILTER_HASHES 6
+#define REPLAY_FILTER_MIN_SIZE 4096
+#define REPLAY_FILTER_HEADER_SIZE 64
+/* Clock skew accepted when validating assertion timestamps */
+#define REPLAY_CLOCK_SKEW 60
+
+/* Intervals without a sign of the reaping process before another
+ * process takes over */
+#define REAPER_LEADER_TIMEOUT 3
+/* Bytes of a session entry, compressed or inflated, read for its times */
+#define REAPER_PEEK_SIZE 4096
+/* Entries deleted by the reaper per lock acquisition */
+#define REAPER_BATCH_SIZE 100
+
+/* Length of an authorization cache key, a SHA-256 digest in hex */
+#define AUTHZ_CACHE_KEY_LEN 64
 
 /*--------------------------------- Prototypes -------------------------------*/
+
+struct am_cache_lock_t;
+
+static apr_status_t
+am_cache_aquire_lock(request_rec *r, struct am_cache_lock_t *lock,
+                     am_cache_op_t op);
+
+static apr_status_t
+am_cache_release_lock(request_rec *r, struct am_cache_lock_t *lock);
+
 /*----------------------------- Internal Functions ---------------------------*/
 
 /**
@@ -184,6 +257,33 @@ session_key_name(request_rec *r, const char *session_id)
     return apr_psprintf(r->pool, "%s:%s", SESSION_KEY_PREFIX, session_id);
 }
 
+static const char *
+session_logout_key_name(request_rec *r, const char *session_id)
+{
+    return apr_psprintf(r->pool, "%s:%s", SESSION_LOGOUT_KEY_PREFIX,
+                        session_id);
+}
+
+static const char *
+session_touch_key_name(request_rec *r, const char *session_id)
+{
+    return apr_psprintf(r->pool, "%s:%s", SESSION_TOUCH_KEY_PREFIX,
+                        session_id);
+}
+
+static const char *
+session_revoked_key_name(request_rec *r, const char *session_id)
+{
+    return apr_psprintf(r->pool, "%s:%s", SESSION_REVOKED_KEY_PREFIX,
+                        session_id);
+}
+
+static const char *
+assertion_id_key_name(request_rec *r, const char *digest)
+{
+    return apr_psprintf(r->pool, "%s:%s", ASSERTIONID_KEY_PREFIX, digest);
+}
+
 static const char *
 name_id_key_name(request_rec *r, LassoSaml2NameID *name_id,
                  LassoSaml2NameID *issuer)
@@ -198,568 +298,4580 @@ name_id_key_name(request_rec *r, LassoSaml2NameID *name_id,
     return apr_psprintf(r->pool, "%s:%s", NAMEID_KEY_PREFIX, key);
 }
 
-/*------------------------------ Public Functions ----------------------------*/
-
+/**
+ * Create a segment of shared memory for state shared by all processes
+ *
+ * Anonymous shared memory is used where available, otherwise a file
+ * named @name in the runtime directory. Must be called before the
+ * children are forked.
+ *
+ * @param[in]  pool     Configuration pool, owning the segment
+ * @param[in]  size     Size of the segment
+ * @param[in]  name     File name used when anonymous memory is missing
+ * @param[out] base_out the zeroed memory
+ *
+ * @returns APR_SUCCESS or an error status.
+ */
 static apr_status_t
-am_destroy_socache(server_rec *s)
+am_cache_shm_create(apr_pool_t *pool, apr_size_t size, const char *name,
+                    void **base_out)
 {
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
-
-    if (mod_cfg->socache_instance) {
-        mod_cfg->socache_provider->destroy(mod_cfg->socache_instance, s);
-        mod_cfg->socache_instance = NULL;
+    apr_shm_t *shm = NULL;
+    apr_status_t rv;
+
+    rv = apr_shm_create(&shm, size, NULL, pool);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        const char *filename = ap_runtime_dir_relative(pool, name);
+        apr_shm_remove(filename, pool);
+        rv = apr_shm_create(&shm, size, filename, pool);
+    }
+    if (rv != APR_SUCCESS) {
+        return rv;
     }
-    return APR_SUCCESS;
-}
 
-static apr_status_t
-am_destroy_socache_lock(server_rec *s)
-{
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+    *base_out = apr_shm_baseaddr_get(shm);
+    memset(*base_out, 0, size);
 
-    if (mod_cfg->socache_lock) {
-        apr_global_mutex_destroy(mod_cfg->socache_lock);
-        mod_cfg->socache_lock = NULL;
-    }
     return APR_SUCCESS;
 }
 
-static apr_status_t
-destroy_socache_callback(void *data)
-{
-    server_rec *s = (server_rec *)data;
+/*-------------------------- Decoded Session Cache ---------------------------*/
 
-    return am_destroy_socache(s);
+/*
+ * Every authenticated request has to turn the serialized session
+ * state held in the socache back into an am_session_state_t. To avoid
+ * repeating that work on every request each process keeps a small LRU
+ * cache of decoded sessions keyed by session id.
+ *
+ * Each cached session lives in its own sub-pool so it can be released
+ * individually on eviction. Callers never see the cached copy, they
+ * always receive a private copy allocated from the request pool, hence
+ * an entry may be evicted while a request is still using the session.
+ *
+ * Deletes and stores made by this process invalidate the entry
+ * immediately. A session entry is only ever stored when the session
+ * is created, later it can only be deleted, so deleting a session
+ * also stores its revocation record (see session_revoked_key_name())
+ * until every cached copy has expired, and a hit is only served once
+ * the store holds no such record. MellonSessionCacheTTL bounds how
+ * long a copy may be served.
+ */
+
+typedef struct am_session_cache_entry_t {
+    am_lru_link_t link;           /* keyed by session id */
+    apr_pool_t *pool;
+    am_session_state_t *session;
+    apr_time_t valid_until;
+} am_session_cache_entry_t;
+
+typedef struct am_session_cache_t {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    am_lru_t lru;
+    int max_entries;
+    apr_interval_time_t ttl;
+} am_session_cache_t;
+
+static am_session_cache_t *am_session_cache = NULL;
+
+static void
+am_session_cache_lock(am_session_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
 }
 
-static apr_status_t
-destroy_socache_lock_callback(void *data)
+static void
+am_session_cache_unlock(am_session_cache_t *cache)
 {
-    server_rec *s = (server_rec *)data;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
 
-    return am_destroy_socache_lock(s);
+/* Must be called with the cache mutex held. */
+static void
+am_session_cache_evict(am_session_cache_t *cache,
+                       am_session_cache_entry_t *entry)
+{
+    am_lru_remove(&cache->lru, entry);
+    apr_pool_destroy(entry->pool);
 }
 
-apr_status_t
-am_get_socache_provider(apr_pool_t *pool, const char *name,
-                        ap_socache_provider_t **socache_provider_out,
-                        const char **errmsg_out)
+/**
+ * Look up a decoded session in the per-process session cache
+ *
+ * @param[in] r          Current HTTP request
+ * @param[in] session_id Session id to look up
+ *
+ * @returns copy of the cached session allocated from the request pool,
+ *          NULL if the session is not cached or the entry is stale.
+ */
+static am_session_state_t *
+am_session_cache_get(request_rec *r, const char *session_id)
 {
-    apr_status_t apr_status = APR_SUCCESS;
-    ap_socache_provider_t *socache_provider = NULL;
+    am_session_cache_t *cache = am_session_cache;
+    am_session_cache_entry_t *entry;
+    am_session_state_t *session = NULL;
 
-    *socache_provider_out = NULL;
-    if (errmsg_out) {
-        *errmsg_out = NULL;
+    if (cache == NULL || session_id == NULL) {
+        return NULL;
     }
 
-    socache_provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP,
-                                          name,
-                                          AP_SOCACHE_PROVIDER_VERSION);
-    if (socache_provider == NULL) {
-        apr_status = APR_NOTFOUND;
-        if (errmsg_out) {
-            char *errmsg = NULL;
-            apr_array_header_t *name_list;
-            const char *all_names;
-
-            /* Build a comma-separated list of all registered provider names: */
-            name_list = ap_list_provider_names(pool,
-                                               AP_SOCACHE_PROVIDER_GROUP,
-                                               AP_SOCACHE_PROVIDER_VERSION);
-            all_names = apr_array_pstrcat(pool, name_list, ',');
+    am_session_cache_lock(cache);
 
-            errmsg = apr_psprintf(pool,
-                                  "'%s' session socache not supported "
-                                  "(known names: %s). "
-                                  "Maybe you need to load the appropriate "
-                                  "socache module (mod_socache_%s?).",
-                                  name, all_names, name);
-            *errmsg_out = errmsg;
+    entry = am_lru_get(&cache->lru, session_id);
+    if (entry != NULL) {
+        if (entry->valid_until > apr_time_now()) {
+            am_lru_use(&cache->lru, entry);
+            session = am_session_state_copy(r->pool, entry->session);
+        } else {
+            am_session_cache_evict(cache, entry);
         }
-        return apr_status;
     }
-    
-    *socache_provider_out = socache_provider;
-    return apr_status;
+
+    am_session_cache_unlock(cache);
+
+    am_diag_printf(r, "%s: session_id=%s %s\n",
+                   __func__, session_id, session ? "hit" : "miss");
+
+    return session;
 }
 
-apr_status_t
-am_socache_init(apr_pool_t *pool, apr_pool_t *tmp_pool, server_rec *s)
+/**
+ * Add a decoded session to the per-process session cache
+ *
+ * Any previous entry for the same session id is replaced, the least
+ * recently used entry is evicted if the cache is full.
+ *
+ * @param[in] r       Current HTTP request
+ * @param[in] session Session just decoded from the socache
+ */
+static void
+am_session_cache_put(request_rec *r, const am_session_state_t *session)
 {
-    apr_status_t apr_status;
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
-    struct ap_socache_hints socache_hints;
-    const char *errmsg = NULL;
+    am_session_cache_t *cache = am_session_cache;
+    am_session_cache_entry_t *entry;
+    apr_pool_t *pool;
+    apr_time_t valid_until;
 
-    memset(&socache_hints, 0, sizeof socache_hints);
-    socache_hints.avg_id_len = AM_ID_LENGTH;
-    socache_hints.avg_obj_size = mod_cfg->socache_session_state_entry_size;;
-    socache_hints.expiry_interval = 60000000;
+    if (cache == NULL || session == NULL || session->session_id == NULL) {
+        return;
+    }
 
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
-                 "initializing socache provider_name=\"%s\" "
-                 "provider_args=\"%s\" session_state_entry_size=%d",
-                 mod_cfg->socache_provider_name,
-                 mod_cfg->socache_provider_args,
-                 mod_cfg->socache_session_state_entry_size);
+    valid_until = apr_time_now() + cache->ttl;
+    if (session->expires < valid_until) {
+        valid_until = session->expires;
+    }
 
-    if (mod_cfg->socache_provider == NULL) {
-        apr_status = am_get_socache_provider(pool,
-                                             mod_cfg->socache_provider_name,
-                                             &mod_cfg->socache_provider,
-                                             &errmsg);
-        if (apr_status != APR_SUCCESS) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
-                         "failed loading socache "
-                         "provider_name=%s provider_args=%s errmsg=%s",
-                         mod_cfg->socache_provider_name,
-                         mod_cfg->socache_provider_args, errmsg);
-            return apr_status;
-        }
+    am_session_cache_lock(cache);
+
+    entry = am_lru_get(&cache->lru, session->session_id);
+    if (entry != NULL) {
+        am_session_cache_evict(cache, entry);
+    }
+    while (cache->lru.count >= cache->max_entries) {
+        am_session_cache_evict(cache, am_lru_oldest(&cache->lru));
     }
 
-    if (mod_cfg->socache_instance == NULL) {
-        errmsg = mod_cfg->socache_provider->create(&mod_cfg->socache_instance,
-                                                   mod_cfg->socache_provider_args,
-                                                   tmp_pool, pool);
-        if (errmsg) {
-            apr_status = APR_EGENERAL;
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
-                         "failed to create socache provider "
-                         "provider_name=%s provider_args=%s errmsg=%s",
-                         mod_cfg->socache_provider_name,
-                         mod_cfg->socache_provider_args, errmsg);
-            return apr_status;
-        }
+    if (apr_pool_create(&pool, cache->pool) != APR_SUCCESS) {
+        am_session_cache_unlock(cache);
+        return;
     }
 
-    if (mod_cfg->socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
-        apr_status = ap_global_mutex_create(&mod_cfg->socache_lock,
-                                            NULL, SOCACHE_ID,
-                                            NULL, s, pool, 0);
+    entry = apr_pcalloc(pool, sizeof(*entry));
+    entry->pool = pool;
+    entry->session = am_session_state_copy(pool, session);
+    if (entry->session == NULL) {
+        apr_pool_destroy(pool);
+        am_session_cache_unlock(cache);
+        return;
+    }
+    entry->valid_until = valid_until;
 
-        if (apr_status != APR_SUCCESS) {
-            char buffer[512];
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
-                         "mutex_create: Error [%d] \"%s\"",
-                         apr_status, apr_strerror(apr_status,
-                                                  buffer, sizeof(buffer)));
-            return apr_status;
-        }
+    am_lru_add(&cache->lru, entry, entry->session->session_id);
 
-        apr_pool_cleanup_register(pool, (void*)s, destroy_socache_lock_callback,
-                                  apr_pool_cleanup_null);
-#ifdef AP_NEED_SET_MUTEX_PERMS
-        /* On some platforms the mutex is implemented as a file. To
-         * allow child processes running as a different user to open
-         * it, it is necessary to change the permissions on it. */
-        apr_status = ap_unixd_set_global_mutex_perms(mod_cfg->socache_lock);
-        if (apr_status != APR_SUCCESS) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
-                         "Failed to set permissions on session lock, "
-                         " check User and Group directives");
-            return apr_status;
-        }
-#endif
+    am_session_cache_unlock(cache);
+}
+
+/**
+ * Update the idle deadline of a session in the per-process session cache
+ *
+ * Called when a newer idle deadline has been read from or written to
+ * the touch record of the session, so later requests served from the
+ * cache see it without going back to the socache.
+ *
+ * @param[in] session_id   Session id whose entry is updated
+ * @param[in] idle_timeout New idle deadline of the session
+ */
+static void
+am_session_cache_touch(const char *session_id, apr_time_t idle_timeout)
+{
+    am_session_cache_t *cache = am_session_cache;
+    am_session_cache_entry_t *entry;
 
+    if (cache == NULL || session_id == NULL) {
+        return;
     }
 
-    apr_status = mod_cfg->socache_provider->init(mod_cfg->socache_instance,
-                                         SOCACHE_ID, &socache_hints, s, pool);
-    if (apr_status != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
-                     "failed to initialise %s cache", SOCACHE_ID);
-        return apr_status;
+    am_session_cache_lock(cache);
+
+    entry = am_lru_get(&cache->lru, session_id);
+    if (entry != NULL && entry->session->idle_timeout < idle_timeout) {
+        entry->session->idle_timeout = idle_timeout;
     }
-    apr_pool_cleanup_register(pool, (void*)s, destroy_socache_callback,
-                              apr_pool_cleanup_null);
-    return APR_SUCCESS;
+
+    am_session_cache_unlock(cache);
 }
 
-apr_status_t am_cache_aquire_lock(request_rec *r)
+/*
+ * The idle deadline kept with a session entry is the one it was stored
+ * with, later deadlines are in its touch record. Without the decoded
+ * session cache, or once its entry has expired, every request would
+ * read the touch record again once the stored deadline is due for a
+ * refresh. Each process therefore also remembers the last deadline it
+ * read from or wrote to the touch record of a session, in a small
+ * direct mapped table which needs no configuration: a collision merely
+ * costs one more read.
+ *
+ * Sealed sessions have no touch record. Their slot instead remembers
+ * until when the session was found not to be revoked, so that only one
+ * request every SESSION_REVOKED_CACHE_TTL seconds reads the store.
+ */
+
+typedef struct am_touch_cache_entry_t {
+    char session_id[AM_SESSION_ID_LENGTH + 1];
+    apr_time_t idle_timeout;
+    apr_time_t unrevoked_until;
+} am_touch_cache_entry_t;
+
+static am_touch_cache_entry_t *am_touch_cache = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *am_touch_cache_mutex = NULL;
+#endif
+
+static apr_status_t
+am_touch_cache_init(apr_pool_t *p, server_rec *s)
 {
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
-    ap_socache_provider_t *socache_provider = mod_cfg->socache_provider;
-    apr_status_t rv = APR_SUCCESS;
+#if APR_HAS_THREADS
+    apr_status_t rv;
 
-    if (socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
-        if ((rv = apr_global_mutex_lock(mod_cfg->socache_lock)) != APR_SUCCESS) {
-            char error_buf[512];
-            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                          "apr_global_mutex_lock() failed [%d]: %s",
-                          rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
+    rv = apr_thread_mutex_create(&am_touch_cache_mutex,
+                                 APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create touch cache mutex: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
         return rv;
-        }
     }
+#endif
+
+    am_touch_cache = apr_pcalloc(p, sizeof(am_touch_cache_entry_t) *
+                                 SESSION_TOUCH_CACHE_SIZE);
+
     return APR_SUCCESS;
 }
 
-apr_status_t am_cache_release_lock(request_rec *r)
+/* Slot of a session in the touch cache, NULL if the id doesn't fit */
+static am_touch_cache_entry_t *
+am_touch_cache_slot(const char *session_id)
 {
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
-    ap_socache_provider_t *socache_provider = mod_cfg->socache_provider;
-    apr_status_t rv = APR_SUCCESS;
+    apr_uint32_t hash = 2166136261U; /* FNV-1a */
+    const char *p;
 
-    if (socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
-        if ((rv = apr_global_mutex_unlock(mod_cfg->socache_lock)) != APR_SUCCESS) {
-            char error_buf[512];
-            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                          "apr_global_mutex_unlock() failed [%d]: %s",
-                          rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
-        return rv;
-        }
+    if (am_touch_cache == NULL ||
+        strlen(session_id) > AM_SESSION_ID_LENGTH) {
+        return NULL;
     }
-    return APR_SUCCESS;
+
+    for (p = session_id; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619U;
+    }
+    return &am_touch_cache[hash % SESSION_TOUCH_CACHE_SIZE];
 }
 
-static const char *
-am_cache_load_session_id_from_name_id(request_rec *r, LassoSaml2NameID *name_id,
-                                      LassoSaml2NameID *issuer)
-{
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
-    ap_socache_provider_t *socache_provider = mod_cfg->socache_provider;
-    ap_socache_instance_t *socache_instance = mod_cfg->socache_instance;
+/**
+ * Look up the idle deadline a process last saw for a session
+ *
+ * @param[in]  session_id       Session id to look up
+ * @param[out] idle_timeout_out Idle deadline of the session
+ *
+ * @returns true if the deadline is known.
+ */
+static bool
+am_touch_cache_get(const char *session_id, apr_time_t *idle_timeout_out)
+{
+    am_touch_cache_entry_t *entry = am_touch_cache_slot(session_id);
+    bool found = false;
+
+    if (entry == NULL) {
+        return false;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(am_touch_cache_mutex);
+#endif
+    if (strcmp(entry->session_id, session_id) == 0 &&
+        entry->idle_timeout != 0) {
+        *idle_timeout_out = entry->idle_timeout;
+        found = true;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(am_touch_cache_mutex);
+#endif
+
+    return found;
+}
+
+/**
+ * Remember the idle deadline read from or written to a touch record
+ *
+ * @param[in] session_id   Session id
+ * @param[in] idle_timeout Idle deadline of the session
+ */
+static void
+am_touch_cache_put(const char *session_id, apr_time_t idle_timeout)
+{
+    am_touch_cache_entry_t *entry = am_touch_cache_slot(session_id);
+
+    if (entry == NULL) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(am_touch_cache_mutex);
+#endif
+    if (strcmp(entry->session_id, session_id) != 0) {
+        strcpy(entry->session_id, session_id);
+        entry->idle_timeout = idle_timeout;
+        entry->unrevoked_until = 0;
+    } else if (entry->idle_timeout < idle_timeout) {
+        entry->idle_timeout = idle_timeout;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(am_touch_cache_mutex);
+#endif
+}
+
+/**
+ * Check whether a process recently found a sealed session not revoked
+ *
+ * @param[in] session_id Session id to look up
+ * @param[in] now        Current time
+ *
+ * @returns true if the session need not be looked up in the store.
+ */
+static bool
+am_touch_cache_unrevoked(const char *session_id, apr_time_t now)
+{
+    am_touch_cache_entry_t *entry = am_touch_cache_slot(session_id);
+    bool found = false;
+
+    if (entry == NULL) {
+        return false;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(am_touch_cache_mutex);
+#endif
+    if (strcmp(entry->session_id, session_id) == 0 &&
+        entry->unrevoked_until > now) {
+        found = true;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(am_touch_cache_mutex);
+#endif
+
+    return found;
+}
+
+/**
+ * Remember that a sealed session was found not to be revoked
+ *
+ * @param[in] session_id Session id
+ * @param[in] until      Time until which the store is not read again
+ */
+static void
+am_touch_cache_put_unrevoked(const char *session_id, apr_time_t until)
+{
+    am_touch_cache_entry_t *entry = am_touch_cache_slot(session_id);
+
+    if (entry == NULL) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(am_touch_cache_mutex);
+#endif
+    if (strcmp(entry->session_id, session_id) != 0) {
+        strcpy(entry->session_id, session_id);
+        entry->idle_timeout = 0;
+    }
+    entry->unrevoked_until = until;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(am_touch_cache_mutex);
+#endif
+}
+
+/* Forget a deleted session */
+static void
+am_touch_cache_remove(const char *session_id)
+{
+    am_touch_cache_entry_t *entry = am_touch_cache_slot(session_id);
+
+    if (entry == NULL) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(am_touch_cache_mutex);
+#endif
+    if (strcmp(entry->session_id, session_id) == 0) {
+        entry->session_id[0] = '\0';
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(am_touch_cache_mutex);
+#endif
+}
+
+/**
+ * Drop a session from the per-process session cache
+ *
+ * @param[in] session_id Session id whose entry is removed
+ */
+static void
+am_session_cache_remove(const char *session_id)
+{
+    am_session_cache_t *cache = am_session_cache;
+    am_session_cache_entry_t *entry;
+
+    if (cache == NULL || session_id == NULL) {
+        return;
+    }
+
+    am_session_cache_lock(cache);
+
+    entry = am_lru_get(&cache->lru, session_id);
+    if (entry != NULL) {
+        am_session_cache_evict(cache, entry);
+    }
+
+    am_session_cache_unlock(cache);
+}
+
+/**
+ * Keep the MellonIdentityHeader attributes of a session in its entry
+ *
+ * Only needed for selections whose JSON is not stored with the session,
+ * see am_session_identity_json(). An entry keeps at most one JSON per
+ * selection of the configuration.
+ *
+ * @param[in] r          Current HTTP request
+ * @param[in] session_id Session the attributes belong to
+ * @param[in] key        Key of the selection of attributes
+ * @param[in] json       The serialized attributes
+ */
+void
+am_cache_session_identity_put(request_rec *r, const char *session_id,
+                              const char *key, const char *json)
+{
+    am_session_cache_t *cache = am_session_cache;
+    am_session_cache_entry_t *entry;
+
+    if (cache == NULL || session_id == NULL) {
+        return;
+    }
+
+    am_session_cache_lock(cache);
+
+    entry = am_lru_get(&cache->lru, session_id);
+    if (entry != NULL &&
+        apr_hash_get(entry->session->identity_json, key,
+                     APR_HASH_KEY_STRING) == NULL) {
+        apr_hash_set(entry->session->identity_json,
+                     apr_pstrdup(entry->pool, key), APR_HASH_KEY_STRING,
+                     apr_pstrdup(entry->pool, json));
+    }
+
+    am_session_cache_unlock(cache);
+
+    am_diag_printf(r, "%s: session_id=%s %s\n", __func__,
+                   session_id, entry ? "kept" : "not cached");
+}
+
+/*------------------------------- Replay Filter ------------------------------*/
+
+/*
+ * Every login stores the ID of the assertion it consumed so that the
+ * assertion cannot be replayed, and has to look the ID up first. The
+ * ID is almost never there, so in front of the replay records sits a
+ * Bloom filter which answers "never seen" without asking the socache.
+ *
+ * A negative answer can only be trusted if the filter saw every
+ * assertion the socache did. The filter lives in shared memory created
+ * before the children are forked, hence it is shared by all processes
+ * of this server and reset on restart. That matches a socache which is
+ * itself local to the server and recreated on restart (shmcb and
+ * mellon_shm); with any other provider the filter is not used.
+ *
+ * IDs cannot be removed from a Bloom filter, instead two generations
+ * are kept. IDs are added to the current generation, lookups test
+ * both, and every REPLAY_FILTER_PERIOD seconds the older generation
+ * is cleared and becomes the current one, so an ID stays in the
+ * filter for at least REPLAY_FILTER_PERIOD seconds after it was added.
+ * An ID is added no earlier than the IssueInstant of its assertion
+ * (less the accepted clock skew), so a negative answer is only used
+ * while the assertion is younger than that. Lookups of older
+ * assertions, which still have to be rejected until their
+ * NotOnOrAfter, always go to the socache.
+ *
+ * Sized at 1MB per generation and 6 hashes the filter keeps a false
+ * positive rate below 1% at 750,000 IDs per generation, i.e. 50,000
+ * logins per minute. A false positive only costs a socache lookup.
+ *
+ * The filter is updated without a lock. A rotation marks itself by
+ * making the epoch odd. When an ID may have been lost to a concurrent
+ * rotation, or the filter is in an unexpected state, negative answers
+ * are disabled until the assertion would have left the filter anyway
+ * (untrusted_until), which errs on the side of asking the socache.
+ */
+
+typedef struct am_replay_filter_t {
+    volatile apr_uint32_t epoch;           /* odd while rotating */
+    volatile apr_uint32_t current;         /* generation receiving IDs */
+    volatile apr_uint32_t rotated;         /* when it started, seconds */
+    volatile apr_uint32_t untrusted_until; /* seconds */
+    apr_uint32_t n_bits;                   /* per generation, power of 2 */
+} am_replay_filter_t;
+
+static am_replay_filter_t *am_replay_filter = NULL;
+
+static volatile apr_uint32_t *
+am_replay_filter_bits(am_replay_filter_t *filter, apr_uint32_t generation)
+{
+    return (volatile apr_uint32_t *)((char *)filter
+                                     + REPLAY_FILTER_HEADER_SIZE
+                                     + generation * (filter->n_bits / 8));
+}
+
+static void
+am_replay_filter_barrier(void)
+{
+#if defined(__GNUC__)
+    __sync_synchronize();
+#else
+    static volatile apr_uint32_t fence;
+    apr_atomic_add32(&fence, 0);
+#endif
+}
+
+/* Set bits in a shared word, returns the previous value of the word */
+static apr_uint32_t
+am_replay_filter_set(volatile apr_uint32_t *word, apr_uint32_t mask)
+{
+#if defined(__GNUC__)
+    return __sync_fetch_and_or(word, mask);
+#else
+    apr_uint32_t old;
+
+    do {
+        old = *word;
+    } while (apr_atomic_cas32(word, old | mask, old) != old);
+
+    return old;
+#endif
+}
+
+/* Don't trust negative answers of the filter before until */
+static void
+am_replay_filter_distrust(am_replay_filter_t *filter, apr_uint32_t until)
+{
+    apr_uint32_t old;
+
+    do {
+        old = filter->untrusted_until;
+        if (old >= until) {
+            return;
+        }
+    } while (apr_atomic_cas32(&filter->untrusted_until, until, old) != old);
+}
+
+static void
+am_replay_filter_rotate(am_replay_filter_t *filter, apr_uint32_t now)
+{
+    apr_uint32_t epoch = filter->epoch;
+    apr_uint32_t next;
+
+    if ((epoch & 1) || now - filter->rotated < REPLAY_FILTER_PERIOD) {
+        return;
+    }
+
+    /* Whoever moves the epoch to odd does the rotation */
+    if (apr_atomic_cas32(&filter->epoch, epoch + 1, epoch) != epoch) {
+        return;
+    }
+
+    next = filter->current ^ 1;
+    memset((void *)am_replay_filter_bits(filter, next), 0,
+           filter->n_bits / 8);
+    filter->current = next;
+    filter->rotated = now;
+
+    am_replay_filter_barrier();
+    apr_atomic_inc32(&filter->epoch);
+}
+
+/*
+ * Hash positions are derived from the SHA256 digest (hex) of the ID
+ * by double hashing.
+ */
+static void
+am_replay_filter_hash(const char *digest, apr_uint64_t *h1, apr_uint64_t *h2)
+{
+    apr_uint64_t h[2] = { 0, 0 };
+    int i;
+
+    for (i = 0; i < 32 && digest[i] != '\0'; i++) {
+        int c = digest[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' :
+                (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                (c >= 'A' && c <= 'F') ? c - 'A' + 10 : 0;
+
+        h[i / 16] = (h[i / 16] << 4) | v;
+    }
+
+    *h1 = h[0];
+    *h2 = h[1] | 1;
+}
+
+/**
+ * Check an Assertion ID against the replay filter and add it
+ *
+ * @param[in] filter  the replay filter
+ * @param[in] digest  SHA256 digest (hex) of the Assertion ID
+ * @param[in] issued  IssueInstant of the assertion, 0 if unknown
+ *
+ * @returns false if the ID has certainly not been seen before, true
+ *          if it may have been and the socache must be consulted.
+ */
+static bool
+am_replay_filter_check(am_replay_filter_t *filter, const char *digest,
+                       apr_time_t issued)
+{
+    apr_uint32_t now = (apr_uint32_t)apr_time_sec(apr_time_now());
+    apr_uint32_t added = now;
+    apr_uint32_t trusted_until;
+    apr_uint32_t epoch;
+    apr_uint32_t mask = filter->n_bits - 1;
+    volatile apr_uint32_t *current;
+    volatile apr_uint32_t *previous;
+    apr_uint64_t h1, h2;
+    bool in_current = true;
+    bool in_previous = true;
+    bool maybe_seen;
+    int i;
+
+    if (issued != 0) {
+        added = (apr_uint32_t)apr_time_sec(issued) - REPLAY_CLOCK_SKEW;
+    }
+    trusted_until = added + REPLAY_FILTER_PERIOD;
+
+    am_replay_filter_rotate(filter, now);
+
+    epoch = filter->epoch;
+    if (epoch & 1) {
+        am_replay_filter_distrust(filter, trusted_until);
+        return true;
+    }
+    am_replay_filter_barrier();
+
+    current = am_replay_filter_bits(filter, filter->current);
+    previous = am_replay_filter_bits(filter, filter->current ^ 1);
+
+    am_replay_filter_hash(digest, &h1, &h2);
+    for (i = 0; i < REPLAY_FILTER_HASHES; i++) {
+        apr_uint32_t bit = (apr_uint32_t)(h1 + i * h2) & mask;
+        apr_uint32_t word_mask = 1U << (bit & 31);
+
+        if (!(previous[bit >> 5] & word_mask)) {
+            in_previous = false;
+        }
+        if (!(am_replay_filter_set(&current[bit >> 5], word_mask)
+              & word_mask)) {
+            in_current = false;
+        }
+    }
+
+    am_replay_filter_barrier();
+    if (filter->epoch != epoch) {
+        /* Rotated underneath us, the ID may not have been kept */
+        am_replay_filter_distrust(filter, trusted_until);
+        return true;
+    }
+
+    /* Clock of the IdP ahead of ours: the ID is added later than the
+     * IssueInstant suggests and may leave the filter too early. */
+    if (added > now) {
+        am_replay_filter_distrust(filter, trusted_until);
+    }
+
+    maybe_seen = in_current || in_previous ||
+                 issued == 0 || now >= trusted_until ||
+                 now < filter->untrusted_until;
+
+    return maybe_seen;
+}
+
+/**
+ * Create the replay filter in front of the replay records
+ *
+ * Only done for socache providers whose content is local to this
+ * server and does not survive a restart, see above.
+ *
+ * @param[in] pool    pool of the server configuration
+ * @param[in] s       the server
+ * @param[in] mod_cfg module configuration
+ *
+ * @returns APR_SUCCESS, or an error status if the shared memory could
+ *          not be created.
+ */
+static apr_status_t
+am_replay_filter_init(apr_pool_t *pool, server_rec *s,
+                      am_mod_cfg_rec *mod_cfg)
+{
+    apr_size_t generation_size;
+    apr_size_t size;
+    apr_status_t rv;
+
+    am_replay_filter = NULL;
+
+    if (mod_cfg->assertion_id_filter_size <= 0) {
+        return APR_SUCCESS;
+    }
+
+    /* mellon_shm adds Assertion IDs atomically, without a lookup */
+    if (strcmp(mod_cfg->socache_provider_name, "shmcb") != 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "assertion ID filter not used with socache "
+                     "provider %s", mod_cfg->socache_provider_name);
+        return APR_SUCCESS;
+    }
+
+    /* Round down to a power of two so positions can be masked */
+    generation_size = REPLAY_FILTER_MIN_SIZE;
+    while (generation_size * 2 <= (apr_size_t)mod_cfg->assertion_id_filter_size) {
+        generation_size *= 2;
+    }
+    size = REPLAY_FILTER_HEADER_SIZE + 2 * generation_size;
+
+    rv = am_cache_shm_create(pool, size, "mellon_replay_filter",
+                             (void **)&am_replay_filter);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create assertion ID filter of %"
+                     APR_SIZE_T_FMT " bytes: %s", size,
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+
+    am_replay_filter->n_bits = generation_size * 8;
+    am_replay_filter->rotated = (apr_uint32_t)apr_time_sec(apr_time_now());
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "assertion ID filter of 2 x %" APR_SIZE_T_FMT " bytes",
+                 generation_size);
+
+    return APR_SUCCESS;
+}
+
+/*------------------------------ Cache Statistics ----------------------------*/
+
+/*
+ * Per-process counters kept by the cache layer, protected by a mutex of
+ * their own and logged when the process exits.
+ *
+ * For every type of operation which takes the socache lock the time
+ * spent waiting for the lock and the time it was held are recorded.
+ * The lock is only taken for providers which are not multi-process
+ * safe, with other providers no lock statistics are collected.
+ */
+
+typedef struct am_cache_lock_t {
+    am_cache_op_t op;
+    apr_time_t requested;
+    apr_time_t acquired;
+} am_cache_lock_t;
+
+static const char * const am_cache_op_names[AM_CACHE_OP_MAX] = {
+    "load_session",
+    "load_session_by_name_id",
+    "load_logout_state",
+    "store_session",
+    "delete_session",
+    "load_session_touch",
+    "touch_session",
+    "check_assertion_id",
+    "load_generation",
+    "store_generation",
+    "create_generation",
+};
+
+static am_cache_compress_stats_t am_compress_stats;
+static am_cache_lock_stats_t am_lock_stats[AM_CACHE_OP_MAX];
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *am_cache_stats_mutex = NULL;
+#endif
+
+static void
+am_cache_stats_lock(void)
+{
+#if APR_HAS_THREADS
+    if (am_cache_stats_mutex) {
+        apr_thread_mutex_lock(am_cache_stats_mutex);
+    }
+#endif
+}
+
+static void
+am_cache_stats_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (am_cache_stats_mutex) {
+        apr_thread_mutex_unlock(am_cache_stats_mutex);
+    }
+#endif
+}
+
+static void
+am_cache_lock_stats_add(am_cache_op_t op, apr_interval_time_t wait,
+                        apr_interval_time_t hold)
+{
+    am_cache_lock_stats_t *stats = &am_lock_stats[op];
+
+    am_cache_stats_lock();
+    stats->count++;
+    stats->wait_time += wait;
+    if (wait > stats->wait_max) {
+        stats->wait_max = wait;
+    }
+    stats->hold_time += hold;
+    if (hold > stats->hold_max) {
+        stats->hold_max = hold;
+    }
+    am_cache_stats_unlock();
+}
+
+/* Log the cache counters of this process when it exits */
+static apr_status_t
+am_cache_stats_log(void *data)
+{
+    server_rec *s = (server_rec *)data;
+    am_cache_compress_stats_t stats;
+    am_cache_lock_stats_t lock_stats[AM_CACHE_OP_MAX];
+    int op;
+
+    am_cache_get_compress_stats(&stats);
+    am_cache_get_lock_stats(lock_stats);
+
+    if (stats.compressed != 0 || stats.decompressed != 0) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                     "session compression: %" APR_UINT64_T_FMT " entries"
+                     " compressed from %" APR_UINT64_T_FMT " to %"
+                     APR_UINT64_T_FMT " bytes (ratio %.2f) in %"
+                     APR_TIME_T_FMT " usec, %" APR_UINT64_T_FMT
+                     " not compressible, %" APR_UINT64_T_FMT
+                     " entries decompressed in %" APR_TIME_T_FMT " usec",
+                     stats.compressed, stats.bytes_in, stats.bytes_out,
+                     stats.bytes_out ?
+                     (double)stats.bytes_in / (double)stats.bytes_out : 0.0,
+                     stats.compress_time, stats.incompressible,
+                     stats.decompressed, stats.decompress_time);
+    }
+
+    for (op = 0; op < AM_CACHE_OP_MAX; op++) {
+        if (lock_stats[op].count == 0) {
+            continue;
+        }
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                     "socache lock %s: %" APR_UINT64_T_FMT " times,"
+                     " wait %" APR_TIME_T_FMT " usec (max %" APR_TIME_T_FMT
+                     "), held %" APR_TIME_T_FMT " usec (max %"
+                     APR_TIME_T_FMT ")",
+                     am_cache_op_name(op), lock_stats[op].count,
+                     lock_stats[op].wait_time, lock_stats[op].wait_max,
+                     lock_stats[op].hold_time, lock_stats[op].hold_max);
+    }
+
+    return APR_SUCCESS;
+}
+
+/*------------------------------ Store Statistics ----------------------------*/
+
+/*
+ * Counters of the session store shared by all processes of the server,
+ * kept in shared memory created when the socache is initialised and
+ * reported by the "stats" endpoint (see am_cache_write_stats()). They
+ * start from zero on every restart.
+ *
+ * Every socache access goes through the Cache Backend functions, which
+ * count the result of each entry and time each call. Besides that the
+ * size of the session entries retrieved, the time to decode them, the
+ * session entries rejected for being too large and the lookups served
+ * by the decoded session cache are recorded.
+ *
+ * Counters are updated with atomic adds and read without a lock, a
+ * histogram read while it is updated may be off by one observation.
+ */
+
+#define AM_CACHE_STATS_BUCKETS 12
+
+typedef struct am_cache_histogram_t {
+    volatile apr_uint64_t count;
+    volatile apr_uint64_t sum;
+    volatile apr_uint64_t buckets[AM_CACHE_STATS_BUCKETS]; /* last is +Inf */
+} am_cache_histogram_t;
+
+typedef enum {
+    AM_CACHE_BACKEND_RETRIEVE,
+    AM_CACHE_BACKEND_STORE,
+    AM_CACHE_BACKEND_REMOVE,
+    AM_CACHE_BACKEND_MAX
+} am_cache_backend_op_t;
+
+typedef enum {
+    AM_CACHE_RESULT_OK,
+    AM_CACHE_RESULT_NOTFOUND,
+    AM_CACHE_RESULT_ERROR,
+    AM_CACHE_RESULT_MAX
+} am_cache_result_t;
+
+typedef struct am_cache_store_stats_t {
+    apr_time_t started;
+    volatile apr_uint64_t results[AM_CACHE_BACKEND_MAX][AM_CACHE_RESULT_MAX];
+    am_cache_histogram_t latency[AM_CACHE_BACKEND_MAX];   /* usec */
+    am_cache_histogram_t session_size;                    /* bytes */
+    am_cache_histogram_t decode_time;                     /* usec */
+    volatile apr_uint64_t rejected_too_large;
+    volatile apr_uint64_t session_cache_hits;
+    volatile apr_uint64_t authz_cache_hits;
+    volatile apr_uint64_t authz_cache_misses;
+} am_cache_store_stats_t;
+
+static const char * const am_cache_backend_op_names[AM_CACHE_BACKEND_MAX] = {
+    "retrieve",
+    "store",
+    "remove",
+};
+
+static const char * const am_cache_result_names[AM_CACHE_RESULT_MAX] = {
+    "ok",
+    "not_found",
+    "error",
+};
+
+/* Upper bounds of the histogram buckets, the last bucket has none */
+static const apr_uint64_t am_cache_time_bounds[AM_CACHE_STATS_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000
+};
+static const apr_uint64_t am_cache_size_bounds[AM_CACHE_STATS_BUCKETS - 1] = {
+    256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536, 131072, 262144
+};
+
+static am_cache_store_stats_t *am_store_stats = NULL;
+
+/*
+ * The counters are shared by all processes. APR has 64 bit atomics
+ * since 1.7; with an older APR the GCC builtins are used, and failing
+ * those plain updates, which may lose a count under contention.
+ */
+static void
+am_cache_stats_add(volatile apr_uint64_t *counter, apr_uint64_t value)
+{
+#if APR_VERSION_AT_LEAST(1,7,0)
+    apr_atomic_add64(counter, value);
+#elif defined(__GNUC__)
+    __sync_fetch_and_add(counter, value);
+#else
+    *counter += value;
+#endif
+}
+
+static apr_uint64_t
+am_cache_stats_read(const volatile apr_uint64_t *counter)
+{
+#if APR_VERSION_AT_LEAST(1,7,0)
+    return apr_atomic_read64(counter);
+#elif defined(__GNUC__)
+    return __sync_fetch_and_add((volatile apr_uint64_t *)counter, 0);
+#else
+    return *counter;
+#endif
+}
+
+static void
+am_cache_histogram_add(am_cache_histogram_t *histogram,
+                       const apr_uint64_t *bounds, apr_uint64_t value)
+{
+    int i;
+
+    for (i = 0; i < AM_CACHE_STATS_BUCKETS - 1; i++) {
+        if (value <= bounds[i]) {
+            break;
+        }
+    }
+
+    am_cache_stats_add(&histogram->buckets[i], 1);
+    am_cache_stats_add(&histogram->sum, value);
+    am_cache_stats_add(&histogram->count, 1);
+}
+
+/* Record the result of every item and the time taken by a backend call */
+static void
+am_cache_stats_backend(am_cache_backend_op_t op,
+                       const am_cache_batch_item_t *items, int n_items,
+                       apr_interval_time_t elapsed)
+{
+    am_cache_store_stats_t *stats = am_store_stats;
+    int i;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    for (i = 0; i < n_items; i++) {
+        am_cache_result_t result;
+
+        /* An add finding the entry present worked as intended */
+        if (items[i].status == APR_SUCCESS ||
+            items[i].status == APR_EEXIST) {
+            result = AM_CACHE_RESULT_OK;
+        } else if (items[i].status == APR_NOTFOUND) {
+            result = AM_CACHE_RESULT_NOTFOUND;
+        } else {
+            result = AM_CACHE_RESULT_ERROR;
+        }
+        am_cache_stats_add(&stats->results[op][result], 1);
+    }
+
+    am_cache_histogram_add(&stats->latency[op], am_cache_time_bounds,
+                           elapsed > 0 ? elapsed : 0);
+}
+
+static void
+am_cache_stats_session_size(apr_size_t size)
+{
+    if (am_store_stats != NULL) {
+        am_cache_histogram_add(&am_store_stats->session_size,
+                               am_cache_size_bounds, size);
+    }
+}
+
+static void
+am_cache_stats_decode_time(apr_interval_time_t elapsed)
+{
+    if (am_store_stats != NULL) {
+        am_cache_histogram_add(&am_store_stats->decode_time,
+                               am_cache_time_bounds,
+                               elapsed > 0 ? elapsed : 0);
+    }
+}
+
+static void
+am_cache_stats_rejected(void)
+{
+    if (am_store_stats != NULL) {
+        am_cache_stats_add(&am_store_stats->rejected_too_large, 1);
+    }
+}
+
+static void
+am_cache_stats_session_cache_hit(void)
+{
+    if (am_store_stats != NULL) {
+        am_cache_stats_add(&am_store_stats->session_cache_hits, 1);
+    }
+}
+
+static void
+am_cache_stats_authz_lookup(bool hit)
+{
+    if (am_store_stats != NULL) {
+        am_cache_stats_add(hit ? &am_store_stats->authz_cache_hits :
+                                 &am_store_stats->authz_cache_misses, 1);
+    }
+}
+
+/**
+ * Create the shared memory holding the session store statistics
+ *
+ * Called from the post_config hook via am_socache_init(), before the
+ * children are forked. Failing to create it only disables the
+ * statistics.
+ *
+ * @param[in] pool Configuration pool
+ * @param[in] s    Server record
+ */
+static void
+am_cache_stats_init(apr_pool_t *pool, server_rec *s)
+{
+    apr_size_t size = sizeof(am_cache_store_stats_t);
+    apr_status_t rv;
+
+    am_store_stats = NULL;
+
+    rv = am_cache_shm_create(pool, size, "mellon_store_stats",
+                             (void **)&am_store_stats);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                     "failed to create session store statistics, "
+                     "statistics are disabled: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return;
+    }
+
+    am_store_stats->started = apr_time_now();
+}
+
+/* Print a histogram as one line of the plain text statistics */
+static void
+am_cache_stats_print_histogram(request_rec *r, const char *name,
+                               const char *unit,
+                               const am_cache_histogram_t *histogram,
+                               const apr_uint64_t *bounds)
+{
+    apr_uint64_t count = am_cache_stats_read(&histogram->count);
+    int i;
+
+    ap_rprintf(r, "%s: count=%" APR_UINT64_T_FMT " avg=%" APR_UINT64_T_FMT
+               " %s\n", name, count,
+               count ? am_cache_stats_read(&histogram->sum) / count : 0,
+               unit);
+
+    ap_rputs("   ", r);
+    for (i = 0; i < AM_CACHE_STATS_BUCKETS - 1; i++) {
+        ap_rprintf(r, " <=%" APR_UINT64_T_FMT ":%" APR_UINT64_T_FMT,
+                   bounds[i], am_cache_stats_read(&histogram->buckets[i]));
+    }
+    ap_rprintf(r, " >%" APR_UINT64_T_FMT ":%" APR_UINT64_T_FMT "\n",
+               bounds[i - 1],
+               am_cache_stats_read(&histogram->buckets[i]));
+}
+
+/*
+ * Print a histogram in the Prometheus text format. Buckets are
+ * cumulative there, scale converts the observed values to the base
+ * unit of the metric (seconds or bytes).
+ */
+static void
+am_cache_stats_prometheus_histogram(request_rec *r, const char *name,
+                                    const char *labels,
+                                    const am_cache_histogram_t *histogram,
+                                    const apr_uint64_t *bounds,
+                                    double scale)
+{
+    const char *sep = *labels ? "," : "";
+    apr_uint64_t cumulative = 0;
+    int i;
+
+    for (i = 0; i < AM_CACHE_STATS_BUCKETS; i++) {
+        cumulative += am_cache_stats_read(&histogram->buckets[i]);
+        if (i < AM_CACHE_STATS_BUCKETS - 1) {
+            ap_rprintf(r, "%s_bucket{%s%sle=\"%g\"} %" APR_UINT64_T_FMT "\n",
+                       name, labels, sep, (double)bounds[i] * scale,
+                       cumulative);
+        } else {
+            ap_rprintf(r, "%s_bucket{%s%sle=\"+Inf\"} %" APR_UINT64_T_FMT
+                       "\n", name, labels, sep, cumulative);
+        }
+    }
+    ap_rprintf(r, "%s_sum{%s} %g\n", name, labels,
+               (double)am_cache_stats_read(&histogram->sum) * scale);
+    ap_rprintf(r, "%s_count{%s} %" APR_UINT64_T_FMT "\n", name, labels,
+               cumulative);
+}
+
+/*------------------------- Compressed Session Entries -----------------------*/
+
+/*
+ * Session state entries, in particular those carrying many attribute
+ * values, compress very well. Entries of at least
+ * MellonSoCacheCompressThreshold bytes are deflated before they are
+ * stored, the stored value then starts with COMPRESSED_ENTRY_MAGIC
+ * followed by the uncompressed length as a 32-bit integer in network
+ * byte order and the zlib stream.
+ *
+ * The magic cannot be mistaken for the start of a binary or XML
+ * session, so whether an entry is compressed is decided by the entry
+ * itself, not by the current configuration.
+ */
+
+/**
+ * Compress a session entry before it is stored
+ *
+ * @param[in]     r        Current HTTP request
+ * @param[in]     data     Entry to store
+ * @param[in,out] data_len Length of @data, updated to the length of
+ *                         the returned buffer
+ *
+ * @returns the compressed entry allocated from the request pool, or
+ *          @data if the entry is below the threshold or does not
+ *          compress.
+ */
+static const char *
+am_cache_compress_entry(request_rec *r, const char *data,
+                        apr_size_t *data_len)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    apr_size_t len = *data_len;
+    apr_time_t start;
+    apr_interval_time_t elapsed;
+    unsigned char *buf;
+    uLongf zlen;
+    int zrv;
+
+    if (mod_cfg->socache_compress_threshold <= 0 ||
+        len < (apr_size_t)mod_cfg->socache_compress_threshold ||
+        len > COMPRESSED_ENTRY_MAX_SIZE) {
+        return data;
+    }
+
+    start = apr_time_now();
+
+    zlen = compressBound(len);
+    buf = apr_palloc(r->pool, COMPRESSED_ENTRY_HEADER_LEN + zlen);
+    zrv = compress2(buf + COMPRESSED_ENTRY_HEADER_LEN, &zlen,
+                    (const Bytef *)data, len, Z_DEFAULT_COMPRESSION);
+
+    elapsed = apr_time_now() - start;
+
+    if (zrv != Z_OK || COMPRESSED_ENTRY_HEADER_LEN + zlen >= len) {
+        if (zrv != Z_OK) {
+            AM_LOG_RERROR(APLOG_MARK, APLOG_WARNING, 0, r,
+                          "failed to compress session entry, zlib error %d,"
+                          " storing it uncompressed", zrv);
+        }
+        am_cache_stats_lock();
+        am_compress_stats.incompressible++;
+        am_compress_stats.compress_time += elapsed;
+        am_cache_stats_unlock();
+        return data;
+    }
+
+    memcpy(buf, COMPRESSED_ENTRY_MAGIC, COMPRESSED_ENTRY_MAGIC_LEN);
+    buf[4] = (len >> 24) & 0xff;
+    buf[5] = (len >> 16) & 0xff;
+    buf[6] = (len >> 8) & 0xff;
+    buf[7] = len & 0xff;
+
+    *data_len = COMPRESSED_ENTRY_HEADER_LEN + zlen;
+
+    am_cache_stats_lock();
+    am_compress_stats.compressed++;
+    am_compress_stats.bytes_in += len;
+    am_compress_stats.bytes_out += *data_len;
+    am_compress_stats.compress_time += elapsed;
+    am_cache_stats_unlock();
+
+    am_diag_printf(r, "%s: compressed %" APR_SIZE_T_FMT " to %"
+                   APR_SIZE_T_FMT " bytes in %" APR_TIME_T_FMT " usec\n",
+                   __func__, len, *data_len, elapsed);
+
+    return (const char *)buf;
+}
+
+/**
+ * Copy an entry read from the socache into the request pool
+ *
+ * The entry is retrieved into a scratch buffer (see
+ * am_cache_retrieve_buffer()), only the bytes actually used are copied
+ * into the request pool. This runs with the cache lock held, anything
+ * more expensive (see am_cache_inflate_entry()) is left until the lock
+ * is released.
+ *
+ * @param[in] r        Current HTTP request
+ * @param[in] data     Entry as retrieved
+ * @param[in] data_len Length of @data
+ *
+ * @returns the NUL-terminated copy of the entry.
+ */
+static const char *
+am_cache_copy_out_entry(request_rec *r, const char *data,
+                        apr_size_t data_len)
+{
+    char *buf;
+
+    /* NUL-terminate, the legacy XML session state is parsed as text */
+    buf = apr_palloc(r->pool, data_len + 1);
+    memcpy(buf, data, data_len);
+    buf[data_len] = '\0';
+
+    return buf;
+}
+
+/**
+ * Undo am_cache_compress_entry() on an entry read from the socache
+ *
+ * @param[in]     r        Current HTTP request
+ * @param[in]     data     Entry as retrieved
+ * @param[in,out] data_len Length of @data, updated to the length of
+ *                         the returned buffer
+ *
+ * @returns the uncompressed, NUL-terminated entry; @data itself if it
+ *          is not compressed; NULL if it could not be decompressed.
+ */
+static const char *
+am_cache_inflate_entry(request_rec *r, const char *data,
+                       apr_size_t *data_len)
+{
+    const unsigned char *hdr = (const unsigned char *)data;
+    apr_size_t len;
+    apr_time_t start;
+    apr_interval_time_t elapsed;
+    char *buf;
+    uLongf out_len;
+    int zrv;
+
+    if (data == NULL ||
+        *data_len < COMPRESSED_ENTRY_HEADER_LEN ||
+        memcmp(data, COMPRESSED_ENTRY_MAGIC,
+               COMPRESSED_ENTRY_MAGIC_LEN) != 0) {
+        return data;
+    }
+
+    len = ((apr_size_t)hdr[4] << 24) | ((apr_size_t)hdr[5] << 16) |
+          ((apr_size_t)hdr[6] << 8) | hdr[7];
+    if (len > COMPRESSED_ENTRY_MAX_SIZE) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "compressed session entry claims %" APR_SIZE_T_FMT
+                      " bytes, more than the maximum of %d",
+                      len, COMPRESSED_ENTRY_MAX_SIZE);
+        return NULL;
+    }
+
+    start = apr_time_now();
+
+    buf = apr_palloc(r->pool, len + 1);
+    out_len = len;
+    zrv = uncompress((Bytef *)buf, &out_len,
+                     hdr + COMPRESSED_ENTRY_HEADER_LEN,
+                     *data_len - COMPRESSED_ENTRY_HEADER_LEN);
+    if (zrv != Z_OK || out_len != len) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "failed to decompress session entry, zlib error %d",
+                      zrv);
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    elapsed = apr_time_now() - start;
+
+    am_cache_stats_lock();
+    am_compress_stats.decompressed++;
+    am_compress_stats.decompress_time += elapsed;
+    am_cache_stats_unlock();
+
+    am_diag_printf(r, "%s: decompressed %" APR_SIZE_T_FMT " to %"
+                   APR_SIZE_T_FMT " bytes in %" APR_TIME_T_FMT " usec\n",
+                   __func__, *data_len, len, elapsed);
+
+    *data_len = len;
+    return buf;
+}
+
+/*------------------------------ Retrieve Buffers ----------------------------*/
+
+/*
+ * The socache retrieve API needs a buffer large enough for the largest
+ * entry which may be stored, MellonSoCacheSessionStateSize. Allocating
+ * that from the request pool on every lookup grows each request pool by
+ * the maximum entry size even though a typical session is a few KB.
+ *
+ * Instead every thread retrieves into a scratch buffer of its own which
+ * is allocated once and reused, am_cache_copy_out_entry() then copies
+ * just the retrieved bytes into the request pool. The buffer is only
+ * used between the retrieve and the copy, never across requests.
+ */
+
+typedef struct am_retrieve_buffer_t {
+    unsigned char *data;
+    apr_size_t size;
+} am_retrieve_buffer_t;
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *am_retrieve_buffer_key = NULL;
+
+static void
+am_retrieve_buffer_free(void *data)
+{
+    am_retrieve_buffer_t *buf = (am_retrieve_buffer_t *)data;
+
+    if (buf) {
+        free(buf->data);
+        free(buf);
+    }
+}
+#else
+static am_retrieve_buffer_t am_retrieve_buffer_process;
+#endif
+
+/**
+ * Get the scratch buffer of the calling thread
+ *
+ * @param[in] r    Current HTTP request
+ * @param[in] size Minimum size of the buffer
+ *
+ * @returns a buffer of at least @size bytes which remains valid until
+ *          the next call on the same thread. If no per-thread buffer is
+ *          available the buffer is allocated from the request pool.
+ */
+static unsigned char *
+am_cache_retrieve_buffer(request_rec *r, apr_size_t size)
+{
+    am_retrieve_buffer_t *buf = NULL;
+    unsigned char *data;
+
+#if APR_HAS_THREADS
+    if (am_retrieve_buffer_key == NULL) {
+        return apr_palloc(r->pool, size);
+    }
+
+    apr_threadkey_private_get((void **)&buf, am_retrieve_buffer_key);
+    if (buf == NULL) {
+        if ((buf = calloc(1, sizeof(*buf))) == NULL) {
+            return apr_palloc(r->pool, size);
+        }
+        if (apr_threadkey_private_set(buf, am_retrieve_buffer_key)
+            != APR_SUCCESS) {
+            free(buf);
+            return apr_palloc(r->pool, size);
+        }
+    }
+#else
+    buf = &am_retrieve_buffer_process;
+#endif
+
+    if (buf->size < size) {
+        if ((data = realloc(buf->data, size)) == NULL) {
+            return apr_palloc(r->pool, size);
+        }
+        buf->data = data;
+        buf->size = size;
+    }
+
+    return buf->data;
+}
+
+/*------------------------------- Cache Backend ------------------------------*/
+
+/*
+ * Entries are read, written and removed through batches of keys. A
+ * login stores the session, logout and name_id entries and a logout
+ * removes up to four, which with a remote socache provider would cost
+ * one round trip per key. Providers able to send a batch at once
+ * provide an am_cache_batch_provider_t (looked up when the socache is
+ * initialised), for all others the batch is executed key by key with
+ * the regular ap_socache calls.
+ */
+
+static void
+am_cache_batch_item_init(am_cache_batch_item_t *item, const char *what,
+                         const char *key)
+{
+    memset(item, 0, sizeof(*item));
+    item->what = what;
+    item->key = (const unsigned char *)key;
+    item->key_len = strlen(key);
+    item->status = APR_EGENERAL;
+}
+
+/**
+ * Retrieve a batch of entries
+ *
+ * Each item must point to a buffer of data_len bytes, on return the
+ * status of each item tells whether it was found and data_len holds
+ * the length of the entry.
+ *
+ * @param[in]     r       Current HTTP request
+ * @param[in,out] items   keys to retrieve
+ * @param[in]     n_items number of items
+ *
+ * @returns the status of the first item which was neither found nor
+ *          absent (nor too large for a probe), APR_SUCCESS otherwise.
+ */
+static apr_status_t
+am_cache_backend_retrieve(request_rec *r, am_cache_batch_item_t *items,
+                          int n_items)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    const am_cache_batch_provider_t *batch = mod_cfg->socache_batch_provider;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv = APR_SUCCESS;
+    apr_status_t first_rv = APR_SUCCESS;
+    int i;
+
+    if (batch != NULL && batch->retrieve != NULL && n_items > 1) {
+        rv = batch->retrieve(mod_cfg->socache_instance, r->server,
+                             items, n_items, r->pool);
+    } else {
+        for (i = 0; i < n_items; i++) {
+            items[i].status =
+                mod_cfg->socache_provider->retrieve(mod_cfg->socache_instance,
+                                                    r->server,
+                                                    items[i].key,
+                                                    items[i].key_len,
+                                                    items[i].data,
+                                                    &items[i].data_len,
+                                                    r->pool);
+        }
+    }
+
+    for (i = 0; i < n_items; i++) {
+        if (rv != APR_SUCCESS) {
+            items[i].status = rv;
+        }
+        if (items[i].status == APR_ENOSPC && items[i].probe) {
+            AM_LOG_RERROR(APLOG_MARK, APLOG_DEBUG, 0, r,
+                          "%s entry key=%s larger than %u bytes",
+                          items[i].what, (const char *)items[i].key,
+                          items[i].data_len);
+        } else if (items[i].status != APR_SUCCESS &&
+                   items[i].status != APR_NOTFOUND) {
+            char error_buf[512];
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "failed to retrieve %s entry key=%s "
+                          "error=[%d]: %s", items[i].what,
+                          (const char *)items[i].key, items[i].status,
+                          apr_strerror(items[i].status,
+                                       error_buf, sizeof(error_buf)));
+            if (first_rv == APR_SUCCESS) {
+                first_rv = items[i].status;
+            }
+        }
+    }
+
+    am_cache_stats_backend(AM_CACHE_BACKEND_RETRIEVE, items, n_items,
+                           apr_time_now() - start);
+
+    return first_rv;
+}
+
+/**
+ * Store a batch of entries
+ *
+ * @param[in]     r       Current HTTP request
+ * @param[in,out] items   keys, data and expiry of the entries
+ * @param[in]     n_items number of items
+ *
+ * @returns the status of the first item which could not be stored,
+ *          APR_SUCCESS if all were.
+ */
+static apr_status_t
+am_cache_backend_store(request_rec *r, am_cache_batch_item_t *items,
+                       int n_items)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    const am_cache_batch_provider_t *batch = mod_cfg->socache_batch_provider;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv = APR_SUCCESS;
+    apr_status_t first_rv = APR_SUCCESS;
+    int i;
+
+    if (batch != NULL && batch->store != NULL && n_items > 1) {
+        rv = batch->store(mod_cfg->socache_instance, r->server,
+                          items, n_items, r->pool);
+    } else {
+        for (i = 0; i < n_items; i++) {
+            items[i].status =
+                mod_cfg->socache_provider->store(mod_cfg->socache_instance,
+                                                 r->server,
+                                                 items[i].key,
+                                                 items[i].key_len,
+                                                 items[i].expiry,
+                                                 items[i].data,
+                                                 items[i].data_len,
+                                                 r->pool);
+        }
+    }
+
+    for (i = 0; i < n_items; i++) {
+        if (rv != APR_SUCCESS) {
+            items[i].status = rv;
+        }
+        if (items[i].status != APR_SUCCESS) {
+            char error_buf[512];
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "failed to store %s entry key=%s "
+                          "expiration=%s now=%s error=[%d]: %s",
+                          items[i].what, (const char *)items[i].key,
+                          am_time_t_to_8601(r->pool, items[i].expiry),
+                          am_time_t_to_8601(r->pool, apr_time_now()),
+                          items[i].status,
+                          apr_strerror(items[i].status,
+                                       error_buf, sizeof(error_buf)));
+            if (first_rv == APR_SUCCESS) {
+                first_rv = items[i].status;
+            }
+        }
+    }
+
+    am_cache_stats_backend(AM_CACHE_BACKEND_STORE, items, n_items,
+                           apr_time_now() - start);
+
+    return first_rv;
+}
+
+/**
+ * Remove a batch of entries, entries already absent are not an error
+ *
+ * @param[in]     r       Current HTTP request
+ * @param[in,out] items   keys to remove
+ * @param[in]     n_items number of items
+ *
+ * @returns the status of the first item which could not be removed,
+ *          APR_SUCCESS if all are gone.
+ */
+static apr_status_t
+am_cache_backend_remove(request_rec *r, am_cache_batch_item_t *items,
+                        int n_items)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    const am_cache_batch_provider_t *batch = mod_cfg->socache_batch_provider;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv = APR_SUCCESS;
+    apr_status_t first_rv = APR_SUCCESS;
+    int i;
+
+    if (batch != NULL && batch->remove != NULL && n_items > 1) {
+        rv = batch->remove(mod_cfg->socache_instance, r->server,
+                           items, n_items, r->pool);
+    } else {
+        for (i = 0; i < n_items; i++) {
+            items[i].status =
+                mod_cfg->socache_provider->remove(mod_cfg->socache_instance,
+                                                  r->server,
+                                                  items[i].key,
+                                                  items[i].key_len,
+                                                  r->pool);
+        }
+    }
+
+    for (i = 0; i < n_items; i++) {
+        if (rv != APR_SUCCESS) {
+            items[i].status = rv;
+        }
+        if (items[i].status == APR_NOTFOUND) {
+            am_diag_printf(r, "%s: %s entry not found, key=%s\n",
+                           __func__, items[i].what,
+                           (const char *)items[i].key);
+        } else if (items[i].status != APR_SUCCESS) {
+            char error_buf[512];
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "failed to delete %s entry key=%s now=%s "
+                          "error=[%d]: %s", items[i].what,
+                          (const char *)items[i].key,
+                          am_time_t_to_8601(r->pool, apr_time_now()),
+                          items[i].status,
+                          apr_strerror(items[i].status,
+                                       error_buf, sizeof(error_buf)));
+            if (first_rv == APR_SUCCESS) {
+                first_rv = items[i].status;
+            }
+        }
+    }
+
+    am_cache_stats_backend(AM_CACHE_BACKEND_REMOVE, items, n_items,
+                           apr_time_now() - start);
+
+    return first_rv;
+}
+
+/**
+ * Store a batch of entries unless they are present already
+ *
+ * Only available if the batch provider has an add function, see
+ * am_cache_backend_has_add(). Each key is checked and stored in one
+ * atomic step by the provider, so of two concurrent requests adding
+ * the same key only one succeeds, without any lock in Mellon.
+ *
+ * @param[in]     r       Current HTTP request
+ * @param[in,out] items   keys, data and expiry of the entries
+ * @param[in]     n_items number of items
+ *
+ * @returns the status of the first item which could not be stored,
+ *          APR_EEXIST for an item present already, APR_SUCCESS if all
+ *          were stored.
+ */
+static apr_status_t
+am_cache_backend_add(request_rec *r, am_cache_batch_item_t *items,
+                     int n_items)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    const am_cache_batch_provider_t *batch = mod_cfg->socache_batch_provider;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv;
+    apr_status_t first_rv = APR_SUCCESS;
+    int i;
+
+    rv = batch->add(mod_cfg->socache_instance, r->server,
+                    items, n_items, r->pool);
+
+    for (i = 0; i < n_items; i++) {
+        if (rv != APR_SUCCESS) {
+            items[i].status = rv;
+        }
+        if (items[i].status == APR_EEXIST) {
+            am_diag_printf(r, "%s: %s entry exists, key=%s\n",
+                           __func__, items[i].what,
+                           (const char *)items[i].key);
+        } else if (items[i].status != APR_SUCCESS) {
+            char error_buf[512];
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "failed to add %s entry key=%s "
+                          "expiration=%s now=%s error=[%d]: %s",
+                          items[i].what, (const char *)items[i].key,
+                          am_time_t_to_8601(r->pool, items[i].expiry),
+                          am_time_t_to_8601(r->pool, apr_time_now()),
+                          items[i].status,
+                          apr_strerror(items[i].status,
+                                       error_buf, sizeof(error_buf)));
+        }
+        if (first_rv == APR_SUCCESS) {
+            first_rv = items[i].status;
+        }
+    }
+
+    am_cache_stats_backend(AM_CACHE_BACKEND_STORE, items, n_items,
+                           apr_time_now() - start);
+
+    return first_rv;
+}
+
+/* Can the socache provider add an entry only if it is absent? */
+static bool
+am_cache_backend_has_add(am_mod_cfg_rec *mod_cfg)
+{
+    return mod_cfg->socache_batch_provider != NULL &&
+        mod_cfg->socache_batch_provider->add != NULL;
+}
+
+/**
+ * Store an entry unless it is present already
+ *
+ * Uses the add function of the provider if there is one, otherwise
+ * looks the key up and stores the entry under the global mutex, see
+ * am_cache_op_needs_lock(). The lookup reads into a buffer the size of
+ * the entry: shmcb reports a present entry which does not fit the
+ * buffer as absent.
+ *
+ * @param[in]     r    Current HTTP request
+ * @param[in,out] item key, data and expiry of the entry
+ * @param[in]     op   operation, must be one needing the lock without add
+ *
+ * @returns APR_SUCCESS if the entry was stored, APR_EEXIST if the key
+ *          was present, another error status if the socache failed.
+ */
+static apr_status_t
+am_cache_backend_add_one(request_rec *r, am_cache_batch_item_t *item,
+                         am_cache_op_t op)
+{
+    am_cache_batch_item_t probe = *item;
+    am_cache_lock_t lock;
+    apr_status_t rv;
+
+    if (am_cache_backend_has_add(am_get_mod_cfg(r->server))) {
+        return am_cache_backend_add(r, item, 1);
+    }
+
+    if ((rv = am_cache_aquire_lock(r, &lock, op)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    probe.data = apr_palloc(r->pool, item->data_len);
+    probe.probe = true;
+    am_cache_backend_retrieve(r, &probe, 1);
+
+    if (probe.status == APR_SUCCESS || probe.status == APR_ENOSPC) {
+        rv = item->status = APR_EEXIST;
+    } else if (probe.status != APR_NOTFOUND) {
+        rv = item->status = probe.status;
+    } else {
+        rv = am_cache_backend_store(r, item, 1);
+    }
+
+    am_cache_release_lock(r, &lock);
+
+    return rv;
+}
+
+/*------------------------------- Generations --------------------------------*/
+
+/*
+ * Every session records the global generation and the generation of
+ * the IdP which issued it, current when it was created. Bumping a
+ * generation (am_cache_bump_generation()) invalidates every session
+ * recorded under an older value, without enumerating the socache:
+ * am_session_validate() rejects sessions whose generations differ
+ * from the current ones.
+ *
+ * A generation is kept in a record of its own, "AMGN" followed by the
+ * generation and the time the record was written, both int64 in
+ * network byte order. A bump sets the generation to the current time
+ * in microseconds (or one more than the old value should the clock
+ * have gone backwards), so generations only ever grow and a session is
+ * revoked once a current generation is newer than the one it recorded.
+ *
+ * Only a bump moves a generation. An absent record is generation 0,
+ * no revocation since any session was created: sessions created while
+ * it was absent and sessions stored before Mellon had generations both
+ * record 0. Should a record written by a bump be lost to eviction, a
+ * process which still remembers the generation adds it back, but
+ * sessions revoked by it are accepted again until one does.
+ *
+ * Generations are checked on every request, each process caches the
+ * values it read for GENERATION_CACHE_TTL seconds, which bounds the
+ * time a bump takes to reach every process. A record read which was
+ * written more than GENERATION_REFRESH seconds ago is written again,
+ * which keeps it from expiring and, with providers evicting the oldest
+ * entries first, from being evicted.
+ */
+
+typedef struct am_generation_entry_t {
+    am_lru_link_t link;
+    /* generation:global or generation:idp:<SHA-256 in hex> */
+    char key[sizeof(GENERATION_KEY_PREFIX ":idp:") + 64];
+    apr_uint64_t generation;
+    apr_time_t fetched;
+} am_generation_entry_t;
+
+typedef struct am_generation_cache_t {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    am_lru_t lru;                 /* key name -> am_generation_entry_t */
+} am_generation_cache_t;
+
+static am_generation_cache_t *am_generation_cache = NULL;
+
+static const char *
+generation_key_name(request_rec *r, const char *idp)
+{
+    const char *digest;
+
+    if (idp == NULL) {
+        return apr_psprintf(r->pool, "%s:global", GENERATION_KEY_PREFIX);
+    }
+
+    digest = am_sha256_sum(r, (const unsigned char *)idp, strlen(idp));
+    if (digest == NULL) {
+        return NULL;
+    }
+    return apr_psprintf(r->pool, "%s:idp:%s", GENERATION_KEY_PREFIX, digest);
+}
+
+static void
+am_generation_put_u64(unsigned char *buf, apr_uint64_t value)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        buf[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static apr_uint64_t
+am_generation_get_u64(const unsigned char *buf)
+{
+    apr_uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+static apr_status_t
+am_generation_cache_init(apr_pool_t *p, server_rec *s)
+{
+    am_generation_cache_t *cache;
+    apr_status_t rv;
+
+    cache = apr_pcalloc(p, sizeof(*cache));
+
+    if ((rv = apr_pool_create(&cache->pool, p)) != APR_SUCCESS) {
+        return rv;
+    }
+
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create generation cache mutex: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+#endif
+
+    am_lru_init(&cache->lru, cache->pool);
+    am_generation_cache = cache;
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Look up a generation this process read
+ *
+ * @param[in]  key        key of the generation record
+ * @param[in]  stale      also return a generation read more than
+ *                        GENERATION_CACHE_TTL seconds ago
+ * @param[out] generation the generation
+ *
+ * @returns true if the generation was found.
+ */
+static bool
+am_generation_cache_get(const char *key, bool stale,
+                        apr_uint64_t *generation)
+{
+    am_generation_cache_t *cache = am_generation_cache;
+    am_generation_entry_t *entry;
+    bool found = false;
+
+    if (cache == NULL) {
+        return false;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+    entry = am_lru_get(&cache->lru, key);
+    if (entry != NULL &&
+        (stale || apr_time_now() - entry->fetched <
+         apr_time_from_sec(GENERATION_CACHE_TTL))) {
+        am_lru_use(&cache->lru, entry);
+        *generation = entry->generation;
+        found = true;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+
+    return found;
+}
+
+static void
+am_generation_cache_put(const char *key, apr_uint64_t generation)
+{
+    am_generation_cache_t *cache = am_generation_cache;
+    am_generation_entry_t *entry;
+
+    if (cache == NULL || strlen(key) >= sizeof(entry->key)) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+    entry = am_lru_get(&cache->lru, key);
+    if (entry != NULL) {
+        am_lru_use(&cache->lru, entry);
+    } else {
+        /* One entry per IdP, but don't let a stream of them grow it */
+        if (cache->lru.count >= GENERATION_CACHE_SIZE) {
+            entry = am_lru_oldest(&cache->lru);
+            am_lru_remove(&cache->lru, entry);
+        } else {
+            entry = apr_palloc(cache->pool, sizeof(*entry));
+        }
+        strcpy(entry->key, key);
+        am_lru_add(&cache->lru, entry, entry->key);
+    }
+    entry->generation = generation;
+    entry->fetched = apr_time_now();
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
+
+/* Prepare the batch item writing a generation record into buf */
+static void
+am_generation_item(am_cache_batch_item_t *item, const char *key,
+                   unsigned char *buf, apr_uint64_t generation)
+{
+    apr_time_t now = apr_time_now();
+
+    memcpy(buf, GENERATION_MAGIC, GENERATION_MAGIC_LEN);
+    am_generation_put_u64(buf + GENERATION_MAGIC_LEN, generation);
+    am_generation_put_u64(buf + GENERATION_MAGIC_LEN + 8, (apr_uint64_t)now);
+
+    am_cache_batch_item_init(item, "generation", key);
+    item->expiry = now + apr_time_from_sec(GENERATION_LIFETIME);
+    item->data = buf;
+    item->data_len = GENERATION_ENTRY_SIZE;
+}
+
+/**
+ * Read a generation record from the socache
+ *
+ * @param[in]  r          Current HTTP request
+ * @param[in]  key        key of the generation record
+ * @param[out] generation the generation, 0 if there is no record
+ * @param[out] written    when the record was written, 0 if there is none
+ *
+ * @returns APR_SUCCESS or an error status.
+ */
+static apr_status_t
+am_generation_fetch(request_rec *r, const char *key,
+                    apr_uint64_t *generation, apr_time_t *written)
+{
+    unsigned char entry_buf[GENERATION_ENTRY_SIZE];
+    am_cache_batch_item_t item;
+    am_cache_lock_t lock;
+    apr_status_t rv;
+
+    am_cache_batch_item_init(&item, "generation", key);
+    item.data = entry_buf;
+    item.data_len = sizeof(entry_buf);
+
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_LOAD_GENERATION)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    am_cache_backend_retrieve(r, &item, 1);
+
+    am_cache_release_lock(r, &lock);
+
+    if (item.status == APR_NOTFOUND) {
+        *generation = 0;
+        *written = 0;
+        return APR_SUCCESS;
+    } else if (item.status != APR_SUCCESS) {
+        return item.status;
+    }
+
+    if (item.data_len != GENERATION_ENTRY_SIZE ||
+        memcmp(entry_buf, GENERATION_MAGIC, GENERATION_MAGIC_LEN) != 0) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "invalid generation entry key=%s length=%u",
+                      key, item.data_len);
+        return APR_EGENERAL;
+    }
+
+    *generation = am_generation_get_u64(entry_buf + GENERATION_MAGIC_LEN);
+    *written = (apr_time_t)am_generation_get_u64(entry_buf
+                                                 + GENERATION_MAGIC_LEN + 8);
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Add back a generation record lost to eviction
+ *
+ * @param[in]     r          Current HTTP request
+ * @param[in]     key        key of the generation record
+ * @param[in,out] generation the generation this process remembers,
+ *                           the current one on return
+ *
+ * @returns APR_SUCCESS or an error status.
+ */
+static apr_status_t
+am_generation_restore(request_rec *r, const char *key,
+                      apr_uint64_t *generation)
+{
+    unsigned char entry_buf[GENERATION_ENTRY_SIZE];
+    am_cache_batch_item_t item;
+    apr_time_t written;
+    apr_status_t rv;
+
+    am_generation_item(&item, key, entry_buf, *generation);
+
+    rv = am_cache_backend_add_one(r, &item, AM_CACHE_OP_CREATE_GENERATION);
+    if (rv == APR_EEXIST) {
+        /* Written meanwhile, by a bump or another process */
+        return am_generation_fetch(r, key, generation, &written);
+    } else if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    AM_LOG_RERROR(APLOG_MARK, APLOG_WARNING, 0, r,
+                  "generation record %s was lost, restored generation %"
+                  APR_UINT64_T_FMT, key, *generation);
+
+    return APR_SUCCESS;
+}
+
+/* Get a generation, from the process cache if it is recent enough */
+static apr_status_t
+am_generation_get(request_rec *r, const char *key, apr_uint64_t *generation)
+{
+    unsigned char entry_buf[GENERATION_ENTRY_SIZE];
+    am_cache_batch_item_t item;
+    am_cache_lock_t lock;
+    apr_time_t written;
+    apr_uint64_t remembered;
+    apr_status_t rv;
+
+    if (am_generation_cache_get(key, false, generation)) {
+        return APR_SUCCESS;
+    }
+
+    if ((rv = am_generation_fetch(r, key, generation,
+                                  &written)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    if (written == 0) {
+        if (am_generation_cache_get(key, true, &remembered) &&
+            remembered != 0) {
+            *generation = remembered;
+            if ((rv = am_generation_restore(r, key,
+                                            generation)) != APR_SUCCESS) {
+                return rv;
+            }
+        }
+    } else if (apr_time_now() - written >
+               apr_time_from_sec(GENERATION_REFRESH)) {
+        /* Keep the record alive, it is rewritten with the same value */
+        am_generation_item(&item, key, entry_buf, *generation);
+        if (am_cache_aquire_lock(r, &lock,
+                                 AM_CACHE_OP_STORE_GENERATION) == APR_SUCCESS) {
+            am_cache_backend_store(r, &item, 1);
+            am_cache_release_lock(r, &lock);
+        }
+    }
+
+    am_generation_cache_put(key, *generation);
+
+    return APR_SUCCESS;
+}
+
+/*------------------------ Authorization Decision Cache ----------------------*/
+
+/*
+ * am_check_permissions() evaluates every MellonRequire and MellonCond
+ * of a location against the session on every request, although the
+ * outcome only changes with the session or the configuration. Each
+ * process keeps a small LRU cache of those decisions.
+ *
+ * The key is computed by the caller and covers the session id, the
+ * generations the session was created under and the conditions of
+ * the location (see am_check_permissions()), so a cached decision is
+ * never applied to another session or another set of conditions. It
+ * is a SHA-256 digest in hex, which gives every entry a fixed size:
+ * the entries are allocated once and recycled, lookups do not
+ * allocate. Decisions expire after MellonAuthzCacheTTL seconds.
+ */
+
+typedef struct am_authz_cache_entry_t {
+    am_lru_link_t link;
+    struct am_authz_cache_entry_t *next_free;
+    char key[AUTHZ_CACHE_KEY_LEN + 1];
+    int decision;
+    apr_time_t valid_until;
+} am_authz_cache_entry_t;
+
+typedef struct am_authz_cache_t {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    am_lru_t lru;                 /* key -> am_authz_cache_entry_t */
+    am_authz_cache_entry_t *free;
+    apr_interval_time_t ttl;
+} am_authz_cache_t;
+
+static am_authz_cache_t *am_authz_cache = NULL;
+
+static void
+am_authz_cache_lock(am_authz_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+}
+
+static void
+am_authz_cache_unlock(am_authz_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
+
+/* Must be called with the cache mutex held. */
+static void
+am_authz_cache_evict(am_authz_cache_t *cache, am_authz_cache_entry_t *entry)
+{
+    am_lru_remove(&cache->lru, entry);
+    entry->next_free = cache->free;
+    cache->free = entry;
+}
+
+/*
+ * Create the authorization decision cache if it is enabled with
+ * MellonAuthzCacheSize and MellonAuthzCacheTTL.
+ */
+static apr_status_t
+am_authz_cache_init(apr_pool_t *p, server_rec *s)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+    am_authz_cache_t *cache;
+    am_authz_cache_entry_t *entries;
+    apr_status_t rv;
+    int i;
+
+    if (mod_cfg->authz_cache_size <= 0 || mod_cfg->authz_cache_ttl <= 0) {
+        return APR_SUCCESS;
+    }
+
+    cache = apr_pcalloc(p, sizeof(*cache));
+
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create authorization cache mutex: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+#endif
+
+    entries = apr_pcalloc(p, mod_cfg->authz_cache_size * sizeof(*entries));
+    for (i = 0; i < mod_cfg->authz_cache_size; i++) {
+        entries[i].next_free = cache->free;
+        cache->free = &entries[i];
+    }
+
+    am_lru_init(&cache->lru, p);
+    cache->ttl = apr_time_from_sec(mod_cfg->authz_cache_ttl);
+
+    am_authz_cache = cache;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "authorization cache enabled, size=%d ttl=%d",
+                 mod_cfg->authz_cache_size, mod_cfg->authz_cache_ttl);
+
+    return APR_SUCCESS;
+}
+
+/*------------------------------- Session Reaper -----------------------------*/
+
+/*
+ * Expired session entries are deleted by the request which finds them,
+ * sessions nobody comes back to stay in the socache until it evicts
+ * them. With MellonSessionReaperInterval set, one thread in one child
+ * process sweeps the socache every interval: it walks the entries with
+ * the iterate call of the socache provider, and deletes the session,
+ * logout, touch and name_id entries of every session past its
+ * expiration or idle deadline, as well as the logout, touch and
+ * name_id entries left behind by a session entry which is gone.
+ *
+ * The children agree on which of them sweeps through a small segment
+ * of shared memory holding the pid of the leader and the time it was
+ * last seen. A child takes over when there is no leader, when the
+ * leader process is gone or when it has not been seen for
+ * REAPER_LEADER_TIMEOUT intervals. Once the leader has completed a
+ * sweep am_cache_reaper_active() returns true and requests finding an
+ * expired session leave its entries to the reaper.
+ *
+ * Providers without iterate (memcache, mellon_redis) cannot be swept,
+ * the reaper then logs this once and requests keep deleting expired
+ * entries themselves.
+ */
+
+typedef struct am_reaper_state_t {
+    volatile apr_uint32_t leader;       /* pid of the sweeping process */
+    volatile apr_uint32_t leader_start; /* its start time, 0 if unknown */
+    volatile apr_uint32_t heartbeat;    /* seconds, last seen alive */
+    volatile apr_uint32_t sweeping;     /* a sweep has completed */
+} am_reaper_state_t;
+
+typedef struct am_reaper_t {
+    server_rec *s;
+    am_mod_cfg_rec *mod_cfg;
+    apr_pool_t *pool;
+    apr_thread_t *thread;
+    volatile apr_uint32_t stop;
+    apr_uint32_t pid;
+    apr_uint32_t start;                 /* am_process_start_time() */
+    apr_uint32_t suspect_start;         /* leader start seen not to match */
+    unsigned char *inflate_buf;
+} am_reaper_t;
+
+/* A session found while iterating */
+typedef struct am_reaper_session_t {
+    apr_time_t expires;
+    apr_time_t idle_timeout;
+    apr_time_t touch;
+    bool present;                       /* its session entry was seen */
+    bool found;                         /* and its times could be read */
+    bool probed;                        /* looked up again, see below */
+    bool orphaned;                      /* session entry confirmed absent */
+} am_reaper_session_t;
+
+/* Start of a session entry copied out while iterating */
+typedef struct am_reaper_entry_t {
+    const char *session_id;
+    const unsigned char *data;
+    unsigned int data_len;
+} am_reaper_entry_t;
+
+/* State of a single sweep */
+typedef struct am_reaper_sweep_t {
+    am_reaper_t *reaper;
+    apr_pool_t *pool;
+    apr_array_header_t *entries;      /* am_reaper_entry_t */
+    apr_hash_t *sessions;             /* session id -> am_reaper_session_t */
+    apr_array_header_t *name_ids;     /* const char * pairs, key and id */
+    apr_array_header_t *logouts;      /* session ids with a logout entry */
+    unsigned char *probe_buf;         /* am_reaper_session_orphaned() */
+    unsigned int scanned;
+} am_reaper_sweep_t;
+
+static am_reaper_state_t *am_reaper_state = NULL;
+
+static apr_uint32_t
+am_reaper_now(void)
+{
+    return (apr_uint32_t)apr_time_sec(apr_time_now());
+}
+
+static apr_uint32_t
+am_reaper_timeout(am_mod_cfg_rec *mod_cfg)
+{
+    return (apr_uint32_t)mod_cfg->session_reaper_interval *
+           REAPER_LEADER_TIMEOUT;
+}
+
+/**
+ * Create the shared state of the session reaper
+ *
+ * Called from the post_config hook via am_socache_init(), before the
+ * children are forked.
+ *
+ * @param[in] pool    Configuration pool
+ * @param[in] s       Server record
+ * @param[in] mod_cfg Server-wide configuration
+ */
+static void
+am_cache_reaper_init(apr_pool_t *pool, server_rec *s,
+                     am_mod_cfg_rec *mod_cfg)
+{
+    apr_status_t rv;
+
+    am_reaper_state = NULL;
+
+    if (mod_cfg->session_reaper_interval <= 0) {
+        return;
+    }
+
+    rv = am_cache_shm_create(pool, sizeof(am_reaper_state_t),
+                             "mellon_session_reaper",
+                             (void **)&am_reaper_state);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                     "failed to create session reaper state, expired "
+                     "sessions are deleted by requests: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        am_reaper_state = NULL;
+    }
+}
+
+#if APR_HAS_THREADS
+/**
+ * Check whether the pid of the leader now belongs to another process
+ *
+ * The leader records its start time next to its pid. A mismatch is
+ * only trusted once it has been seen on two elections in a row, since
+ * a new leader writes its start time just after taking over.
+ *
+ * @param[in] reaper The reaper of this process
+ * @param[in] leader Pid of the leader, which is alive
+ *
+ * @returns true if the leader is gone and its pid was reused.
+ */
+static bool
+am_reaper_leader_reused(am_reaper_t *reaper, apr_uint32_t leader)
+{
+    apr_uint32_t start = apr_atomic_read32(&am_reaper_state->leader_start);
+    apr_uint32_t current;
+
+    if (start == 0 ||
+        (current = am_process_start_time((pid_t)leader)) == 0 ||
+        current == start) {
+        reaper->suspect_start = 0;
+        return false;
+    }
+
+    if (reaper->suspect_start != start) {
+        reaper->suspect_start = start;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Decide whether this process is the one sweeping
+ *
+ * @param[in] reaper The reaper of this process
+ * @param[in] now    Current time in seconds
+ *
+ * @returns true if this process is, or just became, the leader.
+ */
+static bool
+am_reaper_elect(am_reaper_t *reaper, apr_uint32_t now)
+{
+    am_reaper_state_t *state = am_reaper_state;
+    apr_uint32_t leader = apr_atomic_read32(&state->leader);
+    apr_uint32_t heartbeat;
+
+    if (leader == reaper->pid) {
+        return true;
+    }
+
+    if (leader != 0) {
+        heartbeat = apr_atomic_read32(&state->heartbeat);
+        if (now - heartbeat <= am_reaper_timeout(reaper->mod_cfg) &&
+            (kill((pid_t)leader, 0) == 0 || errno != ESRCH) &&
+            !am_reaper_leader_reused(reaper, leader)) {
+            return false;
+        }
+    }
+
+    if (apr_atomic_cas32(&state->leader, reaper->pid, leader) != leader) {
+        return false;
+    }
+    apr_atomic_set32(&state->leader_start, reaper->start);
+    reaper->suspect_start = 0;
+
+    apr_atomic_set32(&state->heartbeat, now);
+    apr_atomic_set32(&state->sweeping, 0);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, reaper->s,
+                 "session reaper running in process %u (was %u)",
+                 (unsigned int)reaper->pid, (unsigned int)leader);
+
+    return true;
+}
+
+/**
+ * Read the expiration and idle deadline from a session entry
+ *
+ * A compressed entry is only inflated as far as the first
+ * REAPER_PEEK_SIZE bytes, which is where the times are kept.
+ *
+ * @returns true if the times could be read, false for entries in the
+ *          XML format or otherwise not understood.
+ */
+static bool
+am_reaper_peek_session(am_reaper_t *reaper, const unsigned char *data,
+                       unsigned int data_len, am_reaper_session_t *session)
+{
+    z_stream zs;
+    apr_size_t len;
+    int zrv;
+
+    if (data_len < COMPRESSED_ENTRY_HEADER_LEN ||
+        memcmp(data, COMPRESSED_ENTRY_MAGIC,
+               COMPRESSED_ENTRY_MAGIC_LEN) != 0) {
+        return am_session_state_peek_times((const char *)data, data_len,
+                                           &session->expires,
+                                           &session->idle_timeout);
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+    zs.next_in = (Bytef *)(data + COMPRESSED_ENTRY_HEADER_LEN);
+    zs.avail_in = data_len - COMPRESSED_ENTRY_HEADER_LEN;
+    zs.next_out = reaper->inflate_buf;
+    zs.avail_out = REAPER_PEEK_SIZE;
+    zrv = inflate(&zs, Z_SYNC_FLUSH);
+    len = REAPER_PEEK_SIZE - zs.avail_out;
+    inflateEnd(&zs);
+
+    if (zrv != Z_OK && zrv != Z_STREAM_END && zrv != Z_BUF_ERROR) {
+        return false;
+    }
+
+    return am_session_state_peek_times((const char *)reaper->inflate_buf, len,
+                                       &session->expires,
+                                       &session->idle_timeout);
+}
+
+static am_reaper_session_t *
+am_reaper_session(am_reaper_sweep_t *sweep, const char *session_id)
+{
+    am_reaper_session_t *session;
+
+    session = apr_hash_get(sweep->sessions, session_id, APR_HASH_KEY_STRING);
+    if (session == NULL) {
+        session = apr_pcalloc(sweep->pool, sizeof(*session));
+        apr_hash_set(sweep->sessions, session_id, APR_HASH_KEY_STRING,
+                     session);
+    }
+    return session;
+}
+
+/* Does the key start with the prefix and a colon, if so return the rest */
+static const char *
+am_reaper_key_suffix(am_reaper_sweep_t *sweep, const unsigned char *key,
+                     unsigned int key_len, const char *prefix)
+{
+    apr_size_t prefix_len = strlen(prefix);
+
+    if (key_len <= prefix_len + 1 ||
+        memcmp(key, prefix, prefix_len) != 0 || key[prefix_len] != ':') {
+        return NULL;
+    }
+    return apr_pstrmemdup(sweep->pool, (const char *)key + prefix_len + 1,
+                          key_len - prefix_len - 1);
+}
+
+/**
+ * Collect an entry of the socache, called by the iterate call of the
+ * provider
+ *
+ * Nothing is deleted here, the provider may hold its own lock while
+ * iterating, and with a provider needing the global mutex it is held
+ * for the whole iteration. Session entries are therefore not decoded
+ * (or inflated) here, the start of each is only copied out and read
+ * once the iteration is over.
+ */
+static apr_status_t
+am_reaper_collect(ap_socache_instance_t *instance, server_rec *s,
+                  void *userctx, const unsigned char *key,
+                  unsigned int key_len, const unsigned char *data,
+                  unsigned int data_len, apr_pool_t *pool)
+{
+    am_reaper_sweep_t *sweep = userctx;
+    const char *id;
+    apr_uint64_t touch = 0;
+    unsigned int i;
+
+    if (sweep->reaper->stop) {
+        return APR_EINTR;
+    }
+
+    sweep->scanned++;
+
+    if ((id = am_reaper_key_suffix(sweep, key, key_len,
+                                   SESSION_KEY_PREFIX)) != NULL) {
+        am_reaper_entry_t *entry = &APR_ARRAY_PUSH(sweep->entries,
+                                                   am_reaper_entry_t);
+
+        /* The times are near the start, in the inflated data as well */
+        entry->session_id = id;
+        entry->data_len = data_len < REAPER_PEEK_SIZE ?
+            data_len : REAPER_PEEK_SIZE;
+        entry->data = apr_pmemdup(sweep->pool, data, entry->data_len);
+    } else if ((id = am_reaper_key_suffix(sweep, key, key_len,
+                                          SESSION_TOUCH_KEY_PREFIX)) != NULL) {
+        if (data_len == SESSION_TOUCH_ENTRY_SIZE &&
+            memcmp(data, SESSION_TOUCH_MAGIC, SESSION_TOUCH_MAGIC_LEN) == 0) {
+            for (i = SESSION_TOUCH_MAGIC_LEN; i < SESSION_TOUCH_ENTRY_SIZE;
+                 i++) {
+                touch = (touch << 8) | data[i];
+            }
+            am_reaper_session(sweep, id)->touch = (apr_time_t)touch;
+        }
+    } else if ((id = am_reaper_key_suffix(sweep, key, key_len,
+                                          SESSION_LOGOUT_KEY_PREFIX)) != NULL) {
+        APR_ARRAY_PUSH(sweep->logouts, const char *) = id;
+    } else if (am_reaper_key_suffix(sweep, key, key_len,
+                                    NAMEID_KEY_PREFIX) != NULL) {
+        APR_ARRAY_PUSH(sweep->name_ids, const char *) =
+            apr_pstrmemdup(sweep->pool, (const char *)key, key_len);
+        APR_ARRAY_PUSH(sweep->name_ids, const char *) =
+            apr_pstrmemdup(sweep->pool, (const char *)data, data_len);
+    }
+
+    return APR_SUCCESS;
+}
+
+static bool
+am_reaper_session_dead(const am_reaper_session_t *session, apr_time_t now)
+{
+    apr_time_t deadline;
+
+    if (!session->found) {
+        return false;
+    }
+
+    if (session->expires < now) {
+        return true;
+    }
+
+    deadline = session->idle_timeout;
+    if (session->touch > deadline) {
+        deadline = session->touch;
+    }
+    return deadline != 0 && deadline < now;
+}
+
+static apr_status_t
+am_reaper_lock(am_reaper_t *reaper)
+{
+    if (reaper->mod_cfg->socache_provider->flags &
+        AP_SOCACHE_FLAG_NOTMPSAFE) {
+        return apr_global_mutex_lock(reaper->mod_cfg->socache_lock);
+    }
+    return APR_SUCCESS;
+}
+
+static void
+am_reaper_unlock(am_reaper_t *reaper)
+{
+    if (reaper->mod_cfg->socache_provider->flags &
+        AP_SOCACHE_FLAG_NOTMPSAFE) {
+        apr_global_mutex_unlock(reaper->mod_cfg->socache_lock);
+    }
+}
+
+/**
+ * Check whether the records of a session outlived its session entry
+ *
+ * A logout, touch or name_id record whose session entry was not seen
+ * belongs to a session which was deleted or evicted, unless the
+ * session was stored while the sweep was iterating: a login writes the
+ * session entry before the other records, but the iteration may have
+ * passed its position already. The session entry is therefore looked
+ * up again before its records are deleted; the result is kept for the
+ * other records of the session. The lookup reads into a buffer as
+ * large as a session entry may be, shmcb reports an entry larger than
+ * the buffer as absent.
+ *
+ * Sessions sealed into cookies (MellonSessionStorage cookie) have no
+ * session entry at all, their records are left to expire with the
+ * session.
+ *
+ * @returns true if the session entry is absent.
+ */
+static bool
+am_reaper_session_orphaned(am_reaper_sweep_t *sweep, const char *session_id)
+{
+    am_reaper_t *reaper = sweep->reaper;
+    am_mod_cfg_rec *mod_cfg = reaper->mod_cfg;
+    am_reaper_session_t *session = am_reaper_session(sweep, session_id);
+    const char *key;
+    unsigned int probe_len = mod_cfg->socache_session_state_entry_size;
+    apr_status_t rv;
+
+    if (session->present ||
+        mod_cfg->session_storage == AM_SESSION_STORAGE_COOKIE) {
+        return false;
+    }
+    if (session->probed) {
+        return session->orphaned;
+    }
+    session->probed = true;
+
+    if (sweep->probe_buf == NULL) {
+        sweep->probe_buf = apr_palloc(sweep->pool, probe_len);
+    }
+
+    if (am_reaper_lock(reaper) != APR_SUCCESS) {
+        return false;
+    }
+    key = apr_psprintf(sweep->pool, "%s:%s", SESSION_KEY_PREFIX, session_id);
+    rv = mod_cfg->socache_provider->retrieve(mod_cfg->socache_instance,
+                                             reaper->s,
+                                             (const unsigned char *)key,
+                                             strlen(key), sweep->probe_buf,
+                                             &probe_len, sweep->pool);
+    am_reaper_unlock(reaper);
+
+    session->orphaned = rv == APR_NOTFOUND;
+    return session->orphaned;
+}
+
+/**
+ * Delete a batch of entries, taking the lock for this batch only so
+ * requests are not held up for the whole sweep
+ *
+ * @returns the number of entries deleted.
+ */
+static unsigned int
+am_reaper_remove(am_reaper_sweep_t *sweep, am_cache_batch_item_t *items,
+                 int n_items)
+{
+    am_mod_cfg_rec *mod_cfg = sweep->reaper->mod_cfg;
+    const am_cache_batch_provider_t *batch = mod_cfg->socache_batch_provider;
+    server_rec *s = sweep->reaper->s;
+    apr_time_t start;
+    apr_status_t rv = APR_SUCCESS;
+    unsigned int removed = 0;
+    int i;
+
+    if (n_items == 0 || am_reaper_lock(sweep->reaper) != APR_SUCCESS) {
+        return 0;
+    }
+
+    start = apr_time_now();
+
+    if (batch != NULL && batch->remove != NULL) {
+        rv = batch->remove(mod_cfg->socache_instance, s, items, n_items,
+                           sweep->pool);
+    } else {
+        for (i = 0; i < n_items; i++) {
+            items[i].status =
+                mod_cfg->socache_provider->remove(mod_cfg->socache_instance,
+                                                  s, items[i].key,
+                                                  items[i].key_len,
+                                                  sweep->pool);
+        }
+    }
+
+    am_reaper_unlock(sweep->reaper);
+
+    for (i = 0; i < n_items; i++) {
+        if (rv != APR_SUCCESS) {
+            items[i].status = rv;
+        }
+        if (items[i].status == APR_SUCCESS) {
+            removed++;
+        }
+    }
+
+    am_cache_stats_backend(AM_CACHE_BACKEND_REMOVE, items, n_items,
+                           apr_time_now() - start);
+
+    apr_atomic_set32(&am_reaper_state->heartbeat, am_reaper_now());
+
+    return removed;
+}
+
+/* Queue the deletion of an entry, flushing the batch once it is full */
+static void
+am_reaper_queue(am_reaper_sweep_t *sweep, am_cache_batch_item_t *items,
+                int *n_items, const char *what, const char *key,
+                unsigned int *removed)
+{
+    am_cache_batch_item_init(&items[(*n_items)++], what, key);
+    if (*n_items == REAPER_BATCH_SIZE) {
+        *removed += am_reaper_remove(sweep, items, *n_items);
+        *n_items = 0;
+    }
+}
+
+/**
+ * Sweep the socache once
+ *
+ * @returns APR_SUCCESS, APR_ENOTIMPL if the provider cannot iterate,
+ *          or another error status.
+ */
+static apr_status_t
+am_reaper_sweep(am_reaper_t *reaper)
+{
+    am_mod_cfg_rec *mod_cfg = reaper->mod_cfg;
+    am_cache_batch_item_t items[REAPER_BATCH_SIZE];
+    am_reaper_sweep_t sweep;
+    apr_hash_index_t *hi;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv;
+    unsigned int sessions = 0;
+    unsigned int removed = 0;
+    int n_items = 0;
+    int i;
+
+    apr_pool_clear(reaper->pool);
+
+    memset(&sweep, 0, sizeof(sweep));
+    sweep.reaper = reaper;
+    sweep.pool = reaper->pool;
+    sweep.entries = apr_array_make(sweep.pool, 64, sizeof(am_reaper_entry_t));
+    sweep.sessions = apr_hash_make(sweep.pool);
+    sweep.name_ids = apr_array_make(sweep.pool, 64, sizeof(const char *));
+    sweep.logouts = apr_array_make(sweep.pool, 64, sizeof(const char *));
+
+    if ((rv = am_reaper_lock(reaper)) != APR_SUCCESS) {
+        return rv;
+    }
+    rv = mod_cfg->socache_provider->iterate(mod_cfg->socache_instance,
+                                            reaper->s, &sweep,
+                                            am_reaper_collect, sweep.pool);
+    am_reaper_unlock(reaper);
+
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    for (i = 0; i < sweep.entries->nelts && !reaper->stop; i++) {
+        am_reaper_entry_t *entry = &APR_ARRAY_IDX(sweep.entries, i,
+                                                  am_reaper_entry_t);
+        am_reaper_session_t *session = am_reaper_session(&sweep,
+                                                         entry->session_id);
+
+        session->present = true;
+        session->found = am_reaper_peek_session(reaper, entry->data,
+                                                entry->data_len, session);
+    }
+    if (reaper->stop) {
+        return APR_EINTR;
+    }
+
+    for (hi = apr_hash_first(sweep.pool, sweep.sessions); hi;
+         hi = apr_hash_next(hi)) {
+        const void *id;
+        void *session;
+
+        apr_hash_this(hi, &id, NULL, &session);
+        if (am_reaper_session_dead(session, start)) {
+            sessions++;
+            am_reaper_queue(&sweep, items, &n_items, "session",
+                            apr_psprintf(sweep.pool, "%s:%s",
+                                         SESSION_KEY_PREFIX,
+                                         (const char *)id), &removed);
+        } else if (!am_reaper_session_orphaned(&sweep, id)) {
+            continue;
+        }
+        /* Only sessions with a touch record are in the hash without
+         * a session entry */
+        am_reaper_queue(&sweep, items, &n_items, "touch",
+                        apr_psprintf(sweep.pool, "%s:%s",
+                                     SESSION_TOUCH_KEY_PREFIX,
+                                     (const char *)id), &removed);
+    }
+
+    for (i = 0; i < sweep.logouts->nelts; i++) {
+        const char *id = APR_ARRAY_IDX(sweep.logouts, i, const char *);
+
+        if (am_reaper_session_dead(am_reaper_session(&sweep, id), start) ||
+            am_reaper_session_orphaned(&sweep, id)) {
+            am_reaper_queue(&sweep, items, &n_items, "logout",
+                            apr_psprintf(sweep.pool, "%s:%s",
+                                         SESSION_LOGOUT_KEY_PREFIX, id),
+                            &removed);
+        }
+    }
+
+    for (i = 0; i + 1 < sweep.name_ids->nelts; i += 2) {
+        const char *key = APR_ARRAY_IDX(sweep.name_ids, i, const char *);
+        const char *id = APR_ARRAY_IDX(sweep.name_ids, i + 1, const char *);
+
+        if (am_reaper_session_dead(am_reaper_session(&sweep, id), start) ||
+            am_reaper_session_orphaned(&sweep, id)) {
+            am_reaper_queue(&sweep, items, &n_items, "name_id", key,
+                            &removed);
+        }
+    }
+
+    removed += am_reaper_remove(&sweep, items, n_items);
+
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, reaper->s,
+                 "session reaper scanned %u entries, removed %u entries "
+                 "of %u expired sessions in %" APR_TIME_T_FMT " ms",
+                 sweep.scanned, removed, sessions,
+                 apr_time_as_msec(apr_time_now() - start));
+
+    return APR_SUCCESS;
+}
+
+static void * APR_THREAD_FUNC
+am_reaper_thread(apr_thread_t *thread, void *data)
+{
+    am_reaper_t *reaper = data;
+    apr_uint32_t next_sweep = 0;
+    apr_uint32_t now;
+    apr_status_t rv;
+    bool unsupported = false;
+
+    while (!reaper->stop) {
+        now = am_reaper_now();
+
+        if (am_reaper_elect(reaper, now)) {
+            apr_atomic_set32(&am_reaper_state->heartbeat, now);
+
+            if (!unsupported && now >= next_sweep) {
+                rv = am_reaper_sweep(reaper);
+                if (rv == APR_SUCCESS) {
+                    apr_atomic_set32(&am_reaper_state->sweeping, 1);
+                } else if (APR_STATUS_IS_ENOTIMPL(rv)) {
+                    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, reaper->s,
+                                 "socache provider %s cannot be iterated, "
+                                 "the session reaper is disabled",
+                                 reaper->mod_cfg->socache_provider_name);
+                    apr_atomic_set32(&am_reaper_state->sweeping, 0);
+                    unsupported = true;
+                } else if (!reaper->stop) {
+                    char error_buf[512];
+                    ap_log_error(APLOG_MARK, APLOG_ERR, rv, reaper->s,
+                                 "session reaper sweep failed: %s",
+                                 apr_strerror(rv, error_buf,
+                                              sizeof(error_buf)));
+                }
+                next_sweep = am_reaper_now() +
+                             reaper->mod_cfg->session_reaper_interval;
+            }
+        }
+
+        apr_sleep(apr_time_from_sec(1));
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t
+am_reaper_stop(void *data)
+{
+    am_reaper_t *reaper = data;
+    apr_status_t thread_rv;
+
+    reaper->stop = 1;
+    apr_thread_join(&thread_rv, reaper->thread);
+
+    /* Let another process take over at once */
+    apr_atomic_cas32(&am_reaper_state->leader, 0, reaper->pid);
+
+    return APR_SUCCESS;
+}
+#endif /* APR_HAS_THREADS */
+
+/*------------------------------ Public Functions ----------------------------*/
+
+/**
+ * Get the name of a cache operation type
+ *
+ * @param[in] op Operation type
+ *
+ * @returns name of the operation, as used in logs and statistics.
+ */
+const char *
+am_cache_op_name(am_cache_op_t op)
+{
+    if (op < 0 || op >= AM_CACHE_OP_MAX) {
+        return "unknown";
+    }
+    return am_cache_op_names[op];
+}
+
+/**
+ * Get a snapshot of the socache lock counters of this process
+ *
+ * @param[out] stats Receives the counters, indexed by am_cache_op_t
+ */
+void
+am_cache_get_lock_stats(am_cache_lock_stats_t stats[AM_CACHE_OP_MAX])
+{
+    am_cache_stats_lock();
+    memcpy(stats, am_lock_stats, sizeof(am_lock_stats));
+    am_cache_stats_unlock();
+}
+
+/**
+ * Get a snapshot of the compression counters of this process
+ *
+ * @param[out] stats Receives the counters
+ */
+void
+am_cache_get_compress_stats(am_cache_compress_stats_t *stats)
+{
+    am_cache_stats_lock();
+    *stats = am_compress_stats;
+    am_cache_stats_unlock();
+}
+
+/**
+ * Write the session store statistics as the body of a response
+ *
+ * The plain text format is meant for people, the Prometheus text
+ * exposition format for monitoring systems. Times are in microseconds
+ * in the plain text format and in seconds in the Prometheus format.
+ *
+ * @param[in] r          Current HTTP request
+ * @param[in] prometheus Use the Prometheus format
+ *
+ * @returns APR_SUCCESS, or APR_ENOTIMPL if no statistics are kept.
+ */
+apr_status_t
+am_cache_write_stats(request_rec *r, bool prometheus)
+{
+    const am_cache_store_stats_t *stats = am_store_stats;
+    const char *name;
+    int op, result;
+
+    if (stats == NULL) {
+        return APR_ENOTIMPL;
+    }
+
+    if (!prometheus) {
+        ap_rprintf(r, "started: %s\n",
+                   am_time_t_to_8601(r->pool, stats->started));
+        for (op = 0; op < AM_CACHE_BACKEND_MAX; op++) {
+            ap_rprintf(r, "%s:", am_cache_backend_op_names[op]);
+            for (result = 0; result < AM_CACHE_RESULT_MAX; result++) {
+                ap_rprintf(r, " %s=%" APR_UINT64_T_FMT,
+                           am_cache_result_names[result],
+                           am_cache_stats_read(&stats->results[op][result]));
+            }
+            ap_rputs("\n", r);
+        }
+        for (op = 0; op < AM_CACHE_BACKEND_MAX; op++) {
+            am_cache_stats_print_histogram(r,
+                apr_pstrcat(r->pool, am_cache_backend_op_names[op],
+                            " latency", NULL),
+                "usec", &stats->latency[op], am_cache_time_bounds);
+        }
+        am_cache_stats_print_histogram(r, "session size", "bytes",
+                                       &stats->session_size,
+                                       am_cache_size_bounds);
+        am_cache_stats_print_histogram(r, "session decode", "usec",
+                                       &stats->decode_time,
+                                       am_cache_time_bounds);
+        ap_rprintf(r, "rejected too large: %" APR_UINT64_T_FMT "\n",
+                   am_cache_stats_read(&stats->rejected_too_large));
+        ap_rprintf(r, "session cache hits: %" APR_UINT64_T_FMT "\n",
+                   am_cache_stats_read(&stats->session_cache_hits));
+        ap_rprintf(r, "authz cache: hit=%" APR_UINT64_T_FMT
+                   " miss=%" APR_UINT64_T_FMT "\n",
+                   am_cache_stats_read(&stats->authz_cache_hits),
+                   am_cache_stats_read(&stats->authz_cache_misses));
+        return APR_SUCCESS;
+    }
+
+    name = "mellon_cache_operations_total";
+    ap_rprintf(r, "# HELP %s Session store entry operations by result.\n"
+               "# TYPE %s counter\n", name, name);
+    for (op = 0; op < AM_CACHE_BACKEND_MAX; op++) {
+        for (result = 0; result < AM_CACHE_RESULT_MAX; result++) {
+            ap_rprintf(r, "%s{op=\"%s\",result=\"%s\"} %" APR_UINT64_T_FMT
+                       "\n", name, am_cache_backend_op_names[op],
+                       am_cache_result_names[result],
+                       am_cache_stats_read(&stats->results[op][result]));
+        }
+    }
+
+    name = "mellon_cache_operation_duration_seconds";
+    ap_rprintf(r, "# HELP %s Time taken by session store calls.\n"
+               "# TYPE %s histogram\n", name, name);
+    for (op = 0; op < AM_CACHE_BACKEND_MAX; op++) {
+        am_cache_stats_prometheus_histogram(r, name,
+            apr_psprintf(r->pool, "op=\"%s\"",
+                         am_cache_backend_op_names[op]),
+            &stats->latency[op], am_cache_time_bounds, 1e-6);
+    }
+
+    name = "mellon_session_entry_size_bytes";
+    ap_rprintf(r, "# HELP %s Size of the session entries retrieved.\n"
+               "# TYPE %s histogram\n", name, name);
+    am_cache_stats_prometheus_histogram(r, name, "", &stats->session_size,
+                                        am_cache_size_bounds, 1.0);
+
+    name = "mellon_session_decode_duration_seconds";
+    ap_rprintf(r, "# HELP %s Time taken to decode session entries.\n"
+               "# TYPE %s histogram\n", name, name);
+    am_cache_stats_prometheus_histogram(r, name, "", &stats->decode_time,
+                                        am_cache_time_bounds, 1e-6);
+
+    name = "mellon_session_entries_rejected_total";
+    ap_rprintf(r, "# HELP %s Entries not stored for exceeding the maximum "
+               "entry size.\n# TYPE %s counter\n%s %" APR_UINT64_T_FMT "\n",
+               name, name, name,
+               am_cache_stats_read(&stats->rejected_too_large));
+
+    name = "mellon_session_cache_hits_total";
+    ap_rprintf(r, "# HELP %s Session lookups served by the decoded "
+               "session cache.\n# TYPE %s counter\n%s %" APR_UINT64_T_FMT
+               "\n", name, name, name,
+               am_cache_stats_read(&stats->session_cache_hits));
+
+    name = "mellon_authz_cache_lookups_total";
+    ap_rprintf(r, "# HELP %s Authorization decision cache lookups by "
+               "result.\n# TYPE %s counter\n", name, name);
+    ap_rprintf(r, "%s{result=\"hit\"} %" APR_UINT64_T_FMT "\n",
+               name, am_cache_stats_read(&stats->authz_cache_hits));
+    ap_rprintf(r, "%s{result=\"miss\"} %" APR_UINT64_T_FMT "\n",
+               name, am_cache_stats_read(&stats->authz_cache_misses));
+
+    name = "mellon_cache_stats_start_time_seconds";
+    ap_rprintf(r, "# HELP %s Time the statistics were reset.\n"
+               "# TYPE %s gauge\n%s %" APR_TIME_T_FMT "\n",
+               name, name, name, apr_time_sec(stats->started));
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Create the decoded session cache if it is enabled with
+ * MellonSessionCacheSize and MellonSessionCacheTTL.
+ */
+static apr_status_t
+am_session_cache_init(apr_pool_t *p, server_rec *s)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+    am_session_cache_t *cache;
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+
+    if (mod_cfg->session_cache_size <= 0 || mod_cfg->session_cache_ttl <= 0) {
+        return APR_SUCCESS;
+    }
+
+    cache = apr_pcalloc(p, sizeof(*cache));
+
+    /*
+     * The cache has an allocator of its own, all allocations from it
+     * are serialized by the cache mutex.
+     */
+    if ((rv = apr_allocator_create(&allocator)) != APR_SUCCESS) {
+        return rv;
+    }
+    if ((rv = apr_pool_create_ex(&cache->pool, p, NULL,
+                                 allocator)) != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, cache->pool);
+
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create session cache mutex: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+#endif
+
+    am_lru_init(&cache->lru, cache->pool);
+    cache->max_entries = mod_cfg->session_cache_size;
+    cache->ttl = apr_time_from_sec(mod_cfg->session_cache_ttl);
+
+    am_session_cache = cache;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "session cache enabled, size=%d ttl=%d",
+                 mod_cfg->session_cache_size, mod_cfg->session_cache_ttl);
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Set up the per-process state of the session store
+ *
+ * Called from the child_init hook. Creates the decoded session and
+ * authorization caches and the compression counters.
+ *
+ * @param[in] p Child process pool
+ * @param[in] s Server record
+ *
+ * @returns APR_SUCCESS or error status.
+ */
+apr_status_t
+am_cache_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&am_cache_stats_mutex,
+                                 APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create cache statistics mutex: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+#endif
+    apr_pool_cleanup_register(p, s, am_cache_stats_log,
+                              apr_pool_cleanup_null);
+
+#if APR_HAS_THREADS
+    rv = apr_threadkey_private_create(&am_retrieve_buffer_key,
+                                      am_retrieve_buffer_free, p);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create retrieve buffer key: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+#endif
+
+    if ((rv = am_session_cache_init(p, s)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    if ((rv = am_touch_cache_init(p, s)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    if ((rv = am_generation_cache_init(p, s)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    if ((rv = am_authz_cache_init(p, s)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Start the session reaper thread of a child process
+ *
+ * Called from the child_init hook. Every child runs the thread, only
+ * the one elected leader sweeps the socache (see "Session Reaper").
+ *
+ * @param[in] p Child process pool, the thread is stopped when it is
+ *              destroyed
+ * @param[in] s Server record
+ *
+ * @returns APR_SUCCESS or error status.
+ */
+apr_status_t
+am_cache_reaper_start(apr_pool_t *p, server_rec *s)
+{
+#if APR_HAS_THREADS
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+    am_reaper_t *reaper;
+    apr_status_t rv;
+
+    if (am_reaper_state == NULL) {
+        return APR_SUCCESS;
+    }
+
+    reaper = apr_pcalloc(p, sizeof(*reaper));
+    reaper->s = s;
+    reaper->mod_cfg = mod_cfg;
+    reaper->pid = (apr_uint32_t)getpid();
+    reaper->start = am_process_start_time((pid_t)reaper->pid);
+    reaper->inflate_buf = apr_palloc(p, REAPER_PEEK_SIZE);
+
+    if ((rv = apr_pool_create(&reaper->pool, p)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = apr_thread_create(&reaper->thread, NULL, am_reaper_thread,
+                           reaper, p);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    /* The thread uses subpools of p, which are destroyed before the
+     * regular cleanups of p run; stop it before that. */
+    apr_pool_pre_cleanup_register(p, reaper, am_reaper_stop);
+
+    return APR_SUCCESS;
+#else
+    if (am_reaper_state != NULL) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "MellonSessionReaperInterval requires thread support, "
+                     "expired sessions are deleted by requests");
+    }
+    return APR_SUCCESS;
+#endif
+}
+
+/**
+ * Whether the session reaper removes expired sessions
+ *
+ * True once the reaping process has completed a sweep and for as long
+ * as it keeps running, requests then leave expired sessions to it.
+ *
+ * @param[in] s Server record
+ *
+ * @returns true if expired sessions need not be deleted inline.
+ */
+bool
+am_cache_reaper_active(server_rec *s)
+{
+    am_reaper_state_t *state = am_reaper_state;
+
+    if (state == NULL || !apr_atomic_read32(&state->sweeping)) {
+        return false;
+    }
+
+    return am_reaper_now() - apr_atomic_read32(&state->heartbeat) <=
+           am_reaper_timeout(am_get_mod_cfg(s));
+}
+
+static apr_status_t
+am_destroy_socache(server_rec *s)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+
+    if (mod_cfg->socache_instance) {
+        mod_cfg->socache_provider->destroy(mod_cfg->socache_instance, s);
+        mod_cfg->socache_instance = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+am_destroy_socache_lock(server_rec *s)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+
+    if (mod_cfg->socache_lock) {
+        apr_global_mutex_destroy(mod_cfg->socache_lock);
+        mod_cfg->socache_lock = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+destroy_socache_callback(void *data)
+{
+    server_rec *s = (server_rec *)data;
+
+    return am_destroy_socache(s);
+}
+
+static apr_status_t
+destroy_socache_lock_callback(void *data)
+{
+    server_rec *s = (server_rec *)data;
+
+    return am_destroy_socache_lock(s);
+}
+
+apr_status_t
+am_get_socache_provider(apr_pool_t *pool, const char *name,
+                        ap_socache_provider_t **socache_provider_out,
+                        const char **errmsg_out)
+{
+    apr_status_t apr_status = APR_SUCCESS;
+    ap_socache_provider_t *socache_provider = NULL;
+
+    *socache_provider_out = NULL;
+    if (errmsg_out) {
+        *errmsg_out = NULL;
+    }
+
+    socache_provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP,
+                                          name,
+                                          AP_SOCACHE_PROVIDER_VERSION);
+    if (socache_provider == NULL) {
+        apr_status = APR_NOTFOUND;
+        if (errmsg_out) {
+            char *errmsg = NULL;
+            apr_array_header_t *name_list;
+            const char *all_names;
+
+            /* Build a comma-separated list of all registered provider names: */
+            name_list = ap_list_provider_names(pool,
+                                               AP_SOCACHE_PROVIDER_GROUP,
+                                               AP_SOCACHE_PROVIDER_VERSION);
+            all_names = apr_array_pstrcat(pool, name_list, ',');
+
+            errmsg = apr_psprintf(pool,
+                                  "'%s' session socache not supported "
+                                  "(known names: %s). "
+                                  "Maybe you need to load the appropriate "
+                                  "socache module (mod_socache_%s?).",
+                                  name, all_names, name);
+            *errmsg_out = errmsg;
+        }
+        return apr_status;
+    }
+    
+    *socache_provider_out = socache_provider;
+    return apr_status;
+}
+
+apr_status_t
+am_socache_init(apr_pool_t *pool, apr_pool_t *tmp_pool, server_rec *s)
+{
+    apr_status_t apr_status;
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+    struct ap_socache_hints socache_hints;
+    const char *errmsg = NULL;
+
+    memset(&socache_hints, 0, sizeof socache_hints);
+    socache_hints.avg_id_len = AM_ID_LENGTH;
+    socache_hints.avg_obj_size = mod_cfg->socache_session_state_entry_size;;
+    socache_hints.expiry_interval = 60000000;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "initializing socache provider_name=\"%s\" "
+                 "provider_args=\"%s\" session_state_entry_size=%d",
+                 mod_cfg->socache_provider_name,
+                 mod_cfg->socache_provider_args,
+                 mod_cfg->socache_session_state_entry_size);
+
+    if (mod_cfg->socache_provider == NULL) {
+        apr_status = am_get_socache_provider(pool,
+                                             mod_cfg->socache_provider_name,
+                                             &mod_cfg->socache_provider,
+                                             &errmsg);
+        if (apr_status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "failed loading socache "
+                         "provider_name=%s provider_args=%s errmsg=%s",
+                         mod_cfg->socache_provider_name,
+                         mod_cfg->socache_provider_args, errmsg);
+            return apr_status;
+        }
+    }
+
+    mod_cfg->socache_batch_provider =
+        ap_lookup_provider(AM_CACHE_BATCH_PROVIDER_GROUP,
+                           mod_cfg->socache_provider_name,
+                           AM_CACHE_BATCH_PROVIDER_VERSION);
+
+    if (mod_cfg->socache_instance == NULL) {
+        errmsg = mod_cfg->socache_provider->create(&mod_cfg->socache_instance,
+                                                   mod_cfg->socache_provider_args,
+                                                   tmp_pool, pool);
+        if (errmsg) {
+            apr_status = APR_EGENERAL;
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "failed to create socache provider "
+                         "provider_name=%s provider_args=%s errmsg=%s",
+                         mod_cfg->socache_provider_name,
+                         mod_cfg->socache_provider_args, errmsg);
+            return apr_status;
+        }
+    }
+
+    if (mod_cfg->socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE ||
+        !am_cache_backend_has_add(mod_cfg)) {
+        apr_status = ap_global_mutex_create(&mod_cfg->socache_lock,
+                                            NULL, SOCACHE_ID,
+                                            NULL, s, pool, 0);
+
+        if (apr_status != APR_SUCCESS) {
+            char buffer[512];
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "mutex_create: Error [%d] \"%s\"",
+                         apr_status, apr_strerror(apr_status,
+                                                  buffer, sizeof(buffer)));
+            return apr_status;
+        }
+
+        apr_pool_cleanup_register(pool, (void*)s, destroy_socache_lock_callback,
+                                  apr_pool_cleanup_null);
+#ifdef AP_NEED_SET_MUTEX_PERMS
+        /* On some platforms the mutex is implemented as a file. To
+         * allow child processes running as a different user to open
+         * it, it is necessary to change the permissions on it. */
+        apr_status = ap_unixd_set_global_mutex_perms(mod_cfg->socache_lock);
+        if (apr_status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "Failed to set permissions on session lock, "
+                         " check User and Group directives");
+            return apr_status;
+        }
+#endif
+
+    }
+
+    apr_status = mod_cfg->socache_provider->init(mod_cfg->socache_instance,
+                                         SOCACHE_ID, &socache_hints, s, pool);
+    if (apr_status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "failed to initialise %s cache", SOCACHE_ID);
+        return apr_status;
+    }
+    apr_pool_cleanup_register(pool, (void*)s, destroy_socache_callback,
+                              apr_pool_cleanup_null);
+
+    am_cache_stats_init(pool, s);
+    am_cache_reaper_init(pool, s, mod_cfg);
+
+    return am_replay_filter_init(pool, s, mod_cfg);
+}
+
+/*
+ * Every operation takes the global mutex with a socache provider which
+ * is not safe for concurrent use. With any other provider only the
+ * operations storing an entry only if it is absent need it (the replay
+ * check of an Assertion ID and the creation of a generation record), a
+ * lookup followed by a store, and only if the provider cannot add the
+ * entry atomically.
+ */
+static bool
+am_cache_op_needs_lock(am_mod_cfg_rec *mod_cfg, am_cache_op_t op)
+{
+    if (mod_cfg->socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        return true;
+    }
+    return (op == AM_CACHE_OP_ASSERTION_ID ||
+            op == AM_CACHE_OP_CREATE_GENERATION) &&
+        !am_cache_backend_has_add(mod_cfg);
+}
+
+static apr_status_t
+am_cache_aquire_lock(request_rec *r, am_cache_lock_t *lock, am_cache_op_t op)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    apr_status_t rv = APR_SUCCESS;
+
+    lock->op = op;
+
+    if (am_cache_op_needs_lock(mod_cfg, op)) {
+        lock->requested = apr_time_now();
+        if ((rv = apr_global_mutex_lock(mod_cfg->socache_lock)) != APR_SUCCESS) {
+            char error_buf[512];
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "apr_global_mutex_lock() failed [%d]: %s",
+                          rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+        }
+        lock->acquired = apr_time_now();
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+am_cache_release_lock(request_rec *r, am_cache_lock_t *lock)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    apr_status_t rv = APR_SUCCESS;
+
+    if (am_cache_op_needs_lock(mod_cfg, lock->op)) {
+        apr_interval_time_t wait = lock->acquired - lock->requested;
+        apr_interval_time_t hold;
+
+        if ((rv = apr_global_mutex_unlock(mod_cfg->socache_lock)) != APR_SUCCESS) {
+            char error_buf[512];
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "apr_global_mutex_unlock() failed [%d]: %s",
+                          rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+        }
+
+        hold = apr_time_now() - lock->acquired;
+        am_cache_lock_stats_add(lock->op, wait, hold);
+
+        am_diag_printf(r, "%s: %s waited %" APR_TIME_T_FMT " usec,"
+                       " held lock %" APR_TIME_T_FMT " usec\n",
+                       __func__, am_cache_op_name(lock->op), wait, hold);
+    }
+    return APR_SUCCESS;
+}
+
+static const char *
+am_cache_load_session_id_from_name_id(request_rec *r, LassoSaml2NameID *name_id,
+                                      LassoSaml2NameID *issuer)
+{
+    const char *name_id_key = name_id_key_name(r, name_id, issuer);
+    am_cache_batch_item_t item;
+    char *entry_buf = NULL;
+
+    if (name_id == NULL || name_id_key == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "name_id was NULL");
+        return NULL;
+    }
+
+    am_diag_printf(r, "%s: name_id=%s name_id_key=%s now=%s\n",
+                   __func__,
+                   am_lasso_name_id_string(r, name_id),
+                   name_id_key,
+                   am_time_t_to_8601(r->pool, apr_time_now()));
+
+    entry_buf = apr_palloc(r->pool, NAMEID_ENTRY_SIZE + 1);
+    if (entry_buf == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "failed to allocate session_id buffer");
+        return NULL;
+    }
+
+    am_cache_batch_item_init(&item, "name_id", name_id_key);
+    item.data = (unsigned char *)entry_buf;
+    item.data_len = NAMEID_ENTRY_SIZE;
+
+    am_cache_backend_retrieve(r, &item, 1);
+    if (item.status != APR_SUCCESS) {
+        am_diag_printf(r, "%s: name_id not found, name_id=%s now=%s\n",
+                       __func__,
+                       am_lasso_name_id_string(r, name_id),
+                       am_time_t_to_8601(r->pool, apr_time_now()));
+        return NULL;
+    }
+
+    entry_buf[item.data_len] = '\0'; /* NULL-terminate */
+
+    am_diag_printf(r, "%s: successfully retrieved %u bytes\n",
+                   __func__, item.data_len);
+
+    return entry_buf;
+}
+
+static const char *
+am_cache_load_session_data_from_session_id(request_rec *r,
+                                           const char *session_id,
+                                           apr_size_t *data_len_out)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    am_cache_batch_item_t item;
+    unsigned char *entry_buf = NULL;
+
+    if (session_id == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "session_id was NULL");
+        return NULL;
+    }
+
+    am_cache_batch_item_init(&item, "session_id",
+                             session_key_name(r, session_id));
+
+    am_diag_printf(r, "%s: session_id=%s session_id_key=%s now=%s\n",
+                   __func__, session_id, (const char *)item.key,
+                   am_time_t_to_8601(r->pool, apr_time_now()));
+
+    entry_buf = am_cache_retrieve_buffer(r,
+                                         mod_cfg->socache_session_state_entry_size);
+    if (entry_buf == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "failed to allocate session data buffer");
+        return NULL;
+    }
+
+    item.data = entry_buf;
+    item.data_len = mod_cfg->socache_session_state_entry_size;
+
+    am_cache_backend_retrieve(r, &item, 1);
+    if (item.status != APR_SUCCESS) {
+        am_diag_printf(r, "%s: session not found using session_id=%s now=%s\n",
+                       __func__, session_id,
+                       am_time_t_to_8601(r->pool, apr_time_now()));
+        return NULL;
+    }
+
+    *data_len_out = item.data_len;
+    am_cache_stats_session_size(item.data_len);
+
+    am_diag_printf(r, "%s: successfully retrieved %u bytes\n",
+                   __func__, item.data_len);
+
+    return am_cache_copy_out_entry(r, (const char *)entry_buf, item.data_len);
+}
+
+static const char *
+am_cache_load_logout_data_from_session_id(request_rec *r,
+                                          const char *session_id,
+                                          apr_size_t *data_len_out)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    am_cache_batch_item_t item;
+    unsigned char *entry_buf = NULL;
+
+    am_cache_batch_item_init(&item, "logout",
+                             session_logout_key_name(r, session_id));
+
+    am_diag_printf(r, "%s: session_id=%s logout_key=%s now=%s\n",
+                   __func__, session_id, (const char *)item.key,
+                   am_time_t_to_8601(r->pool, apr_time_now()));
+
+    entry_buf = am_cache_retrieve_buffer(r,
+                                         mod_cfg->socache_session_state_entry_size);
+    if (entry_buf == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "failed to allocate logout data buffer");
+        return NULL;
+    }
+
+    item.data = entry_buf;
+    item.data_len = mod_cfg->socache_session_state_entry_size;
+
+    am_cache_backend_retrieve(r, &item, 1);
+    if (item.status != APR_SUCCESS) {
+        am_diag_printf(r, "%s: logout state not found using session_id=%s "
+                       "now=%s\n",
+                       __func__, session_id,
+                       am_time_t_to_8601(r->pool, apr_time_now()));
+        return NULL;
+    }
+
+    *data_len_out = item.data_len;
+
+    am_diag_printf(r, "%s: successfully retrieved %u bytes\n",
+                   __func__, item.data_len);
+
+    return am_cache_copy_out_entry(r, (const char *)entry_buf, item.data_len);
+}
+
+/*
+ * The am_cache_store_*_entry() functions check an entry and prepare
+ * the batch item storing it, see am_cache_store_session_entries().
+ *
+ * retrieve will fail if it's not provided with a buffer big enough
+ * to receive the data. Worse is the fact the error from some socache
+ * providers when the return buffer is too small is APR_NOTFOUND which
+ * is not the real reason. Hence the size limits.
+ */
+static apr_status_t
+am_cache_store_name_id_entry(request_rec *r,
+                             const char *session_id,
+                             LassoSaml2NameID *name_id,
+                             LassoSaml2NameID *issuer,
+                             apr_time_t expiration,
+                             am_cache_batch_item_t *item)
+{
+    const char *name_id_key = name_id_key_name(r, name_id, issuer);
+    unsigned int data_len = strlen(session_id);
+
+    if (name_id_key == NULL) {
+        return APR_EINVAL;
+    }
+
+    am_diag_printf(r, "%s: name_id=\"%s\" name_id_key=%s "
+                   "expiration=%s now=%s "
+                   "data_len=%u data=\"%s\" \n", __func__,
+                   am_lasso_name_id_string(r, name_id),
+                   name_id_key,
+                   am_time_t_to_8601(r->pool, expiration),
+                   am_time_t_to_8601(r->pool, apr_time_now()),
+                   data_len, session_id);
+
+    if (data_len > NAMEID_ENTRY_SIZE) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "name_id data size (%u) exceeds maximum "
+                      "name_id data size (%u)",
+                      data_len, NAMEID_ENTRY_SIZE);
+        am_cache_stats_rejected();
+        return APR_FROM_OS_ERROR(EMSGSIZE);
+    }
+
+    am_cache_batch_item_init(item, "name_id", name_id_key);
+    item->expiry = expiration;
+    item->data = (unsigned char *)session_id;
+    item->data_len = data_len;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+am_cache_store_session_id_entry(request_rec *r,
+                                const char *session_id,
+                                LassoSaml2NameID *name_id,
+                                apr_time_t expiration,
+                                const char *session_data,
+                                apr_size_t session_data_len,
+                                am_cache_batch_item_t *item)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    const char *session_key = session_key_name(r, session_id);
+    unsigned int data_len = session_data_len;
+
+    am_diag_printf(r, "%s: session_id=\"%s\" name_id=\"%s\" "
+                   "session_key=%s "
+                   "expiration=%s now=%s "
+                   "data_len=%u\n", __func__,
+                   session_id, am_lasso_name_id_string(r, name_id),
+                   session_key,
+                   am_time_t_to_8601(r->pool, expiration),
+                   am_time_t_to_8601(r->pool, apr_time_now()),
+                   data_len);
+
+    if (data_len > mod_cfg->socache_session_state_entry_size) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "session data size (%u) exceeds maximum "
+                      "session data size (%u)",
+                      data_len, mod_cfg->socache_session_state_entry_size);
+        am_cache_stats_rejected();
+        return APR_FROM_OS_ERROR(EMSGSIZE);
+    }
+
+    am_cache_batch_item_init(item, "session_id", session_key);
+    item->expiry = expiration;
+    item->data = (unsigned char *)session_data;
+    item->data_len = data_len;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+am_cache_store_logout_entry(request_rec *r,
+                            const char *session_id,
+                            apr_time_t expiration,
+                            const char *logout_data,
+                            apr_size_t logout_data_len,
+                            am_cache_batch_item_t *item)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    const char *logout_key = session_logout_key_name(r, session_id);
+    unsigned int data_len = logout_data_len;
+
+    am_diag_printf(r, "%s: session_id=\"%s\" "
+                   "logout_key=%s "
+                   "expiration=%s now=%s "
+                   "data_len=%u\n", __func__,
+                   session_id, logout_key,
+                   am_time_t_to_8601(r->pool, expiration),
+                   am_time_t_to_8601(r->pool, apr_time_now()),
+                   data_len);
+
+    if (data_len > mod_cfg->socache_session_state_entry_size) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "logout data size (%u) exceeds maximum "
+                      "session data size (%u)",
+                      data_len, mod_cfg->socache_session_state_entry_size);
+        am_cache_stats_rejected();
+        return APR_FROM_OS_ERROR(EMSGSIZE);
+    }
+
+    am_cache_batch_item_init(item, "logout", logout_key);
+    item->expiry = expiration;
+    item->data = (unsigned char *)logout_data;
+    item->data_len = data_len;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+am_cache_delete_session_entries(request_rec *r,
+                                const char *session_id,
+                                LassoSaml2NameID *name_id,
+                                LassoSaml2NameID *issuer)
+{
+    am_cache_lock_t lock;
+    am_cache_batch_item_t items[4];
     const char *name_id_key = name_id_key_name(r, name_id, issuer);
-    unsigned int name_id_key_len = strlen(name_id_key);
+    int n_items = 0;
     apr_status_t rv = APR_SUCCESS;
 
-    unsigned int entry_buf_len = NAMEID_ENTRY_SIZE;
-    char *entry_buf = NULL;
+    am_diag_printf(r, "%s: session_id=%s name_id=%s now=%s\n",
+                   __func__, session_id,
+                   am_lasso_name_id_string(r, name_id),
+                   am_time_t_to_8601(r->pool, apr_time_now()));
+
+    am_session_cache_remove(session_id);
+    am_touch_cache_remove(session_id);
+
+    /* Other processes may still hold a decoded copy of the session */
+    if (am_session_cache != NULL) {
+        am_cache_batch_item_t revoked;
+
+        am_cache_batch_item_init(&revoked, "revoked",
+                                 session_revoked_key_name(r, session_id));
+        revoked.expiry = apr_time_now() + am_session_cache->ttl;
+        revoked.data = (unsigned char *)"1";
+        revoked.data_len = 1;
+
+        if ((rv = am_cache_aquire_lock(r, &lock,
+                                       AM_CACHE_OP_DELETE)) != APR_SUCCESS) {
+            return rv;
+        }
+        rv = am_cache_backend_store(r, &revoked, 1);
+        am_cache_release_lock(r, &lock);
+
+        if (rv != APR_SUCCESS) {
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, rv, r,
+                          "Could not record the deletion of session %s, "
+                          "other processes may serve it for up to %"
+                          APR_TIME_T_FMT " seconds.", session_id,
+                          apr_time_sec(am_session_cache->ttl));
+        }
+    }
+
+    am_cache_batch_item_init(&items[n_items++], "session_id",
+                             session_key_name(r, session_id));
+    if (name_id_key != NULL) {
+        am_cache_batch_item_init(&items[n_items++], "name_id", name_id_key);
+    }
+    am_cache_batch_item_init(&items[n_items++], "logout",
+                             session_logout_key_name(r, session_id));
+    am_cache_batch_item_init(&items[n_items++], "touch",
+                             session_touch_key_name(r, session_id));
+
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_DELETE)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = am_cache_backend_remove(r, items, n_items);
+
+    am_cache_release_lock(r, &lock);
+
+    return rv;
+}
+
+/*
+ * Decode a session state retrieved from the socache. Sessions are
+ * stored in the binary session encoding, sessions stored by older
+ * versions of Mellon are in XML and still accepted.
+ */
+static am_session_state_t *
+am_cache_decode_session_data(request_rec *r, const char *session_data,
+                             apr_size_t session_data_len)
+{
+    const char *session_xml = session_data;
+    xmlDocPtr session_doc = NULL;
+    am_session_state_t *session = NULL;
+
+    if (am_session_state_is_binary(session_data, session_data_len)) {
+        return am_session_state_from_binary(r, session_data,
+                                            session_data_len);
+    }
+
+    session_doc = am_get_xml_doc_from_string(r, session_xml);
+    if (session_doc == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "failed to parse XML session state text "
+                      "into XML document: %s", session_xml);
+        return NULL;
+    }
+
+    session = am_session_state_from_xml(r, session_doc);
+    xmlFreeDoc(session_doc);
+    if (session == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "failed load session state from XML document");
+        return NULL;
+    }
+
+    return session;
+}
+
+/* Decode a session state, recording the time taken in the statistics */
+static am_session_state_t *
+am_cache_parse_session_data(request_rec *r, const char *session_data,
+                            apr_size_t session_data_len)
+{
+    apr_time_t start = apr_time_now();
+    am_session_state_t *session;
+
+    session = am_cache_decode_session_data(r, session_data, session_data_len);
+    am_cache_stats_decode_time(apr_time_now() - start);
+
+    return session;
+}
+
+/**
+ * Check whether a session served from the decoded session cache was
+ * deleted by another process
+ *
+ * Reads the revocation record stored by am_cache_delete_session_entries(),
+ * a single byte, and drops the cached copy of the session if there is
+ * one.
+ *
+ * @param[in] r          Current HTTP request
+ * @param[in] session_id Session found in the decoded session cache
+ *
+ * @returns true unless the store was read and holds no revocation
+ *          record for the session.
+ */
+static bool
+am_session_cache_deleted(request_rec *r, const char *session_id)
+{
+    unsigned char entry_buf[1];
+    am_cache_batch_item_t item;
+    am_cache_lock_t lock;
+
+    am_cache_batch_item_init(&item, "revoked",
+                             session_revoked_key_name(r, session_id));
+    item.data = entry_buf;
+    item.data_len = sizeof(entry_buf);
+    item.probe = true;
+
+    if (am_cache_aquire_lock(r, &lock,
+                             AM_CACHE_OP_LOAD_SESSION) != APR_SUCCESS) {
+        return true;
+    }
+
+    am_cache_backend_retrieve(r, &item, 1);
+
+    am_cache_release_lock(r, &lock);
+
+    if (item.status == APR_NOTFOUND) {
+        return false;
+    }
+
+    am_diag_printf(r, "%s: session_id=%s status=%d, dropping cached copy\n",
+                   __func__, session_id, item.status);
 
-    am_diag_printf(r, "%s: name_id=%s name_id_key=%s name_id_key_len=%u "
-                   "now=%s\n",
-                   __func__,
-                   am_lasso_name_id_string(r, name_id),
-                   name_id_key, name_id_key_len,
+    am_session_cache_remove(session_id);
+
+    return true;
+}
+
+am_session_state_t *
+am_cache_load_session_by_session_id(request_rec *r, const char *session_id)
+{
+    am_cache_lock_t lock;
+    const char *session_data = NULL;
+    apr_size_t session_data_len = 0;
+    am_session_state_t *session = NULL;
+
+    am_diag_printf(r, "%s: lookup session by session _id %s now=%s\n",
+                   __func__, session_id,
                    am_time_t_to_8601(r->pool, apr_time_now()));
 
-    if (name_id == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "name_id was NULL");
+    if (session_id == NULL) {
         return NULL;
     }
 
-    entry_buf = apr_palloc(r->pool, entry_buf_len + 1);
-    if (entry_buf == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to allocate session_id buffer");
+    session = am_session_cache_get(r, session_id);
+    if (session != NULL && !am_session_cache_deleted(r, session_id)) {
+        am_cache_stats_session_cache_hit();
+        return session;
+    }
+
+    /* Only copy the entry out under the lock, decode it afterwards */
+    if (am_cache_aquire_lock(r, &lock,
+                             AM_CACHE_OP_LOAD_SESSION) != APR_SUCCESS) {
         return NULL;
     }
 
-    rv = socache_provider->retrieve(socache_instance, r->server,
-                                    (const unsigned char *)name_id_key,
-                                    name_id_key_len,
-                                    (unsigned char *)entry_buf, &entry_buf_len,
-                                    r->pool);
-    if (rv == APR_NOTFOUND) {
-        am_diag_printf(r, "%s: name_id not found, name_id=%s now=%s\n",
-                       __func__,
-                       am_lasso_name_id_string(r, name_id),
+    session_data = am_cache_load_session_data_from_session_id(r, session_id,
+                                                              &session_data_len);
+
+    am_cache_release_lock(r, &lock);
+
+    if (session_data == NULL) {
+        am_diag_printf(r, "%s: session not found using session_id, "
+                       "session_id=%s now=%s\n",
+                       __func__, session_id,
                        am_time_t_to_8601(r->pool, apr_time_now()));
         return NULL;
-    } else if (rv != APR_SUCCESS) {
-        char error_buf[512];
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to retrieve name_id=%s now=%s error=[%d]: %s",
-                      am_lasso_name_id_string(r, name_id),
-                      am_time_t_to_8601(r->pool, apr_time_now()),
-                      rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
+    }
+
+    session_data = am_cache_inflate_entry(r, session_data, &session_data_len);
+    if (session_data == NULL) {
         return NULL;
     }
 
-    entry_buf[entry_buf_len] = '\0'; /* NULL-terminate */
+    session = am_cache_parse_session_data(r, session_data, session_data_len);
 
-    am_diag_printf(r, "%s: successfully retrieved %u bytes\n",
-                   __func__, entry_buf_len);
+    am_session_cache_put(r, session);
 
-    return entry_buf;
+    return session;
 }
 
-static const char *
-am_cache_load_session_xml_from_session_id(request_rec *r, const char *session_id)
+am_session_state_t *
+am_cache_load_session_by_name_id(request_rec *r,
+                                 LassoSaml2NameID *name_id,
+                                 LassoSaml2NameID *issuer)
 {
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
-    ap_socache_provider_t *socache_provider = mod_cfg->socache_provider;
-    ap_socache_instance_t *socache_instance = mod_cfg->socache_instance;
-    const char *session_key = session_key_name(r, session_id);
-    unsigned int session_key_len = strlen(session_key);
-    apr_status_t rv = APR_SUCCESS;
-
-    unsigned int entry_buf_len = mod_cfg->socache_session_state_entry_size;
-    char *entry_buf = NULL;
+    am_cache_lock_t lock;
+    const char *session_id = NULL;
+    const char *session_data = NULL;
+    apr_size_t session_data_len = 0;
+    am_session_state_t *session = NULL;
 
-    am_diag_printf(r, "%s: session_id=%s "
-                   "session_id_key=%s session_id_key_len=%u "
-                   "now=%s\n",
-                   __func__, session_id,
-                   session_key, session_key_len,
+    am_diag_printf(r, "%s: lookup session by name_id %s, now=%s\n",
+                   __func__,
+                   am_lasso_name_id_string(r, name_id),
                    am_time_t_to_8601(r->pool, apr_time_now()));
 
-    if (session_id == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "session_id was NULL");
+    if (name_id == NULL) {
         return NULL;
     }
 
-    entry_buf = apr_palloc(r->pool, entry_buf_len + 1);
-    if (entry_buf == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to allocate session xml buffer");
+    if (am_cache_aquire_lock(r, &lock,
+                             AM_CACHE_OP_LOAD_BY_NAME_ID) != APR_SUCCESS) {
         return NULL;
     }
 
-    rv = socache_provider->retrieve(socache_instance, r->server,
-                                    (const unsigned char *)session_key,
-                                    session_key_len,
-                                    (unsigned char *)entry_buf, &entry_buf_len,
-                                    r->pool);
+    session_id = am_cache_load_session_id_from_name_id(r, name_id, issuer);
+    if (session_id == NULL) {
+        am_diag_printf(r, "%s: session not found using name_id, "
+                       "name_id=%s now=%s\n",
+                       __func__,
+                       am_lasso_name_id_string(r, name_id),
+                       am_time_t_to_8601(r->pool, apr_time_now()));
+        am_cache_release_lock(r, &lock);
+        return NULL;
+    }
 
-    if (rv == APR_NOTFOUND) {
-        am_diag_printf(r, "%s: session not found using session_id=%s now=%s\n",
+    session_data = am_cache_load_session_data_from_session_id(r, session_id,
+                                                              &session_data_len);
+    if (session_data == NULL) {
+        am_diag_printf(r, "%s: session not found using session_id, "
+                       "session_id=%s now=%s\n",
                        __func__, session_id,
                        am_time_t_to_8601(r->pool, apr_time_now()));
+        am_cache_release_lock(r, &lock);
         return NULL;
-    } else if (rv != APR_SUCCESS) {
-        char error_buf[512];
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to retrieve session_id=%s now=%s error=[%d]: %s",
-                      session_id,
-                      am_time_t_to_8601(r->pool, apr_time_now()),
-                      rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
+    }
+
+    am_cache_release_lock(r, &lock);
+
+    session_data = am_cache_inflate_entry(r, session_data, &session_data_len);
+    if (session_data == NULL) {
         return NULL;
     }
 
-    entry_buf[entry_buf_len] = '\0'; /* NULL-terminate */
+    session = am_cache_parse_session_data(r, session_data, session_data_len);
 
-    am_diag_printf(r, "%s: successfully retrieved %u bytes\n",
-                   __func__, entry_buf_len);
+    return session;
+}
 
-    return entry_buf;
+/*
+ * Fetch the logout record of a session, see am_session_load_logout_state().
+ * Returns NULL if the session has no logout record.
+ */
+const char *
+am_cache_load_session_logout_data(request_rec *r, const char *session_id,
+                                  apr_size_t *data_len_out)
+{
+    am_cache_lock_t lock;
+    const char *logout_data = NULL;
+
+    if (session_id == NULL) {
+        return NULL;
+    }
+
+    if (am_cache_aquire_lock(r, &lock,
+                             AM_CACHE_OP_LOAD_LOGOUT) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    logout_data = am_cache_load_logout_data_from_session_id(r, session_id,
+                                                            data_len_out);
+
+    am_cache_release_lock(r, &lock);
+
+    return am_cache_inflate_entry(r, logout_data, data_len_out);
 }
 
-static apr_status_t
-am_cache_store_name_id_entry(request_rec *r,
-                             const char *session_id,
-                             LassoSaml2NameID *name_id,
-                             LassoSaml2NameID *issuer,
-                             apr_time_t expiration)
+/**
+ * Fetch the idle deadline kept in the touch record of a session
+ *
+ * The touch record lets the idle deadline of a session move forward
+ * without rewriting the session entry, see am_session_touch().
+ *
+ * @param[in]  r                Current HTTP request
+ * @param[in]  session_id       Session whose touch record is read
+ * @param[out] idle_timeout_out Idle deadline found in the record
+ *
+ * @returns APR_SUCCESS if a touch record was found, APR_NOTFOUND if the
+ *          session has none, another error status on failure.
+ */
+apr_status_t
+am_cache_load_session_touch(request_rec *r, const char *session_id,
+                            apr_time_t *idle_timeout_out)
 {
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
-    ap_socache_provider_t *socache_provider = mod_cfg->socache_provider;
-    ap_socache_instance_t *socache_instance = mod_cfg->socache_instance;
-    const char *name_id_key = name_id_key_name(r, name_id, issuer);
-    unsigned int name_id_key_len = strlen(name_id_key);
-    unsigned int data_len = strlen(session_id);
-    apr_status_t rv = APR_SUCCESS;
+    unsigned char entry_buf[SESSION_TOUCH_ENTRY_SIZE];
+    apr_uint64_t idle_timeout = 0;
+    am_cache_batch_item_t item;
+    am_cache_lock_t lock;
+    apr_status_t rv;
+    int i;
 
-    /*
-     * retrieve will fail if it's not provided with a buffer big
-     * enough to receive the data. Worse is the fact the error from
-     * some socache providers when the return buffer is too small is
-     * APR_NOTFOUND which is not the real reason.
-     */
+    if (session_id == NULL) {
+        return APR_EINVAL;
+    }
 
-    am_diag_printf(r, "%s: name_id=\"%s\" name_id_key=%s name_id_key_len=%u "
-                   "expiration=%s now=%s "
-                   "data_len=%u data=\"%s\" \n", __func__, 
-                   am_lasso_name_id_string(r, name_id),
-                   name_id_key, name_id_key_len,
-                   am_time_t_to_8601(r->pool, expiration),
-                   am_time_t_to_8601(r->pool, apr_time_now()),
-                   data_len, session_id);
+    am_cache_batch_item_init(&item, "touch",
+                             session_touch_key_name(r, session_id));
+    item.data = entry_buf;
+    item.data_len = sizeof(entry_buf);
 
-    if (data_len > NAMEID_ENTRY_SIZE) {
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_LOAD_TOUCH)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    am_cache_backend_retrieve(r, &item, 1);
+
+    am_cache_release_lock(r, &lock);
+
+    if (item.status == APR_NOTFOUND) {
+        am_diag_printf(r, "%s: no touch record, session_id=%s\n",
+                       __func__, session_id);
+        return item.status;
+    } else if (item.status != APR_SUCCESS) {
+        return item.status;
+    }
+
+    if (item.data_len != SESSION_TOUCH_ENTRY_SIZE ||
+        memcmp(entry_buf, SESSION_TOUCH_MAGIC, SESSION_TOUCH_MAGIC_LEN) != 0) {
         AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "name_id data size (%u) exceeds maximum "
-                      "name_id data size (%u)",
-                      data_len, NAMEID_ENTRY_SIZE);
-        return APR_FROM_OS_ERROR(EMSGSIZE);
+                      "invalid touch entry session_id=%s length=%u",
+                      session_id, item.data_len);
+        return APR_EGENERAL;
     }
 
-    rv = socache_provider->store(socache_instance, r->server,
-                                 (const unsigned char *)name_id_key,
-                                 name_id_key_len,
-                                 expiration,
-                                 (unsigned char *)session_id,
-                                 data_len,
-                                 r->pool);
+    for (i = SESSION_TOUCH_MAGIC_LEN; i < SESSION_TOUCH_ENTRY_SIZE; i++) {
+        idle_timeout = (idle_timeout << 8) | entry_buf[i];
+    }
+    *idle_timeout_out = (apr_time_t)idle_timeout;
+
+    am_diag_printf(r, "%s: session_id=%s idle_timeout=%s\n",
+                   __func__, session_id,
+                   am_time_t_to_8601(r->pool, *idle_timeout_out));
+
+    am_session_cache_touch(session_id, *idle_timeout_out);
+    am_touch_cache_put(session_id, *idle_timeout_out);
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Store a new idle deadline for a session in its touch record
+ *
+ * Only the small touch record is written, the session entry itself
+ * is left untouched.
+ *
+ * @param[in] r            Current HTTP request
+ * @param[in] session_id   Session being touched
+ * @param[in] expiration   Expiration of the session, the touch record
+ *                         never outlives the session
+ * @param[in] idle_timeout New idle deadline of the session
+ *
+ * @returns APR_SUCCESS or an error status if the store failed.
+ */
+apr_status_t
+am_cache_store_session_touch(request_rec *r, const char *session_id,
+                             apr_time_t expiration, apr_time_t idle_timeout)
+{
+    unsigned char entry_buf[SESSION_TOUCH_ENTRY_SIZE];
+    apr_uint64_t value = (apr_uint64_t)idle_timeout;
+    am_cache_batch_item_t item;
+    am_cache_lock_t lock;
+    apr_status_t rv;
+    int i;
+
+    if (session_id == NULL) {
+        return APR_EINVAL;
+    }
+
+    memcpy(entry_buf, SESSION_TOUCH_MAGIC, SESSION_TOUCH_MAGIC_LEN);
+    for (i = SESSION_TOUCH_ENTRY_SIZE - 1; i >= SESSION_TOUCH_MAGIC_LEN; i--) {
+        entry_buf[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+
+    am_diag_printf(r, "%s: session_id=%s idle_timeout=%s expiration=%s\n",
+                   __func__, session_id,
+                   am_time_t_to_8601(r->pool, idle_timeout),
+                   am_time_t_to_8601(r->pool, expiration));
+
+    am_cache_batch_item_init(&item, "touch",
+                             session_touch_key_name(r, session_id));
+    item.expiry = expiration;
+    item.data = entry_buf;
+    item.data_len = sizeof(entry_buf);
+
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_TOUCH)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = am_cache_backend_store(r, &item, 1);
+
+    am_cache_release_lock(r, &lock);
+
+    /* Requests of this process need not read the record back */
+    if (rv == APR_SUCCESS) {
+        am_session_cache_touch(session_id, idle_timeout);
+        am_touch_cache_put(session_id, idle_timeout);
+    }
+
+    return rv;
+}
+
+/**
+ * Look up the idle deadline this process last saw for a session
+ *
+ * The deadline was read from or written to the touch record of the
+ * session by an earlier request of this process. It saves reading the
+ * touch record again until it is itself due for a refresh.
+ *
+ * @param[in]  r                Current HTTP request
+ * @param[in]  session_id       Session to look up
+ * @param[out] idle_timeout_out Idle deadline of the session
+ *
+ * @returns true if this process knows a deadline for the session.
+ */
+bool
+am_cache_get_session_touch(request_rec *r, const char *session_id,
+                           apr_time_t *idle_timeout_out)
+{
+    if (session_id == NULL ||
+        !am_touch_cache_get(session_id, idle_timeout_out)) {
+        return false;
+    }
+
+    am_diag_printf(r, "%s: session_id=%s idle_timeout=%s\n",
+                   __func__, session_id,
+                   am_time_t_to_8601(r->pool, *idle_timeout_out));
+
+    return true;
+}
+
+/**
+ * Record that a sealed session was deleted
+ *
+ * A sealed session lives in the cookies of the client, deleting its
+ * records doesn't stop those cookies from being presented again. A
+ * small revocation record is therefore stored until the session would
+ * have expired, see am_cache_sealed_session_revoked().
+ *
+ * @param[in] r          Current HTTP request
+ * @param[in] session_id Session which is deleted
+ * @param[in] expiration Expiration of the session
+ *
+ * @returns APR_SUCCESS or an error status if the store failed.
+ */
+apr_status_t
+am_cache_revoke_sealed_session(request_rec *r, const char *session_id,
+                               apr_time_t expiration)
+{
+    am_cache_batch_item_t item;
+    am_cache_lock_t lock;
+    apr_status_t rv;
+
+    if (session_id == NULL) {
+        return APR_EINVAL;
+    }
+
+    am_diag_printf(r, "%s: session_id=%s expiration=%s\n",
+                   __func__, session_id,
+                   am_time_t_to_8601(r->pool, expiration));
+
+    am_touch_cache_remove(session_id);
+
+    am_cache_batch_item_init(&item, "revoked",
+                             session_revoked_key_name(r, session_id));
+    item.expiry = expiration;
+    item.data = (unsigned char *)"1";
+    item.data_len = 1;
+
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_DELETE)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = am_cache_backend_store(r, &item, 1);
+
+    am_cache_release_lock(r, &lock);
+
     if (rv != APR_SUCCESS) {
-        char error_buf[512];
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to store name_id entry "
-                      "session_id=%s name_id=%s expiration=%s now=%s "
-                      "key=%s error=[%d]: %s",
-                      session_id,
-                      am_lasso_name_id_string(r, name_id),
-                      am_time_t_to_8601(r->pool, expiration),
-                      am_time_t_to_8601(r->pool, apr_time_now()),
-                      name_id_key,
-                      rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, rv, r,
+                      "Could not record the deletion of sealed "
+                      "session %s.", session_id);
+    }
+
+    return rv;
+}
+
+/**
+ * Check whether a sealed session was deleted
+ *
+ * Once a process found a session not to be revoked it relies on that
+ * for SESSION_REVOKED_CACHE_TTL seconds, so a deletion by another
+ * process is noticed within that time.
+ *
+ * @param[in]  r          Current HTTP request
+ * @param[in]  session_id Session which is checked
+ * @param[out] revoked    Whether the session was deleted
+ *
+ * @returns APR_SUCCESS or an error status if the store could not be
+ *          read.
+ */
+apr_status_t
+am_cache_sealed_session_revoked(request_rec *r, const char *session_id,
+                                bool *revoked)
+{
+    unsigned char entry_buf[1];
+    apr_time_t now = apr_time_now();
+    am_cache_batch_item_t item;
+    am_cache_lock_t lock;
+    apr_status_t rv;
+
+    *revoked = false;
+
+    if (session_id == NULL) {
+        return APR_EINVAL;
+    }
+
+    if (am_touch_cache_unrevoked(session_id, now)) {
+        return APR_SUCCESS;
+    }
+
+    am_cache_batch_item_init(&item, "revoked",
+                             session_revoked_key_name(r, session_id));
+    item.data = entry_buf;
+    item.data_len = sizeof(entry_buf);
+    item.probe = true;
+
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_LOAD_SESSION)) != APR_SUCCESS) {
         return rv;
     }
 
+    am_cache_backend_retrieve(r, &item, 1);
+
+    am_cache_release_lock(r, &lock);
+
+    if (item.status == APR_SUCCESS || item.status == APR_ENOSPC) {
+        *revoked = true;
+    } else if (item.status == APR_NOTFOUND) {
+        am_touch_cache_put_unrevoked(session_id,
+                                     now + apr_time_from_sec(
+                                         SESSION_REVOKED_CACHE_TTL));
+    } else {
+        return item.status;
+    }
+
+    am_diag_printf(r, "%s: session_id=%s revoked=%s\n",
+                   __func__, session_id, *revoked ? "yes" : "no");
+
     return APR_SUCCESS;
 }
 
-static apr_status_t
-am_cache_store_session_id_entry(request_rec *r,
-                                const char *session_id,
-                                LassoSaml2NameID *name_id,
-                                apr_time_t expiration,
-                                const char *session_xml)
+/**
+ * Look up the id of the session of a name id
+ *
+ * @param[in] r       Current HTTP request
+ * @param[in] name_id Name id of the session
+ * @param[in] issuer  Issuer of the name id, may be NULL
+ *
+ * @returns the session id, or NULL if the name id has no session.
+ */
+const char *
+am_cache_load_session_id_by_name_id(request_rec *r,
+                                    LassoSaml2NameID *name_id,
+                                    LassoSaml2NameID *issuer)
 {
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
-    ap_socache_provider_t *socache_provider = mod_cfg->socache_provider;
-    ap_socache_instance_t *socache_instance = mod_cfg->socache_instance;
-    const char *session_key = session_key_name(r, session_id);
-    unsigned int session_key_len = strlen(session_key);
-    unsigned int data_len = strlen(session_xml);
-    apr_status_t rv = APR_SUCCESS;
-
-    /*
-     * retrieve will fail if it's not provided with a buffer big
-     * enough to receive the data. Worse is the fact the error from
-     * some socache providers when the return buffer is too small is
-     * APR_NOTFOUND which is not the real reason.
-     */
+    am_cache_lock_t lock;
+    const char *session_id;
 
-    am_diag_printf(r, "%s: session_id=\"%s\" name_id=\"%s\" "
-                   "session_key=%s session_key_len=%u "
-                   "expiration=%s now=%s "
-                   "data_len=%u session_xml:\n%s\n", __func__,
-                   session_id, am_lasso_name_id_string(r, name_id),
-                   session_key, session_key_len, 
-                   am_time_t_to_8601(r->pool, expiration),
-                   am_time_t_to_8601(r->pool, apr_time_now()),
-                   data_len, session_xml);
+    if (name_id == NULL) {
+        return NULL;
+    }
 
-    if (data_len > mod_cfg->socache_session_state_entry_size) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "session data size (%u) exceeds maximum "
-                      "session data size (%u)",
-                      data_len, mod_cfg->socache_session_state_entry_size);
-        return APR_FROM_OS_ERROR(EMSGSIZE);
+    if (am_cache_aquire_lock(r, &lock,
+                             AM_CACHE_OP_LOAD_BY_NAME_ID) != APR_SUCCESS) {
+        return NULL;
     }
 
-    rv = socache_provider->store(socache_instance, r->server,
-                                 (const unsigned char *)session_key,
-                                 session_key_len,
-                                 expiration,
-                                 (unsigned char *)session_xml,
-                                 data_len,
-                                 r->pool);
+    session_id = am_cache_load_session_id_from_name_id(r, name_id, issuer);
+
+    am_cache_release_lock(r, &lock);
+
+    return session_id;
+}
+
+/**
+ * Get the current global generation and the generation of an IdP
+ *
+ * See the Generations section. Sessions record these when they are
+ * created and are rejected once either has changed.
+ *
+ * @param[in]  r              Current HTTP request
+ * @param[in]  idp            entity ID of the IdP, may be NULL
+ * @param[out] generation     current global generation
+ * @param[out] idp_generation current generation of the IdP, 0 if idp
+ *                            is NULL
+ *
+ * @returns APR_SUCCESS or an error status if a generation could not
+ *          be read.
+ */
+apr_status_t
+am_cache_load_generations(request_rec *r, const char *idp,
+                          apr_uint64_t *generation,
+                          apr_uint64_t *idp_generation)
+{
+    const char *key;
+    apr_status_t rv;
+
+    rv = am_generation_get(r, generation_key_name(r, NULL), generation);
     if (rv != APR_SUCCESS) {
-        char error_buf[512];
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to store session_id entry "
-                      "session_id=%s name_id=%s expiration=%s now=%s "
-                      "key=%s error=[%d]: %s",
-                      session_id,
-                      am_lasso_name_id_string(r, name_id),
-                      am_time_t_to_8601(r->pool, expiration),
-                      am_time_t_to_8601(r->pool, apr_time_now()),
-                      session_key,
-                      rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
         return rv;
     }
 
-    return APR_SUCCESS;
+    *idp_generation = 0;
+    if (idp == NULL) {
+        return APR_SUCCESS;
+    }
+
+    if ((key = generation_key_name(r, idp)) == NULL) {
+        return APR_EGENERAL;
+    }
+    return am_generation_get(r, key, idp_generation);
 }
 
-static apr_status_t
-am_cache_delete_name_id_entry(request_rec *r,
-                              LassoSaml2NameID *name_id,
-                              LassoSaml2NameID *issuer)
+/**
+ * Invalidate every session issued so far, or issued by one IdP
+ *
+ * Stores a new generation, see the Generations section. Other
+ * processes notice it within GENERATION_CACHE_TTL seconds.
+ *
+ * @param[in]  r              Current HTTP request
+ * @param[in]  idp            entity ID of the IdP, NULL for all sessions
+ * @param[out] generation_out the new generation
+ *
+ * @returns APR_SUCCESS or an error status if the generation could not
+ *          be stored.
+ */
+apr_status_t
+am_cache_bump_generation(request_rec *r, const char *idp,
+                         apr_uint64_t *generation_out)
 {
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
-    ap_socache_provider_t *socache_provider = mod_cfg->socache_provider;
-    ap_socache_instance_t *socache_instance = mod_cfg->socache_instance;
-    const char *name_id_key = name_id_key_name(r, name_id, issuer);
-    unsigned int name_id_key_len = strlen(name_id_key);
-    apr_status_t rv = APR_SUCCESS;
+    unsigned char entry_buf[GENERATION_ENTRY_SIZE];
+    const char *key = generation_key_name(r, idp);
+    apr_uint64_t generation;
+    apr_time_t written;
+    am_cache_batch_item_t item;
+    am_cache_lock_t lock;
+    apr_status_t rv;
 
-    am_diag_printf(r, "%s: name_id=%s name_id_key=%s name_id_key_len=%u "
-                   "now=%s\n",
-                   __func__,
-                   am_lasso_name_id_string(r, name_id),
-                   name_id_key, name_id_key_len,
-                   am_time_t_to_8601(r->pool, apr_time_now()));
+    if (key == NULL) {
+        return APR_EGENERAL;
+    }
 
-    if (name_id_key == NULL) {
-        return APR_EINVAL;
+    if ((rv = am_generation_fetch(r, key, &generation,
+                                  &written)) != APR_SUCCESS) {
+        return rv;
     }
 
-    rv = socache_provider->remove(socache_instance, r->server,
-                                  (const unsigned char *)name_id_key,
-                                  name_id_key_len,
-                                  r->pool);
-    if (rv == APR_NOTFOUND) {
-        am_diag_printf(r, "%s: name_id not found, name_id=%s now=%s\n",
-                       __func__,
-                       am_lasso_name_id_string(r, name_id),
-                       am_time_t_to_8601(r->pool, apr_time_now()));
-        /* If the entry is already absent it's not an error */
-        return APR_SUCCESS;
-    } else if (rv != APR_SUCCESS) {
-        char error_buf[512];
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to delete name_id entry "
-                      "name_id=%s now=%s error=[%d]: %s",
-                      am_lasso_name_id_string(r, name_id),
-                      am_time_t_to_8601(r->pool, apr_time_now()),
-                      rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
+    if ((apr_uint64_t)apr_time_now() > generation) {
+        generation = (apr_uint64_t)apr_time_now();
+    } else {
+        generation++;
     }
 
-    return APR_SUCCESS;
-}
+    am_generation_item(&item, key, entry_buf, generation);
 
-static apr_status_t
-am_cache_delete_session_id_entry(request_rec *r, const char *session_id)
-{
-    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
-    ap_socache_provider_t *socache_provider = mod_cfg->socache_provider;
-    ap_socache_instance_t *socache_instance = mod_cfg->socache_instance;
-    const char *session_key = session_key_name(r, session_id);
-    unsigned int session_key_len = strlen(session_key);
-    apr_status_t rv = APR_SUCCESS;
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_STORE_GENERATION)) != APR_SUCCESS) {
+        return rv;
+    }
 
-    am_diag_printf(r, "%s: session_id=%s name_id_key=%s name_id_key_len=%u "
-                   "now=%s\n",
-                   __func__, session_id,
-                   session_key, session_key_len,
-                   am_time_t_to_8601(r->pool, apr_time_now()));
+    rv = am_cache_backend_store(r, &item, 1);
 
-    rv = socache_provider->remove(socache_instance, r->server,
-                                  (const unsigned char *)session_key,
-                                  session_key_len,
-                                  r->pool);
-    if (rv == APR_NOTFOUND) {
-        am_diag_printf(r, "%s: session_id not found, session_id=%s now=%s\n",
-                       __func__, session_id,
-                       am_time_t_to_8601(r->pool, apr_time_now()));
-        /* If the entry is already absent it's not an error */
-        return APR_SUCCESS;
-    } else if (rv != APR_SUCCESS) {
-        char error_buf[512];
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to delete session_id entry "
-                      "session_id=%s now=%s error=[%d]: %s",
-                      session_id, am_time_t_to_8601(r->pool, apr_time_now()),
-                      rv, apr_strerror(rv, error_buf, sizeof(error_buf)));
+    am_cache_release_lock(r, &lock);
+
+    if (rv != APR_SUCCESS) {
+        return rv;
     }
 
+    am_generation_cache_put(key, generation);
+
+    AM_LOG_RERROR(APLOG_MARK, APLOG_NOTICE, 0, r,
+                  "sessions of %s%s revoked, generation %" APR_UINT64_T_FMT,
+                  idp ? "IdP " : "all IdPs", idp ? idp : "", generation);
+
+    *generation_out = generation;
+
     return APR_SUCCESS;
 }
 
 apr_status_t
-am_cache_delete_session_entries(request_rec *r,
-                                const char *session_id,
-                                LassoSaml2NameID *name_id,
-                                LassoSaml2NameID *issuer)
+am_cache_store_session_entries(request_rec *r,
+                               const char *session_id,
+                               LassoSaml2NameID *name_id,
+                               LassoSaml2NameID *issuer,
+                               apr_time_t expiration,
+                               const char *session_data,
+                               apr_size_t session_data_len,
+                               const char *logout_data,
+                               apr_size_t logout_data_len)
 {
-    apr_status_t session_id_rv = APR_SUCCESS;
-    apr_status_t name_id_rv = APR_SUCCESS;
+    am_cache_lock_t lock;
+    am_cache_batch_item_t items[3];
+    int n_items = 0;
     apr_status_t rv = APR_SUCCESS;
 
     am_diag_printf(r, "%s: session_id=%s name_id=%s now=%s\n",
@@ -767,159 +4879,232 @@ am_cache_delete_session_entries(request_rec *r,
                    am_lasso_name_id_string(r, name_id),
                    am_time_t_to_8601(r->pool, apr_time_now()));
 
-    if ((rv = am_cache_aquire_lock(r)) != APR_SUCCESS) {
+    am_session_cache_remove(session_id);
+
+    /* Compress before taking the lock */
+    if (session_data != NULL) {
+        session_data = am_cache_compress_entry(r, session_data,
+                                               &session_data_len);
+    }
+    if (logout_data != NULL) {
+        logout_data = am_cache_compress_entry(r, logout_data,
+                                              &logout_data_len);
+    }
+
+    /* Without session data the session travels in a sealed cookie */
+    if (session_data != NULL) {
+        rv = am_cache_store_session_id_entry(r, session_id, name_id,
+                                             expiration, session_data,
+                                             session_data_len,
+                                             &items[n_items++]);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    rv = am_cache_store_name_id_entry(r, session_id, name_id, issuer,
+                                      expiration, &items[n_items++]);
+    if (rv != APR_SUCCESS) {
         return rv;
     }
 
-    session_id_rv = am_cache_delete_session_id_entry(r, session_id);
-    name_id_rv = am_cache_delete_name_id_entry(r, name_id, issuer);
+    /* Without logout data the logout record already stored is kept */
+    if (logout_data != NULL) {
+        rv = am_cache_store_logout_entry(r, session_id, expiration,
+                                         logout_data, logout_data_len,
+                                         &items[n_items++]);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_STORE)) != APR_SUCCESS) {
+        return rv;
+    }
 
-    rv = session_id_rv != APR_SUCCESS ? session_id_rv : name_id_rv;
+    rv = am_cache_backend_store(r, items, n_items);
 
-    am_cache_release_lock(r);
+    am_cache_release_lock(r, &lock);
 
     return rv;
 }
 
-static am_session_state_t *
-am_cache_parse_session_xml(request_rec *r, const char *session_xml) {
-    xmlDocPtr session_doc = NULL;
-    am_session_state_t *session = NULL;
-
-    session_doc = am_get_xml_doc_from_string(r, session_xml);
-    if (session_doc == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed to parse XML session state text "
-                      "into XML document: %s", session_xml);
-        return NULL;
-    }
-
-    session = am_session_state_from_xml(r, session_doc);
-    if (session == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "failed load session state from XML document");
-        return NULL;
+/**
+ * Record the ID of a consumed assertion, rejecting a replay
+ *
+ * The ID is recorded until the assertion expires. A socache provider
+ * able to add an entry only if it is absent (see am_cache_backend_add())
+ * does the check and the store in one atomic step. With any other
+ * provider the ID is looked up in the replay records, unless the
+ * replay filter can tell it has never been seen, and then stored, both
+ * under the global mutex. Either way, of two concurrent logins with
+ * the same assertion only one succeeds.
+ *
+ * @param[in] r            Current HTTP request
+ * @param[in] assertion_id ID of the assertion
+ * @param[in] issued       IssueInstant of the assertion, 0 if unknown
+ * @param[in] expiration   when the assertion can no longer be used
+ *
+ * @returns APR_SUCCESS if the ID was not used before, APR_EEXIST if it
+ *          was, another error status if the socache failed.
+ */
+apr_status_t
+am_cache_store_assertion_id(request_rec *r, const char *assertion_id,
+                            apr_time_t issued, apr_time_t expiration)
+{
+    const char *digest;
+    unsigned char entry_buf[1];
+    am_cache_batch_item_t item;
+    bool maybe_seen = true;
+    am_cache_lock_t lock;
+    apr_status_t rv;
+
+    digest = am_sha256_sum(r, (const unsigned char *)assertion_id,
+                           strlen(assertion_id));
+    if (digest == NULL) {
+        return APR_EGENERAL;
     }
+    am_cache_batch_item_init(&item, "assertion_id",
+                             assertion_id_key_name(r, digest));
+    item.expiry = expiration;
 
-    return session;
-}
+    if (am_cache_backend_has_add(am_get_mod_cfg(r->server))) {
+        item.data = (unsigned char *)"1";
+        item.data_len = 1;
+        rv = am_cache_backend_add(r, &item, 1);
 
-am_session_state_t *
-am_cache_load_session_by_session_id(request_rec *r, const char *session_id)
-{
-    const char *session_xml = NULL;
-    am_session_state_t *session = NULL;
+        am_diag_printf(r, "%s: assertion_id=%s key=%s added=%s "
+                       "expiration=%s\n", __func__, assertion_id,
+                       (const char *)item.key,
+                       rv == APR_SUCCESS ? "yes" : "no",
+                       am_time_t_to_8601(r->pool, expiration));
 
-    am_diag_printf(r, "%s: lookup session by session _id %s now=%s\n",
-                   __func__, session_id,
-                   am_time_t_to_8601(r->pool, apr_time_now()));
+        return rv;
+    }
 
-    if (session_id == NULL) {
-        return NULL;
+    if ((rv = am_cache_aquire_lock(r, &lock,
+                                   AM_CACHE_OP_ASSERTION_ID)) != APR_SUCCESS) {
+        return rv;
     }
 
-    if (am_cache_aquire_lock(r) != APR_SUCCESS) {
-        return NULL;
+    if (am_replay_filter != NULL) {
+        maybe_seen = am_replay_filter_check(am_replay_filter, digest, issued);
     }
 
-    session_xml = am_cache_load_session_xml_from_session_id(r, session_id);
-    if (session_xml == NULL) {
-        am_diag_printf(r, "%s: session not found using session_id, "
-                       "session_id=%s now=%s\n",
-                       __func__, session_id,
-                       am_time_t_to_8601(r->pool, apr_time_now()));
-        am_cache_release_lock(r);
-        return NULL;
+    if (maybe_seen) {
+        /* Any entry under the key means the ID was used, whatever it holds */
+        item.data = entry_buf;
+        item.data_len = sizeof(entry_buf);
+        item.probe = true;
+        am_cache_backend_retrieve(r, &item, 1);
+        if (item.status == APR_SUCCESS || item.status == APR_ENOSPC) {
+            am_cache_release_lock(r, &lock);
+            return APR_EEXIST;
+        } else if (item.status != APR_NOTFOUND) {
+            am_cache_release_lock(r, &lock);
+            return item.status;
+        }
     }
 
-    session = am_cache_parse_session_xml(r, session_xml);
+    item.data = (unsigned char *)"1";
+    item.data_len = 1;
+    rv = am_cache_backend_store(r, &item, 1);
 
-    am_cache_release_lock(r);
+    am_cache_release_lock(r, &lock);
 
-    return session;
+    am_diag_printf(r, "%s: assertion_id=%s key=%s filter=%s expiration=%s\n",
+                   __func__, assertion_id, (const char *)item.key,
+                   am_replay_filter == NULL ? "unused" :
+                   maybe_seen ? "maybe seen" : "not seen",
+                   am_time_t_to_8601(r->pool, expiration));
+
+    return rv;
 }
 
-am_session_state_t *
-am_cache_load_session_by_name_id(request_rec *r,
-                                 LassoSaml2NameID *name_id,
-                                 LassoSaml2NameID *issuer)
+/**
+ * Look up an authorization decision in the per-process cache
+ *
+ * @param[in]  r            Current HTTP request
+ * @param[in]  key          Key computed by am_check_permissions()
+ * @param[out] decision_out Cached decision, OK or HTTP_FORBIDDEN
+ *
+ * @returns true if a decision was found which has not expired.
+ */
+bool
+am_cache_authz_get(request_rec *r, const char *key, int *decision_out)
 {
-    const char *session_id = NULL;
-    const char *session_xml = NULL;
-    am_session_state_t *session = NULL;
-
-    am_diag_printf(r, "%s: lookup session by name_id %s, now=%s\n",
-                   __func__,
-                   am_lasso_name_id_string(r, name_id),
-                   am_time_t_to_8601(r->pool, apr_time_now()));
+    am_authz_cache_t *cache = am_authz_cache;
+    am_authz_cache_entry_t *entry;
+    bool found = false;
 
-    if (name_id == NULL) {
-        return NULL;
+    if (cache == NULL || key == NULL) {
+        return false;
     }
 
-    if (am_cache_aquire_lock(r) != APR_SUCCESS) {
-        return NULL;
-    }
+    am_authz_cache_lock(cache);
 
-    session_id = am_cache_load_session_id_from_name_id(r, name_id, issuer);
-    if (session_id == NULL) {
-        am_diag_printf(r, "%s: session not found using name_id, "
-                       "name_id=%s now=%s\n",
-                       __func__,
-                       am_lasso_name_id_string(r, name_id),
-                       am_time_t_to_8601(r->pool, apr_time_now()));
-        am_cache_release_lock(r);
-        return NULL;
+    entry = am_lru_get(&cache->lru, key);
+    if (entry != NULL) {
+        if (entry->valid_until > apr_time_now()) {
+            am_lru_use(&cache->lru, entry);
+            *decision_out = entry->decision;
+            found = true;
+        } else {
+            am_authz_cache_evict(cache, entry);
+        }
     }
 
-    session_xml = am_cache_load_session_xml_from_session_id(r, session_id);
-    if (session_xml == NULL) {
-        am_diag_printf(r, "%s: session not found using session_id, "
-                       "session_id=%s now=%s\n",
-                       __func__, session_id,
-                       am_time_t_to_8601(r->pool, apr_time_now()));
-        am_cache_release_lock(r);
-        return NULL;
-    }
+    am_authz_cache_unlock(cache);
 
-    am_cache_release_lock(r);
+    am_cache_stats_authz_lookup(found);
 
-    session = am_cache_parse_session_xml(r, session_xml);
+    am_diag_printf(r, "%s: key=%s %s\n", __func__, key,
+                   found ? "hit" : "miss");
 
-    return session;
+    return found;
 }
 
-apr_status_t
-am_cache_store_session_entries(request_rec *r,
-                               const char *session_id,
-                               LassoSaml2NameID *name_id,
-                               LassoSaml2NameID *issuer,
-                               apr_time_t expiration,
-                               const char *session_xml)
+/**
+ * Add an authorization decision to the per-process cache
+ *
+ * Any previous decision under the same key is replaced, the least
+ * recently used entry is evicted if the cache is full.
+ *
+ * @param[in] r        Current HTTP request
+ * @param[in] key      Key computed by am_check_permissions()
+ * @param[in] decision Decision to cache, OK or HTTP_FORBIDDEN
+ */
+void
+am_cache_authz_put(request_rec *r, const char *key, int decision)
 {
-    apr_status_t session_id_rv = APR_SUCCESS;
-    apr_status_t name_id_rv = APR_SUCCESS;
-    apr_status_t rv = APR_SUCCESS;
+    am_authz_cache_t *cache = am_authz_cache;
+    am_authz_cache_entry_t *entry;
 
-    am_diag_printf(r, "%s: session_id=%s name_id=%s now=%s\n",
-                   __func__, session_id,
-                   am_lasso_name_id_string(r, name_id),
-                   am_time_t_to_8601(r->pool, apr_time_now()));
+    if (cache == NULL || key == NULL || strlen(key) != AUTHZ_CACHE_KEY_LEN) {
+        return;
+    }
 
-    if ((rv = am_cache_aquire_lock(r)) != APR_SUCCESS) {
-        return rv;
+    am_authz_cache_lock(cache);
+
+    entry = am_lru_get(&cache->lru, key);
+    if (entry != NULL) {
+        am_authz_cache_evict(cache, entry);
+    }
+    if (cache->free == NULL) {
+        am_authz_cache_evict(cache, am_lru_oldest(&cache->lru));
     }
 
-    name_id_rv = am_cache_store_name_id_entry(r, session_id, name_id,
-                                              issuer, expiration);
-    session_id_rv = am_cache_store_session_id_entry(r, session_id, name_id,
-                                                    expiration, session_xml);
+    entry = cache->free;
+    cache->free = entry->next_free;
 
-    rv = session_id_rv != APR_SUCCESS ? session_id_rv : name_id_rv;
+    memcpy(entry->key, key, AUTHZ_CACHE_KEY_LEN + 1);
+    entry->decision = decision;
+    entry->valid_until = apr_time_now() + cache->ttl;
 
-    am_cache_release_lock(r);
+    am_lru_add(&cache->lru, entry, entry->key);
 
-    return rv;
+    am_authz_cache_unlock(cache);
 }
 
 #ifdef ENABLE_DIAGNOSTICS
@@ -83,6 +83,56 @@ static const apr_size_t post_size = 1024 * 1024;
  */
 static const int post_count = 100;
 
+/* maximum number of decoded sessions kept in each process
+ * the MellonSessionCacheSize configuration directive if you change this.
+ */
+static const int session_cache_size = 0;
+
+/* seconds a decoded session may be served from the process cache
+ * the MellonSessionCacheTTL configuration directive if you change this.
+ */
+static const int session_cache_ttl = 5;
+
+/* maximum number of authorization decisions kept in each process
+ * the MellonAuthzCacheSize configuration directive if you change this.
+ */
+static const int authz_cache_size = 0;
+
+/* seconds an authorization decision may be served from the process cache
+ * the MellonAuthzCacheTTL configuration directive if you change this.
+ */
+static const int authz_cache_ttl = 5;
+
+/* minimum size of a session entry stored compressed
+ * the MellonSoCacheCompressThreshold configuration directive if you change
+ * this.
+ */
+static const int socache_compress_threshold = 0;
+
+/* percentage of the idle timeout which elapses before it is refreshed
+ * the MellonSessionIdleTimeoutRefresh configuration directive if you change
+ * this.
+ */
+static const int session_idle_refresh = 50;
+
+/* bytes in each generation of the Assertion ID replay filter
+ * the MellonAssertionIdFilterSize configuration directive if you change
+ * this.
+ */
+static const int assertion_id_filter_size = 1048576;
+
+/* seconds between sweeps of the session reaper, 0 disables it
+ * the MellonSessionReaperInterval configuration directive if you change
+ * this.
+ */
+static const int session_reaper_interval = 0;
+
+/* maximum length of the sealed session cookies together
+ * the MellonSessionCookieMaxSize configuration directive if you change
+ * this.
+ */
+static const int session_cookie_max_size = 4096;
+
 #ifdef ENABLE_DIAGNOSTICS
 /* Default filename for mellon diagnostics log file.
  * Relative pathname is relative to server root. */
@@ -573,6 +623,78 @@ static const char *am_set_module_diag_flags_slot(cmd_parms *cmd,
 #endif
 }
 
+/* This function handles the MellonSessionIdSecretFile configuration
+ * directive. The file holds one secret per line, whitespace, empty lines
+ * and lines starting with '#' are ignored. The first secret signs new session
+ * ids, all of them are accepted when a session id is checked, which
+ * allows the secret to be rotated.
+ *
+ * Parameters:
+ *  cmd_parms *cmd       The command structure for this configuration
+ *                       directive.
+ *  void *struct_ptr     Pointer to the current directory configuration.
+ *                       NULL if we are not in a directory configuration.
+ *                       This value isn't used by this function.
+ *  const char *arg      The string argument following this configuration
+ *                       directive in the configuraion file.
+ *
+ * Returns:
+ *  NULL on success or an error string on failure.
+ */
+static const char *am_set_module_session_id_secret_slot(cmd_parms *cmd,
+                                                        void *struct_ptr,
+                                                        const char *arg)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(cmd->server);
+    am_file_data_t *file_data;
+    apr_array_header_t *keys;
+    const char *path;
+    char *line, *last;
+
+    path = ap_server_root_relative(cmd->pool, arg);
+    if (!path) {
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           ": Invalid file path ", arg, NULL);
+    }
+
+    file_data = am_file_data_new(cmd->pool, path);
+    if (am_file_read(file_data) != APR_SUCCESS) {
+        return file_data->strerror;
+    }
+
+    keys = apr_array_make(cmd->pool, 2, sizeof(am_session_id_key_t));
+
+    for (line = apr_strtok(file_data->contents, "\r\n", &last);
+         line != NULL;
+         line = apr_strtok(NULL, "\r\n", &last)) {
+        am_session_id_key_t *key;
+
+        apr_collapse_spaces(line, line);
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (strlen(line) < AM_SESSION_ID_SECRET_MIN_LENGTH) {
+            return apr_psprintf(cmd->pool, "%s: secrets in \"%s\" must be"
+                                " at least %d characters long",
+                                cmd->cmd->name, path,
+                                AM_SESSION_ID_SECRET_MIN_LENGTH);
+        }
+
+        key = apr_array_push(keys);
+        key->secret = (const unsigned char *)line;
+        key->len = strlen(line);
+    }
+
+    if (keys->nelts == 0) {
+        return apr_psprintf(cmd->pool, "%s: no secret found in \"%s\"",
+                            cmd->cmd->name, path);
+    }
+
+    mod_cfg->session_id_keys = keys;
+
+    return NULL;
+}
+
 static const char *am_set_module_socache_slot(cmd_parms *cmd,
                                               void *struct_ptr,
                                               const char *arg)
@@ -635,6 +757,38 @@ static const char *am_set_samesite_slot(cmd_parms *cmd,
     return NULL;
 }
 
+/* This function handles the MellonSessionStorage configuration directive.
+ * This directive can be set to "store" or "cookie".
+ *
+ * Parameters:
+ *  cmd_parms *cmd       The command structure for this configuration
+ *                       directive.
+ *  void *struct_ptr     Pointer to the current directory configuration.
+ *                       NULL if we are not in a directory configuration.
+ *                       This value isn't used by this function.
+ *  const char *arg      The string argument following this configuration
+ *                       directive in the configuraion file.
+ *
+ * Returns:
+ *  NULL on success or an error string if the argument is wrong.
+ */
+static const char *am_set_module_session_storage_slot(cmd_parms *cmd,
+                                                      void *struct_ptr,
+                                                      const char *arg)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(cmd->server);
+
+    if(!strcasecmp(arg, "store")) {
+        mod_cfg->session_storage = AM_SESSION_STORAGE_STORE;
+    } else if(!strcasecmp(arg, "cookie")) {
+        mod_cfg->session_storage = AM_SESSION_STORAGE_COOKIE;
+    } else {
+        return "The MellonSessionStorage parameter must be 'store' or 'cookie'";
+    }
+
+    return NULL;
+}
+
 /* This function handles the MellonEnable configuration directive.
  * This directive can be set to "off", "info" or "auth".
  *
@@ -756,6 +910,39 @@ static const char *am_set_endpoint_path(cmd_parms *cmd,
 }
 
 
+/* This function creates the configuration of a renamed attribute, with
+ * the names it is exported under prepared so that requests don't have to
+ * format them.
+ *
+ * Parameters:
+ *  apr_pool_t *p        The pool the configuration is allocated from.
+ *  const char *name     The new name of the attribute.
+ *  int prefixed         Whether MELLON_ is prepended to the name.
+ *
+ * Returns:
+ *  The new attribute configuration.
+ */
+static am_envattr_conf_t *am_new_envattr_conf(apr_pool_t *p,
+                                              const char *name,
+                                              int prefixed)
+{
+    am_envattr_conf_t *envattr_conf = apr_palloc(p, sizeof(*envattr_conf));
+    int i;
+
+    envattr_conf->name = name;
+    envattr_conf->prefixed = prefixed;
+    envattr_conf->prefixed_name = prefixed ?
+        apr_pstrcat(p, ENV_ATTR_PREFIX, name, NULL) : name;
+    for (i = 0; i < AM_ENVATTR_INDEXED_NAMES; i++) {
+        envattr_conf->indexed_names[i] =
+            apr_psprintf(p, "%s_%d", envattr_conf->prefixed_name, i);
+    }
+    envattr_conf->count_name = apr_pstrcat(p, envattr_conf->prefixed_name,
+                                           "_N", NULL);
+
+    return envattr_conf;
+}
+
 /* This function handles the MellonSetEnv configuration directive.
  * This directive allows the user to change the name of attributes.
  *
@@ -776,9 +963,8 @@ static const char *am_set_setenv_slot(cmd_parms *cmd,
 {
     am_dir_cfg_rec *d = (am_dir_cfg_rec *)struct_ptr;
     /* Configure as prefixed attribute name */
-    am_envattr_conf_t *envattr_conf = (am_envattr_conf_t *)apr_palloc(cmd->pool, sizeof(am_envattr_conf_t));
-    envattr_conf->name = newName;
-    envattr_conf->prefixed = 1;
+    am_envattr_conf_t *envattr_conf = am_new_envattr_conf(cmd->pool, newName,
+                                                          1);
     apr_hash_set(d->envattr, oldName, APR_HASH_KEY_STRING, envattr_conf);
     return NULL;
 }
@@ -803,9 +989,8 @@ static const char *am_set_setenv_no_prefix_slot(cmd_parms *cmd,
 {
     am_dir_cfg_rec *d = (am_dir_cfg_rec *)struct_ptr;
     /* Configure as not prefixed attribute name */
-    am_envattr_conf_t *envattr_conf = (am_envattr_conf_t *)apr_palloc(cmd->pool, sizeof(am_envattr_conf_t));
-    envattr_conf->name = newName;
-    envattr_conf->prefixed = 0;
+    am_envattr_conf_t *envattr_conf = am_new_envattr_conf(cmd->pool, newName,
+                                                          0);
     apr_hash_set(d->envattr, oldName, APR_HASH_KEY_STRING, envattr_conf);
     return NULL;
 }
@@ -914,6 +1099,28 @@ static int am_cond_flags(const char *arg)
     return -1;
 }
 
+/* This function compiles the conditions of a directory configuration
+ * after a MellonCond or MellonRequire directive changed them. The
+ * previous program is released, so only the last one is kept.
+ *
+ * Parameters:
+ *  cmd_parms *cmd       The command structure of the directive.
+ *  am_dir_cfg_rec *d    The current directory configuration.
+ *
+ * Returns:
+ *  Nothing.
+ */
+static void am_compile_cond(cmd_parms *cmd, am_dir_cfg_rec *d)
+{
+    if (d->cond_pool == NULL) {
+        apr_pool_create(&d->cond_pool, cmd->pool);
+    } else {
+        apr_pool_clear(d->cond_pool);
+    }
+
+    d->cond_program = am_cond_compile(d->cond_pool, d->cond);
+}
+
 /* This function handles the MellonCond configuration directive, which
  * allows the user to restrict access based on attributes received from
  * the IdP.
@@ -956,6 +1163,7 @@ static const char *am_set_cond_slot(cmd_parms *cmd,
     element->flags = flags;
     element->str = NULL;
     element->regex = NULL;
+    element->jit = NULL;
     element->directive = apr_pstrcat(cmd->pool, cmd->directive->directive, 
                                      " ", cmd->directive->args, NULL);
     if (element->flags & AM_COND_FLAG_REG) {
@@ -968,6 +1176,8 @@ static const char *am_set_cond_slot(cmd_parms *cmd,
         if (element->regex == NULL) 
              return apr_psprintf(cmd->pool, "%s - invalid regex %s",
                                  cmd->cmd->name, value);
+
+        element->jit = am_regex_jit_compile(cmd->pool, value, regex_flags);
     }
 
     /*
@@ -982,6 +1192,8 @@ static const char *am_set_cond_slot(cmd_parms *cmd,
      * print it for debug purpose and perform substitutions on it. 
      */
     element->str = value;
+
+    am_compile_cond(cmd, d);
     
     return NULL;
 }
@@ -1037,6 +1249,7 @@ static const char *am_set_require_slot(cmd_parms *cmd,
         element->flags = AM_COND_FLAG_OR|AM_COND_FLAG_REQ;
         element->str = value;
         element->regex = NULL;
+        element->jit = NULL;
 
         /*
          * When multiple values are given, we track the first one
@@ -1058,6 +1271,8 @@ static const char *am_set_require_slot(cmd_parms *cmd,
      */
     element->flags &= ~AM_COND_FLAG_OR;
 
+    am_compile_cond(cmd, d);
+
     return NULL;
 }
 
@@ -1187,6 +1402,221 @@ static const char *am_set_merge_env_vars(cmd_parms *cmd,
     return NULL;
 }
 
+/* This function handles the MellonEnvExport configuration directive.
+ * The first argument is "all" or "declared". With "declared" only the
+ * attributes renamed by MellonSetEnv or MellonSetEnvNoPrefix and the
+ * attribute names following it are exported to the environment.
+ *
+ * Parameters:
+ *  cmd_parms *cmd       The command structure for this configuration
+ *                       directive.
+ *  void *struct_ptr     Pointer to the current directory configuration.
+ *  int argc             Number of arguments.
+ *  char *const argv[]   The mode followed by the attribute names.
+ *
+ * Returns:
+ *  NULL on success, or errror string on failure.
+ */
+static const char *am_set_env_export_slot(cmd_parms *cmd,
+                                          void *struct_ptr,
+                                          int argc,
+                                          char *const argv[])
+{
+    am_dir_cfg_rec *d = (am_dir_cfg_rec *)struct_ptr;
+    int i;
+
+    if (argc < 1) {
+        return apr_psprintf(cmd->pool, "%s takes at least one argument",
+                            cmd->cmd->name);
+    }
+
+    if (!strcasecmp(argv[0], "all")) {
+        if (argc > 1) {
+            return apr_psprintf(cmd->pool, "%s all takes no attribute names",
+                                cmd->cmd->name);
+        }
+        d->env_export = AM_ENV_EXPORT_ALL;
+    } else if (!strcasecmp(argv[0], "declared")) {
+        d->env_export = AM_ENV_EXPORT_DECLARED;
+    } else {
+        return apr_psprintf(cmd->pool, "%s: the first argument must be"
+                            " all or declared, not \"%s\"",
+                            cmd->cmd->name, argv[0]);
+    }
+
+    d->env_export_names = apr_hash_make(cmd->pool);
+    for (i = 1; i < argc; i++) {
+        apr_hash_set(d->env_export_names, argv[i], APR_HASH_KEY_STRING,
+                     argv[i]);
+    }
+
+    return NULL;
+}
+
+/* qsort() comparison of two strings in an array of strings. */
+static int am_strcmp_indirect(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* This function builds the key identifying a MellonIdentityHeader
+ * selection in the session record. The key is the same in every
+ * process and across restarts: "*" for every attribute, otherwise the
+ * sorted attribute names, each followed by a newline.
+ *
+ * Parameters:
+ *  apr_pool_t *p        The pool we should allocate memory from.
+ *  apr_hash_t *names    The set of attribute names, NULL for every
+ *                       attribute.
+ *
+ * Returns:
+ *  The key.
+ */
+static const char *am_identity_header_key(apr_pool_t *p, apr_hash_t *names)
+{
+    apr_array_header_t *sorted;
+    apr_hash_index_t *hi;
+    const char *name;
+    int i;
+
+    if (names == NULL) {
+        return "*";
+    }
+
+    sorted = apr_array_make(p, apr_hash_count(names), sizeof(char *));
+    for (hi = apr_hash_first(p, names); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (const void **)&name, NULL, NULL);
+        APR_ARRAY_PUSH(sorted, const char *) = name;
+    }
+    qsort(sorted->elts, sorted->nelts, sizeof(char *), am_strcmp_indirect);
+
+    for (i = 0; i < sorted->nelts; i++) {
+        APR_ARRAY_IDX(sorted, i, const char *) =
+            apr_pstrcat(p, APR_ARRAY_IDX(sorted, i, const char *), "\n",
+                        NULL);
+    }
+
+    return apr_array_pstrcat(p, sorted, '\0');
+}
+
+/* This function handles the MellonIdentityHeader configuration
+ * directive. The first argument is the name of the request header,
+ * or "Off", followed by the attributes to include. Without attribute
+ * names every attribute of the session is included.
+ *
+ * Parameters:
+ *  cmd_parms *cmd       The command structure for this configuration
+ *                       directive.
+ *  void *struct_ptr     Pointer to the current directory configuration.
+ *  int argc             Number of arguments.
+ *  char *const argv[]   The header name followed by the attribute names.
+ *
+ * Returns:
+ *  NULL on success, or errror string on failure.
+ */
+static const char *am_set_identity_header_slot(cmd_parms *cmd,
+                                               void *struct_ptr,
+                                               int argc,
+                                               char *const argv[])
+{
+    am_dir_cfg_rec *d = (am_dir_cfg_rec *)struct_ptr;
+    int i;
+
+    if (argc < 1) {
+        return apr_psprintf(cmd->pool, "%s takes at least one argument",
+                            cmd->cmd->name);
+    }
+
+    if (!strcasecmp(argv[0], "off")) {
+        if (argc > 1) {
+            return apr_psprintf(cmd->pool, "%s Off takes no attribute names",
+                                cmd->cmd->name);
+        }
+        d->identity_header = "";
+        d->identity_header_names = NULL;
+        d->identity_header_key = NULL;
+        return NULL;
+    }
+
+    d->identity_header = argv[0];
+    d->identity_header_names = NULL;
+    if (argc > 1) {
+        d->identity_header_names = apr_hash_make(cmd->pool);
+        for (i = 1; i < argc; i++) {
+            apr_hash_set(d->identity_header_names, argv[i],
+                         APR_HASH_KEY_STRING, argv[i]);
+        }
+    }
+    d->identity_header_key = am_identity_header_key(cmd->pool,
+                                                    d->identity_header_names);
+
+    return NULL;
+}
+
+/* This function handles the MellonAttributeFilter configuration
+ * directive. The first argument is "off", "allow", "deny" or "auto",
+ * followed by the attribute names to allow or deny. With "auto" the
+ * names are allowed in addition to the attributes the configuration
+ * refers to.
+ *
+ * Parameters:
+ *  cmd_parms *cmd       The command structure for this configuration
+ *                       directive.
+ *  void *struct_ptr     Pointer to the current directory configuration.
+ *  int argc             Number of arguments.
+ *  char *const argv[]   The mode followed by the attribute names.
+ *
+ * Returns:
+ *  NULL on success, or errror string on failure.
+ */
+static const char *am_set_attribute_filter_slot(cmd_parms *cmd,
+                                                void *struct_ptr,
+                                                int argc,
+                                                char *const argv[])
+{
+    am_dir_cfg_rec *d = (am_dir_cfg_rec *)struct_ptr;
+    am_attribute_filter_t filter;
+    int i;
+
+    if (argc < 1) {
+        return apr_psprintf(cmd->pool, "%s takes at least one argument",
+                            cmd->cmd->name);
+    }
+
+    if (!strcasecmp(argv[0], "off")) {
+        filter = AM_ATTRIBUTE_FILTER_OFF;
+    } else if (!strcasecmp(argv[0], "allow")) {
+        filter = AM_ATTRIBUTE_FILTER_ALLOW;
+    } else if (!strcasecmp(argv[0], "deny")) {
+        filter = AM_ATTRIBUTE_FILTER_DENY;
+    } else if (!strcasecmp(argv[0], "auto")) {
+        filter = AM_ATTRIBUTE_FILTER_AUTO;
+    } else {
+        return apr_psprintf(cmd->pool, "%s: the first argument must be"
+                            " off, allow, deny or auto, not \"%s\"",
+                            cmd->cmd->name, argv[0]);
+    }
+
+    if (filter == AM_ATTRIBUTE_FILTER_OFF && argc > 1) {
+        return apr_psprintf(cmd->pool, "%s off takes no attribute names",
+                            cmd->cmd->name);
+    }
+    if ((filter == AM_ATTRIBUTE_FILTER_ALLOW ||
+         filter == AM_ATTRIBUTE_FILTER_DENY) && argc < 2) {
+        return apr_psprintf(cmd->pool, "%s %s takes at least one attribute"
+                            " name", cmd->cmd->name, argv[0]);
+    }
+
+    d->attribute_filter = filter;
+    d->attribute_filter_names = apr_hash_make(cmd->pool);
+    for (i = 1; i < argc; i++) {
+        apr_hash_set(d->attribute_filter_names, argv[i], APR_HASH_KEY_STRING,
+                     argv[i]);
+    }
+
+    return NULL;
+}
+
 /* Handle MellonRedirectDomains option.
  *
  * Parameters:
@@ -1445,6 +1875,100 @@ const command_rec auth_mellon_commands[] = {
         "The maximum size for a single session state entry in the socache. "
         "Default is "
         ),
+    AP_INIT_TAKE1(
+        "MellonSoCacheCompressThreshold",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, socache_compress_threshold),
+        RSRC_CONF,
+        "Session state entries of at least this many bytes are compressed"
+        " before they are stored in the socache. Default value is 0"
+        " (disabled)."
+        ),
+    AP_INIT_TAKE1(
+        "MellonSessionCacheSize",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, session_cache_size),
+        RSRC_CONF,
+        "The maximum number of decoded sessions each process keeps in"
+        " front of the socache. Default value is 0 (disabled)."
+        ),
+    AP_INIT_TAKE1(
+        "MellonSessionCacheTTL",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, session_cache_ttl),
+        RSRC_CONF,
+        "The number of seconds a decoded session may be served from the"
+        " per-process session cache. Default value is 5."
+        ),
+    AP_INIT_TAKE1(
+        "MellonAuthzCacheSize",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, authz_cache_size),
+        RSRC_CONF,
+        "The maximum number of MellonRequire and MellonCond decisions each"
+        " process caches. Default value is 0 (disabled)."
+        ),
+    AP_INIT_TAKE1(
+        "MellonAuthzCacheTTL",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, authz_cache_ttl),
+        RSRC_CONF,
+        "The number of seconds an authorization decision may be served"
+        " from the per-process cache. Default value is 5."
+        ),
+    AP_INIT_TAKE1(
+        "MellonSessionIdleTimeoutRefresh",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, session_idle_refresh),
+        RSRC_CONF,
+        "The percentage of MellonSessionIdleTimeout which has to elapse"
+        " before the idle timeout of a session is pushed forward. Default"
+        " value is 50."
+        ),
+    AP_INIT_TAKE1(
+        "MellonAssertionIdFilterSize",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, assertion_id_filter_size),
+        RSRC_CONF,
+        "The size in bytes of each of the two generations of the filter"
+        " kept in front of the Assertion ID replay records. Default value"
+        " is 1048576, 0 disables the filter."
+        ),
+    AP_INIT_TAKE1(
+        "MellonSessionReaperInterval",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, session_reaper_interval),
+        RSRC_CONF,
+        "The number of seconds between two sweeps of the thread removing"
+        " expired sessions from the socache. Default value is 0"
+        " (disabled)."
+        ),
+    AP_INIT_TAKE1(
+        "MellonSessionIdSecretFile",
+        am_set_module_session_id_secret_slot,
+        NULL,
+        RSRC_CONF,
+        "A file with the secrets session ids are authenticated with, one"
+        " per line, the first one signs new session ids. Not set by"
+        " default."
+        ),
+    AP_INIT_TAKE1(
+        "MellonSessionStorage",
+        am_set_module_session_storage_slot,
+        NULL,
+        RSRC_CONF,
+        "Where sessions are kept, \"store\" for the session store or"
+        " \"cookie\" for sealed cookies. Default value is \"store\"."
+        ),
+    AP_INIT_TAKE1(
+        "MellonSessionCookieMaxSize",
+        am_set_module_config_int_slot,
+        (void *)APR_OFFSETOF(am_mod_cfg_rec, session_cookie_max_size),
+        RSRC_CONF,
+        "The maximum number of characters of the sealed session cookies"
+        " together, larger sessions are kept in the session store."
+        " Default value is 4096."
+        ),
 
 
     /* Per-location configuration directives. */
@@ -1544,6 +2068,37 @@ const command_rec auth_mellon_commands[] = {
         "Renames attributes received from the server without adding prefix. The format is"
         " MellonSetEnvNoPrefix <old name> <new name>."
         ),
+    AP_INIT_TAKE_ARGV(
+        "MellonEnvExport",
+        am_set_env_export_slot,
+        NULL,
+        OR_AUTHCFG,
+        "Which attributes are exported to the environment. The format is"
+        " MellonEnvExport all|declared [<attribute name>] ... With declared"
+        " only the attributes renamed with MellonSetEnv or"
+        " MellonSetEnvNoPrefix and the listed ones are exported. Default"
+        " is all."
+        ),
+    AP_INIT_TAKE_ARGV(
+        "MellonIdentityHeader",
+        am_set_identity_header_slot,
+        NULL,
+        OR_AUTHCFG,
+        "Request header set to the user and the attributes as JSON, for"
+        " backends behind mod_proxy. The format is MellonIdentityHeader"
+        " <header name>|Off [<attribute name>] ... Without attribute names"
+        " every attribute is included. The JSON is built when the session"
+        " is created and stored with it. Default is Off."
+        ),
+    AP_INIT_TAKE_ARGV(
+        "MellonAttributeFilter",
+        am_set_attribute_filter_slot,
+        NULL,
+        OR_AUTHCFG,
+        "Which attributes received from the IdP are stored in the session."
+        " The format is MellonAttributeFilter off|auto|allow|deny"
+        " [<attribute name>] ... Default is off, storing every attribute."
+        ),
     AP_INIT_TAKE1(
         "MellonEnvPrefix",
         ap_set_string_slot,
@@ -1842,6 +2397,21 @@ const command_rec auth_mellon_commands[] = {
         OR_AUTHCFG,
         "Enabled the session invalidation endpoint. Default is 'off'."
         ),
+    AP_INIT_FLAG(
+        "MellonStatsEndpoint",
+        ap_set_flag_slot,
+        (void *)APR_OFFSETOF(am_dir_cfg_rec, stats_endpoint),
+        OR_AUTHCFG,
+        "Enable the session store statistics endpoint. Default is off."
+        ),
+    AP_INIT_FLAG(
+        "MellonRevokeEndpoint",
+        ap_set_flag_slot,
+        (void *)APR_OFFSETOF(am_dir_cfg_rec, revoke_endpoint),
+        OR_AUTHCFG,
+        "Enable the endpoint revoking the sessions of all or one IdP."
+        " Default is off."
+        ),
     AP_INIT_TAKE1(
         "MellonSendExpectHeader",
         am_set_send_expect_header_slots,
@@ -1908,6 +2478,8 @@ void *auth_mellon_dir_config(apr_pool_t *p, char *d)
     dir->env_vars_index_start = default_env_vars_index_start;
     dir->env_vars_count_in_n = default_env_vars_count_in_n;
     dir->cond = apr_array_make(p, 0, sizeof(am_cond_t));
+    dir->cond_program = NULL;
+    dir->cond_pool = NULL;
     dir->cookie_domain = NULL;
     dir->cookie_path = NULL;
     dir->cookie_samesite = am_samesite_default;
@@ -1915,6 +2487,14 @@ void *auth_mellon_dir_config(apr_pool_t *p, char *d)
     dir->env_prefix = default_env_prefix;
     dir->userattr  = default_user_attribute;
     dir->idpattr  = NULL;
+    dir->env_export = AM_ENV_EXPORT_DEFAULT;
+    dir->env_export_names = NULL;
+    dir->identity_header = NULL;
+    dir->identity_header_names = NULL;
+    dir->identity_header_key = NULL;
+    dir->attribute_filter = AM_ATTRIBUTE_FILTER_DEFAULT;
+    dir->attribute_filter_names = NULL;
+    dir->attribute_names_known = false;
     dir->signature_method = inherit_signature_method;
     dir->dump_session = default_dump_session;
     dir->dump_saml_response = default_dump_saml_response;
@@ -1957,6 +2537,8 @@ void *auth_mellon_dir_config(apr_pool_t *p, char *d)
     dir->ecp_send_idplist = inherit_ecp_send_idplist;
 
     dir->enabled_invalidation_session = default_enabled_invalidation_session;
+    dir->stats_endpoint = inherit_stats_endpoint;
+    dir->revoke_endpoint = inherit_revoke_endpoint;
 
     dir->send_expect_header = default_send_expect_header;
 
@@ -2066,6 +2648,11 @@ void *auth_mellon_dir_merge(apr_pool_t *p, void *base, void *add)
                                    add_cfg->cond :
                                    base_cfg->cond);
 
+    new_cfg->cond_program = (!apr_is_empty_array(add_cfg->cond)) ?
+                            add_cfg->cond_program :
+                            base_cfg->cond_program;
+    new_cfg->cond_pool = NULL;
+
     new_cfg->envattr = apr_hash_copy(p,
                                      (apr_hash_count(add_cfg->envattr) > 0) ?
                                      add_cfg->envattr :
@@ -2083,6 +2670,34 @@ void *auth_mellon_dir_merge(apr_pool_t *p, void *base, void *add)
                         add_cfg->idpattr :
                         base_cfg->idpattr);
 
+    if (add_cfg->env_export != AM_ENV_EXPORT_DEFAULT) {
+        new_cfg->env_export = add_cfg->env_export;
+        new_cfg->env_export_names = add_cfg->env_export_names;
+    } else {
+        new_cfg->env_export = base_cfg->env_export;
+        new_cfg->env_export_names = base_cfg->env_export_names;
+    }
+
+    if (add_cfg->identity_header != NULL) {
+        new_cfg->identity_header = add_cfg->identity_header;
+        new_cfg->identity_header_names = add_cfg->identity_header_names;
+        new_cfg->identity_header_key = add_cfg->identity_header_key;
+    } else {
+        new_cfg->identity_header = base_cfg->identity_header;
+        new_cfg->identity_header_names = base_cfg->identity_header_names;
+        new_cfg->identity_header_key = base_cfg->identity_header_key;
+    }
+
+    if (add_cfg->attribute_filter != AM_ATTRIBUTE_FILTER_DEFAULT) {
+        new_cfg->attribute_filter = add_cfg->attribute_filter;
+        new_cfg->attribute_filter_names = add_cfg->attribute_filter_names;
+    } else {
+        new_cfg->attribute_filter = base_cfg->attribute_filter;
+        new_cfg->attribute_filter_names = base_cfg->attribute_filter_names;
+    }
+    new_cfg->attribute_names_known = add_cfg->attribute_names_known &&
+                                     base_cfg->attribute_names_known;
+
     new_cfg->signature_method = CFG_MERGE(add_cfg, base_cfg, signature_method);
 
     new_cfg->dump_session = (add_cfg->dump_session != default_dump_session ?
@@ -2221,6 +2836,9 @@ void *auth_mellon_dir_merge(apr_pool_t *p, void *base, void *add)
          add_cfg->enabled_invalidation_session :
          base_cfg->enabled_invalidation_session);
 
+    new_cfg->stats_endpoint = CFG_MERGE(add_cfg, base_cfg, stats_endpoint);
+    new_cfg->revoke_endpoint = CFG_MERGE(add_cfg, base_cfg, revoke_endpoint);
+
     new_cfg->send_expect_header =
         (add_cfg->send_expect_header != default_send_expect_header ?
          add_cfg->send_expect_header :
@@ -2230,6 +2848,187 @@ void *auth_mellon_dir_merge(apr_pool_t *p, void *base, void *add)
 }
 
 
+/* This function adds the names of the attributes a configuration
+ * section refers to to a set, for "MellonAttributeFilter auto": the
+ * attributes named by MellonCond, MellonRequire and MellonUser, renamed
+ * by MellonSetEnv or MellonSetEnvNoPrefix, listed by MellonEnvExport or
+ * MellonIdentityHeader and listed after "auto".
+ *
+ * Parameters:
+ *  apr_pool_t *p        The pool the set was allocated from.
+ *  am_dir_cfg_rec *d    The configuration section.
+ *  apr_hash_t *names    The set of attribute names.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_attribute_filter_add_names(apr_pool_t *p, const am_dir_cfg_rec *d,
+                                   apr_hash_t *names)
+{
+    apr_hash_index_t *hi;
+    const char *name;
+    int i;
+
+    if (d->attribute_filter == AM_ATTRIBUTE_FILTER_AUTO &&
+        d->attribute_filter_names != NULL) {
+        for (hi = apr_hash_first(p, d->attribute_filter_names); hi;
+             hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, (const void **)&name, NULL, NULL);
+            apr_hash_set(names, name, APR_HASH_KEY_STRING, name);
+        }
+    }
+
+    for (hi = apr_hash_first(p, d->envattr); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (const void **)&name, NULL, NULL);
+        apr_hash_set(names, name, APR_HASH_KEY_STRING, name);
+    }
+
+    if (d->env_export_names != NULL) {
+        for (hi = apr_hash_first(p, d->env_export_names); hi;
+             hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, (const void **)&name, NULL, NULL);
+            apr_hash_set(names, name, APR_HASH_KEY_STRING, name);
+        }
+    }
+    if (d->identity_header_names != NULL) {
+        for (hi = apr_hash_first(p, d->identity_header_names); hi;
+             hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, (const void **)&name, NULL, NULL);
+            apr_hash_set(names, name, APR_HASH_KEY_STRING, name);
+        }
+    }
+
+    apr_hash_set(names, d->userattr, APR_HASH_KEY_STRING, d->userattr);
+
+    for (i = 0; i < d->cond->nelts; i++) {
+        const am_cond_t *ce = &((am_cond_t *)(d->cond->elts))[i];
+        const am_envattr_conf_t *env_attr_conf;
+
+        if (ce->flags & AM_COND_FLAG_IGN) {
+            continue;
+        }
+
+        apr_hash_set(names, ce->varname, APR_HASH_KEY_STRING, ce->varname);
+        if (ce->flags & AM_COND_FLAG_MAP) {
+            env_attr_conf = apr_hash_get(d->envattr, ce->varname,
+                                         APR_HASH_KEY_STRING);
+            if (env_attr_conf != NULL) {
+                apr_hash_set(names, env_attr_conf->name, APR_HASH_KEY_STRING,
+                             env_attr_conf->name);
+            }
+        }
+    }
+}
+
+/* This function adds the attribute names of a configuration section,
+ * and of the <Files> and <If> sections nested in it, to a set, and
+ * their MellonIdentityHeader selections to another. See
+ * am_attribute_filter_init().
+ *
+ * Parameters:
+ *  apr_pool_t *p           The pool the set was allocated from.
+ *  ap_conf_vector_t *sec   The configuration section.
+ *  apr_hash_t *names       The set of attribute names.
+ *  apr_hash_t *selections  The MellonIdentityHeader selections.
+ *  bool *auto_used         Set if the section uses
+ *                          "MellonAttributeFilter auto".
+ *
+ * Returns:
+ *  Nothing.
+ */
+static void am_attribute_filter_add_section(apr_pool_t *p,
+                                            ap_conf_vector_t *sec,
+                                            apr_hash_t *names,
+                                            apr_hash_t *selections,
+                                            bool *auto_used)
+{
+    am_dir_cfg_rec *d = ap_get_module_config(sec, &auth_mellon_module);
+    core_dir_config *core = ap_get_module_config(sec, &core_module);
+    ap_conf_vector_t **nested;
+    int i;
+
+    if (d != NULL) {
+        am_attribute_filter_add_names(p, d, names);
+        d->attribute_names_known = true;
+        if (d->attribute_filter == AM_ATTRIBUTE_FILTER_AUTO) {
+            *auto_used = true;
+        }
+        if (d->identity_header_key != NULL) {
+            apr_hash_set(selections, d->identity_header_key,
+                         APR_HASH_KEY_STRING, d);
+        }
+    }
+
+    if (core == NULL) {
+        return;
+    }
+    if (core->sec_file != NULL) {
+        nested = (ap_conf_vector_t **)core->sec_file->elts;
+        for (i = 0; i < core->sec_file->nelts; i++) {
+            am_attribute_filter_add_section(p, nested[i], names, selections,
+                                            auto_used);
+        }
+    }
+    if (core->sec_if != NULL) {
+        nested = (ap_conf_vector_t **)core->sec_if->elts;
+        for (i = 0; i < core->sec_if->nelts; i++) {
+            am_attribute_filter_add_section(p, nested[i], names, selections,
+                                            auto_used);
+        }
+    }
+}
+
+/* This function collects the attribute names "MellonAttributeFilter
+ * auto" keeps from every section of the configuration, of every
+ * virtual host. The endpoint receiving an assertion must keep the
+ * attributes any location of the server may check, not only those
+ * its own configuration refers to. For the same reason it collects
+ * the MellonIdentityHeader selections, whose JSON is stored with a
+ * new session.
+ *
+ * The sections walked here are marked, configurations merged only from
+ * marked sections have attribute_names_known set. Sections read from
+ * .htaccess files are not known at startup, see am_check_permissions().
+ *
+ * Parameters:
+ *  apr_pool_t *p        The configuration pool.
+ *  server_rec *s        The main server.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_attribute_filter_init(apr_pool_t *p, server_rec *s)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+    apr_hash_t *names = apr_hash_make(p);
+    apr_hash_t *selections = apr_hash_make(p);
+    bool auto_used = false;
+    core_server_config *sconf;
+    ap_conf_vector_t **secs;
+    server_rec *sv;
+    int i;
+
+    for (sv = s; sv != NULL; sv = sv->next) {
+        am_attribute_filter_add_section(p, sv->lookup_defaults, names,
+                                        selections, &auto_used);
+
+        sconf = ap_get_module_config(sv->module_config, &core_module);
+        secs = (ap_conf_vector_t **)sconf->sec_dir->elts;
+        for (i = 0; i < sconf->sec_dir->nelts; i++) {
+            am_attribute_filter_add_section(p, secs[i], names, selections,
+                                            &auto_used);
+        }
+        secs = (ap_conf_vector_t **)sconf->sec_url->elts;
+        for (i = 0; i < sconf->sec_url->nelts; i++) {
+            am_attribute_filter_add_section(p, secs[i], names, selections,
+                                            &auto_used);
+        }
+    }
+
+    mod_cfg->attribute_filter_auto_names = auto_used ? names : NULL;
+    mod_cfg->identity_header_selections = selections;
+}
+
 /* This function creates a new per-server configuration.
  * auth_mellon uses the server configuration to store a pointer
  * to the global module configuration.
@@ -2277,7 +3076,22 @@ void *auth_mellon_server_config(apr_pool_t *p, server_rec *s)
     mod->socache_provider_args = NULL;
     mod->socache_provider = NULL;
     mod->socache_instance = NULL;
+    mod->socache_batch_provider = NULL;
     mod->socache_session_state_entry_size = SESSION_STATE_ENTRY_SIZE;
+    mod->socache_compress_threshold = socache_compress_threshold;
+
+    mod->session_cache_size = session_cache_size;
+    mod->session_cache_ttl = session_cache_ttl;
+    mod->authz_cache_size = authz_cache_size;
+    mod->authz_cache_ttl = authz_cache_ttl;
+    mod->session_idle_refresh = session_idle_refresh;
+    mod->assertion_id_filter_size = assertion_id_filter_size;
+    mod->session_reaper_interval = session_reaper_interval;
+    mod->session_id_keys = NULL;
+    mod->session_storage = AM_SESSION_STORAGE_STORE;
+    mod->session_cookie_max_size = session_cookie_max_size;
+    mod->attribute_filter_auto_names = NULL;
+    mod->identity_header_selections = NULL;
 
     apr_pool_userdata_set(mod, key, apr_pool_cleanup_null, p);
 
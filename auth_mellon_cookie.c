@@ -100,39 +100,21 @@ static const char *am_cookie_params(request_rec *r)
 }
 
 
-/* This functions finds the value of our cookie.
+/* This function finds the value of a cookie in the request.
  *
  * Parameters:
  *  request_rec *r       The request we should find the cookie in.
+ *  const char *name     The name of the cookie.
  *
  * Returns:
  *  The value of the cookie, or NULL if we don't find the cookie.
  */
-const char *am_cookie_get(request_rec *r)
+static const char *am_cookie_get_named(request_rec *r, const char *name)
 {
-    am_req_cfg_rec *req_cfg;
-    const char *name;
     const char *value;
     const char *cookie;
     char *buffer, *end;
 
-    /* don't run for subrequests */
-    if (r->main) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
-                     "cookie_get: Subrequest, so return NULL");        
-        return NULL;
-    }
-
-    /* Check if we have added a note on the current request. */
-    req_cfg = am_get_req_cfg(r);
-    value = req_cfg->cookie_value;
-    if(value != NULL) {
-        return value;
-    }
-
-
-    name = am_cookie_name(r);
-
     cookie = apr_table_get(r->headers_in, "Cookie");
     if(cookie == NULL) {
         return NULL;
@@ -197,6 +179,37 @@ const char *am_cookie_get(request_rec *r)
 }
 
 
+/* This functions finds the value of our cookie.
+ *
+ * Parameters:
+ *  request_rec *r       The request we should find the cookie in.
+ *
+ * Returns:
+ *  The value of the cookie, or NULL if we don't find the cookie.
+ */
+const char *am_cookie_get(request_rec *r)
+{
+    am_req_cfg_rec *req_cfg;
+    const char *value;
+
+    /* don't run for subrequests */
+    if (r->main) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
+                     "cookie_get: Subrequest, so return NULL");        
+        return NULL;
+    }
+
+    /* Check if we have added a note on the current request. */
+    req_cfg = am_get_req_cfg(r);
+    value = req_cfg->cookie_value;
+    if(value != NULL) {
+        return value;
+    }
+
+    return am_cookie_get_named(r, am_cookie_name(r));
+}
+
+
 /* This function sets the value of our cookie.
  *
  * Parameters:
@@ -266,6 +279,138 @@ void am_cookie_delete(request_rec *r)
     apr_table_addn(r->err_headers_out, "Set-Cookie", cookie);
 }
 
+/* This function returns the name of one of the cookies a sealed session
+ * is split over (see MellonSessionStorage), the name of our cookie
+ * followed by the number of the chunk.
+ *
+ * Parameters:
+ *  request_rec *r       The current request.
+ *  int chunk            The number of the chunk.
+ *
+ * Returns:
+ *  The name of the cookie.
+ */
+static const char *am_cookie_sealed_name(request_rec *r, int chunk)
+{
+    return apr_psprintf(r->pool, "%s-%d", am_cookie_name(r), chunk);
+}
+
+
+/* This function finds the sealed session of the request, joining the
+ * cookies it is split over.
+ *
+ * Parameters:
+ *  request_rec *r       The request we should find the cookies in.
+ *
+ * Returns:
+ *  The sealed session, or NULL if the request has none.
+ */
+const char *am_cookie_get_sealed(request_rec *r)
+{
+    am_req_cfg_rec *req_cfg;
+    const char *chunk;
+    char *value = NULL;
+    int i;
+
+    /* don't run for subrequests */
+    if (r->main) {
+        return NULL;
+    }
+
+    req_cfg = am_get_req_cfg(r);
+    if (req_cfg->sealed_cookie_value != NULL) {
+        return req_cfg->sealed_cookie_value;
+    }
+
+    for (i = 0; i < AM_SEALED_COOKIE_MAX_CHUNKS; i++) {
+        chunk = am_cookie_get_named(r, am_cookie_sealed_name(r, i));
+        if (chunk == NULL) {
+            break;
+        }
+        value = value ? apr_pstrcat(r->pool, value, chunk, NULL)
+                      : (char *)chunk;
+    }
+
+    return value;
+}
+
+
+/* This function sets the cookies holding a sealed session. Cookies
+ * left from a longer sealed session are deleted.
+ *
+ * Parameters:
+ *  request_rec *r       The request we should set the cookies in.
+ *  const char *value    The sealed session, at most
+ *                       AM_SEALED_COOKIE_MAX_CHUNKS chunks long.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_cookie_set_sealed(request_rec *r, const char *value)
+{
+    am_req_cfg_rec *req_cfg;
+    const char *cookie_params = am_cookie_params(r);
+    apr_size_t len = strlen(value);
+    apr_size_t offset;
+    int i;
+
+    for (i = 0, offset = 0;
+         i < AM_SEALED_COOKIE_MAX_CHUNKS && offset < len;
+         i++, offset += AM_SEALED_COOKIE_CHUNK_SIZE) {
+        apr_table_addn(r->err_headers_out, "Set-Cookie",
+                       apr_psprintf(r->pool, "%s=%.*s; %s",
+                                    am_cookie_sealed_name(r, i),
+                                    AM_SEALED_COOKIE_CHUNK_SIZE,
+                                    value + offset, cookie_params));
+    }
+
+    for (; i < AM_SEALED_COOKIE_MAX_CHUNKS; i++) {
+        const char *name = am_cookie_sealed_name(r, i);
+
+        if (am_cookie_get_named(r, name) == NULL) {
+            break;
+        }
+        apr_table_addn(r->err_headers_out, "Set-Cookie",
+                       apr_psprintf(r->pool, "%s=NULL;"
+                                    " expires=Thu, 01-Jan-1970 00:00:00 GMT;"
+                                    " %s", name, cookie_params));
+    }
+
+    req_cfg = am_get_req_cfg(r);
+    req_cfg->sealed_cookie_value = apr_pstrdup(r->pool, value);
+}
+
+
+/* This function deletes the cookies holding a sealed session.
+ *
+ * Parameters:
+ *  request_rec *r       The request we should clear the cookies in.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_cookie_delete_sealed(request_rec *r)
+{
+    am_req_cfg_rec *req_cfg;
+    const char *cookie_params = am_cookie_params(r);
+    const char *name;
+    int i;
+
+    for (i = 0; i < AM_SEALED_COOKIE_MAX_CHUNKS; i++) {
+        name = am_cookie_sealed_name(r, i);
+        if (am_cookie_get_named(r, name) == NULL) {
+            break;
+        }
+        apr_table_addn(r->err_headers_out, "Set-Cookie",
+                       apr_psprintf(r->pool, "%s=NULL;"
+                                    " expires=Thu, 01-Jan-1970 00:00:00 GMT;"
+                                    " %s", name, cookie_params));
+    }
+
+    req_cfg = am_get_req_cfg(r);
+    req_cfg->sealed_cookie_value = NULL;
+}
+
 /* Get string that is used to tie a session to a specific cookie.
  *
  *  request_rec *r       The current request.
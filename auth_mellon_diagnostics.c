@@ -49,6 +49,12 @@ am_diag_enable_str(request_rec *r, am_enable_t enable);
 static const char *
 am_diag_samesite_str(request_rec *r, am_samesite_t samesite);
 
+static const char *
+am_diag_attribute_filter_str(request_rec *r, am_attribute_filter_t filter);
+
+static const char *
+am_diag_env_export_str(request_rec *r, am_env_export_t env_export);
+
 static const char *
 am_diag_httpd_error_level_str(request_rec *r, int level);
 
@@ -222,6 +228,32 @@ am_diag_samesite_str(request_rec *r, am_samesite_t samesite)
     }
 }
 
+static const char *
+am_diag_env_export_str(request_rec *r, am_env_export_t env_export)
+{
+    switch(env_export) {
+    case AM_ENV_EXPORT_DEFAULT:  return "default";
+    case AM_ENV_EXPORT_ALL:      return "all";
+    case AM_ENV_EXPORT_DECLARED: return "declared";
+    default:
+        return apr_psprintf(r->pool, "unknown (%d)", env_export);
+    }
+}
+
+static const char *
+am_diag_attribute_filter_str(request_rec *r, am_attribute_filter_t filter)
+{
+    switch(filter) {
+    case AM_ATTRIBUTE_FILTER_DEFAULT: return "default";
+    case AM_ATTRIBUTE_FILTER_OFF:     return "off";
+    case AM_ATTRIBUTE_FILTER_ALLOW:   return "allow";
+    case AM_ATTRIBUTE_FILTER_DENY:    return "deny";
+    case AM_ATTRIBUTE_FILTER_AUTO:    return "auto";
+    default:
+        return apr_psprintf(r->pool, "unknown (%d)", filter);
+    }
+}
+
 static const char *
 am_diag_httpd_error_level_str(request_rec *r, int level)
 {
@@ -473,6 +505,47 @@ am_diag_log_dir_cfg(request_rec *r, int level, am_dir_cfg_rec *cfg,
     apr_file_printf(diag_cfg->fd,
                     "%sMellonIdP (idpattr): %s\n",
                     indent(level+1), cfg->idpattr);
+    apr_file_printf(diag_cfg->fd,
+                    "%sMellonEnvExport (env_export): %s\n",
+                    indent(level+1),
+                    am_diag_env_export_str(r, cfg->env_export));
+    if (cfg->env_export_names != NULL) {
+        for (hash_item = apr_hash_first(r->pool, cfg->env_export_names);
+             hash_item;
+             hash_item = apr_hash_next(hash_item)) {
+            const char *key;
+
+            apr_hash_this(hash_item, (void *)&key, NULL, NULL);
+            apr_file_printf(diag_cfg->fd, "%s%s\n", indent(level+2), key);
+        }
+    }
+    apr_file_printf(diag_cfg->fd,
+                    "%sMellonIdentityHeader (identity_header): %s\n",
+                    indent(level+1), cfg->identity_header);
+    if (cfg->identity_header_names != NULL) {
+        for (hash_item = apr_hash_first(r->pool, cfg->identity_header_names);
+             hash_item;
+             hash_item = apr_hash_next(hash_item)) {
+            const char *key;
+
+            apr_hash_this(hash_item, (void *)&key, NULL, NULL);
+            apr_file_printf(diag_cfg->fd, "%s%s\n", indent(level+2), key);
+        }
+    }
+    apr_file_printf(diag_cfg->fd,
+                    "%sMellonAttributeFilter (attribute_filter): %s\n",
+                    indent(level+1),
+                    am_diag_attribute_filter_str(r, cfg->attribute_filter));
+    if (cfg->attribute_filter_names != NULL) {
+        for (hash_item = apr_hash_first(r->pool, cfg->attribute_filter_names);
+             hash_item;
+             hash_item = apr_hash_next(hash_item)) {
+            const char *key;
+
+            apr_hash_this(hash_item, (void *)&key, NULL, NULL);
+            apr_file_printf(diag_cfg->fd, "%s%s\n", indent(level+2), key);
+        }
+    }
     apr_file_printf(diag_cfg->fd,
                     "%sMellonSessionDump (dump_session): %s\n",
                     indent(level+1), cfg->dump_session ? "On":"Off");
@@ -781,17 +854,6 @@ am_diag_cond_str(request_rec *r, const am_cond_t *cond)
                         cond->str, cond->directive);
 }
 
-const char *
-am_diag_cache_key_type_str(am_cache_key_t key_type)
-{
-    switch(key_type) {
-    case AM_CACHE_SESSION:      return "session";
-    case AM_CACHE_NAMEID:       return "name id";
-    case AM_CACHE_ASSERTIONID:  return "assertion id";
-    default:                    return "unknown";
-    }
-}
-
 const char *
 am_diag_lasso_http_method_str(LassoHttpMethod http_method)
 {
@@ -1116,7 +1178,12 @@ am_diag_log_session_state(request_rec *r, int level, am_session_state_t *ss,
         apr_file_printf(diag_cfg->fd,
                         "%sidle_timeout: %s\n",
                         indent(level+1),
-                        am_diag_time_t_to_8601(r, entry->idle_timeout));
+                        am_diag_time_t_to_8601(r, ss->idle_timeout));
+        apr_file_printf(diag_cfg->fd,
+                        "%sgeneration: %" APR_UINT64_T_FMT
+                        " idp_generation: %" APR_UINT64_T_FMT "\n",
+                        indent(level+1),
+                        ss->generation, ss->idp_generation);
         apr_file_printf(diag_cfg->fd,
                         "%saccess: %s\n",
                         indent(level+1),
@@ -1155,6 +1222,11 @@ am_diag_log_session_state(request_rec *r, int level, am_session_state_t *ss,
             }
         }
 
+        apr_file_printf(diag_cfg->fd,
+                        "%slogout_state_loaded: %s\n",
+                        indent(level+1),
+                        ss->logout_state_loaded ? "true" : "false");
+
         apr_file_printf(diag_cfg->fd,
                         "%ssaml_response: %s\n",
                         indent(level+1), ss->session_id);
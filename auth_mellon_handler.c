@@ -528,6 +528,7 @@ am_session_save_lasso_state(request_rec *r,
     LassoSession *lasso_session;
     int rc = OK;
 
+    session->logout_state_loaded = true;
     session->saml_response = apr_pstrdup(r->pool, saml_response);
 
     lasso_identity = lasso_profile_get_identity(profile);
@@ -704,8 +705,9 @@ static int am_return_logout_response(request_rec *r,
 
 
 /* This function restores dumps of a LassoIdentity object and a LassoSession
- * object. The dumps are fetched from the session belonging to the current
- * request and restored to the given LassoProfile object.
+ * object. The dumps are fetched from the logout state of the session
+ * belonging to the current request and restored to the given LassoProfile
+ * object.
  *
  * Parameters:
  *  request_rec *r              The current request.
@@ -726,6 +728,12 @@ am_restore_lasso_profile_state(request_rec *r, LassoProfile *profile,
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    if (am_session_load_logout_state(r, session) != APR_SUCCESS) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Could not load the logout state of the session.");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
     if (session->lasso_identity_dump != NULL) {
         int rc;
         rc = lasso_profile_set_identity_from_dump(profile, session->lasso_identity_dump);
@@ -857,6 +865,10 @@ static int am_handle_logout_request(request_rec *r,
         /* We found a matching session -- delete it. */
         am_session_delete(r, session);
         session = NULL;
+    } else if (session == NULL) {
+        /* A sealed session is only found through its name id record. */
+        am_session_revoke_sealed_by_name_id(r, name_id,
+            LASSO_SAMLP2_REQUEST_ABSTRACT(LASSO_PROFILE(logout))->Issuer);
     }
 
     /* Create response message. */
@@ -1571,7 +1583,14 @@ static int am_validate_conditions(request_rec *r,
 
 
 
-/* Validate that the ID of the Assertion has not been used.
+/* Validate that the ID of the Assertion has not been used, and record
+ * it so that it cannot be used again.
+ *
+ * The ID is remembered for as long as the assertion is accepted, that
+ * is until the earliest NotOnOrAfter of the Conditions and the
+ * SubjectConfirmationData plus the clock skew allowed when validating
+ * them. An assertion without either is remembered for the length of
+ * a session.
  *
  * Parameters:
  *  request_rec *r                   The current request. Used to log
@@ -1579,12 +1598,18 @@ static int am_validate_conditions(request_rec *r,
  *  LassoSaml2Assertion *assertion   The assertion we will validate.
  *
  * Returns:
- *  OK on success, HTTP_BAD_REQUEST on failure.
+ *  OK on success, HTTP_BAD_REQUEST if the ID has been used or is
+ *  missing, HTTP_INTERNAL_SERVER_ERROR if it could not be checked.
  */
 static int am_validate_unique_assertion_id(request_rec *r,
                                            LassoSaml2Assertion *assertion)
 {
-    am_cache_entry_t *session = NULL;
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    LassoSaml2Subject *subject = assertion->Subject;
+    apr_time_t issued = 0;
+    apr_time_t expires = 0;
+    apr_time_t t;
+    apr_status_t rv;
 
     if (assertion->ID == NULL) {
         AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
@@ -1592,233 +1617,48 @@ static int am_validate_unique_assertion_id(request_rec *r,
         return HTTP_BAD_REQUEST;
     }
 
-    // Check if there is a session associate with the Assertion ID
-    session = am_get_request_session_by_assertionid(r, assertion->ID);
-    if (session != NULL) {
-        am_cache_unlock(r, session);
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "Assertion ID %s has already been used.",
-                      assertion->ID);
-        return HTTP_BAD_REQUEST;
+    if (assertion->IssueInstant != NULL) {
+        issued = am_parse_timestamp(r, assertion->IssueInstant);
     }
 
-    return OK;
-}
-
-
-
-/* This function sets the session expire timestamp based on NotOnOrAfter
- * attribute of a condition element.
- *
- * Parameters:
- *  request_rec *r                   The current request. Used to log
- *                                   errors.
- *  am_cache_entry_t *session        The current session.
- *  LassoSaml2Assertion *assertion   The assertion which we will extract
- *                                   the conditions from.
- *
- * Returns:
- *  Nothing.
- */
-static void am_handle_session_expire(request_rec *r, am_cache_entry_t *session,
-                                LassoSaml2Assertion *assertion)
-{
-    GList *authn_itr;
-    LassoSaml2AuthnStatement *authn;
-    const char *not_on_or_after;
-    apr_time_t t;
-
-    for(authn_itr = g_list_first(assertion->AuthnStatement); authn_itr != NULL;
-        authn_itr = g_list_next(authn_itr)) {
-
-        authn = authn_itr->data;
-        if (!LASSO_IS_SAML2_AUTHN_STATEMENT(authn)) {
-            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                          "Wrong type of AuthnStatement node.");
-            continue;
-        }
-
-        /* Find timestamp. */
-        not_on_or_after = authn->SessionNotOnOrAfter;
-        if(not_on_or_after == NULL) {
-            am_diag_printf(r, "%s failed to find"
-                           " Assertion.AuthnStatement.SessionNotOnOrAfter\n",
-                           __func__);
-            continue;
-        }
-
-
-        /* Parse timestamp. */
-        t = am_parse_timestamp(r, not_on_or_after);
-        if(t == 0) {
-            continue;
+    /* Subject and Conditions have been validated by now. */
+    if (assertion->Conditions != NULL &&
+        assertion->Conditions->NotOnOrAfter != NULL) {
+        expires = am_parse_timestamp(r, assertion->Conditions->NotOnOrAfter);
+    }
+    if (subject != NULL && subject->SubjectConfirmation != NULL &&
+        subject->SubjectConfirmation->SubjectConfirmationData != NULL &&
+        subject->SubjectConfirmation->SubjectConfirmationData->NotOnOrAfter != NULL) {
+        t = am_parse_timestamp(r,
+                subject->SubjectConfirmation->SubjectConfirmationData->NotOnOrAfter);
+        if (expires == 0 || (t != 0 && t < expires)) {
+            expires = t;
         }
-
-        am_diag_printf(r, "%s Assertion.AuthnStatement.SessionNotOnOrAfter:"
-                       " %s\n",
-                       __func__, am_diag_time_t_to_8601(r, t));
-
-        /* Updates the expires timestamp if this one is earlier than the
-         * previous timestamp.
-         */
-        am_cache_update_expires(r, session, t);
     }
-}
-
-/* Add all the attributes from an assertion to the session data for the
- * current user.
- *
- * Parameters:
- *  am_cache_entry_t *s             The current session.
- *  request_rec *r                  The current request.
- *  const char *name_id             The name identifier we received from
- *                                  the IdP.
- *  LassoSaml2Assertion *assertion  The assertion.
- *
- * Returns:
- *  HTTP_BAD_REQUEST if we couldn't find the session id of the user, or
- *  OK if no error occured.
- */
-static int add_attributes(am_cache_entry_t *session, request_rec *r,
-                          const char *name_id, LassoSaml2Assertion *assertion)
-{
-    am_dir_cfg_rec *dir_cfg;
-    GList *atr_stmt_itr;
-    LassoSaml2AttributeStatement *atr_stmt;
-    GList *atr_itr;
-    LassoSaml2Attribute *attribute;
-    GList *value_itr;
-    LassoSaml2AttributeValue *value;
-    GList *any_itr;
-    char *content;
-    char *dump;
-    int ret;
-
-    dir_cfg = am_get_dir_cfg(r);
 
-    /* Set expires to whatever is set by MellonSessionLength. */
-    if(dir_cfg->session_length == -1) {
-        /* -1 means "use default. The current default is 86400 seconds. */
-        am_cache_update_expires(r, session, apr_time_now()
-                                + apr_time_make(86400, 0));
+    if (expires != 0) {
+        expires += 60000000;
+    } else if (dir_cfg->session_length == -1) {
+        expires = apr_time_now() + apr_time_make(86400, 0);
     } else {
-        am_cache_update_expires(r, session, apr_time_now()
-                                + apr_time_make(dir_cfg->session_length, 0));
-    }
-
-    /* Set the idle timeout to whatever is set by MellonSessionIdleTimeout. */
-    am_cache_update_idle_timeout(r, session, dir_cfg->session_idle_timeout);
-
-    /* Save session NAME_ID information. */
-    ret = am_cache_env_append(session, "NAME_ID", name_id);
-    if(ret != OK) {
-        return ret;
+        expires = apr_time_now() + apr_time_make(dir_cfg->session_length, 0);
     }
 
-    /* Save session ASSERTION_ID information. */
-    ret = am_cache_env_append(session, "ASSERTION_ID", assertion->ID);
-    if(ret != OK) {
-        return ret;
-    }
-
-    /* Update expires timestamp of session. */
-    am_handle_session_expire(r, session, assertion);
-
-    /* assertion->AttributeStatement is a list of
-     * LassoSaml2AttributeStatement objects.
-     */
-    for(atr_stmt_itr = g_list_first(assertion->AttributeStatement);
-        atr_stmt_itr != NULL;
-        atr_stmt_itr = g_list_next(atr_stmt_itr)) {
-
-        atr_stmt = atr_stmt_itr->data;
-        if (!LASSO_IS_SAML2_ATTRIBUTE_STATEMENT(atr_stmt)) {
-            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                          "Wrong type of AttributeStatement node.");
-            continue;
-        }
-
-        /* atr_stmt->Attribute is list of LassoSaml2Attribute objects. */
-        for(atr_itr = g_list_first(atr_stmt->Attribute);
-            atr_itr != NULL;
-            atr_itr = g_list_next(atr_itr)) {
-
-            attribute = atr_itr->data;
-            if (!LASSO_IS_SAML2_ATTRIBUTE(attribute)) {
-                AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                              "Wrong type of Attribute node.");
-                continue;
-            }
-
-            if (attribute->Name == NULL) {
-                AM_LOG_RERROR(APLOG_MARK, APLOG_WARNING, 0, r,
-                              "SAML 2.0 attribute without name.");
-                continue;
-            }
-
-            /* attribute->AttributeValue is a list of
-             * LassoSaml2AttributeValue objects.
-             */
-            for(value_itr = g_list_first(attribute->AttributeValue);
-                value_itr != NULL;
-                value_itr = g_list_next(value_itr)) {
-
-
-                value = value_itr->data;
-                if (!LASSO_IS_SAML2_ATTRIBUTE_VALUE(value)) {
-                    AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                                  "Wrong type of AttributeValue node.");
-                    continue;
-                }
-
-                /* value->any is a list with the child nodes of the
-                 * AttributeValue element.
-                 *
-                 * We assume that the list contains a single text node.
-                 */
-                if(value->any == NULL) {
-                    AM_LOG_RERROR(APLOG_MARK, APLOG_WARNING, 0, r,
-                                  "AttributeValue element was empty.");
-                    continue;
-                }
-
-                content = "";
-                for (any_itr = g_list_first(value->any);
-                     any_itr != NULL;
-                     any_itr = g_list_next(any_itr)) {
-                        /* Verify that this is a LassoNode object. */
-                        if(!LASSO_NODE(any_itr->data)) {
-                            AM_LOG_RERROR(APLOG_MARK, APLOG_WARNING, 0, r,
-                                          "AttributeValue element contained an "
-                                          " element which wasn't a Node.");
-                            continue;
-                        }
-                        dump = lasso_node_dump(LASSO_NODE(any_itr->data));
-                        if (!dump) {
-                            AM_LOG_RERROR(APLOG_MARK, APLOG_WARNING, 0, r,
-                                          "AttributeValue content dump failed.");
-                            continue;
-                        }
-                        /* Use the request pool, no need to free results */
-                        content = apr_pstrcat(r->pool, content, dump, NULL);
-                        g_free(dump);
-                }
-                /* Decode and save the attribute. */
-
-                am_diag_printf(r, "%s name=%s value=%s\n",
-                               __func__, attribute->Name, content);
-
-                ret = am_cache_env_append(session, attribute->Name, content);
-                if(ret != OK) {
-                    return ret;
-                }
-            }
-        }
+    rv = am_cache_store_assertion_id(r, assertion->ID, issued, expires);
+    if (rv == APR_EEXIST) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Assertion ID %s has already been used.",
+                      assertion->ID);
+        return HTTP_BAD_REQUEST;
+    } else if (rv != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
     }
 
     return OK;
 }
 
+
+
 /* This function validates that the received assertion verify the security level configured by
  * MellonAuthnContextClassRef directives
  */
@@ -2802,6 +2642,124 @@ static int am_handle_metadata(request_rec *r)
 }
 
 
+/* This function handles requests to the stats endpoint, which reports
+ * the session store statistics. The plain text format is returned
+ * unless the "format" query parameter is "prometheus".
+ *
+ * Parameters:
+ *  request_rec *r       The request.
+ *
+ * Returns:
+ *  OK on success, or an error on failure.
+ */
+static int am_handle_stats(request_rec *r)
+{
+    am_dir_cfg_rec *cfg = am_get_dir_cfg(r);
+    const char *format;
+    bool prometheus = false;
+
+    am_diag_printf(r, "enter function %s\n", __func__);
+
+    if (!CFG_VALUE(cfg, stats_endpoint)) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Statistics endpoint is not enabled.");
+        return HTTP_NOT_FOUND;
+    }
+
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+
+    format = am_extract_query_parameter(r->pool, r->args, "format");
+    if (format != NULL) {
+        if (strcmp(format, "prometheus") == 0) {
+            prometheus = true;
+        } else if (strcmp(format, "text") != 0) {
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "Unknown statistics format \"%s\".", format);
+            return HTTP_BAD_REQUEST;
+        }
+    }
+
+    ap_set_content_type(r, prometheus ? "text/plain; version=0.0.4"
+                                      : "text/plain");
+    apr_table_setn(r->headers_out, "Cache-Control", "no-cache, no-store");
+
+    if (am_cache_write_stats(r, prometheus) != APR_SUCCESS) {
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    return OK;
+}
+
+
+/* This function handles requests to the revoke endpoint. A POST to it
+ * invalidates every existing session, or with the "idp" parameter
+ * every session issued by that IdP. The parameter is read from the
+ * query string or a form encoded body.
+ *
+ * Parameters:
+ *  request_rec *r       The request.
+ *
+ * Returns:
+ *  OK on success, or an error on failure.
+ */
+static int am_handle_revoke(request_rec *r)
+{
+    am_dir_cfg_rec *cfg = am_get_dir_cfg(r);
+    const char *idp = NULL;
+    char *post_data;
+    apr_uint64_t generation;
+    int rc;
+
+    am_diag_printf(r, "enter function %s\n", __func__);
+
+    if (!CFG_VALUE(cfg, revoke_endpoint)) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Revoke endpoint is not enabled.");
+        return HTTP_NOT_FOUND;
+    }
+
+    if (r->method_number != M_POST) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Expected POST request for the revoke endpoint.");
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+
+    if ((rc = am_read_post_data(r, &post_data, NULL)) != OK) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, rc, r,
+                      "Error reading POST data.");
+        return rc;
+    }
+
+    idp = am_extract_query_parameter(r->pool, post_data, "idp");
+    if (idp == NULL) {
+        idp = am_extract_query_parameter(r->pool, r->args, "idp");
+    }
+    if (idp != NULL) {
+        char *decoded = apr_pstrdup(r->pool, idp);
+
+        if (am_urldecode(decoded) != OK || *decoded == '\0') {
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "Invalid idp parameter for the revoke endpoint.");
+            return HTTP_BAD_REQUEST;
+        }
+        idp = decoded;
+    }
+
+    if (am_cache_bump_generation(r, idp, &generation) != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ap_set_content_type(r, "text/plain");
+    apr_table_setn(r->headers_out, "Cache-Control", "no-cache, no-store");
+    ap_rprintf(r, "revoked %s generation %" APR_UINT64_T_FMT "\n",
+               idp ? idp : "all", generation);
+
+    return OK;
+}
+
+
 /* Use Lasso Login to set the HTTP content & headers for HTTP-Redirect binding.
  *
  * Parameters:
@@ -3695,6 +3653,10 @@ int am_handler(request_rec *r)
         return am_handle_login(r);
     } else if(!strcmp(endpoint, "probeDisco")) {
         return am_handle_probe_discovery(r);
+    } else if(!strcmp(endpoint, "stats")) {
+        return am_handle_stats(r);
+    } else if(!strcmp(endpoint, "revoke")) {
+        return am_handle_revoke(r);
     } else {
         AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
                       "Endpoint \"%s\" not handled by mod_auth_mellon.",
@@ -3769,6 +3731,11 @@ int am_auth_mellon_user(request_rec *r)
         return OK;
     }
 
+    /* Only we may set the identity header, never the client. */
+    if (dir->identity_header != NULL && *dir->identity_header) {
+        apr_table_unset(r->headers_in, dir->identity_header);
+    }
+
     /* Check that the user has enabled authentication for this directory. */
     if(dir->enable_mellon == am_enable_off
        || dir->enable_mellon == am_enable_default) {
@@ -3867,8 +3834,8 @@ int am_auth_mellon_user(request_rec *r)
             return return_code;
         }
 
-        /* Update the idle timeout to whatever is set by MellonSessionIdleTimeout. */
-        am_cache_update_idle_timeout(r, session, dir->session_idle_timeout);
+        /* Push the idle timeout forward, see MellonSessionIdleTimeout. */
+        am_session_touch(r, session);
 
         /* The user has been authenticated, and we can now populate r->user
          * and the r->subprocess_env with values from the session store.
@@ -3894,8 +3861,8 @@ int am_auth_mellon_user(request_rec *r)
             am_diag_printf(r, "%s am_enable_info, have valid session\n",
                            __func__);
 
-            /* Update the idle timeout to whatever is set by MellonSessionIdleTimeout. */
-            am_cache_update_idle_timeout(r, session, dir->session_idle_timeout);
+            /* Push the idle timeout forward, see MellonSessionIdleTimeout. */
+            am_session_touch(r, session);
 
             /* The user is authenticated and has access to the resource.
              * Now we populate the environment with information about
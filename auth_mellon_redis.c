@@ -0,0 +1,994 @@
+/*
+ *
+ *   auth_mellon_redis.c: an authentication apache module
+ *   Copyright © 2003-2007 UNINETT (http://www.uninett.no/)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "auth_mellon.h"
+
+#include "apr_atomic.h"
+#include "apr_network_io.h"
+#include "apr_reslist.h"
+#include "ap_mpm.h"
+#include "ap_provider.h"
+
+#ifdef APLOG_USE_MODULE
+APLOG_USE_MODULE(auth_mellon);
+#endif
+
+/*
+ * Mellon's Redis socache provider, "mellon_redis".
+ *
+ * Sessions are kept in a Redis server (or anything else speaking the
+ * Redis protocol, RESP) so they are shared by every httpd node of a
+ * farm and survive restarts of httpd. Entries are stored with SET and
+ * a PX expiry, Redis drops them by itself once they expire.
+ *
+ * Every child process keeps a pool of persistent connections, created
+ * in the child_init hook and sized for one connection per worker
+ * thread by default. A connection found broken is dropped from the
+ * pool, and a request failing on a connection taken from the pool is
+ * retried once on a new connection since the server may have closed
+ * an idle connection. A SET NX is only retried if none of it was
+ * written, see am_redis_pipeline().
+ *
+ * Besides the regular socache interface the provider registers an
+ * am_cache_batch_provider_t, so the entries Mellon stores or removes
+ * together are sent as one pipeline: all commands are written at once
+ * and the replies read afterwards, costing a single round trip. Its
+ * add function uses SET NX, so a replayed assertion is detected by
+ * Redis itself, also across the nodes of a farm.
+ *
+ * Arguments are a comma separated list of key=value pairs:
+ *
+ *   host=<name>      Redis server (default 127.0.0.1)
+ *   port=<port>      Redis port (default 6379)
+ *   password=<pw>    sent with AUTH on each new connection
+ *   db=<n>           database selected on each new connection (default 0)
+ *   timeout=<ms>     connect and I/O timeout (default 1000)
+ *   conns=<n>        connections per child, 0 for one per worker
+ *                    thread (default 0)
+ *   prefix=<str>     prepended to every key (default "mellon:")
+ */
+
+/*---------------------------------- Defines ---------------------------------*/
+
+#define AM_REDIS_PROVIDER_NAME "mellon_redis"
+
+#define AM_REDIS_DEFAULT_HOST "127.0.0.1"
+#define AM_REDIS_DEFAULT_PORT 6379
+#define AM_REDIS_DEFAULT_TIMEOUT 1000
+#define AM_REDIS_DEFAULT_PREFIX "mellon:"
+
+/* Replies other than bulk data must fit in the read buffer */
+#define AM_REDIS_READ_BUFFER 8192
+
+/* Idle connections are closed after this many seconds */
+#define AM_REDIS_CONN_TTL 300
+
+/*--------------------------------- typedefs ---------------------------------*/
+
+typedef struct am_redis_conn_t {
+    apr_pool_t *pool;
+    apr_socket_t *sock;
+    bool broken;          /* I/O or protocol error, don't reuse */
+    bool used;            /* has completed a request before */
+    apr_size_t rpos;      /* first unread byte in rbuf */
+    apr_size_t rlen;      /* bytes in rbuf */
+    char rbuf[AM_REDIS_READ_BUFFER];
+} am_redis_conn_t;
+
+struct ap_socache_instance_t {
+    apr_pool_t *pool;
+    server_rec *s;
+    const char *host;
+    apr_port_t port;
+    const char *password;
+    int db;
+    apr_interval_time_t timeout;
+    int n_conns;
+    const char *prefix;
+    apr_size_t prefix_len;
+    apr_sockaddr_t *addr;
+#if APR_HAS_THREADS
+    apr_reslist_t *conns;
+#else
+    am_redis_conn_t *conn;
+#endif
+    /* Per-process counters */
+    volatile apr_uint32_t commands;
+    volatile apr_uint32_t pipelines;
+    volatile apr_uint32_t connects;
+    volatile apr_uint32_t errors;
+};
+
+typedef enum {
+    AM_REDIS_GET,
+    AM_REDIS_SET,
+    AM_REDIS_SETNX,   /* SET ... NX, only if the key is absent */
+    AM_REDIS_DEL
+} am_redis_cmd_t;
+
+/*----------------------------- Internal Functions ---------------------------*/
+
+/* Append one RESP bulk string to buf, returns the new end */
+static char *
+am_redis_put_bulk(char *buf, const void *data, apr_size_t len)
+{
+    buf += sprintf(buf, "$%" APR_SIZE_T_FMT "\r\n", len);
+    memcpy(buf, data, len);
+    buf += len;
+    *buf++ = '\r';
+    *buf++ = '\n';
+    return buf;
+}
+
+/* Bytes needed by am_redis_put_bulk() */
+static apr_size_t
+am_redis_bulk_size(apr_size_t len)
+{
+    return len + 1 + 20 + 2 + 2;
+}
+
+/* Write buf, sent (if not NULL) counts the bytes written even on error */
+static apr_status_t
+am_redis_send(am_redis_conn_t *conn, const char *buf, apr_size_t len,
+              apr_size_t *sent)
+{
+    apr_status_t rv;
+
+    while (len > 0) {
+        apr_size_t n = len;
+
+        rv = apr_socket_send(conn->sock, buf, &n);
+        if (sent != NULL) {
+            *sent += n;
+        }
+        if (rv != APR_SUCCESS) {
+            conn->broken = true;
+            return rv;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Check whether the server closed an idle connection
+ *
+ * Reads without waiting: nothing to read means the connection is
+ * open, an end of file, an error or unexpected data mark it broken.
+ *
+ * @returns true if the connection can't be used.
+ */
+static bool
+am_redis_conn_closed(ap_socache_instance_t *ctx, am_redis_conn_t *conn)
+{
+    char c;
+    apr_size_t n = 1;
+    apr_status_t rv;
+
+    apr_socket_timeout_set(conn->sock, 0);
+    rv = apr_socket_recv(conn->sock, &c, &n);
+    apr_socket_timeout_set(conn->sock, ctx->timeout);
+
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        return false;
+    }
+    conn->broken = true;
+    return true;
+}
+
+/* Make sure more data is in the read buffer */
+static apr_status_t
+am_redis_fill(am_redis_conn_t *conn)
+{
+    apr_size_t n;
+    apr_status_t rv;
+
+    if (conn->rpos > 0) {
+        memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen - conn->rpos);
+        conn->rlen -= conn->rpos;
+        conn->rpos = 0;
+    }
+    if (conn->rlen == sizeof(conn->rbuf)) {
+        conn->broken = true;
+        return APR_ENOSPC;
+    }
+
+    n = sizeof(conn->rbuf) - conn->rlen;
+    rv = apr_socket_recv(conn->sock, conn->rbuf + conn->rlen, &n);
+    if (rv != APR_SUCCESS && !(APR_STATUS_IS_EOF(rv) && n > 0)) {
+        conn->broken = true;
+        return APR_STATUS_IS_EOF(rv) ? APR_ECONNRESET : rv;
+    }
+    conn->rlen += n;
+
+    return APR_SUCCESS;
+}
+
+/* Read a CRLF terminated line, the line stays valid until the next read */
+static apr_status_t
+am_redis_read_line(am_redis_conn_t *conn, char **line)
+{
+    apr_status_t rv;
+    char *start, *end;
+
+    for (;;) {
+        start = conn->rbuf + conn->rpos;
+        end = memchr(start, '\n', conn->rlen - conn->rpos);
+        if (end != NULL && end > start && end[-1] == '\r') {
+            end[-1] = '\0';
+            conn->rpos = end + 1 - conn->rbuf;
+            *line = start;
+            return APR_SUCCESS;
+        }
+        if ((rv = am_redis_fill(conn)) != APR_SUCCESS) {
+            return rv;
+        }
+    }
+}
+
+/* Read len bytes into dest, or discard them if dest is NULL */
+static apr_status_t
+am_redis_read_data(am_redis_conn_t *conn, unsigned char *dest, apr_size_t len)
+{
+    apr_status_t rv;
+
+    while (len > 0) {
+        apr_size_t n = conn->rlen - conn->rpos;
+
+        if (n == 0) {
+            if ((rv = am_redis_fill(conn)) != APR_SUCCESS) {
+                return rv;
+            }
+            continue;
+        }
+        if (n > len) {
+            n = len;
+        }
+        if (dest != NULL) {
+            memcpy(dest, conn->rbuf + conn->rpos, n);
+            dest += n;
+        }
+        conn->rpos += n;
+        len -= n;
+    }
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Read the reply to one command of a pipeline
+ *
+ * GET expects a bulk string which is copied into the item buffer, SET
+ * expects a status and DEL an integer telling whether the key existed.
+ * The status of the item is set with the meaning the socache interface
+ * gives it. An error reply from the server only fails the item, an
+ * I/O or protocol error marks the connection broken.
+ *
+ * @param[in]     ctx  provider instance
+ * @param[in]     conn connection the pipeline was sent on
+ * @param[in]     cmd  command the reply belongs to
+ * @param[in,out] item the item of the command
+ *
+ * @returns APR_SUCCESS unless the connection failed.
+ */
+static apr_status_t
+am_redis_read_reply(ap_socache_instance_t *ctx, am_redis_conn_t *conn,
+                    am_redis_cmd_t cmd, am_cache_batch_item_t *item)
+{
+    apr_status_t rv;
+    apr_int64_t value;
+    char *line;
+
+    if ((rv = am_redis_read_line(conn, &line)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    if (line[0] == '-') {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ctx->s,
+                     AM_REDIS_PROVIDER_NAME ": %s failed: %s",
+                     item->what ? item->what : "command", line + 1);
+        apr_atomic_inc32(&ctx->errors);
+        item->status = APR_EGENERAL;
+        return APR_SUCCESS;
+    }
+
+    switch (cmd) {
+    case AM_REDIS_GET:
+        if (line[0] != '$') {
+            break;
+        }
+        value = apr_atoi64(line + 1);
+        if (value < 0) {
+            item->status = APR_NOTFOUND;
+            return APR_SUCCESS;
+        }
+        if ((apr_uint64_t)value > item->data_len) {
+            /* Consume the value so the connection stays usable */
+            rv = am_redis_read_data(conn, NULL, (apr_size_t)value + 2);
+            item->status = APR_ENOSPC;
+            return rv;
+        }
+        rv = am_redis_read_data(conn, item->data, (apr_size_t)value);
+        if (rv == APR_SUCCESS) {
+            rv = am_redis_read_data(conn, NULL, 2);
+        }
+        item->data_len = (unsigned int)value;
+        item->status = APR_SUCCESS;
+        return rv;
+    case AM_REDIS_SET:
+        if (line[0] != '+') {
+            break;
+        }
+        item->status = APR_SUCCESS;
+        return APR_SUCCESS;
+    case AM_REDIS_SETNX:
+        /* +OK if the key was set, a null bulk string if it exists */
+        if (line[0] == '+') {
+            item->status = APR_SUCCESS;
+            return APR_SUCCESS;
+        }
+        if (line[0] != '$' || apr_atoi64(line + 1) >= 0) {
+            break;
+        }
+        item->status = APR_EEXIST;
+        return APR_SUCCESS;
+    case AM_REDIS_DEL:
+        if (line[0] != ':') {
+            break;
+        }
+        item->status = apr_atoi64(line + 1) > 0 ? APR_SUCCESS : APR_NOTFOUND;
+        return APR_SUCCESS;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, ctx->s,
+                 AM_REDIS_PROVIDER_NAME ": unexpected reply \"%.40s\"", line);
+    conn->broken = true;
+    return APR_EGENERAL;
+}
+
+/* Send a simple command during connection setup and expect +OK */
+static apr_status_t
+am_redis_handshake(ap_socache_instance_t *ctx, am_redis_conn_t *conn,
+                   const char *name, const char *arg)
+{
+    am_cache_batch_item_t item;
+    char *buf, *p;
+    apr_status_t rv;
+
+    p = buf = apr_palloc(conn->pool,
+                         16 + am_redis_bulk_size(strlen(name))
+                         + am_redis_bulk_size(strlen(arg)));
+    p += sprintf(p, "*2\r\n");
+    p = am_redis_put_bulk(p, name, strlen(name));
+    p = am_redis_put_bulk(p, arg, strlen(arg));
+
+    if ((rv = am_redis_send(conn, buf, p - buf, NULL)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    memset(&item, 0, sizeof(item));
+    item.what = name;
+    if ((rv = am_redis_read_reply(ctx, conn, AM_REDIS_SET, &item))
+        != APR_SUCCESS) {
+        return rv;
+    }
+
+    return item.status;
+}
+
+static apr_status_t
+am_redis_connect(ap_socache_instance_t *ctx, apr_pool_t *pool,
+                 am_redis_conn_t **conn_out)
+{
+    am_redis_conn_t *conn;
+    apr_pool_t *conn_pool;
+    apr_status_t rv;
+
+    if ((rv = apr_pool_create(&conn_pool, pool)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    conn = apr_pcalloc(conn_pool, sizeof(*conn));
+    conn->pool = conn_pool;
+
+    rv = apr_socket_create(&conn->sock, ctx->addr->family, SOCK_STREAM,
+                           APR_PROTO_TCP, conn_pool);
+    if (rv == APR_SUCCESS) {
+        apr_socket_opt_set(conn->sock, APR_TCP_NODELAY, 1);
+        apr_socket_timeout_set(conn->sock, ctx->timeout);
+        rv = apr_socket_connect(conn->sock, ctx->addr);
+    }
+    if (rv == APR_SUCCESS && ctx->password != NULL) {
+        rv = am_redis_handshake(ctx, conn, "AUTH", ctx->password);
+    }
+    if (rv == APR_SUCCESS && ctx->db != 0) {
+        rv = am_redis_handshake(ctx, conn, "SELECT",
+                                apr_itoa(conn_pool, ctx->db));
+    }
+
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, ctx->s,
+                     AM_REDIS_PROVIDER_NAME ": failed to connect to %s:%d: %s",
+                     ctx->host, ctx->port,
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        apr_pool_destroy(conn_pool);
+        return rv;
+    }
+
+    apr_atomic_inc32(&ctx->connects);
+    *conn_out = conn;
+
+    return APR_SUCCESS;
+}
+
+#if APR_HAS_THREADS
+
+static apr_status_t
+am_redis_conn_construct(void **resource, void *params, apr_pool_t *pool)
+{
+    return am_redis_connect(params, pool, (am_redis_conn_t **)resource);
+}
+
+static apr_status_t
+am_redis_conn_destruct(void *resource, void *params, apr_pool_t *pool)
+{
+    am_redis_conn_t *conn = resource;
+
+    apr_socket_close(conn->sock);
+    apr_pool_destroy(conn->pool);
+
+    return APR_SUCCESS;
+}
+
+#endif
+
+static apr_status_t
+am_redis_acquire(ap_socache_instance_t *ctx, am_redis_conn_t **conn,
+                 bool *reused)
+{
+#if APR_HAS_THREADS
+    apr_status_t rv;
+
+    if (ctx->conns == NULL) {
+        return APR_EINIT;
+    }
+
+    rv = apr_reslist_acquire(ctx->conns, (void **)conn);
+    if (rv == APR_SUCCESS) {
+        *reused = (*conn)->used;
+    }
+    return rv;
+#else
+    apr_status_t rv = APR_SUCCESS;
+
+    if (ctx->conn == NULL) {
+        rv = am_redis_connect(ctx, ctx->pool, &ctx->conn);
+    }
+    *conn = ctx->conn;
+    *reused = rv == APR_SUCCESS && ctx->conn->used;
+    return rv;
+#endif
+}
+
+static void
+am_redis_release(ap_socache_instance_t *ctx, am_redis_conn_t *conn)
+{
+    conn->rpos = conn->rlen = 0;
+    conn->used = true;
+
+#if APR_HAS_THREADS
+    if (conn->broken) {
+        apr_reslist_invalidate(ctx->conns, conn);
+    } else {
+        apr_reslist_release(ctx->conns, conn);
+    }
+#else
+    if (conn->broken) {
+        apr_socket_close(conn->sock);
+        apr_pool_destroy(conn->pool);
+        ctx->conn = NULL;
+    }
+#endif
+}
+
+/**
+ * Run one command per item as a single pipeline
+ *
+ * All commands are written before any reply is read. If a connection
+ * taken from the pool fails the whole pipeline is retried once on a
+ * new connection, which is safe since GET, SET and DEL are idempotent.
+ *
+ * A SET NX is not: once any of it was written the server may have run
+ * it, and the retry would find the key it set itself and report it as
+ * present, rejecting a login as a replay. A SET NX pipeline is
+ * therefore only retried if no byte of it was written, and a pooled
+ * connection is checked for having been closed by the server before
+ * it is used for one. Should the connection fail later the pipeline
+ * fails.
+ *
+ * @param[in]     ctx     provider instance
+ * @param[in]     cmd     command to run for every item
+ * @param[in,out] items   keys (and data) of the commands
+ * @param[in]     n_items number of items
+ * @param[in]     pool    pool for temporary allocations
+ *
+ * @returns APR_SUCCESS if every reply was read, the status of every
+ *          item is set in that case.
+ */
+static apr_status_t
+am_redis_pipeline(ap_socache_instance_t *ctx, am_redis_cmd_t cmd,
+                  am_cache_batch_item_t *items, int n_items,
+                  apr_pool_t *pool)
+{
+    apr_time_t now = apr_time_now();
+    am_redis_conn_t *conn;
+    apr_size_t size = 0;
+    apr_status_t rv = APR_SUCCESS;
+    unsigned int *data_lens = NULL;
+    char *buf, *p;
+    int attempt;
+    int i;
+
+    for (i = 0; i < n_items; i++) {
+        size += 16 + am_redis_bulk_size(ctx->prefix_len + items[i].key_len);
+        if (cmd == AM_REDIS_SET || cmd == AM_REDIS_SETNX) {
+            size += am_redis_bulk_size(items[i].data_len)
+                  + 4 * am_redis_bulk_size(20);
+        } else {
+            size += am_redis_bulk_size(3);
+        }
+    }
+
+    p = buf = apr_palloc(pool, size);
+    for (i = 0; i < n_items; i++) {
+        char *key = apr_palloc(pool, ctx->prefix_len + items[i].key_len);
+
+        memcpy(key, ctx->prefix, ctx->prefix_len);
+        memcpy(key + ctx->prefix_len, items[i].key, items[i].key_len);
+
+        switch (cmd) {
+        case AM_REDIS_GET:
+            p += sprintf(p, "*2\r\n");
+            p = am_redis_put_bulk(p, "GET", 3);
+            break;
+        case AM_REDIS_SET:
+            p += sprintf(p, "*5\r\n");
+            p = am_redis_put_bulk(p, "SET", 3);
+            break;
+        case AM_REDIS_SETNX:
+            p += sprintf(p, "*6\r\n");
+            p = am_redis_put_bulk(p, "SET", 3);
+            break;
+        case AM_REDIS_DEL:
+            p += sprintf(p, "*2\r\n");
+            p = am_redis_put_bulk(p, "DEL", 3);
+            break;
+        }
+        p = am_redis_put_bulk(p, key, ctx->prefix_len + items[i].key_len);
+
+        if (cmd == AM_REDIS_SET || cmd == AM_REDIS_SETNX) {
+            apr_int64_t ttl = apr_time_as_msec(items[i].expiry - now);
+            char ttl_buf[32];
+
+            /* Redis expires the key by itself */
+            if (ttl < 1) {
+                ttl = 1;
+            }
+            p = am_redis_put_bulk(p, items[i].data, items[i].data_len);
+            p = am_redis_put_bulk(p, "PX", 2);
+            apr_snprintf(ttl_buf, sizeof(ttl_buf), "%" APR_INT64_T_FMT, ttl);
+            p = am_redis_put_bulk(p, ttl_buf, strlen(ttl_buf));
+        }
+        if (cmd == AM_REDIS_SETNX) {
+            p = am_redis_put_bulk(p, "NX", 2);
+        }
+    }
+
+    /* A GET reply overwrites data_len, a retry needs the buffer sizes */
+    if (cmd == AM_REDIS_GET) {
+        data_lens = apr_palloc(pool, n_items * sizeof(*data_lens));
+        for (i = 0; i < n_items; i++) {
+            data_lens[i] = items[i].data_len;
+        }
+    }
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        bool reused = false;
+        apr_size_t sent = 0;
+
+        if (data_lens != NULL) {
+            for (i = 0; i < n_items; i++) {
+                items[i].data_len = data_lens[i];
+            }
+        }
+
+        if ((rv = am_redis_acquire(ctx, &conn, &reused)) != APR_SUCCESS) {
+            break;
+        }
+
+        if (cmd == AM_REDIS_SETNX && reused &&
+            am_redis_conn_closed(ctx, conn)) {
+            rv = APR_ECONNRESET;
+        } else {
+            rv = am_redis_send(conn, buf, p - buf, &sent);
+        }
+        for (i = 0; rv == APR_SUCCESS && i < n_items; i++) {
+            rv = am_redis_read_reply(ctx, conn, cmd, &items[i]);
+        }
+
+        am_redis_release(ctx, conn);
+
+        if (rv == APR_SUCCESS || !reused) {
+            break;
+        }
+        /* Never run an add twice, it might have been run already */
+        if (cmd == AM_REDIS_SETNX && sent > 0) {
+            break;
+        }
+    }
+
+    apr_atomic_inc32(&ctx->pipelines);
+    apr_atomic_add32(&ctx->commands, n_items);
+
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        apr_atomic_inc32(&ctx->errors);
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, ctx->s,
+                     AM_REDIS_PROVIDER_NAME ": request to %s:%d failed: %s",
+                     ctx->host, ctx->port,
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+    }
+
+    return rv;
+}
+
+/*---------------------------- Socache Provider ------------------------------*/
+
+static const char *
+am_redis_create(ap_socache_instance_t **instance, const char *arg,
+                apr_pool_t *tmp, apr_pool_t *p)
+{
+    ap_socache_instance_t *ctx;
+    char *args, *item, *last;
+
+    ctx = apr_pcalloc(p, sizeof(*ctx));
+    ctx->pool = p;
+    ctx->host = AM_REDIS_DEFAULT_HOST;
+    ctx->port = AM_REDIS_DEFAULT_PORT;
+    ctx->timeout = apr_time_from_msec(AM_REDIS_DEFAULT_TIMEOUT);
+    ctx->prefix = AM_REDIS_DEFAULT_PREFIX;
+
+    if (arg && *arg) {
+        args = apr_pstrdup(tmp, arg);
+        for (item = apr_strtok(args, ",", &last);
+             item;
+             item = apr_strtok(NULL, ",", &last)) {
+            char *value = strchr(item, '=');
+
+            if (value == NULL) {
+                return apr_psprintf(tmp, AM_REDIS_PROVIDER_NAME
+                                    ": invalid argument \"%s\", expected"
+                                    " key=value", item);
+            }
+            *value++ = '\0';
+
+            if (strcasecmp(item, "host") == 0) {
+                ctx->host = apr_pstrdup(p, value);
+            } else if (strcasecmp(item, "port") == 0) {
+                int port = atoi(value);
+
+                if (port < 1 || port > 65535) {
+                    return apr_psprintf(tmp, AM_REDIS_PROVIDER_NAME
+                                        ": invalid port \"%s\"", value);
+                }
+                ctx->port = (apr_port_t)port;
+            } else if (strcasecmp(item, "password") == 0) {
+                ctx->password = apr_pstrdup(p, value);
+            } else if (strcasecmp(item, "db") == 0) {
+                ctx->db = atoi(value);
+            } else if (strcasecmp(item, "timeout") == 0) {
+                int timeout = atoi(value);
+
+                if (timeout < 1) {
+                    return apr_psprintf(tmp, AM_REDIS_PROVIDER_NAME
+                                        ": invalid timeout \"%s\"", value);
+                }
+                ctx->timeout = apr_time_from_msec(timeout);
+            } else if (strcasecmp(item, "conns") == 0) {
+                ctx->n_conns = atoi(value);
+                if (ctx->n_conns < 0) {
+                    return apr_psprintf(tmp, AM_REDIS_PROVIDER_NAME
+                                        ": invalid conns \"%s\"", value);
+                }
+            } else if (strcasecmp(item, "prefix") == 0) {
+                ctx->prefix = apr_pstrdup(p, value);
+            } else {
+                return apr_psprintf(tmp, AM_REDIS_PROVIDER_NAME
+                                    ": unknown argument \"%s\"", item);
+            }
+        }
+    }
+
+    ctx->prefix_len = strlen(ctx->prefix);
+
+    *instance = ctx;
+    return NULL;
+}
+
+static apr_status_t
+am_redis_init(ap_socache_instance_t *ctx, const char *cname,
+              const struct ap_socache_hints *hints,
+              server_rec *s, apr_pool_t *p)
+{
+    apr_status_t rv;
+
+    ctx->s = s;
+
+    rv = apr_sockaddr_info_get(&ctx->addr, ctx->host, APR_UNSPEC, ctx->port,
+                               0, ctx->pool);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     AM_REDIS_PROVIDER_NAME ": cannot resolve %s: %s",
+                     ctx->host, apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 AM_REDIS_PROVIDER_NAME ": using %s:%d db %d prefix \"%s\"",
+                 ctx->host, ctx->port, ctx->db, ctx->prefix);
+
+    /* Connections are only made by the children, see am_redis_child_init() */
+    return APR_SUCCESS;
+}
+
+static void
+am_redis_destroy(ap_socache_instance_t *ctx, server_rec *s)
+{
+#if !APR_HAS_THREADS
+    if (ctx->conn != NULL) {
+        apr_socket_close(ctx->conn->sock);
+        apr_pool_destroy(ctx->conn->pool);
+        ctx->conn = NULL;
+    }
+#endif
+}
+
+static apr_status_t
+am_redis_store(ap_socache_instance_t *ctx, server_rec *s,
+               const unsigned char *id, unsigned int idlen,
+               apr_time_t expiry,
+               unsigned char *data, unsigned int datalen,
+               apr_pool_t *pool)
+{
+    am_cache_batch_item_t item;
+    apr_status_t rv;
+
+    memset(&item, 0, sizeof(item));
+    item.key = id;
+    item.key_len = idlen;
+    item.expiry = expiry;
+    item.data = data;
+    item.data_len = datalen;
+
+    rv = am_redis_pipeline(ctx, AM_REDIS_SET, &item, 1, pool);
+
+    return rv != APR_SUCCESS ? rv : item.status;
+}
+
+static apr_status_t
+am_redis_retrieve(ap_socache_instance_t *ctx, server_rec *s,
+                  const unsigned char *id, unsigned int idlen,
+                  unsigned char *dest, unsigned int *destlen,
+                  apr_pool_t *pool)
+{
+    am_cache_batch_item_t item;
+    apr_status_t rv;
+
+    memset(&item, 0, sizeof(item));
+    item.key = id;
+    item.key_len = idlen;
+    item.data = dest;
+    item.data_len = *destlen;
+
+    rv = am_redis_pipeline(ctx, AM_REDIS_GET, &item, 1, pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    if (item.status == APR_SUCCESS) {
+        *destlen = item.data_len;
+    }
+    return item.status;
+}
+
+static apr_status_t
+am_redis_remove(ap_socache_instance_t *ctx, server_rec *s,
+                const unsigned char *id, unsigned int idlen,
+                apr_pool_t *pool)
+{
+    am_cache_batch_item_t item;
+    apr_status_t rv;
+
+    memset(&item, 0, sizeof(item));
+    item.key = id;
+    item.key_len = idlen;
+
+    rv = am_redis_pipeline(ctx, AM_REDIS_DEL, &item, 1, pool);
+
+    return rv != APR_SUCCESS ? rv : item.status;
+}
+
+static void
+am_redis_status(ap_socache_instance_t *ctx, request_rec *r, int flags)
+{
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "CacheServer: %s:%d\n", ctx->host, ctx->port);
+        ap_rprintf(r, "CacheConnections: %d\n", ctx->n_conns);
+        ap_rprintf(r, "CacheConnects: %u\n",
+                   apr_atomic_read32(&ctx->connects));
+        ap_rprintf(r, "CacheCommands: %u\n",
+                   apr_atomic_read32(&ctx->commands));
+        ap_rprintf(r, "CachePipelines: %u\n",
+                   apr_atomic_read32(&ctx->pipelines));
+        ap_rprintf(r, "CacheErrors: %u\n",
+                   apr_atomic_read32(&ctx->errors));
+        return;
+    }
+
+    ap_rprintf(r, "cache type: <b>" AM_REDIS_PROVIDER_NAME "</b>, "
+               "server: <b>%s:%d</b>, connections per child: <b>%d</b><br>",
+               ctx->host, ctx->port, ctx->n_conns);
+    ap_rprintf(r, "this child: connects: <b>%u</b>, commands: <b>%u</b>, "
+               "pipelines: <b>%u</b>, errors: <b>%u</b><br>",
+               apr_atomic_read32(&ctx->connects),
+               apr_atomic_read32(&ctx->commands),
+               apr_atomic_read32(&ctx->pipelines),
+               apr_atomic_read32(&ctx->errors));
+}
+
+static apr_status_t
+am_redis_iterate(ap_socache_instance_t *ctx, server_rec *s,
+                 void *userctx, ap_socache_iterator_t *iterator,
+                 apr_pool_t *pool)
+{
+    /* Walking a shared Redis keyspace is not something to do per request */
+    return APR_ENOTIMPL;
+}
+
+static const ap_socache_provider_t am_redis_provider = {
+    AM_REDIS_PROVIDER_NAME,
+    0, /* safe for concurrent use, no global mutex needed */
+    am_redis_create,
+    am_redis_init,
+    am_redis_destroy,
+    am_redis_store,
+    am_redis_retrieve,
+    am_redis_remove,
+    am_redis_status,
+    am_redis_iterate
+};
+
+/*----------------------------- Batch Provider -------------------------------*/
+
+static apr_status_t
+am_redis_batch_retrieve(ap_socache_instance_t *ctx, server_rec *s,
+                        am_cache_batch_item_t *items, int n_items,
+                        apr_pool_t *pool)
+{
+    return am_redis_pipeline(ctx, AM_REDIS_GET, items, n_items, pool);
+}
+
+static apr_status_t
+am_redis_batch_store(ap_socache_instance_t *ctx, server_rec *s,
+                     am_cache_batch_item_t *items, int n_items,
+                     apr_pool_t *pool)
+{
+    return am_redis_pipeline(ctx, AM_REDIS_SET, items, n_items, pool);
+}
+
+static apr_status_t
+am_redis_batch_remove(ap_socache_instance_t *ctx, server_rec *s,
+                      am_cache_batch_item_t *items, int n_items,
+                      apr_pool_t *pool)
+{
+    return am_redis_pipeline(ctx, AM_REDIS_DEL, items, n_items, pool);
+}
+
+static apr_status_t
+am_redis_batch_add(ap_socache_instance_t *ctx, server_rec *s,
+                   am_cache_batch_item_t *items, int n_items,
+                   apr_pool_t *pool)
+{
+    return am_redis_pipeline(ctx, AM_REDIS_SETNX, items, n_items, pool);
+}
+
+static const am_cache_batch_provider_t am_redis_batch_provider = {
+    am_redis_batch_retrieve,
+    am_redis_batch_store,
+    am_redis_batch_remove,
+    am_redis_batch_add
+};
+
+/*------------------------------ Public Functions ----------------------------*/
+
+/**
+ * Register the "mellon_redis" socache provider
+ *
+ * Registers both the socache provider and its batch interface, see
+ * am_cache_batch_provider_t.
+ *
+ * @param[in] p Pool passed to register_hooks
+ */
+void
+am_redis_register_provider(apr_pool_t *p)
+{
+    ap_register_provider(p, AP_SOCACHE_PROVIDER_GROUP, AM_REDIS_PROVIDER_NAME,
+                         AP_SOCACHE_PROVIDER_VERSION, &am_redis_provider);
+    ap_register_provider(p, AM_CACHE_BATCH_PROVIDER_GROUP,
+                         AM_REDIS_PROVIDER_NAME,
+                         AM_CACHE_BATCH_PROVIDER_VERSION,
+                         &am_redis_batch_provider);
+}
+
+/**
+ * Set up the connection pool of a child process
+ *
+ * Does nothing unless mellon_redis is the socache provider of Mellon.
+ *
+ * @param[in] p pool of the child process
+ * @param[in] s the server
+ *
+ * @returns APR_SUCCESS or an error status if the pool could not be
+ *          created.
+ */
+apr_status_t
+am_redis_child_init(apr_pool_t *p, server_rec *s)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(s);
+    ap_socache_instance_t *ctx = mod_cfg->socache_instance;
+
+    if (ctx == NULL ||
+        strcmp(mod_cfg->socache_provider_name, AM_REDIS_PROVIDER_NAME) != 0) {
+        return APR_SUCCESS;
+    }
+
+#if APR_HAS_THREADS
+    if (ctx->n_conns == 0) {
+        int threads = 1;
+
+        ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads);
+        ctx->n_conns = threads > 0 ? threads : 1;
+    }
+
+    return apr_reslist_create(&ctx->conns, 0, ctx->n_conns, ctx->n_conns,
+                              apr_time_from_sec(AM_REDIS_CONN_TTL),
+                              am_redis_conn_construct,
+                              am_redis_conn_destruct,
+                              ctx, p);
+#else
+    ctx->n_conns = 1;
+    return APR_SUCCESS;
+#endif
+}
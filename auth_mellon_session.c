@@ -32,15 +32,14 @@ APLOG_USE_MODULE(auth_mellon);
 static apr_status_t
 am_session_state_free(am_session_state_t *session);
 
+static apr_status_t
+am_session_state_pool_cleanup(void *data);
+
 /*--------------------------- XML Serialization ------------------------------*/
 
 /*
  * With XML how do you distinguish between an empty value and NULL?
  *
- * Parameters:
- *  request_rec *r       The request we received from the user.
- *  am_cache_key_t type  AM_CACHE_SESSION, AM_CACHE_NAMEID or AM_CACHE_ASSERTIONID
- *  const char *key      The session key or user
  * An empty value is a value that was initialized but contains no data
  * (e.g. for string data it would be the empty string ""). A NULL
  * value was never initialized to any value. XML uses the term nil to
@@ -779,270 +778,1515 @@ xmlDocPtr am_session_state_to_xml(request_rec *r, am_session_state_t *ss)
 
 /*----------------------- end XML Serialization ------------------------------*/
 
-apr_status_t
-am_session_store(request_rec *r, am_session_state_t *session)
+/*-------------------------- Binary Serialization ----------------------------*/
+
+/*
+ * The binary session state encoding is a flat sequence of fields in a
+ * fixed order, it is decoded in a single pass without building any
+ * intermediate document.
+ *
+ * All integers are in network byte order. A string is a 32-bit length
+ * followed by that many octets (no NUL terminator), the length
+ * AM_BINARY_NULL_STRING denotes a NULL string. A NameID is a presence
+ * octet followed, if present, by the strings content, Format,
+ * NameQualifier, SPNameQualifier and SPProvidedID.
+ *
+ *   magic          SESSION_STATE_BINARY_MAGIC
+ *   version        uint16, SESSION_STATE_BINARY_VERSION
+ *   session_id     string
+ *   lasso_name_id  NameID
+ *   issuer         NameID
+ *   expires        int64
+ *   idle_timeout   int64
+ *   generation     int64 (version 2 and later)
+ *   idp_generation int64 (version 2 and later)
+ *   logged_in      int32
+ *   user           string
+ *   cookie_token   string
+ *   env_attrs      uint32 count, then per attribute a name string,
+ *                  a uint32 value count and the value strings
+ *   identity_json  uint32 count, then per MellonIdentityHeader
+ *                  selection its key and JSON strings (version 3 and
+ *                  later)
+ *
+ * The Lasso dumps and the SAML response are only needed to log out
+ * (or when dumped into the environment) but dominate the size of the
+ * session. They are kept out of the session record above, which is
+ * read on every request, and stored in a separate logout record:
+ *
+ *   magic          SESSION_LOGOUT_STATE_BINARY_MAGIC
+ *   version        uint16, SESSION_LOGOUT_STATE_BINARY_VERSION
+ *   session_id     string
+ *   saml_response  string
+ *   lasso_identity_dump string
+ *   lasso_session_dump  string
+ */
+
+#define AM_BINARY_NULL_STRING 0xffffffffU
+
+typedef struct {
+    apr_pool_t *pool;
+    unsigned char *data;
+    apr_size_t len;
+    apr_size_t size;
+} am_binary_writer_t;
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} am_binary_reader_t;
+
+static void
+am_binary_reserve(am_binary_writer_t *w, apr_size_t n)
 {
-    apr_status_t rv;
-    xmlDocPtr doc;
-    const char *session_xml;
+    unsigned char *data;
+    apr_size_t size;
 
-    am_diag_printf(r, "%s: store session, session_id=%s, name_id=%s "
-                   "issuer=%s expiration=%s now=%s\n",
-                   __func__, session->session_id,
-                   am_lasso_name_id_string(r, session->lasso_name_id),
-                   am_lasso_name_id_string(r, session->issuer),
-                   am_time_t_to_8601(r->pool, session->expires),
-                   am_time_t_to_8601(r->pool, apr_time_now()));
+    if (w->len + n <= w->size) {
+        return;
+    }
 
-    doc = am_session_state_to_xml(r, session);
-    if (doc == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "unable to convert session state to XML document");
-        return APR_EGENERAL;
+    size = w->size ? w->size : 1024;
+    while (size < w->len + n) {
+        size *= 2;
     }
-    session_xml = am_xml_doc_to_string(r, doc, 0);
-    if (session_xml == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "unable to convert session XML document to text");
-        xmlFreeDoc(doc);
-        return APR_EGENERAL;
+
+    data = apr_palloc(w->pool, size);
+    if (w->len) {
+        memcpy(data, w->data, w->len);
     }
+    w->data = data;
+    w->size = size;
+}
 
-    rv = am_cache_store_session_entries(r,
-                                        session->session_id,
-                                        session->lasso_name_id,
-                                        session->issuer,
-                                        session->expires,
-                                        session_xml);
-    xmlFreeDoc(doc);
-    return rv;
+static void
+am_binary_put_bytes(am_binary_writer_t *w, const void *bytes, apr_size_t n)
+{
+    am_binary_reserve(w, n);
+    memcpy(w->data + w->len, bytes, n);
+    w->len += n;
 }
 
-static am_session_state_t *
-am_session_validate(request_rec *r, am_session_state_t *session)
+static void
+am_binary_put_u16(am_binary_writer_t *w, apr_uint16_t v)
 {
-    apr_time_t now = apr_time_now();
-    const char *cookie_token_target = am_cookie_token(r);
+    unsigned char b[2];
 
-    if (session == NULL) {
-        return NULL;
-    }
+    b[0] = (v >> 8) & 0xff;
+    b[1] = v & 0xff;
+    am_binary_put_bytes(w, b, sizeof(b));
+}
 
-    am_diag_log_session_state(r, 0, session, "Session State");
+static void
+am_binary_put_u32(am_binary_writer_t *w, apr_uint32_t v)
+{
+    unsigned char b[4];
 
-    if (session->expires < now) {
-        am_diag_printf(r, "session expired, deleting, expiration=%s now=%s\n",
-                                  am_time_t_to_8601(r->pool, session->expires),
-                                  am_time_t_to_8601(r->pool, now));
+    b[0] = (v >> 24) & 0xff;
+    b[1] = (v >> 16) & 0xff;
+    b[2] = (v >> 8) & 0xff;
+    b[3] = v & 0xff;
+    am_binary_put_bytes(w, b, sizeof(b));
+}
 
-        am_cache_delete_session_entries(r, session->session_id,
-                                        session->lasso_name_id,
-                                        session->issuer);
+static void
+am_binary_put_i64(am_binary_writer_t *w, apr_int64_t v)
+{
+    am_binary_put_u32(w, (apr_uint32_t)((apr_uint64_t)v >> 32));
+    am_binary_put_u32(w, (apr_uint32_t)((apr_uint64_t)v & 0xffffffffU));
+}
 
-        return NULL;
-    }
+static void
+am_binary_put_string(am_binary_writer_t *w, const char *s)
+{
+    apr_size_t n;
 
-    cookie_token_target = am_cookie_token(r);
-    if (strcmp(session->cookie_token, cookie_token_target)) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "Session cookie parameter mismatch. "
-                      "Session created with {%s}, but current "
-                      "request has {%s}.",
-                      session->cookie_token,
-                      cookie_token_target);
-        return NULL;
+    if (s == NULL) {
+        am_binary_put_u32(w, AM_BINARY_NULL_STRING);
+        return;
     }
 
-    return session;
+    n = strlen(s);
+    am_binary_put_u32(w, (apr_uint32_t)n);
+    am_binary_put_bytes(w, s, n);
 }
 
-am_session_state_t *
-am_session_get_session_by_session_id(request_rec *r, const char *session_id)
+static void
+am_binary_put_name_id(am_binary_writer_t *w, LassoSaml2NameID *name_id)
 {
-    am_session_state_t *session = NULL;
+    unsigned char present = name_id != NULL;
 
-    session = am_cache_load_session_by_session_id(r, session_id);
-    if (session == NULL) {
-        return NULL;
+    am_binary_put_bytes(w, &present, 1);
+    if (name_id == NULL) {
+        return;
     }
 
-    return am_session_validate(r, session);
+    am_binary_put_string(w, name_id->content);
+    am_binary_put_string(w, name_id->Format);
+    am_binary_put_string(w, name_id->NameQualifier);
+    am_binary_put_string(w, name_id->SPNameQualifier);
+    am_binary_put_string(w, name_id->SPProvidedID);
 }
 
-am_session_state_t *
-am_session_get_session_by_name_id(request_rec *r,
-                                  LassoSaml2NameID *name_id,
-                                  LassoSaml2NameID *issuer)
+static bool
+am_binary_get_bytes(am_binary_reader_t *rd, const unsigned char **bytes,
+                    apr_size_t n)
 {
-    am_session_state_t *session = NULL;
-
-    session = am_cache_load_session_by_name_id(r, name_id, issuer);
-    if (session == NULL) {
-        return NULL;
+    if ((apr_size_t)(rd->end - rd->p) < n) {
+        return false;
     }
-
-    return am_session_validate(r, session);
+    *bytes = rd->p;
+    rd->p += n;
+    return true;
 }
 
-/* This function gets the session associated with a user, using a cookie
- *
- * Parameters:
- *  request_rec *r       The request we received from the user.
- *
- * Returns:
- *  The session associated with the user who places the request, or
- *  NULL if we don't have a session yet.
- */
-am_session_state_t *am_get_request_session(request_rec *r)
+static bool
+am_binary_get_u16(am_binary_reader_t *rd, apr_uint16_t *v)
 {
-    const char *session_id;
+    const unsigned char *b;
 
-    /* Get session id from cookie. */
-    session_id = am_cookie_get(r);
-    if(session_id == NULL) {
-        /* Cookie is unset - we don't have a session. */
-        return NULL;
+    if (!am_binary_get_bytes(rd, &b, 2)) {
+        return false;
     }
-
-    return am_session_get_session_by_session_id(r, session_id);
+    *v = ((apr_uint16_t)b[0] << 8) | b[1];
+    return true;
 }
 
-static apr_status_t
-am_session_state_pool_cleanup(void *data)
+static bool
+am_binary_get_u32(am_binary_reader_t *rd, apr_uint32_t *v)
 {
-    am_session_state_t *session = (am_session_state_t *)data;
+    const unsigned char *b;
 
-    am_session_state_free(session);
+    if (!am_binary_get_bytes(rd, &b, 4)) {
+        return false;
+    }
+    *v = ((apr_uint32_t)b[0] << 24) | ((apr_uint32_t)b[1] << 16) |
+         ((apr_uint32_t)b[2] << 8) | b[3];
+    return true;
+}
 
-    return APR_SUCCESS;
+static bool
+am_binary_get_i64(am_binary_reader_t *rd, apr_int64_t *v)
+{
+    apr_uint32_t hi, lo;
+
+    if (!am_binary_get_u32(rd, &hi) || !am_binary_get_u32(rd, &lo)) {
+        return false;
+    }
+    *v = (apr_int64_t)(((apr_uint64_t)hi << 32) | lo);
+    return true;
 }
 
-/* This function gets the session associated with a user, using the Assertion ID
- *
- * Parameters:
- *  request_rec *r       The request we received from the user.
- *  char *assertionid    The AssertionID
- *
- * Returns:
- *  The session associated with the user who places the request, or
- *  NULL if we don't have a session yet.
- */
-am_cache_entry_t *am_get_request_session_by_assertionid(request_rec *r, char *assertionid)
+static bool
+am_binary_get_string(am_binary_reader_t *rd, apr_pool_t *pool,
+                     const char **s)
 {
-    return am_lock_and_validate(r, AM_CACHE_ASSERTIONID, assertionid);
+    apr_uint32_t n;
+    const unsigned char *b;
+
+    if (!am_binary_get_u32(rd, &n)) {
+        return false;
+    }
+    if (n == AM_BINARY_NULL_STRING) {
+        *s = NULL;
+        return true;
+    }
+    if (!am_binary_get_bytes(rd, &b, n)) {
+        return false;
+    }
+    *s = apr_pstrmemdup(pool, (const char *)b, n);
+    return true;
 }
 
-/* This function creates a new session.
- *
- * Parameters:
- *  request_rec *r       The request we are processing.
- *
- * Returns:
- *  The new session, or NULL if we have an internal error.
- */
-am_session_state_t *am_new_request_session(request_rec *r)
+static bool
+am_binary_skip_string(am_binary_reader_t *rd)
 {
-    const char *session_id;
-    am_session_state_t *session = NULL;
+    apr_uint32_t n;
+    const unsigned char *b;
 
-    /* Generate session id. */
-    session_id = am_generate_id(r);
-    if(session_id == NULL) {
-        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
-                      "Error creating session id.");
-        return NULL;
+    if (!am_binary_get_u32(rd, &n)) {
+        return false;
     }
+    return n == AM_BINARY_NULL_STRING || am_binary_get_bytes(rd, &b, n);
+}
 
-    /* Set session id. */
-    am_cookie_set(r, session_id);
+static bool
+am_binary_skip_name_id(am_binary_reader_t *rd)
+{
+    const unsigned char *present;
+    int i;
 
-    const char *cookie_token = am_cookie_token(r);
+    if (!am_binary_get_bytes(rd, &present, 1)) {
+        return false;
+    }
+    for (i = 0; *present && i < 5; i++) {
+        if (!am_binary_skip_string(rd)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    am_diag_printf(r, "%s id=%s cookie_token=\"%s\"\n",
-                   __func__, session_id, cookie_token);
+static bool
+am_binary_get_name_id(am_binary_reader_t *rd, apr_pool_t *pool,
+                      LassoSaml2NameID **name_id_out)
+{
+    const unsigned char *present;
+    const char *content, *format, *name_qualifier;
+    const char *sp_name_qualifier, *sp_provided_id;
+    LassoSaml2NameID *name_id;
 
-    session = am_session_state_new(r);
-    session->session_id = session_id;
-    session->cookie_token = cookie_token;
+    *name_id_out = NULL;
 
-    /* Set callback to free contents of the returned session object */
-    apr_pool_cleanup_register(r->pool, session, am_session_state_pool_cleanup,
-                              apr_pool_cleanup_null);
+    if (!am_binary_get_bytes(rd, &present, 1)) {
+        return false;
+    }
+    if (!*present) {
+        return true;
+    }
 
+    if (!am_binary_get_string(rd, pool, &content) ||
+        !am_binary_get_string(rd, pool, &format) ||
+        !am_binary_get_string(rd, pool, &name_qualifier) ||
+        !am_binary_get_string(rd, pool, &sp_name_qualifier) ||
+        !am_binary_get_string(rd, pool, &sp_provided_id)) {
+        return false;
+    }
 
-    return session;
+    name_id = (LassoSaml2NameID *)lasso_saml2_name_id_new();
+    if (name_id == NULL) {
+        return false;
+    }
+    lasso_assign_string(name_id->content, content);
+    lasso_assign_string(name_id->Format, format);
+    lasso_assign_string(name_id->NameQualifier, name_qualifier);
+    lasso_assign_string(name_id->SPNameQualifier, sp_name_qualifier);
+    lasso_assign_string(name_id->SPProvidedID, sp_provided_id);
+
+    *name_id_out = name_id;
+    return true;
 }
 
-
-/* This function releases the session which was returned from
- * am_get_request_session.
+/**
+ * Serialize a session state object into the binary session encoding
  *
- * Parameters:
- *  r              The request we are processing.
- *  session_var    Variable holding pointer to the session we are releasing,
- *                 it will be set to NULL upon return.
+ * @param[in]  r       Current HTTP request
+ * @param[in]  ss      session state object
+ * @param[out] len_out length of the returned buffer
  *
- * Returns:
- *  Nothing.
+ * @returns buffer allocated from the request pool holding the encoded
+ *          session state.
  */
-void
-am_release_request_session(request_rec *r, am_session_state_t **session_var)
+const char *
+am_session_state_to_binary(request_rec *r, am_session_state_t *ss,
+                           apr_size_t *len_out)
 {
-    /*
-     * Nothing to do here at the moment, the session state and it's
-     * contents will be freed when the pool it was allocated from is
-     * freed via pool clean up callbacks. We leave this (mostly) stub
-     * in place for a few reasons:
-     *
-     * - It sets the session state pointer to NULL assuring it cannot
-     *   be used again.
-     *
-     * - If any additional locking is needed this would be the
-     *   location to unlock the session state.
-     */ 
+    am_binary_writer_t w;
+    apr_hash_index_t *hi;
+    const char *attr_name;
+    apr_array_header_t *values;
+    const char *identity_key;
+    const char *identity_json;
+    int i;
 
-    *session_var = NULL;
-}
+    memset(&w, 0, sizeof(w));
+    w.pool = r->pool;
+
+    am_binary_put_bytes(&w, SESSION_STATE_BINARY_MAGIC,
+                        SESSION_STATE_BINARY_MAGIC_LEN);
+    am_binary_put_u16(&w, SESSION_STATE_BINARY_VERSION);
+
+    am_binary_put_string(&w, ss->session_id);
+    am_binary_put_name_id(&w, ss->lasso_name_id);
+    am_binary_put_name_id(&w, ss->issuer);
+    am_binary_put_i64(&w, ss->expires);
+    am_binary_put_i64(&w, ss->idle_timeout);
+    am_binary_put_i64(&w, (apr_int64_t)ss->generation);
+    am_binary_put_i64(&w, (apr_int64_t)ss->idp_generation);
+    am_binary_put_u32(&w, (apr_uint32_t)ss->logged_in);
+    am_binary_put_string(&w, ss->user);
+    am_binary_put_string(&w, ss->cookie_token);
+
+    am_binary_put_u32(&w, apr_hash_count(ss->env_attrs));
+    for (hi = apr_hash_first(r->pool, ss->env_attrs);
+         hi;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (void*)&attr_name, NULL, (void*)&values);
+
+        am_binary_put_string(&w, attr_name);
+        if (values == NULL) {
+            am_binary_put_u32(&w, 0);
+            continue;
+        }
+        am_binary_put_u32(&w, values->nelts);
+        for (i = 0; i < values->nelts; i++) {
+            am_binary_put_string(&w, APR_ARRAY_IDX(values, i, char *));
+        }
+    }
+
+    am_binary_put_u32(&w, apr_hash_count(ss->identity_json));
+    for (hi = apr_hash_first(r->pool, ss->identity_json);
+         hi;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (void*)&identity_key, NULL, (void*)&identity_json);
 
+        am_binary_put_string(&w, identity_key);
+        am_binary_put_string(&w, identity_json);
+    }
 
-/* This function releases and deletes the session which was returned from
- * am_get_request_session.
+    *len_out = w.len;
+    return (const char *)w.data;
+}
+
+/**
+ * Serialize the logout state of a session into its binary encoding
  *
- * Parameters:
- *  request_rec *r              The request we are processing.
- *  am_session_state_t *session The session we are deleting.
+ * The logout state is the SAML response and the Lasso identity and
+ * session dumps, see am_session_load_logout_state().
  *
- * Returns:
- *  Nothing.
+ * @param[in]  r       Current HTTP request
+ * @param[in]  ss      session state object
+ * @param[out] len_out length of the returned buffer
+ *
+ * @returns buffer allocated from the request pool holding the encoded
+ *          logout state.
  */
-void am_session_delete(request_rec *r, am_session_state_t *session)
+const char *
+am_session_logout_state_to_binary(request_rec *r, am_session_state_t *ss,
+                                  apr_size_t *len_out)
 {
-    am_diag_log_session_state(r, 0, session, "delete session");
+    am_binary_writer_t w;
 
-    /* Delete the cookie. */
-    am_cookie_delete(r);
+    memset(&w, 0, sizeof(w));
+    w.pool = r->pool;
 
-    if(session == NULL) {
-        return;
-    }
+    am_binary_put_bytes(&w, SESSION_LOGOUT_STATE_BINARY_MAGIC,
+                        SESSION_STATE_BINARY_MAGIC_LEN);
+    am_binary_put_u16(&w, SESSION_LOGOUT_STATE_BINARY_VERSION);
 
-    /* Delete session from the session store. */
-    am_cache_delete_session_entries(r,
-                                    session->session_id,
-                                    session->lasso_name_id,
-                                    session->issuer);
+    am_binary_put_string(&w, ss->session_id);
+    am_binary_put_string(&w, ss->saml_response);
+    am_binary_put_string(&w, ss->lasso_identity_dump);
+    am_binary_put_string(&w, ss->lasso_session_dump);
+
+    *len_out = w.len;
+    return (const char *)w.data;
 }
 
-/* This function updates the expire-timestamp of a session, if the new
- * timestamp is earlier than the previous.
+/**
+ * Is the buffer a session state in the binary session encoding?
  *
- * Parameters:
- *  request_rec *r        The request we are processing.
- *  am_session_state_t *t The current session.
- *  apr_time_t expires    The new timestamp.
+ * @param[in] data Buffer retrieved from the session store
+ * @param[in] len  Length of @data
  *
- * Returns:
- *  Nothing.
+ * @returns true if @data starts with the binary session state magic.
+ */
+bool
+am_session_state_is_binary(const char *data, apr_size_t len)
+{
+    return len >= SESSION_STATE_BINARY_MAGIC_LEN &&
+        memcmp(data, SESSION_STATE_BINARY_MAGIC,
+               SESSION_STATE_BINARY_MAGIC_LEN) == 0;
+}
+
+/**
+ * Read the expiration and idle deadline of a binary session state
+ *
+ * Only the fields preceding them are looked at, so @data may be a
+ * truncated prefix of the session state. This needs no request and is
+ * used by the session reaper, see am_cache_reaper_start().
+ *
+ * @param[in]  data             Buffer holding the encoded session state
+ * @param[in]  len              Length of @data
+ * @param[out] expires_out      expiration of the session
+ * @param[out] idle_timeout_out idle deadline stored with the session
+ *
+ * @returns true on success, false if @data is not a binary session
+ *          state of a known version or is too short.
+ */
+bool
+am_session_state_peek_times(const char *data, apr_size_t len,
+                            apr_time_t *expires_out,
+                            apr_time_t *idle_timeout_out)
+{
+    am_binary_reader_t rd;
+    const unsigned char *magic;
+    apr_uint16_t version;
+    apr_int64_t expires, idle_timeout;
+
+    rd.p = (const unsigned char *)data;
+    rd.end = rd.p + len;
+
+    if (!am_binary_get_bytes(&rd, &magic, SESSION_STATE_BINARY_MAGIC_LEN) ||
+        memcmp(magic, SESSION_STATE_BINARY_MAGIC,
+               SESSION_STATE_BINARY_MAGIC_LEN) != 0 ||
+        !am_binary_get_u16(&rd, &version) ||
+        version < 1 || version > SESSION_STATE_BINARY_VERSION) {
+        return false;
+    }
+
+    if (!am_binary_skip_string(&rd) ||
+        !am_binary_skip_name_id(&rd) ||
+        !am_binary_skip_name_id(&rd) ||
+        !am_binary_get_i64(&rd, &expires) ||
+        !am_binary_get_i64(&rd, &idle_timeout)) {
+        return false;
+    }
+
+    *expires_out = expires;
+    *idle_timeout_out = idle_timeout;
+    return true;
+}
+
+/**
+ * Deserialize the binary session encoding into a session state object.
+ *
+ * The buffer is decoded in a single pass, strings are copied into the
+ * request pool so the buffer need not outlive this call.
+ *
+ * @param[in] r    Current HTTP request
+ * @param[in] data Buffer holding the encoded session state
+ * @param[in] len  Length of @data
+ *
+ * @returns Allocated & initialized session state object, NULL if the
+ *          buffer could not be decoded.
+ */
+am_session_state_t *
+am_session_state_from_binary(request_rec *r, const char *data,
+                             apr_size_t len)
+{
+    am_session_state_t *ss = NULL;
+    am_binary_reader_t rd;
+    const unsigned char *magic;
+    apr_uint16_t version;
+    apr_int64_t generation = 0;
+    apr_int64_t idp_generation = 0;
+    apr_uint32_t logged_in;
+    apr_uint32_t n_attrs, n_values, n_identities, i, j;
+    const char *attr_name;
+    const char *attr_value;
+    apr_array_header_t *values;
+    const char *identity_key;
+    const char *identity_json;
+
+    rd.p = (const unsigned char *)data;
+    rd.end = rd.p + len;
+
+    if (!am_binary_get_bytes(&rd, &magic, SESSION_STATE_BINARY_MAGIC_LEN) ||
+        memcmp(magic, SESSION_STATE_BINARY_MAGIC,
+               SESSION_STATE_BINARY_MAGIC_LEN) != 0) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "session state is not in binary format");
+        return NULL;
+    }
+
+    if (!am_binary_get_u16(&rd, &version)) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "truncated binary session state header");
+        return NULL;
+    }
+
+    /* Version 1 lacks the generations, read as generation 0: the
+     * session was stored before any bump, which revokes it. */
+    if (version < 1 || version > SESSION_STATE_BINARY_VERSION) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Unsupported binary session state version: %u",
+                      (unsigned int)version);
+        return NULL;
+    }
+
+    if ((ss = am_session_state_new(r)) == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "failed to allocate new session state");
+        return NULL;
+    }
+
+    /* Release the Lasso objects we create with the request */
+    apr_pool_cleanup_register(r->pool, ss, am_session_state_pool_cleanup,
+                              apr_pool_cleanup_null);
+
+    if (!am_binary_get_string(&rd, r->pool, &ss->session_id) ||
+        !am_binary_get_name_id(&rd, r->pool, &ss->lasso_name_id) ||
+        !am_binary_get_name_id(&rd, r->pool, &ss->issuer) ||
+        !am_binary_get_i64(&rd, &ss->expires) ||
+        !am_binary_get_i64(&rd, &ss->idle_timeout) ||
+        (version >= 2 &&
+         (!am_binary_get_i64(&rd, &generation) ||
+          !am_binary_get_i64(&rd, &idp_generation))) ||
+        !am_binary_get_u32(&rd, &logged_in) ||
+        !am_binary_get_string(&rd, r->pool, &ss->user) ||
+        !am_binary_get_string(&rd, r->pool, &ss->cookie_token) ||
+        !am_binary_get_u32(&rd, &n_attrs)) {
+        goto fail;
+    }
+    ss->logged_in = (int)logged_in;
+    ss->generation = (apr_uint64_t)generation;
+    ss->idp_generation = (apr_uint64_t)idp_generation;
+
+    for (i = 0; i < n_attrs; i++) {
+        if (!am_binary_get_string(&rd, r->pool, &attr_name) ||
+            attr_name == NULL ||
+            !am_binary_get_u32(&rd, &n_values)) {
+            goto fail;
+        }
+
+        /* Every value needs at least its length, don't trust n_values */
+        if (n_values > (apr_size_t)(rd.end - rd.p) / 4) {
+            goto fail;
+        }
+
+        values = apr_array_make(r->pool, n_values ? n_values : 1,
+                                sizeof(char *));
+        for (j = 0; j < n_values; j++) {
+            if (!am_binary_get_string(&rd, r->pool, &attr_value)) {
+                goto fail;
+            }
+            APR_ARRAY_PUSH(values, const char *) = attr_value;
+        }
+        apr_hash_set(ss->env_attrs, attr_name, APR_HASH_KEY_STRING, values);
+    }
+
+    /* Version 2 lacks the identity JSON, it is built when needed */
+    if (version >= 3) {
+        if (!am_binary_get_u32(&rd, &n_identities)) {
+            goto fail;
+        }
+        for (i = 0; i < n_identities; i++) {
+            if (!am_binary_get_string(&rd, r->pool, &identity_key) ||
+                identity_key == NULL ||
+                !am_binary_get_string(&rd, r->pool, &identity_json) ||
+                identity_json == NULL) {
+                goto fail;
+            }
+            apr_hash_set(ss->identity_json, identity_key,
+                         APR_HASH_KEY_STRING, identity_json);
+        }
+    }
+
+    if (rd.p != rd.end) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "trailing data after binary session state");
+        return NULL;
+    }
+
+    /* The logout state lives in its own record */
+    ss->logout_state_loaded = false;
+
+    return ss;
+
+ fail:
+    AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                  "truncated or corrupt binary session state");
+    return NULL;
+}
+
+/**
+ * Decode the binary logout state into a session state object.
+ *
+ * @param[in]     r    Current HTTP request
+ * @param[in,out] ss   session state the logout state belongs to
+ * @param[in]     data Buffer holding the encoded logout state
+ * @param[in]     len  Length of @data
+ *
+ * @returns true on success, false if the buffer could not be decoded
+ *          or belongs to another session.
+ */
+static bool
+am_session_logout_state_from_binary(request_rec *r, am_session_state_t *ss,
+                                    const char *data, apr_size_t len)
+{
+    am_binary_reader_t rd;
+    const unsigned char *magic;
+    apr_uint16_t version;
+    const char *session_id;
+    const char *saml_response;
+    const char *lasso_identity_dump;
+    const char *lasso_session_dump;
+
+    rd.p = (const unsigned char *)data;
+    rd.end = rd.p + len;
+
+    if (!am_binary_get_bytes(&rd, &magic, SESSION_STATE_BINARY_MAGIC_LEN) ||
+        memcmp(magic, SESSION_LOGOUT_STATE_BINARY_MAGIC,
+               SESSION_STATE_BINARY_MAGIC_LEN) != 0 ||
+        !am_binary_get_u16(&rd, &version) ||
+        version != SESSION_LOGOUT_STATE_BINARY_VERSION) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "logout state is not in a supported binary format");
+        return false;
+    }
+
+    if (!am_binary_get_string(&rd, r->pool, &session_id) ||
+        !am_binary_get_string(&rd, r->pool, &saml_response) ||
+        !am_binary_get_string(&rd, r->pool, &lasso_identity_dump) ||
+        !am_binary_get_string(&rd, r->pool, &lasso_session_dump) ||
+        rd.p != rd.end) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "truncated or corrupt binary logout state");
+        return false;
+    }
+
+    if (session_id == NULL || ss->session_id == NULL ||
+        strcmp(session_id, ss->session_id) != 0) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "logout state belongs to session_id=%s, "
+                      "expected session_id=%s",
+                      session_id, ss->session_id);
+        return false;
+    }
+
+    ss->saml_response = saml_response;
+    ss->lasso_identity_dump = lasso_identity_dump;
+    ss->lasso_session_dump = lasso_session_dump;
+
+    return true;
+}
+
+/*---------------------- end Binary Serialization ----------------------------*/
+
+/**
+ * Carry a session in sealed cookies (MellonSessionStorage cookie)
+ *
+ * The session state, which never includes the logout state, is sealed
+ * bound to the session id and set in the session cookies.
+ *
+ * @param[in]     r       Current HTTP request
+ * @param[in,out] session session to seal
+ *
+ * @returns true if the cookies were set, false if the session is larger
+ *          than MellonSessionCookieMaxSize or could not be sealed.
+ */
+static bool
+am_session_seal(request_rec *r, am_session_state_t *session)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    const char *data;
+    apr_size_t len;
+    char *sealed;
+
+    data = am_session_state_to_binary(r, session, &len);
+    sealed = am_seal_data(r, data, len, session->session_id);
+    if (sealed == NULL) {
+        return false;
+    }
+
+    len = strlen(sealed);
+    if (len > (apr_size_t)mod_cfg->session_cookie_max_size ||
+        len > AM_SEALED_COOKIE_CHUNK_SIZE * AM_SEALED_COOKIE_MAX_CHUNKS) {
+        am_diag_printf(r, "%s: sealed session of %" APR_SIZE_T_FMT
+                       " bytes too large for cookies, session_id=%s\n",
+                       __func__, len, session->session_id);
+        return false;
+    }
+
+    am_cookie_set_sealed(r, sealed);
+    session->sealed = true;
+
+    return true;
+}
+
+/**
+ * Open the session sealed in the cookies of the request
+ *
+ * @param[in] r          Current HTTP request
+ * @param[in] session_id Session id from the session cookie
+ *
+ * @returns the session, or NULL if the request carries no sealed
+ *          session for @session_id.
+ */
+static am_session_state_t *
+am_session_unseal(request_rec *r, const char *session_id)
+{
+    am_session_state_t *session;
+    const char *sealed;
+    const char *data;
+    apr_size_t len = 0;
+
+    sealed = am_cookie_get_sealed(r);
+    if (sealed == NULL) {
+        return NULL;
+    }
+
+    data = am_unseal_data(r, sealed, session_id, &len);
+    if (data == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "Ignoring sealed session cookie which does not "
+                      "verify, session_id=%s", session_id);
+        return NULL;
+    }
+
+    session = am_session_state_from_binary(r, data, len);
+    if (session == NULL || session->session_id == NULL ||
+        strcmp(session->session_id, session_id) != 0) {
+        return NULL;
+    }
+    session->sealed = true;
+
+    am_diag_printf(r, "%s: session_id=%s from %" APR_SIZE_T_FMT
+                   " bytes of cookies\n", __func__, session_id, len);
+
+    return session;
+}
+
+/**
+ * Serialize the attributes selected by MellonIdentityHeader
+ *
+ * The result is a JSON object mapping each attribute name to the array
+ * of its values.
+ *
+ * @param[in] r     Current HTTP request
+ * @param[in] ss    session state object
+ * @param[in] names set of the selected attribute names, NULL for every
+ *                  attribute
+ *
+ * @returns JSON object allocated from the request pool
+ */
+static const char *
+am_session_identity_json_build(request_rec *r, am_session_state_t *ss,
+                               apr_hash_t *names)
+{
+    apr_hash_index_t *hi;
+    const char *attr_name;
+    apr_array_header_t *attr_values;
+    apr_array_header_t *members;
+    apr_array_header_t *quoted;
+    int i;
+
+    members = apr_array_make(r->pool, apr_hash_count(ss->env_attrs) + 1,
+                             sizeof(char *));
+    for (hi = apr_hash_first(r->pool, ss->env_attrs);
+         hi;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (void*)&attr_name, NULL, (void*)&attr_values);
+
+        if (names != NULL &&
+            apr_hash_get(names, attr_name, APR_HASH_KEY_STRING) == NULL) {
+            continue;
+        }
+
+        quoted = apr_array_make(r->pool,
+                                attr_values ? attr_values->nelts + 1 : 1,
+                                sizeof(char *));
+        for (i = 0; attr_values && i < attr_values->nelts; i++) {
+            APR_ARRAY_PUSH(quoted, char *) =
+                am_json_quote(r->pool, APR_ARRAY_IDX(attr_values, i, char *));
+        }
+        APR_ARRAY_PUSH(members, char *) =
+            apr_pstrcat(r->pool, am_json_quote(r->pool, attr_name), ":[",
+                        am_str_join(r->pool, quoted, ","), "]", NULL);
+    }
+
+    return apr_pstrcat(r->pool, "{", am_str_join(r->pool, members, ","), "}",
+                       NULL);
+}
+
+apr_status_t
+am_session_store(request_rec *r, am_session_state_t *session)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    const char *session_data = NULL;
+    apr_size_t session_data_len = 0;
+    const char *logout_data = NULL;
+    apr_size_t logout_data_len = 0;
+    apr_hash_index_t *hi;
+    const char *key;
+    am_dir_cfg_rec *selection;
+
+    am_diag_printf(r, "%s: store session, session_id=%s, name_id=%s "
+                   "issuer=%s expiration=%s now=%s\n",
+                   __func__, session->session_id,
+                   am_lasso_name_id_string(r, session->lasso_name_id),
+                   am_lasso_name_id_string(r, session->issuer),
+                   am_time_t_to_8601(r->pool, session->expires),
+                   am_time_t_to_8601(r->pool, apr_time_now()));
+
+    /*
+     * Serialize the attributes once for every MellonIdentityHeader
+     * selection of the configuration, rather than on each request.
+     */
+    if (mod_cfg->identity_header_selections != NULL) {
+        for (hi = apr_hash_first(r->pool, mod_cfg->identity_header_selections);
+             hi;
+             hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, (void*)&key, NULL, (void*)&selection);
+            apr_hash_set(session->identity_json, key, APR_HASH_KEY_STRING,
+                         am_session_identity_json_build(
+                             r, session, selection->identity_header_names));
+        }
+    }
+
+    /*
+     * A session sealed into cookies leaves only its logout and name_id
+     * records in the session store.
+     */
+    if (mod_cfg->session_storage != AM_SESSION_STORAGE_COOKIE ||
+        !am_session_seal(r, session)) {
+        if (mod_cfg->session_storage == AM_SESSION_STORAGE_COOKIE) {
+            /* Drop cookies sealed for an earlier session */
+            am_cookie_delete_sealed(r);
+        }
+        session_data = am_session_state_to_binary(r, session,
+                                                  &session_data_len);
+    }
+
+    /*
+     * Only write the logout record when we hold the logout state,
+     * otherwise the record already in the store is left untouched.
+     */
+    if (session->logout_state_loaded) {
+        logout_data = am_session_logout_state_to_binary(r, session,
+                                                        &logout_data_len);
+    }
+
+    return am_cache_store_session_entries(r,
+                                          session->session_id,
+                                          session->lasso_name_id,
+                                          session->issuer,
+                                          session->expires,
+                                          session_data,
+                                          session_data_len,
+                                          logout_data,
+                                          logout_data_len);
+}
+
+/**
+ * Make sure the logout state of a session is available
+ *
+ * Sessions loaded from the session store carry only what is needed to
+ * authorize a request. The SAML response and the Lasso identity and
+ * session dumps are kept in a separate record which is only fetched
+ * here, by the paths which actually need them (logout and the
+ * MellonSessionDump/MellonSamlResponseDump exports).
+ *
+ * A session without a logout record is not an error, it simply has no
+ * logout state (e.g. the record expired or was never written).
+ *
+ * @param[in]     r       Current HTTP request
+ * @param[in,out] session session whose logout state is loaded
+ *
+ * @returns APR_SUCCESS if the logout state is available, an error
+ *          status if the logout record could not be decoded.
+ */
+apr_status_t
+am_session_load_logout_state(request_rec *r, am_session_state_t *session)
+{
+    const char *logout_data;
+    apr_size_t logout_data_len = 0;
+
+    if (session->logout_state_loaded) {
+        return APR_SUCCESS;
+    }
+
+    am_diag_printf(r, "%s: load logout state, session_id=%s\n",
+                   __func__, session->session_id);
+
+    logout_data = am_cache_load_session_logout_data(r, session->session_id,
+                                                    &logout_data_len);
+    if (logout_data != NULL &&
+        !am_session_logout_state_from_binary(r, session, logout_data,
+                                             logout_data_len)) {
+        return APR_EGENERAL;
+    }
+
+    session->logout_state_loaded = true;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Point in time after which the idle deadline of a session is pushed
+ * forward. The deadline is only moved once MellonSessionIdleTimeoutRefresh
+ * percent of the idle window has elapsed since it was last set, so a
+ * session used continuously is written at most a few times per window.
+ */
+static apr_time_t
+am_session_idle_refresh_time(request_rec *r, apr_time_t idle_timeout,
+                             int session_idle_timeout)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    apr_interval_time_t window = apr_time_from_sec(session_idle_timeout);
+
+    return idle_timeout - window
+        + window / 100 * mod_cfg->session_idle_refresh;
+}
+
+/**
+ * Check whether a session has been idle for too long
+ *
+ * The idle deadline stored with the session is only the one set when
+ * the session was last stored, later refreshes are kept in the touch
+ * record of the session. The last deadline this process saw is taken
+ * first, the touch record is consulted only when that deadline has
+ * passed or is due for a refresh, in which case the newer deadline is
+ * merged into the session.
+ *
+ * @param[in]     r       Current HTTP request
+ * @param[in,out] session session being validated
+ * @param[in]     now     current time
+ *
+ * @returns true if the session has exceeded its idle timeout.
+ */
+static bool
+am_session_idle_expired(request_rec *r, am_session_state_t *session,
+                        apr_time_t now)
+{
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    apr_time_t idle_timeout;
+    bool fetch;
+
+    /* A deadline this process read or wrote since the session was
+     * stored saves reading the touch record on every request. */
+    if (!session->sealed &&
+        am_cache_get_session_touch(r, session->session_id, &idle_timeout) &&
+        idle_timeout > session->idle_timeout) {
+        session->idle_timeout = idle_timeout;
+    }
+
+    if (session->idle_timeout == 0) {
+        /* Created without an idle timeout, but it may have been touched
+         * from a location which has one. */
+        fetch = dir_cfg->session_idle_timeout >= 0;
+    } else if (session->idle_timeout < now) {
+        fetch = true;
+    } else if (dir_cfg->session_idle_timeout >= 0) {
+        fetch = now >= am_session_idle_refresh_time(r, session->idle_timeout,
+                                                    dir_cfg->session_idle_timeout);
+    } else {
+        fetch = false;
+    }
+
+    /* A sealed session carries its idle deadline, it has no touch record */
+    if (fetch && !session->sealed &&
+        am_cache_load_session_touch(r, session->session_id,
+                                    &idle_timeout) == APR_SUCCESS &&
+        idle_timeout > session->idle_timeout) {
+        session->idle_timeout = idle_timeout;
+    }
+
+    return session->idle_timeout != 0 && session->idle_timeout < now;
+}
+
+/**
+ * Record activity on a session for MellonSessionIdleTimeout
+ *
+ * Rather than storing the whole session again on every request, the
+ * new idle deadline is written to the small touch record of the
+ * session, and only once enough of the idle window has elapsed for
+ * the write to matter. See am_session_idle_refresh_time().
+ *
+ * @param[in]     r       Current HTTP request
+ * @param[in,out] session session being accessed
+ */
+void
+am_session_touch(request_rec *r, am_session_state_t *session)
+{
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    apr_time_t now = apr_time_now();
+    apr_time_t idle_timeout;
+
+    if (dir_cfg->session_idle_timeout < 0) {
+        return;
+    }
+
+    if (session->idle_timeout != 0 &&
+        now < am_session_idle_refresh_time(r, session->idle_timeout,
+                                           dir_cfg->session_idle_timeout)) {
+        return;
+    }
+
+    idle_timeout = now + apr_time_from_sec(dir_cfg->session_idle_timeout);
+
+    am_diag_printf(r, "%s: session_id=%s idle_timeout=%s\n",
+                   __func__, session->session_id,
+                   am_time_t_to_8601(r->pool, idle_timeout));
+
+    if (session->sealed) {
+        /* Seal the new deadline into the cookies, the store is not
+         * involved. */
+        apr_time_t old_idle_timeout = session->idle_timeout;
+
+        session->idle_timeout = idle_timeout;
+        if (!am_session_seal(r, session)) {
+            session->idle_timeout = old_idle_timeout;
+        }
+        return;
+    }
+
+    if (am_cache_store_session_touch(r, session->session_id,
+                                     session->expires,
+                                     idle_timeout) == APR_SUCCESS) {
+        session->idle_timeout = idle_timeout;
+    }
+}
+
+/* Entity ID of the IdP which issued a session, NULL if unknown */
+static const char *
+am_session_idp(am_session_state_t *session)
+{
+    if (session->issuer == NULL || session->issuer->content == NULL) {
+        return NULL;
+    }
+    return session->issuer->content;
+}
+
+/**
+ * Check whether a session was revoked by a newer generation
+ *
+ * See am_cache_bump_generation().
+ *
+ * @param[in]  r       Current HTTP request
+ * @param[in]  session session being validated
+ * @param[out] revoked set if a generation was bumped since the session
+ *                     was created
+ *
+ * @returns APR_SUCCESS or an error status if the current generations
+ *          could not be read.
+ */
+static apr_status_t
+am_session_check_generations(request_rec *r, am_session_state_t *session,
+                             bool *revoked)
+{
+    apr_uint64_t generation, idp_generation;
+    apr_status_t rv;
+
+    rv = am_cache_load_generations(r, am_session_idp(session),
+                                   &generation, &idp_generation);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    /* Generations only grow, and only with a bump */
+    *revoked = generation > session->generation ||
+               idp_generation > session->idp_generation;
+
+    if (*revoked) {
+        am_diag_printf(r, "%s: session generation %" APR_UINT64_T_FMT
+                       "/%" APR_UINT64_T_FMT " current %" APR_UINT64_T_FMT
+                       "/%" APR_UINT64_T_FMT "\n", __func__,
+                       session->generation, session->idp_generation,
+                       generation, idp_generation);
+    }
+
+    return APR_SUCCESS;
+}
+
+static am_session_state_t *
+am_session_validate(request_rec *r, am_session_state_t *session)
+{
+    apr_time_t now = apr_time_now();
+    const char *cookie_token_target = am_cookie_token(r);
+    bool revoked = false;
+
+    if (session == NULL) {
+        return NULL;
+    }
+
+    am_diag_log_session_state(r, 0, session, "Session State");
+
+    /* With the session reaper sweeping the store, expired entries are
+     * left for it to remove and the request does not pay for the
+     * deletes. */
+    if (session->expires < now) {
+        am_diag_printf(r, "session expired, deleting, expiration=%s now=%s\n",
+                                  am_time_t_to_8601(r->pool, session->expires),
+                                  am_time_t_to_8601(r->pool, now));
+
+        if (!am_cache_reaper_active(r->server)) {
+            am_cache_delete_session_entries(r, session->session_id,
+                                            session->lasso_name_id,
+                                            session->issuer);
+        }
+
+        return NULL;
+    }
+
+    if (am_session_idle_expired(r, session, now)) {
+        am_diag_printf(r, "session idle timeout, deleting, idle_timeout=%s "
+                       "now=%s\n",
+                       am_time_t_to_8601(r->pool, session->idle_timeout),
+                       am_time_t_to_8601(r->pool, now));
+
+        if (!am_cache_reaper_active(r->server)) {
+            am_cache_delete_session_entries(r, session->session_id,
+                                            session->lasso_name_id,
+                                            session->issuer);
+        }
+
+        return NULL;
+    }
+
+    if (am_session_check_generations(r, session, &revoked) != APR_SUCCESS) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Could not check whether session %s was revoked.",
+                      session->session_id);
+        return NULL;
+    }
+    if (revoked) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_INFO, 0, r,
+                      "Session %s was revoked, deleting.",
+                      session->session_id);
+
+        am_cache_delete_session_entries(r, session->session_id,
+                                        session->lasso_name_id,
+                                        session->issuer);
+
+        return NULL;
+    }
+
+    cookie_token_target = am_cookie_token(r);
+    if (strcmp(session->cookie_token, cookie_token_target)) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Session cookie parameter mismatch. "
+                      "Session created with {%s}, but current "
+                      "request has {%s}.",
+                      session->cookie_token,
+                      cookie_token_target);
+        return NULL;
+    }
+
+    return session;
+}
+
+/* Validate a session opened from its sealed cookies. A sealed session
+ * deleted by a logout is still carried by the cookies of the client,
+ * the revocation record written by am_session_delete() rejects it. */
+static am_session_state_t *
+am_session_validate_sealed(request_rec *r, am_session_state_t *session)
+{
+    bool revoked = false;
+
+    if (am_cache_sealed_session_revoked(r, session->session_id,
+                                        &revoked) != APR_SUCCESS) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Could not check whether sealed session %s was "
+                      "deleted.", session->session_id);
+        return NULL;
+    }
+    if (revoked) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_INFO, 0, r,
+                      "Sealed session %s was deleted, ignoring its "
+                      "cookies.", session->session_id);
+        am_cookie_delete_sealed(r);
+        return NULL;
+    }
+
+    return am_session_validate(r, session);
+}
+
+am_session_state_t *
+am_session_get_session_by_session_id(request_rec *r, const char *session_id)
+{
+    am_session_state_t *session = NULL;
+
+    /* Reject forged and garbage ids without touching the store. */
+    if (!am_session_id_valid(r, session_id)) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "Ignoring invalid session id in cookie.");
+        return NULL;
+    }
+
+    if (am_get_mod_cfg(r->server)->session_storage ==
+        AM_SESSION_STORAGE_COOKIE) {
+        session = am_session_unseal(r, session_id);
+        if (session != NULL) {
+            return am_session_validate_sealed(r, session);
+        }
+    }
+
+    session = am_cache_load_session_by_session_id(r, session_id);
+    if (session == NULL) {
+        return NULL;
+    }
+
+    return am_session_validate(r, session);
+}
+
+am_session_state_t *
+am_session_get_session_by_name_id(request_rec *r,
+                                  LassoSaml2NameID *name_id,
+                                  LassoSaml2NameID *issuer)
+{
+    am_session_state_t *session = NULL;
+
+    session = am_cache_load_session_by_name_id(r, name_id, issuer);
+    if (session == NULL) {
+        return NULL;
+    }
+
+    return am_session_validate(r, session);
+}
+
+/* This function looks for a session loaded by the request this request
+ * was internally redirected from, or by its main request if this is a
+ * subrequest. The cookie name, domain and path can differ between
+ * locations, so the session is only reused if the cookie of this request
+ * names it, and is validated again against the configuration of this
+ * request. Subrequests never see the session cookie and use the session
+ * of their main request.
+ *
+ * Parameters:
+ *  request_rec *r         The request we received from the user.
+ *  const char *session_id The session id from the cookie, or NULL.
+ *
+ * Returns:
+ *  The session, or NULL if no earlier request loaded it.
+ */
+static am_session_state_t *am_get_parent_request_session(request_rec *r,
+                                                         const char *session_id)
+{
+    request_rec *q;
+    am_req_cfg_rec *q_cfg;
+
+    for (q = r->prev ? r->prev : r->main; q; q = q->prev ? q->prev : q->main) {
+        q_cfg = am_get_req_cfg(q);
+        if (q_cfg == NULL || !q_cfg->session_loaded) {
+            continue;
+        }
+        if (q_cfg->session == NULL) {
+            continue;
+        }
+
+        if (session_id == NULL ? r->main == NULL :
+            strcmp(q_cfg->session->session_id, session_id) != 0) {
+            continue;
+        }
+
+        am_diag_printf(r, "%s reusing session %s of an earlier request\n",
+                       __func__, q_cfg->session->session_id);
+        return am_session_validate(r, q_cfg->session);
+    }
+
+    return NULL;
+}
+
+/* This function gets the session associated with a user, using a cookie.
+ * The session is fetched and decoded once per client request: the result
+ * is remembered for the other hooks of the request, and is reused by
+ * internal redirects and subrequests.
+ *
+ * Parameters:
+ *  request_rec *r       The request we received from the user.
+ *
+ * Returns:
+ *  The session associated with the user who places the request, or
+ *  NULL if we don't have a session yet.
+ */
+am_session_state_t *am_get_request_session(request_rec *r)
+{
+    am_req_cfg_rec *req_cfg = am_get_req_cfg(r);
+    const char *session_id;
+    am_session_state_t *session;
+
+    if (req_cfg->session_loaded) {
+        return req_cfg->session;
+    }
+
+    /* Get session id from cookie. */
+    session_id = am_cookie_get(r);
+
+    session = am_get_parent_request_session(r, session_id);
+    if (session == NULL && session_id != NULL) {
+        session = am_session_get_session_by_session_id(r, session_id);
+    }
+
+    req_cfg->session = session;
+    req_cfg->session_loaded = true;
+
+    return session;
+}
+
+static apr_status_t
+am_session_state_pool_cleanup(void *data)
+{
+    am_session_state_t *session = (am_session_state_t *)data;
+
+    am_session_state_free(session);
+
+    return APR_SUCCESS;
+}
+
+/* This function creates a new session.
+ *
+ * Parameters:
+ *  request_rec *r       The request we are processing.
+ *
+ * Returns:
+ *  The new session, or NULL if we have an internal error.
+ */
+am_session_state_t *am_new_request_session(request_rec *r)
+{
+    am_req_cfg_rec *req_cfg;
+    const char *session_id;
+    am_session_state_t *session = NULL;
+
+    /* Generate session id. */
+    session_id = am_generate_session_id(r);
+    if(session_id == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Error creating session id.");
+        return NULL;
+    }
+
+    /* Set session id. */
+    am_cookie_set(r, session_id);
+
+    const char *cookie_token = am_cookie_token(r);
+
+    am_diag_printf(r, "%s id=%s cookie_token=\"%s\"\n",
+                   __func__, session_id, cookie_token);
+
+    session = am_session_state_new(r);
+    session->session_id = session_id;
+    session->cookie_token = cookie_token;
+
+    /* Set callback to free contents of the returned session object */
+    apr_pool_cleanup_register(r->pool, session, am_session_state_pool_cleanup,
+                              apr_pool_cleanup_null);
+
+    req_cfg = am_get_req_cfg(r);
+    req_cfg->session = session;
+    req_cfg->session_loaded = true;
+
+    return session;
+}
+
+
+/* This function releases the session which was returned from
+ * am_get_request_session.
+ *
+ * Parameters:
+ *  r              The request we are processing.
+ *  session_var    Variable holding pointer to the session we are releasing,
+ *                 it will be set to NULL upon return.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void
+am_release_request_session(request_rec *r, am_session_state_t **session_var)
+{
+    /*
+     * Nothing to do here at the moment, the session state and it's
+     * contents will be freed when the pool it was allocated from is
+     * freed via pool clean up callbacks. We leave this (mostly) stub
+     * in place for a few reasons:
+     *
+     * - It sets the session state pointer to NULL assuring it cannot
+     *   be used again.
+     *
+     * - If any additional locking is needed this would be the
+     *   location to unlock the session state.
+     */ 
+
+    *session_var = NULL;
+}
+
+
+/* This function releases and deletes the session which was returned from
+ * am_get_request_session.
+ *
+ * Parameters:
+ *  request_rec *r              The request we are processing.
+ *  am_session_state_t *session The session we are deleting.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_session_delete(request_rec *r, am_session_state_t *session)
+{
+    am_req_cfg_rec *req_cfg = am_get_req_cfg(r);
+    request_rec *q;
+    am_req_cfg_rec *q_cfg;
+
+    am_diag_log_session_state(r, 0, session, "delete session");
+
+    /* Neither later hooks of this request nor the requests it is
+     * redirected to may find the session again. */
+    req_cfg->session = NULL;
+    req_cfg->session_loaded = true;
+    for (q = r->prev ? r->prev : r->main; q; q = q->prev ? q->prev : q->main) {
+        q_cfg = am_get_req_cfg(q);
+        if (q_cfg != NULL && session != NULL && q_cfg->session == session) {
+            q_cfg->session = NULL;
+        }
+    }
+
+    /* Delete the cookie. */
+    am_cookie_delete(r);
+    am_cookie_delete_sealed(r);
+
+    if(session == NULL) {
+        return;
+    }
+
+    /* Delete session from the session store. */
+    am_cache_delete_session_entries(r,
+                                    session->session_id,
+                                    session->lasso_name_id,
+                                    session->issuer);
+
+    /* The sealed cookies may be presented again, reject them from now.
+     * This comes last, the revocation record stored by the delete only
+     * lasts MellonSessionCacheTTL. */
+    if (session->sealed) {
+        am_cache_revoke_sealed_session(r, session->session_id,
+                                       session->expires);
+    }
+}
+
+/**
+ * Delete a sealed session known only by its name id
+ *
+ * A logout request of the IdP finds the session by its name id, which
+ * fails for a session sealed into cookies (MellonSessionStorage
+ * cookie): only its name id and logout records are in the store. The
+ * session is revoked and these records are deleted.
+ *
+ * @param[in] r       Current HTTP request
+ * @param[in] name_id Name id of the session
+ * @param[in] issuer  Issuer of the name id, may be NULL
+ */
+void
+am_session_revoke_sealed_by_name_id(request_rec *r,
+                                    LassoSaml2NameID *name_id,
+                                    LassoSaml2NameID *issuer)
+{
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    const char *session_id;
+    apr_time_t expires;
+
+    if (am_get_mod_cfg(r->server)->session_storage !=
+        AM_SESSION_STORAGE_COOKIE) {
+        return;
+    }
+
+    session_id = am_cache_load_session_id_by_name_id(r, name_id, issuer);
+    if (session_id == NULL) {
+        return;
+    }
+
+    /* The session can't outlive MellonSessionLength */
+    if (dir_cfg->session_length == -1) {
+        expires = apr_time_now() + apr_time_make(86400, 0);
+    } else {
+        expires = apr_time_now() + apr_time_make(dir_cfg->session_length, 0);
+    }
+
+    /* Revoke last, see am_session_delete() */
+    am_cache_delete_session_entries(r, session_id, name_id, issuer);
+    am_cache_revoke_sealed_session(r, session_id, expires);
+}
+
+/* This function updates the expire-timestamp of a session, if the new
+ * timestamp is earlier than the previous.
+ *
+ * Parameters:
+ *  request_rec *r        The request we are processing.
+ *  am_session_state_t *t The current session.
+ *  apr_time_t expires    The new timestamp.
+ *
+ * Returns:
+ *  Nothing.
  */
 void
 am_session_update_expires(request_rec *r, am_session_state_t *session,
@@ -1115,8 +2359,80 @@ am_session_set_expriation_from_assertion(request_rec *r,
     }
 }
 
+/* This function collects the names of the attributes kept by
+ * "MellonAttributeFilter auto": those which any section of the server
+ * configuration refers to, see am_attribute_filter_init(), and those
+ * which the configuration of the current request refers to. MellonUser
+ * is also checked by am_attribute_wanted().
+ *
+ * Parameters:
+ *  request_rec *r       The current request.
+ *
+ * Returns:
+ *  A set of attribute names.
+ */
+static apr_hash_t *am_attribute_filter_auto_names(request_rec *r)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    apr_hash_t *names;
+
+    if (mod_cfg->attribute_filter_auto_names != NULL) {
+        names = apr_hash_copy(r->pool, mod_cfg->attribute_filter_auto_names);
+    } else {
+        names = apr_hash_make(r->pool);
+    }
+
+    /* Already in the set, unless the endpoint is configured in a
+     * .htaccess file */
+    if (!dir_cfg->attribute_names_known) {
+        am_attribute_filter_add_names(r->pool, dir_cfg, names);
+    }
+
+    return names;
+}
+
+/* This function checks whether an attribute from an assertion is stored
+ * in the session, according to MellonAttributeFilter.
+ *
+ * Parameters:
+ *  request_rec *r          The current request.
+ *  apr_hash_t *auto_names  The names from am_attribute_filter_auto_names()
+ *                          with "MellonAttributeFilter auto", else NULL.
+ *  const char *name        The name of the attribute.
+ *
+ * Returns:
+ *  true if the attribute is stored, false if it is dropped.
+ */
+static bool am_attribute_wanted(request_rec *r, apr_hash_t *auto_names,
+                                const char *name)
+{
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+
+    switch (dir_cfg->attribute_filter) {
+    case AM_ATTRIBUTE_FILTER_ALLOW:
+        return apr_hash_get(dir_cfg->attribute_filter_names, name,
+                            APR_HASH_KEY_STRING) != NULL;
+    case AM_ATTRIBUTE_FILTER_DENY:
+        return apr_hash_get(dir_cfg->attribute_filter_names, name,
+                            APR_HASH_KEY_STRING) == NULL;
+    case AM_ATTRIBUTE_FILTER_AUTO:
+        /* MellonUser is matched without regard to case, and also against
+         * the name given by MellonSetEnv, see am_session_export_env(). */
+        if (strcasecmp(name, dir_cfg->userattr) == 0 ||
+            strcasecmp(am_mapped_env_attr_name(r, name, NULL),
+                       dir_cfg->userattr) == 0) {
+            return true;
+        }
+        return apr_hash_get(auto_names, name, APR_HASH_KEY_STRING) != NULL;
+    default:
+        return true;
+    }
+}
+
 /* Add all the attributes from an assertion to the session data for the
- * current user.
+ * current user. Attributes left out by MellonAttributeFilter are
+ * skipped.
  *
  * Parameters:
  *  am_session_state_t *s           The current session.
@@ -1146,9 +2462,14 @@ am_session_add_attributes_from_assertion(am_session_state_t *session,
     GList *any_itr;
     char *content;
     char *dump;
+    apr_hash_t *auto_names = NULL;
 
     dir_cfg = am_get_dir_cfg(r);
 
+    if (dir_cfg->attribute_filter == AM_ATTRIBUTE_FILTER_AUTO) {
+        auto_names = am_attribute_filter_auto_names(r);
+    }
+
     /* Set expires to whatever is set by MellonSessionLength. */
     if(dir_cfg->session_length == -1) {
         /* -1 means "use default. The current default is 86400 seconds. */
@@ -1159,6 +2480,12 @@ am_session_add_attributes_from_assertion(am_session_state_t *session,
                                   + apr_time_make(dir_cfg->session_length, 0));
     }
 
+    /* Set the idle timeout to whatever is set by MellonSessionIdleTimeout. */
+    if (dir_cfg->session_idle_timeout >= 0) {
+        session->idle_timeout = apr_time_now()
+            + apr_time_from_sec(dir_cfg->session_idle_timeout);
+    }
+
     /* Save session information. */
     lasso_assign_gobject(session->lasso_name_id, name_id);
     if (!am_session_set_env_attr_value(r, session, "NAME_ID",
@@ -1167,6 +2494,15 @@ am_session_add_attributes_from_assertion(am_session_state_t *session,
     }
     lasso_assign_gobject(session->issuer, issuer);
 
+    /* Record the generations the session is created under. */
+    if (am_cache_load_generations(r, am_session_idp(session),
+                                  &session->generation,
+                                  &session->idp_generation) != APR_SUCCESS) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Could not read the session generations.");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
     /* Update expires timestamp of session. */
     am_session_set_expriation_from_assertion(r, session, assertion);
 
@@ -1202,6 +2538,13 @@ am_session_add_attributes_from_assertion(am_session_state_t *session,
                 continue;
             }
 
+            if (!am_attribute_wanted(r, auto_names, attribute->Name)) {
+                am_diag_printf(r, "%s name=%s not stored, filtered out by"
+                               " MellonAttributeFilter\n",
+                               __func__, attribute->Name);
+                continue;
+            }
+
             /* attribute->AttributeValue is a list of
              * LassoSaml2AttributeValue objects.
              */
@@ -1295,9 +2638,102 @@ am_session_state_new(request_rec *r)
                       "unable to create env_attrs table");
         return NULL;
     }
+    if ((ss->identity_json = apr_hash_make(ss->pool)) == NULL) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "unable to create identity_json table");
+        return NULL;
+    }
 
     ss->expires = MAX_APR_TIME_T; /* Far far into the future. */
 
+    /* A new session state holds all of its state, nothing to load */
+    ss->logout_state_loaded = true;
+
+    return ss;
+}
+
+/**
+ * Make a deep copy of a session state
+ *
+ * Every string and every environment attribute of @src is duplicated
+ * into @pool, the Lasso objects are shared by taking an additional
+ * reference on them. The copy is therefore completely independent of
+ * the lifetime of @src, which allows session state to be handed out
+ * of (and into) the per-process session cache.
+ *
+ * @param[in] pool Pool the copy is allocated from
+ * @param[in] src  Session state to copy
+ *
+ * @returns the copied session state, NULL on allocation failure.
+ */
+am_session_state_t *
+am_session_state_copy(apr_pool_t *pool, const am_session_state_t *src)
+{
+    am_session_state_t *ss;
+    apr_hash_index_t *hi;
+    const char *attr_name;
+    apr_array_header_t *src_values;
+    apr_array_header_t *values;
+    const char *identity_key;
+    const char *identity_json;
+    int i;
+
+    if ((ss = apr_pcalloc(pool, sizeof(am_session_state_t))) == NULL) {
+        return NULL;
+    }
+
+    ss->pool = pool;
+    if ((ss->env_attrs = apr_hash_make(pool)) == NULL ||
+        (ss->identity_json = apr_hash_make(pool)) == NULL) {
+        return NULL;
+    }
+
+    ss->session_id = apr_pstrdup(pool, src->session_id);
+    lasso_assign_gobject(ss->lasso_name_id, src->lasso_name_id);
+    lasso_assign_gobject(ss->issuer, src->issuer);
+    ss->expires = src->expires;
+    ss->idle_timeout = src->idle_timeout;
+    ss->generation = src->generation;
+    ss->idp_generation = src->idp_generation;
+    ss->logged_in = src->logged_in;
+    ss->user = apr_pstrdup(pool, src->user);
+    ss->cookie_token = apr_pstrdup(pool, src->cookie_token);
+    ss->logout_state_loaded = src->logout_state_loaded;
+    ss->sealed = src->sealed;
+    ss->lasso_identity_dump = apr_pstrdup(pool, src->lasso_identity_dump);
+    ss->lasso_session_dump = apr_pstrdup(pool, src->lasso_session_dump);
+    ss->saml_response = apr_pstrdup(pool, src->saml_response);
+
+    for (hi = apr_hash_first(pool, src->env_attrs);
+         hi;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (void*)&attr_name, NULL, (void*)&src_values);
+
+        values = apr_array_make(pool, src_values ? src_values->nelts : 1,
+                                sizeof(char *));
+        if (src_values) {
+            for (i = 0; i < src_values->nelts; i++) {
+                APR_ARRAY_PUSH(values, char *) =
+                    apr_pstrdup(pool, APR_ARRAY_IDX(src_values, i, char *));
+            }
+        }
+        apr_hash_set(ss->env_attrs, apr_pstrdup(pool, attr_name),
+                     APR_HASH_KEY_STRING, values);
+    }
+
+    for (hi = apr_hash_first(pool, src->identity_json);
+         hi;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (void*)&identity_key, NULL, (void*)&identity_json);
+
+        apr_hash_set(ss->identity_json, apr_pstrdup(pool, identity_key),
+                     APR_HASH_KEY_STRING, apr_pstrdup(pool, identity_json));
+    }
+
+    /* Drop our references on the Lasso objects with the pool */
+    apr_pool_cleanup_register(pool, ss, am_session_state_pool_cleanup,
+                              apr_pool_cleanup_null);
+
     return ss;
 }
 
@@ -1501,6 +2937,40 @@ am_session_get_first_env_attr_value(request_rec *r, am_session_state_t *ss,
 }
 
 
+/**
+ * Look up the attributes selected by MellonIdentityHeader, serialized
+ *
+ * The JSON of every selection in the server configuration is stored
+ * with the session when it is created, see am_session_store(). Only a
+ * selection made in an .htaccess file, or a session stored by an
+ * earlier version, needs it built here, and then the decoded session
+ * cache (MellonSessionCacheSize) keeps it for later requests.
+ *
+ * @param[in]     r  Current HTTP request
+ * @param[in,out] ss session state object
+ *
+ * @returns JSON object
+ */
+static const char *
+am_session_identity_json(request_rec *r, am_session_state_t *ss)
+{
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    const char *key = dir_cfg->identity_header_key;
+    const char *json;
+
+    json = apr_hash_get(ss->identity_json, key, APR_HASH_KEY_STRING);
+    if (json != NULL) {
+        return json;
+    }
+
+    json = am_session_identity_json_build(r, ss,
+                                          dir_cfg->identity_header_names);
+    apr_hash_set(ss->identity_json, key, APR_HASH_KEY_STRING, json);
+    am_cache_session_identity_put(r, ss->session_id, key, json);
+
+    return json;
+}
+
 /**
  * Set Apache environment variables derived from current session.
  *
@@ -1533,6 +3003,7 @@ void am_session_export_env(request_rec *r, am_session_state_t *ss)
     const char *exported_name;
     const char *exported_value;
     const char *prefixed_name = NULL;
+    const am_envattr_conf_t *envattr_conf;
 
     /*
      * Set flag which controls if we merge multi-valued values or
@@ -1551,8 +3022,17 @@ void am_session_export_env(request_rec *r, am_session_state_t *ss)
         /* Get the name of the variable and its array of values */
         apr_hash_this(hi, (void*)&attr_name, NULL, (void*)&attr_values);
 
-        /* Map to new name and get prefixed version of name for export */
-        mapped_name = am_mapped_env_attr_name(r, attr_name, &prefixed_name);
+        /* Map to new name and get prefixed version of name for export,
+         * renamed attributes come with their exported names prepared. */
+        envattr_conf = apr_hash_get(dir_cfg->envattr, attr_name,
+                                    APR_HASH_KEY_STRING);
+        if (envattr_conf != NULL) {
+            mapped_name = envattr_conf->name;
+            prefixed_name = envattr_conf->prefixed_name;
+        } else {
+            mapped_name = am_mapped_env_attr_name(r, attr_name,
+                                                  &prefixed_name);
+        }
         /*
          * Set the username. The username comes from one of the SAML
          * attribute names, the attribute name used to set the username
@@ -1570,6 +3050,15 @@ void am_session_export_env(request_rec *r, am_session_state_t *ss)
             }
         }
 
+        /* With MellonEnvExport declared only renamed and listed
+         * attributes go into the environment. */
+        if (dir_cfg->env_export == AM_ENV_EXPORT_DECLARED &&
+            envattr_conf == NULL &&
+            apr_hash_get(dir_cfg->env_export_names, attr_name,
+                         APR_HASH_KEY_STRING) == NULL) {
+            continue;
+        }
+
         /* Does the variable have one or more values? */
         if (attr_values && attr_values->nelts) {
             /* Add the variable without a suffix. */
@@ -1596,8 +3085,15 @@ void am_session_export_env(request_rec *r, am_session_state_t *ss)
                     } else {
                         exported_index = i;
                     }
-                    exported_name = apr_psprintf(r->pool, "%s_%d",
-                                                 prefixed_name, exported_index);
+                    if (envattr_conf != NULL && exported_index >= 0 &&
+                        exported_index < AM_ENVATTR_INDEXED_NAMES) {
+                        exported_name =
+                            envattr_conf->indexed_names[exported_index];
+                    } else {
+                        exported_name = apr_psprintf(r->pool, "%s_%d",
+                                                     prefixed_name,
+                                                     exported_index);
+                    }
                     exported_value = APR_ARRAY_IDX(attr_values, i, char *);
                     apr_table_set(r->subprocess_env,
                                   exported_name, exported_value);
@@ -1613,7 +3109,8 @@ void am_session_export_env(request_rec *r, am_session_state_t *ss)
          *  this attribute has by appending a count to the variable name
          */
         if (dir_cfg->env_vars_count_in_n > 0) {
-            exported_name = apr_psprintf(r->pool, "%s_N", prefixed_name);
+            exported_name = envattr_conf != NULL ? envattr_conf->count_name :
+                apr_pstrcat(r->pool, prefixed_name, "_N", NULL);
             exported_value = apr_psprintf(r->pool, "%d",
                                           attr_values ? attr_values->nelts : 0);
             apr_table_set(r->subprocess_env, exported_name, exported_value);
@@ -1634,4 +3131,40 @@ void am_session_export_env(request_rec *r, am_session_state_t *ss)
                       dir_cfg->userattr);
     }
 
+    /* Pass the user and the attributes to a backend in a single header */
+    if (dir_cfg->identity_header != NULL && *dir_cfg->identity_header) {
+        apr_table_set(r->headers_in, dir_cfg->identity_header,
+                      apr_pstrcat(r->pool, "{\"user\":",
+                                  ss->user ? am_json_quote(r->pool, ss->user)
+                                           : "null",
+                                  ",\"attributes\":",
+                                  am_session_identity_json(r, ss), "}",
+                                  NULL));
+    }
+
+    /* The dumps come from the logout state, only load it when asked to */
+    if (dir_cfg->dump_session || dir_cfg->dump_saml_response) {
+        if (am_session_load_logout_state(r, ss) != APR_SUCCESS) {
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "Unable to load the logout state of session %s,"
+                          " MELLON_SESSION and MELLON_SAML_RESPONSE"
+                          " are not set.", ss->session_id);
+            return;
+        }
+
+        if (dir_cfg->dump_session && ss->lasso_session_dump) {
+            int srclen = strlen(ss->lasso_session_dump);
+            char *session_base64 = apr_palloc(r->pool,
+                                              apr_base64_encode_len(srclen));
+
+            (void)apr_base64_encode(session_base64, ss->lasso_session_dump,
+                                    srclen);
+            apr_table_set(r->subprocess_env, "MELLON_SESSION", session_base64);
+        }
+
+        if (dir_cfg->dump_saml_response && ss->saml_response) {
+            apr_table_set(r->subprocess_env, "MELLON_SAML_RESPONSE",
+                          ss->saml_response);
+        }
+    }
 }
@@ -0,0 +1,936 @@
+/*
+ *
+ *   auth_mellon_shm.c: an authentication apache module
+ *   Copyright © 2003-2007 UNINETT (http://www.uninett.no/)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "auth_mellon.h"
+
+#include "apr_atomic.h"
+#include "ap_provider.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef APLOG_USE_MODULE
+APLOG_USE_MODULE(auth_mellon);
+#endif
+
+/*
+ * Mellon's own shared memory socache provider, "mellon_shm".
+ *
+ * The generic shmcb provider is flagged AP_SOCACHE_FLAG_NOTMPSAFE,
+ * which makes Mellon serialize every session lookup and update of
+ * every process on a single global mutex. This provider is safe for
+ * concurrent use instead:
+ *
+ * - Keys are hashed into a number of shards. Each shard has its own
+ *   index and data area and is modified under a spinlock of its own,
+ *   so writers only contend when they touch the same shard.
+ *
+ * - Readers take no lock at all. Every shard carries a sequence
+ *   counter which a writer makes odd while it modifies the shard and
+ *   even again when it is done. A reader copies the entry out and
+ *   retries if the counter changed meanwhile (a seqlock). Only a
+ *   reader which keeps losing that race falls back to the spinlock.
+ *
+ * Storing a key only if it is absent (the add function of the
+ * am_cache_batch_provider_t, used to record Assertion IDs) checks for
+ * a live record under the shard lock, so it is atomic without the
+ * global mutex.
+ *
+ * Within a shard the data area is used as a log: records are appended
+ * at the head and the oldest records are overwritten when it wraps,
+ * just like shmcb. The index is a ring of fixed size slots in insertion
+ * order, lookups scan it from the newest slot.
+ *
+ * The spinlock holds the pid of its owner. A process which dies while
+ * holding it (e.g. on a crash) would otherwise block the shard forever,
+ * a waiter therefore takes the lock over once the owner is gone and
+ * clears the shard, which may have been left half modified. The pid of
+ * a dead owner may have been reused by the time a waiter looks, so the
+ * owner also records its start time next to the pid (where the system
+ * exposes it, see am_process_start_time()) and a waiter compares it with
+ * the start time of the process now using the pid.
+ *
+ * Arguments are a comma separated list of key=value pairs:
+ *
+ *   size=<bytes>   total size of the shared memory, a K, M or G
+ *                  suffix may be used (default 8M)
+ *   shards=<n>     number of shards (default 16)
+ */
+
+/*---------------------------------- Defines ---------------------------------*/
+
+#define AM_SHM_PROVIDER_NAME "mellon_shm"
+
+#define AM_SHM_MAGIC 0x4d534853 /* "MSHS" */
+
+#define AM_SHM_DEFAULT_SIZE (8 * 1024 * 1024)
+#define AM_SHM_DEFAULT_SHARDS 16
+#define AM_SHM_MAX_SHARDS 1024
+
+/* Expected average record size, used to size the index of a shard */
+#define AM_SHM_AVG_ENTRY_SIZE 1024
+#define AM_SHM_MIN_INDEX_SIZE 8
+#define AM_SHM_MIN_DATA_SIZE 4096
+
+#define AM_SHM_ALIGN(n) (((n) + 63) & ~((apr_size_t)63))
+
+/* Spins before a waiting writer yields the CPU */
+#define AM_SHM_LOCK_SPINS 1000
+/* Optimistic read attempts before a reader takes the lock */
+#define AM_SHM_READ_ATTEMPTS 64
+
+#if defined(__GNUC__)
+#define am_shm_barrier() __sync_synchronize()
+#else
+static volatile apr_uint32_t am_shm_fence;
+#define am_shm_barrier() ((void)apr_atomic_add32(&am_shm_fence, 0))
+#endif
+
+/*--------------------------------- typedefs ---------------------------------*/
+
+/* All shared structures only use fixed width types */
+
+typedef struct am_shm_header_t {
+    apr_uint32_t magic;
+    apr_uint32_t n_shards;
+    apr_uint32_t shard_size;    /* distance between shards */
+    apr_uint32_t index_size;    /* index slots per shard */
+    apr_uint32_t data_size;     /* data bytes per shard */
+} am_shm_header_t;
+
+typedef struct am_shm_shard_t {
+    volatile apr_uint32_t lock; /* pid of the writer, 0 if unlocked */
+    volatile apr_uint32_t lock_start; /* its start time, 0 if unknown */
+    volatile apr_uint32_t seq;  /* odd while the shard is modified */
+    apr_uint32_t idx_first;     /* oldest index slot */
+    apr_uint32_t idx_used;      /* index slots in use */
+    apr_uint64_t head;          /* log offset of the next record */
+
+    /* Counters, reported by the status hook */
+    apr_uint32_t stores;
+    apr_uint32_t removes;
+    apr_uint32_t evictions;     /* live records dropped for space */
+    volatile apr_uint32_t read_retries;
+    volatile apr_uint32_t locked_reads;
+} am_shm_shard_t;
+
+typedef struct am_shm_index_t {
+    apr_uint64_t offset;        /* log offset of the record */
+    apr_int64_t expiry;
+    apr_uint32_t hash;
+    apr_uint32_t data_len;
+    apr_uint16_t key_len;
+    apr_uint16_t removed;
+} am_shm_index_t;
+
+struct ap_socache_instance_t {
+    apr_size_t size;
+    apr_uint32_t n_shards;
+    const char *filename;
+    apr_shm_t *shm;
+    am_shm_header_t *header;
+};
+
+/* A record copied out of a shard for the iterator */
+typedef struct am_shm_record_t {
+    const unsigned char *key;
+    unsigned int key_len;
+    const unsigned char *data;
+    unsigned int data_len;
+} am_shm_record_t;
+
+/* Result of a lookup in a shard */
+typedef enum {
+    AM_SHM_FOUND,
+    AM_SHM_NOT_FOUND,
+    AM_SHM_TOO_SMALL,
+} am_shm_lookup_t;
+
+/*----------------------------- Internal Functions ---------------------------*/
+
+static apr_uint32_t
+am_shm_hash(const unsigned char *key, unsigned int key_len)
+{
+    apr_uint32_t hash = 2166136261U; /* FNV-1a */
+    unsigned int i;
+
+    for (i = 0; i < key_len; i++) {
+        hash ^= key[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static am_shm_shard_t *
+am_shm_shard(am_shm_header_t *header, apr_uint32_t hash)
+{
+    return (am_shm_shard_t *)((char *)header +
+                              AM_SHM_ALIGN(sizeof(am_shm_header_t)) +
+                              (apr_size_t)(hash % header->n_shards) *
+                              header->shard_size);
+}
+
+static am_shm_index_t *
+am_shm_index(am_shm_shard_t *shard)
+{
+    return (am_shm_index_t *)((char *)shard +
+                              AM_SHM_ALIGN(sizeof(am_shm_shard_t)));
+}
+
+static unsigned char *
+am_shm_data(am_shm_header_t *header, am_shm_shard_t *shard)
+{
+    return (unsigned char *)(am_shm_index(shard) + header->index_size);
+}
+
+/* Forget everything held in a shard, the caller holds the lock */
+static void
+am_shm_shard_clear(am_shm_shard_t *shard)
+{
+    shard->idx_first = 0;
+    shard->idx_used = 0;
+    if (shard->seq & 1) {
+        apr_atomic_inc32(&shard->seq);
+    }
+}
+
+static void
+am_shm_yield(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_yield();
+#else
+    apr_sleep(0);
+#endif
+}
+
+/* Start time of this process, looked up again after a fork */
+static apr_uint32_t
+am_shm_self_start(void)
+{
+    static pid_t self_pid = 0;
+    static apr_uint32_t self_start = 0;
+    pid_t pid = getpid();
+
+    if (self_pid != pid) {
+        self_start = am_process_start_time(pid);
+        self_pid = pid;
+    }
+    return self_start;
+}
+
+/*
+ * Check whether the owner of a shard lock is gone: no process has its
+ * pid any more, or the process with its pid started at another time
+ * than the owner did. A start time is only trusted once it has been
+ * seen twice in a row, in *suspect, so that an owner which releases
+ * the lock to another and takes it back in between cannot be mistaken
+ * for a new process.
+ */
+static bool
+am_shm_owner_gone(am_shm_shard_t *shard, apr_uint32_t owner,
+                  apr_uint32_t *suspect)
+{
+    apr_uint32_t start;
+    apr_uint32_t current;
+
+    if (kill((pid_t)owner, 0) != 0 && errno == ESRCH) {
+        return true;
+    }
+
+    start = apr_atomic_read32(&shard->lock_start);
+    if (start == 0 || apr_atomic_read32(&shard->lock) != owner) {
+        /* Being taken or released, or the owner didn't know its start */
+        *suspect = 0;
+        return false;
+    }
+
+    current = am_process_start_time((pid_t)owner);
+    if (current == 0 || current == start) {
+        *suspect = 0;
+        return false;
+    }
+
+    if (*suspect != start) {
+        *suspect = start;
+        return false;
+    }
+    return true;
+}
+
+static void
+am_shm_shard_lock(am_shm_shard_t *shard)
+{
+    apr_uint32_t self = (apr_uint32_t)getpid();
+    apr_uint32_t owner;
+    apr_uint32_t suspect = 0;
+    unsigned int spins = 0;
+
+    while ((owner = apr_atomic_cas32(&shard->lock, self, 0)) != 0) {
+        if (++spins < AM_SHM_LOCK_SPINS) {
+            continue;
+        }
+        spins = 0;
+
+        if (am_shm_owner_gone(shard, owner, &suspect)) {
+            /* The owner died while holding the lock, take it over */
+            if (apr_atomic_cas32(&shard->lock, self, owner) == owner) {
+                apr_atomic_set32(&shard->lock_start, am_shm_self_start());
+                am_shm_shard_clear(shard);
+                return;
+            }
+            continue;
+        }
+
+        am_shm_yield();
+    }
+
+    apr_atomic_set32(&shard->lock_start, am_shm_self_start());
+}
+
+static void
+am_shm_shard_unlock(am_shm_shard_t *shard)
+{
+    apr_atomic_set32(&shard->lock_start, 0);
+    apr_atomic_xchg32(&shard->lock, 0);
+}
+
+/*
+ * Look for a live record in a shard and copy its data out. Runs
+ * either under the shard lock or optimistically, in which case every
+ * value read from the shard may be garbage and is bounds checked
+ * before use; the caller validates the result with the sequence
+ * counter.
+ */
+static am_shm_lookup_t
+am_shm_shard_lookup(am_shm_header_t *header, am_shm_shard_t *shard,
+                    apr_uint32_t hash,
+                    const unsigned char *key, unsigned int key_len,
+                    unsigned char *data, unsigned int *data_len,
+                    apr_time_t now)
+{
+    am_shm_index_t *index = am_shm_index(shard);
+    unsigned char *area = am_shm_data(header, shard);
+    apr_uint32_t index_size = header->index_size;
+    apr_uint32_t data_size = header->data_size;
+    apr_uint32_t first = shard->idx_first;
+    apr_uint32_t used = shard->idx_used;
+    apr_uint64_t head = shard->head;
+    apr_uint32_t i;
+
+    if (used > index_size) {
+        return AM_SHM_NOT_FOUND;
+    }
+
+    for (i = used; i > 0; i--) {
+        am_shm_index_t entry = index[(first + i - 1) % index_size];
+        apr_uint64_t rec_len = (apr_uint64_t)entry.key_len + entry.data_len;
+        apr_size_t pos;
+
+        if (entry.hash != hash || entry.key_len != key_len ||
+            entry.removed) {
+            continue;
+        }
+        if (entry.offset + rec_len > head ||
+            (head > data_size && entry.offset < head - data_size)) {
+            continue; /* overwritten */
+        }
+        pos = (apr_size_t)(entry.offset % data_size);
+        if (pos + rec_len > data_size) {
+            continue;
+        }
+        if (memcmp(area + pos, key, key_len) != 0) {
+            continue;
+        }
+
+        if (entry.expiry < now) {
+            return AM_SHM_NOT_FOUND;
+        }
+        if (entry.data_len > *data_len) {
+            return AM_SHM_TOO_SMALL;
+        }
+        memcpy(data, area + pos + key_len, entry.data_len);
+        *data_len = entry.data_len;
+        return AM_SHM_FOUND;
+    }
+
+    return AM_SHM_NOT_FOUND;
+}
+
+/* Mark all records of a key removed, the caller holds the lock */
+static apr_uint32_t
+am_shm_shard_remove(am_shm_header_t *header, am_shm_shard_t *shard,
+                    apr_uint32_t hash,
+                    const unsigned char *key, unsigned int key_len)
+{
+    am_shm_index_t *index = am_shm_index(shard);
+    unsigned char *area = am_shm_data(header, shard);
+    apr_uint32_t removed = 0;
+    apr_uint32_t i;
+
+    for (i = 0; i < shard->idx_used; i++) {
+        am_shm_index_t *entry =
+            &index[(shard->idx_first + i) % header->index_size];
+
+        if (entry->hash == hash && entry->key_len == key_len &&
+            !entry->removed &&
+            memcmp(area + entry->offset % header->data_size,
+                   key, key_len) == 0) {
+            entry->removed = 1;
+            removed++;
+        }
+    }
+
+    return removed;
+}
+
+/* Is the oldest record of a shard of no further use? */
+static bool
+am_shm_oldest_is_dead(am_shm_header_t *header, am_shm_shard_t *shard,
+                      apr_uint64_t new_head, apr_time_t now)
+{
+    am_shm_index_t *entry = &am_shm_index(shard)[shard->idx_first];
+
+    return entry->removed || entry->expiry < now ||
+        (new_head > header->data_size &&
+         entry->offset < new_head - header->data_size);
+}
+
+/*--------------------------- Provider Functions -----------------------------*/
+
+static apr_status_t
+am_shm_parse_size(const char *value, apr_size_t *size_out)
+{
+    char *end;
+    apr_int64_t size = apr_strtoi64(value, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K':
+        size *= 1024;
+        end++;
+        break;
+    case 'm': case 'M':
+        size *= 1024 * 1024;
+        end++;
+        break;
+    case 'g': case 'G':
+        size *= 1024 * 1024 * 1024;
+        end++;
+        break;
+    }
+
+    if (end == value || *end != '\0' || size <= 0 ||
+        (apr_uint64_t)size > APR_UINT32_MAX) {
+        return APR_EINVAL;
+    }
+
+    *size_out = (apr_size_t)size;
+    return APR_SUCCESS;
+}
+
+static const char *
+am_shm_create(ap_socache_instance_t **instance, const char *arg,
+              apr_pool_t *tmp, apr_pool_t *p)
+{
+    ap_socache_instance_t *ctx;
+    char *args, *item, *last;
+
+    ctx = apr_pcalloc(p, sizeof(*ctx));
+    ctx->size = AM_SHM_DEFAULT_SIZE;
+    ctx->n_shards = AM_SHM_DEFAULT_SHARDS;
+
+    if (arg && *arg) {
+        args = apr_pstrdup(tmp, arg);
+        for (item = apr_strtok(args, ",", &last);
+             item;
+             item = apr_strtok(NULL, ",", &last)) {
+            char *value = strchr(item, '=');
+
+            if (value == NULL) {
+                return apr_psprintf(tmp, AM_SHM_PROVIDER_NAME
+                                    ": invalid argument \"%s\", expected"
+                                    " key=value", item);
+            }
+            *value++ = '\0';
+
+            if (strcasecmp(item, "size") == 0) {
+                if (am_shm_parse_size(value, &ctx->size) != APR_SUCCESS) {
+                    return apr_psprintf(tmp, AM_SHM_PROVIDER_NAME
+                                        ": invalid size \"%s\"", value);
+                }
+            } else if (strcasecmp(item, "shards") == 0) {
+                int n_shards = atoi(value);
+
+                if (n_shards < 1 || n_shards > AM_SHM_MAX_SHARDS) {
+                    return apr_psprintf(tmp, AM_SHM_PROVIDER_NAME
+                                        ": shards must be between 1 and %d",
+                                        AM_SHM_MAX_SHARDS);
+                }
+                ctx->n_shards = n_shards;
+            } else {
+                return apr_psprintf(tmp, AM_SHM_PROVIDER_NAME
+                                    ": unknown argument \"%s\"", item);
+            }
+        }
+    }
+
+    *instance = ctx;
+    return NULL;
+}
+
+static apr_status_t
+am_shm_init(ap_socache_instance_t *ctx, const char *cname,
+            const struct ap_socache_hints *hints,
+            server_rec *s, apr_pool_t *p)
+{
+    am_shm_header_t *header;
+    apr_size_t shard_size, avail, index_size, data_size;
+    apr_uint32_t i;
+    apr_status_t rv;
+
+    shard_size = ((ctx->size - AM_SHM_ALIGN(sizeof(am_shm_header_t))) /
+                  ctx->n_shards) & ~((apr_size_t)63);
+    avail = shard_size - AM_SHM_ALIGN(sizeof(am_shm_shard_t));
+    index_size = avail / (AM_SHM_AVG_ENTRY_SIZE + sizeof(am_shm_index_t));
+    if (index_size < AM_SHM_MIN_INDEX_SIZE) {
+        index_size = AM_SHM_MIN_INDEX_SIZE;
+    }
+    data_size = avail - index_size * sizeof(am_shm_index_t);
+
+    if (shard_size <= AM_SHM_ALIGN(sizeof(am_shm_shard_t)) ||
+        avail <= index_size * sizeof(am_shm_index_t) ||
+        data_size < AM_SHM_MIN_DATA_SIZE) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     AM_SHM_PROVIDER_NAME ": size %" APR_SIZE_T_FMT
+                     " is too small for %u shards",
+                     ctx->size, ctx->n_shards);
+        return APR_EINVAL;
+    }
+
+    /*
+     * Prefer anonymous shared memory, it is inherited by the children
+     * and goes away with the server. Fall back to a file if the
+     * platform does not support it.
+     */
+    rv = apr_shm_create(&ctx->shm, ctx->size, NULL, p);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        ctx->filename = ap_runtime_dir_relative(p, apr_pstrcat(p, "mellon_shm.",
+                                                               cname, NULL));
+        apr_shm_remove(ctx->filename, p);
+        rv = apr_shm_create(&ctx->shm, ctx->size, ctx->filename, p);
+    }
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     AM_SHM_PROVIDER_NAME ": failed to create shared memory"
+                     " of %" APR_SIZE_T_FMT " bytes: %s", ctx->size,
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+
+    header = apr_shm_baseaddr_get(ctx->shm);
+    memset(header, 0, ctx->size);
+    header->magic = AM_SHM_MAGIC;
+    header->n_shards = ctx->n_shards;
+    header->shard_size = shard_size;
+    header->index_size = index_size;
+    header->data_size = data_size;
+
+    for (i = 0; i < header->n_shards; i++) {
+        am_shm_shard_clear(am_shm_shard(header, i));
+    }
+
+    ctx->header = header;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 AM_SHM_PROVIDER_NAME ": %" APR_SIZE_T_FMT " bytes,"
+                 " %u shards of %" APR_SIZE_T_FMT " index slots and %"
+                 APR_SIZE_T_FMT " data bytes",
+                 ctx->size, ctx->n_shards, index_size, data_size);
+
+    return APR_SUCCESS;
+}
+
+static void
+am_shm_destroy(ap_socache_instance_t *ctx, server_rec *s)
+{
+    if (ctx->shm) {
+        apr_shm_destroy(ctx->shm);
+        ctx->shm = NULL;
+        ctx->header = NULL;
+    }
+}
+
+/**
+ * Store a record, replacing any record of the same key
+ *
+ * @param[in] ctx    provider instance
+ * @param[in] id     key
+ * @param[in] idlen  length of the key
+ * @param[in] expiry when the record expires
+ * @param[in] data   data to store
+ * @param[in] datalen length of the data
+ * @param[in] add    only store the record if no live record of the
+ *                   key exists, checked under the shard lock
+ *
+ * @returns APR_SUCCESS, APR_EEXIST if add is set and the key exists,
+ *          APR_ENOSPC if the record does not fit into a shard.
+ */
+static apr_status_t
+am_shm_put(ap_socache_instance_t *ctx,
+           const unsigned char *id, unsigned int idlen,
+           apr_time_t expiry,
+           unsigned char *data, unsigned int datalen,
+           bool add)
+{
+    am_shm_header_t *header = ctx->header;
+    apr_uint32_t hash = am_shm_hash(id, idlen);
+    am_shm_shard_t *shard = am_shm_shard(header, hash);
+    am_shm_index_t *entry;
+    apr_uint64_t rec_len = (apr_uint64_t)idlen + datalen;
+    apr_uint64_t offset, new_head;
+    apr_size_t pos;
+    apr_time_t now = apr_time_now();
+
+    if (idlen > APR_UINT16_MAX || rec_len > header->data_size) {
+        return APR_ENOSPC;
+    }
+
+    am_shm_shard_lock(shard);
+
+    if (add) {
+        unsigned char probe;
+        unsigned int probe_len = 0;
+
+        /* A live record of any size is either found or too large */
+        if (am_shm_shard_lookup(header, shard, hash, id, idlen,
+                                &probe, &probe_len, now) != AM_SHM_NOT_FOUND) {
+            am_shm_shard_unlock(shard);
+            return APR_EEXIST;
+        }
+    }
+
+    apr_atomic_inc32(&shard->seq);
+
+    am_shm_shard_remove(header, shard, hash, id, idlen);
+
+    /* Records never wrap, skip the tail of the area if needed */
+    offset = shard->head;
+    pos = (apr_size_t)(offset % header->data_size);
+    if (pos + rec_len > header->data_size) {
+        offset += header->data_size - pos;
+        pos = 0;
+    }
+    new_head = offset + rec_len;
+
+    /* Drop records which are dead or about to be overwritten */
+    while (shard->idx_used > 0 &&
+           (shard->idx_used == header->index_size ||
+            am_shm_oldest_is_dead(header, shard, new_head, now))) {
+        if (!am_shm_oldest_is_dead(header, shard, new_head, now)) {
+            shard->evictions++;
+        }
+        shard->idx_first = (shard->idx_first + 1) % header->index_size;
+        shard->idx_used--;
+    }
+
+    memcpy(am_shm_data(header, shard) + pos, id, idlen);
+    memcpy(am_shm_data(header, shard) + pos + idlen, data, datalen);
+
+    entry = &am_shm_index(shard)[(shard->idx_first + shard->idx_used) %
+                                 header->index_size];
+    entry->offset = offset;
+    entry->expiry = expiry;
+    entry->hash = hash;
+    entry->data_len = datalen;
+    entry->key_len = idlen;
+    entry->removed = 0;
+
+    shard->idx_used++;
+    shard->head = new_head;
+    shard->stores++;
+
+    apr_atomic_inc32(&shard->seq);
+    am_shm_shard_unlock(shard);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+am_shm_store(ap_socache_instance_t *ctx, server_rec *s,
+             const unsigned char *id, unsigned int idlen,
+             apr_time_t expiry,
+             unsigned char *data, unsigned int datalen,
+             apr_pool_t *pool)
+{
+    return am_shm_put(ctx, id, idlen, expiry, data, datalen, false);
+}
+
+static apr_status_t
+am_shm_retrieve(ap_socache_instance_t *ctx, server_rec *s,
+                const unsigned char *id, unsigned int idlen,
+                unsigned char *dest, unsigned int *destlen,
+                apr_pool_t *pool)
+{
+    am_shm_header_t *header = ctx->header;
+    apr_uint32_t hash = am_shm_hash(id, idlen);
+    am_shm_shard_t *shard = am_shm_shard(header, hash);
+    apr_time_t now = apr_time_now();
+    am_shm_lookup_t result;
+    unsigned int len;
+    apr_uint32_t seq;
+    int attempt;
+
+    for (attempt = 0; attempt < AM_SHM_READ_ATTEMPTS; attempt++) {
+        seq = shard->seq;
+        am_shm_barrier();
+        if (seq & 1) {
+            am_shm_yield();
+            continue;
+        }
+
+        len = *destlen;
+        result = am_shm_shard_lookup(header, shard, hash, id, idlen,
+                                     dest, &len, now);
+
+        am_shm_barrier();
+        if (shard->seq == seq) {
+            goto done;
+        }
+        apr_atomic_inc32(&shard->read_retries);
+    }
+
+    /* Too much write traffic on this shard, read under the lock */
+    apr_atomic_inc32(&shard->locked_reads);
+    am_shm_shard_lock(shard);
+    len = *destlen;
+    result = am_shm_shard_lookup(header, shard, hash, id, idlen,
+                                 dest, &len, now);
+    am_shm_shard_unlock(shard);
+
+ done:
+    switch (result) {
+    case AM_SHM_FOUND:
+        *destlen = len;
+        return APR_SUCCESS;
+    case AM_SHM_TOO_SMALL:
+        return APR_ENOSPC;
+    default:
+        return APR_NOTFOUND;
+    }
+}
+
+static apr_status_t
+am_shm_remove(ap_socache_instance_t *ctx, server_rec *s,
+              const unsigned char *id, unsigned int idlen,
+              apr_pool_t *pool)
+{
+    am_shm_header_t *header = ctx->header;
+    apr_uint32_t hash = am_shm_hash(id, idlen);
+    am_shm_shard_t *shard = am_shm_shard(header, hash);
+    apr_uint32_t removed;
+
+    am_shm_shard_lock(shard);
+    apr_atomic_inc32(&shard->seq);
+
+    removed = am_shm_shard_remove(header, shard, hash, id, idlen);
+    shard->removes += removed;
+
+    apr_atomic_inc32(&shard->seq);
+    am_shm_shard_unlock(shard);
+
+    return removed ? APR_SUCCESS : APR_NOTFOUND;
+}
+
+static void
+am_shm_status(ap_socache_instance_t *ctx, request_rec *r, int flags)
+{
+    am_shm_header_t *header = ctx->header;
+    apr_uint64_t entries = 0, bytes = 0, stores = 0, removes = 0;
+    apr_uint64_t evictions = 0, read_retries = 0, locked_reads = 0;
+    apr_uint32_t i;
+
+    for (i = 0; i < header->n_shards; i++) {
+        am_shm_shard_t *shard = am_shm_shard(header, i);
+
+        entries += shard->idx_used;
+        bytes += shard->head < header->data_size ?
+            shard->head : header->data_size;
+        stores += shard->stores;
+        removes += shard->removes;
+        evictions += shard->evictions;
+        read_retries += shard->read_retries;
+        locked_reads += shard->locked_reads;
+    }
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "CacheShards: %u\n", header->n_shards);
+        ap_rprintf(r, "CacheIndexSlots: %" APR_UINT64_T_FMT "\n",
+                   (apr_uint64_t)header->n_shards * header->index_size);
+        ap_rprintf(r, "CacheIndexUsed: %" APR_UINT64_T_FMT "\n", entries);
+        ap_rprintf(r, "CacheDataUsed: %" APR_UINT64_T_FMT "\n", bytes);
+        ap_rprintf(r, "CacheStores: %" APR_UINT64_T_FMT "\n", stores);
+        ap_rprintf(r, "CacheRemoves: %" APR_UINT64_T_FMT "\n", removes);
+        ap_rprintf(r, "CacheEvictions: %" APR_UINT64_T_FMT "\n", evictions);
+        ap_rprintf(r, "CacheReadRetries: %" APR_UINT64_T_FMT "\n",
+                   read_retries);
+        ap_rprintf(r, "CacheLockedReads: %" APR_UINT64_T_FMT "\n",
+                   locked_reads);
+        return;
+    }
+
+    ap_rprintf(r, "cache type: <b>" AM_SHM_PROVIDER_NAME "</b>, "
+               "shared memory: <b>%" APR_SIZE_T_FMT "</b> bytes, "
+               "shards: <b>%u</b><br>",
+               ctx->size, header->n_shards);
+    ap_rprintf(r, "index slots used: <b>%" APR_UINT64_T_FMT "</b> of "
+               "<b>%" APR_UINT64_T_FMT "</b>, data bytes used: <b>%"
+               APR_UINT64_T_FMT "</b><br>",
+               entries, (apr_uint64_t)header->n_shards * header->index_size,
+               bytes);
+    ap_rprintf(r, "stores: <b>%" APR_UINT64_T_FMT "</b>, removes: <b>%"
+               APR_UINT64_T_FMT "</b>, evictions: <b>%" APR_UINT64_T_FMT
+               "</b><br>", stores, removes, evictions);
+    ap_rprintf(r, "read retries: <b>%" APR_UINT64_T_FMT "</b>, "
+               "locked reads: <b>%" APR_UINT64_T_FMT "</b><br>",
+               read_retries, locked_reads);
+}
+
+static apr_status_t
+am_shm_iterate(ap_socache_instance_t *ctx, server_rec *s,
+               void *userctx, ap_socache_iterator_t *iterator,
+               apr_pool_t *pool)
+{
+    am_shm_header_t *header = ctx->header;
+    apr_time_t now = apr_time_now();
+    apr_pool_t *iter_pool;
+    apr_uint32_t i, j;
+    apr_status_t rv = APR_SUCCESS;
+
+    apr_pool_create(&iter_pool, pool);
+
+    /*
+     * Live records of a shard are copied out under its lock and
+     * handed to the iterator after it is released, so the iterator
+     * may call back into the cache.
+     */
+    for (i = 0; i < header->n_shards && rv == APR_SUCCESS; i++) {
+        am_shm_shard_t *shard = am_shm_shard(header, i);
+        am_shm_index_t *index = am_shm_index(shard);
+        unsigned char *area = am_shm_data(header, shard);
+        apr_array_header_t *records;
+
+        apr_pool_clear(iter_pool);
+        records = apr_array_make(iter_pool, 16, sizeof(am_shm_record_t));
+
+        am_shm_shard_lock(shard);
+        for (j = 0; j < shard->idx_used; j++) {
+            am_shm_index_t *entry =
+                &index[(shard->idx_first + j) % header->index_size];
+            am_shm_record_t *record;
+
+            if (entry->removed || entry->expiry < now) {
+                continue;
+            }
+            record = &APR_ARRAY_PUSH(records, am_shm_record_t);
+            record->key = apr_pmemdup(iter_pool,
+                                      area + entry->offset % header->data_size,
+                                      entry->key_len + entry->data_len);
+            record->key_len = entry->key_len;
+            record->data = record->key + entry->key_len;
+            record->data_len = entry->data_len;
+        }
+        am_shm_shard_unlock(shard);
+
+        for (j = 0; j < (apr_uint32_t)records->nelts && rv == APR_SUCCESS;
+             j++) {
+            am_shm_record_t *record = &APR_ARRAY_IDX(records, j,
+                                                     am_shm_record_t);
+
+            rv = iterator(ctx, s, userctx, record->key, record->key_len,
+                          record->data, record->data_len, iter_pool);
+        }
+    }
+
+    apr_pool_destroy(iter_pool);
+
+    return rv;
+}
+
+static const ap_socache_provider_t am_shm_provider = {
+    AM_SHM_PROVIDER_NAME,
+    0, /* safe for concurrent use, no global mutex needed */
+    am_shm_create,
+    am_shm_init,
+    am_shm_destroy,
+    am_shm_store,
+    am_shm_retrieve,
+    am_shm_remove,
+    am_shm_status,
+    am_shm_iterate
+};
+
+/*----------------------------- Batch Provider -------------------------------*/
+
+static apr_status_t
+am_shm_batch_add(ap_socache_instance_t *ctx, server_rec *s,
+                 am_cache_batch_item_t *items, int n_items,
+                 apr_pool_t *pool)
+{
+    int i;
+
+    for (i = 0; i < n_items; i++) {
+        items[i].status = am_shm_put(ctx, items[i].key, items[i].key_len,
+                                     items[i].expiry, items[i].data,
+                                     items[i].data_len, true);
+    }
+    return APR_SUCCESS;
+}
+
+/* Only add is provided, the other operations are single key anyway */
+static const am_cache_batch_provider_t am_shm_batch_provider = {
+    NULL,
+    NULL,
+    NULL,
+    am_shm_batch_add
+};
+
+/*------------------------------ Public Functions ----------------------------*/
+
+/**
+ * Register the "mellon_shm" socache provider
+ *
+ * Called from register_hooks so the provider can be selected with
+ * MellonSoCache (or by any other module using socache).
+ *
+ * @param[in] p Pool passed to register_hooks
+ */
+void
+am_shm_register_provider(apr_pool_t *p)
+{
+    ap_register_provider(p, AP_SOCACHE_PROVIDER_GROUP, AM_SHM_PROVIDER_NAME,
+                         AP_SOCACHE_PROVIDER_VERSION, &am_shm_provider);
+    ap_register_provider(p, AM_CACHE_BATCH_PROVIDER_GROUP,
+                         AM_SHM_PROVIDER_NAME,
+                         AM_CACHE_BATCH_PROVIDER_VERSION,
+                         &am_shm_batch_provider);
+}
@@ -20,12 +20,23 @@
  */
 
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 
 #include "auth_mellon.h"
 
+/* HAVE_PCRE2 comes from config.h, included by auth_mellon.h */
+#ifdef HAVE_PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
+
 #ifdef APLOG_USE_MODULE
 APLOG_USE_MODULE(auth_mellon);
 #endif
@@ -154,6 +165,561 @@ int am_validate_redirect_url(request_rec *r, const char *url)
     return HTTP_BAD_REQUEST;
 }
 
+/* Maximum number of substituted regular expressions kept compiled by
+ * each process */
+#define AM_COND_REGEX_CACHE_SIZE 256
+
+#ifdef HAVE_PCRE2
+/* A regular expression compiled with the PCRE2 JIT */
+struct am_regex_jit_t {
+    pcre2_code *code;
+    uint32_t pairs;             /* ovector pairs a match can fill */
+};
+
+static apr_status_t am_regex_jit_free(void *data)
+{
+    am_regex_jit_t *jit = data;
+
+    pcre2_code_free(jit->code);
+    return APR_SUCCESS;
+}
+#endif
+
+/* This function compiles a regular expression with the PCRE2 JIT, with
+ * the same options ap_pregcomp() would compile it with.
+ *
+ * Parameters:
+ *  apr_pool_t *p           The pool the expression is allocated from.
+ *  const char *pattern     The regular expression.
+ *  int cflags              The AP_REG_* flags it was compiled with.
+ *
+ * Returns:
+ *  The compiled expression, or NULL if PCRE2 is not available or the
+ *  JIT fails, in which case ap_regexec() is used.
+ */
+const am_regex_jit_t *am_regex_jit_compile(apr_pool_t *p,
+                                           const char *pattern, int cflags)
+{
+#ifdef HAVE_PCRE2
+    am_regex_jit_t *jit;
+    pcre2_code *code;
+    uint32_t options = 0;
+    PCRE2_SIZE erroffset;
+    int errcode;
+
+#ifdef AP_REG_DOLLAR_ENDONLY
+    /* RegexDefaultOptions */
+    if (!(cflags & AP_REG_NO_DEFAULT))
+        cflags |= ap_regcomp_get_default_cflags();
+    if (cflags & AP_REG_DOTALL)
+        options |= PCRE2_DOTALL;
+    if (cflags & AP_REG_DOLLAR_ENDONLY)
+        options |= PCRE2_DOLLAR_ENDONLY;
+#endif
+    if (cflags & AP_REG_ICASE)
+        options |= PCRE2_CASELESS;
+    if (cflags & AP_REG_NEWLINE)
+        options |= PCRE2_MULTILINE;
+
+    code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+                         options, &errcode, &erroffset, NULL);
+    if (code == NULL)
+        return NULL;
+
+    if (pcre2_jit_compile(code, PCRE2_JIT_COMPLETE) != 0) {
+        pcre2_code_free(code);
+        return NULL;
+    }
+
+    jit = apr_palloc(p, sizeof(*jit));
+    jit->code = code;
+    if (pcre2_pattern_info(code, PCRE2_INFO_CAPTURECOUNT, &jit->pairs) != 0)
+        jit->pairs = 0;
+    jit->pairs++;               /* the whole match */
+    apr_pool_cleanup_register(p, jit, am_regex_jit_free,
+                              apr_pool_cleanup_null);
+
+    return jit;
+#else
+    return NULL;
+#endif
+}
+
+#ifdef HAVE_PCRE2
+/*
+ * Match data large enough for the expressions a thread has matched so
+ * far. Allocating it for every match would cost a malloc and a free on
+ * each MellonCond evaluation, each thread instead keeps its own and
+ * only replaces it with a larger one.
+ */
+
+typedef struct am_match_data_t {
+    pcre2_match_data *data;
+    uint32_t pairs;
+} am_match_data_t;
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *am_match_data_key = NULL;
+
+static void am_match_data_free(void *data)
+{
+    am_match_data_t *md = data;
+
+    if (md) {
+        pcre2_match_data_free(md->data);
+        free(md);
+    }
+}
+#else
+static am_match_data_t am_match_data_process;
+#endif
+
+/* This function returns the match data of the calling thread.
+ *
+ * Parameters:
+ *  const am_regex_jit_t *jit  The expression it is matched with.
+ *
+ * Returns:
+ *  Match data with room for all the subexpressions of the expression,
+ *  valid until the next call on the same thread, or NULL if there is
+ *  no per-thread match data. The caller then allocates its own.
+ */
+static pcre2_match_data *am_match_data_get(const am_regex_jit_t *jit)
+{
+    am_match_data_t *md = NULL;
+    pcre2_match_data *data;
+
+#if APR_HAS_THREADS
+    if (am_match_data_key == NULL)
+        return NULL;
+
+    apr_threadkey_private_get((void **)&md, am_match_data_key);
+    if (md == NULL) {
+        if ((md = calloc(1, sizeof(*md))) == NULL)
+            return NULL;
+        if (apr_threadkey_private_set(md, am_match_data_key)
+            != APR_SUCCESS) {
+            free(md);
+            return NULL;
+        }
+    }
+#else
+    md = &am_match_data_process;
+#endif
+
+    if (md->pairs < jit->pairs) {
+        if ((data = pcre2_match_data_create(jit->pairs, NULL)) == NULL)
+            return NULL;
+        pcre2_match_data_free(md->data);
+        md->data = data;
+        md->pairs = jit->pairs;
+    }
+
+    return md->data;
+}
+#endif
+
+/* This function matches the regular expression of a condition against
+ * a value, like ap_regexec(). The PCRE2 JIT is used if the expression
+ * was compiled with it.
+ *
+ * Parameters:
+ *  const am_cond_t *ce     The condition.
+ *  const char *value       The value matched.
+ *  apr_size_t nmatch       The number of entries in pmatch.
+ *  ap_regmatch_t *pmatch   Receives the offsets of the subexpressions.
+ *
+ * Returns:
+ *  0 if the expression matches, non-zero if it doesn't.
+ */
+static int am_cond_regexec(const am_cond_t *ce, const char *value,
+                           apr_size_t nmatch, ap_regmatch_t *pmatch)
+{
+#ifdef HAVE_PCRE2
+    if (ce->jit != NULL) {
+        pcre2_match_data *match_data;
+        pcre2_match_data *own_data = NULL;
+        PCRE2_SIZE *ovector;
+        apr_size_t i;
+        int rc;
+
+        match_data = am_match_data_get(ce->jit);
+        if (match_data == NULL) {
+            own_data = pcre2_match_data_create(ce->jit->pairs, NULL);
+            if (own_data == NULL)
+                return AP_REG_ESPACE;
+            match_data = own_data;
+        }
+
+        rc = pcre2_jit_match(ce->jit->code, (PCRE2_SPTR)value,
+                             strlen(value), 0, 0, match_data, NULL);
+        if (rc >= 0) {
+            ovector = pcre2_get_ovector_pointer(match_data);
+            for (i = 0; i < nmatch; i++) {
+                if ((rc == 0 || i < (apr_size_t)rc) &&
+                    ovector[i * 2] != PCRE2_UNSET) {
+                    pmatch[i].rm_so = (int)ovector[i * 2];
+                    pmatch[i].rm_eo = (int)ovector[i * 2 + 1];
+                } else {
+                    pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+                }
+            }
+        }
+
+        pcre2_match_data_free(own_data);
+
+        return (rc >= 0) ? 0 : AP_REG_NOMATCH;
+    }
+#endif
+
+    return ap_regexec(ce->regex, value, nmatch, pmatch, 0);
+}
+
+/*
+ * The per-process caches (decoded sessions, authorization decisions,
+ * generations and the regular expressions below) keep their entries in
+ * an am_lru_t: a hash by key and a list from the most to the least
+ * recently used entry. Each entry starts with its am_lru_link_t. The
+ * functions neither allocate nor free entries, nor lock: the cache
+ * owning the list does, under its own mutex.
+ */
+
+/* This function initializes an empty list.
+ *
+ * Parameters:
+ *  am_lru_t *lru        The list.
+ *  apr_pool_t *pool     The pool the hash of the list is allocated from.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_lru_init(am_lru_t *lru, apr_pool_t *pool)
+{
+    lru->entries = apr_hash_make(pool);
+    lru->head = NULL;
+    lru->tail = NULL;
+    lru->count = 0;
+}
+
+/* This function looks up an entry by key. The entry is not marked as
+ * used, see am_lru_use().
+ *
+ * Parameters:
+ *  am_lru_t *lru        The list.
+ *  const char *key      The key of the entry.
+ *
+ * Returns:
+ *  The entry, or NULL if there is none with this key.
+ */
+void *am_lru_get(am_lru_t *lru, const char *key)
+{
+    return apr_hash_get(lru->entries, key, APR_HASH_KEY_STRING);
+}
+
+/* Unlink an entry from the list, leaving the hash untouched. */
+static void am_lru_unlink(am_lru_t *lru, am_lru_link_t *link)
+{
+    if (link->prev) {
+        link->prev->next = link->next;
+    } else {
+        lru->head = link->next;
+    }
+    if (link->next) {
+        link->next->prev = link->prev;
+    } else {
+        lru->tail = link->prev;
+    }
+    link->prev = link->next = NULL;
+}
+
+/* Link an entry at the head of the list, leaving the hash untouched. */
+static void am_lru_link_head(am_lru_t *lru, am_lru_link_t *link)
+{
+    link->prev = NULL;
+    link->next = lru->head;
+    if (lru->head) {
+        lru->head->prev = link;
+    } else {
+        lru->tail = link;
+    }
+    lru->head = link;
+}
+
+/* This function marks an entry of the list as the most recently used.
+ *
+ * Parameters:
+ *  am_lru_t *lru        The list.
+ *  void *entry          The entry.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_lru_use(am_lru_t *lru, void *entry)
+{
+    am_lru_link_t *link = entry;
+
+    if (lru->head != link) {
+        am_lru_unlink(lru, link);
+        am_lru_link_head(lru, link);
+    }
+}
+
+/* This function adds an entry to the list as the most recently used.
+ * No entry with the same key may be in the list.
+ *
+ * Parameters:
+ *  am_lru_t *lru        The list.
+ *  void *entry          The entry.
+ *  const char *key      The key of the entry, which must live as long
+ *                       as the entry.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_lru_add(am_lru_t *lru, void *entry, const char *key)
+{
+    am_lru_link_t *link = entry;
+
+    link->key = key;
+    apr_hash_set(lru->entries, key, APR_HASH_KEY_STRING, link);
+    am_lru_link_head(lru, link);
+    lru->count++;
+}
+
+/* This function removes an entry from the list. The caller releases
+ * the entry.
+ *
+ * Parameters:
+ *  am_lru_t *lru        The list.
+ *  void *entry          The entry.
+ *
+ * Returns:
+ *  Nothing.
+ */
+void am_lru_remove(am_lru_t *lru, void *entry)
+{
+    am_lru_link_t *link = entry;
+
+    am_lru_unlink(lru, link);
+    apr_hash_set(lru->entries, link->key, APR_HASH_KEY_STRING, NULL);
+    lru->count--;
+}
+
+/* This function returns the least recently used entry of the list.
+ *
+ * Parameters:
+ *  am_lru_t *lru        The list.
+ *
+ * Returns:
+ *  The entry, or NULL if the list is empty.
+ */
+void *am_lru_oldest(am_lru_t *lru)
+{
+    return lru->tail;
+}
+
+/*
+ * Conditions with a format string in a regular expression have to be
+ * compiled again for every request, with the backreferences and
+ * environment variables substituted. Each process keeps the compiled
+ * expressions in an LRU cache keyed by the flags and the substituted
+ * expression.
+ *
+ * A request holds a reference on the entries it uses until its pool is
+ * cleared, an entry evicted while referenced is only released with
+ * the last reference.
+ */
+
+typedef struct am_regex_cache_entry_t {
+    am_lru_link_t link;
+    apr_pool_t *pool;
+    ap_regex_t *regex;
+    const am_regex_jit_t *jit;
+    int refs;
+    bool evicted;
+} am_regex_cache_entry_t;
+
+typedef struct am_regex_cache_t {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    am_lru_t lru;
+} am_regex_cache_t;
+
+static am_regex_cache_t *am_regex_cache = NULL;
+
+static void am_regex_cache_lock(am_regex_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+}
+
+static void am_regex_cache_unlock(am_regex_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
+
+/* Must be called with the cache mutex held. */
+static void am_regex_cache_evict(am_regex_cache_t *cache,
+                                 am_regex_cache_entry_t *entry)
+{
+    am_lru_remove(&cache->lru, entry);
+
+    entry->evicted = true;
+    if (entry->refs == 0)
+        apr_pool_destroy(entry->pool);
+}
+
+/* Pool cleanup dropping the reference of a request on an entry. */
+static apr_status_t am_regex_cache_release(void *data)
+{
+    am_regex_cache_entry_t *entry = data;
+    am_regex_cache_t *cache = am_regex_cache;
+
+    am_regex_cache_lock(cache);
+    entry->refs--;
+    if (entry->evicted && entry->refs == 0)
+        apr_pool_destroy(entry->pool);
+    am_regex_cache_unlock(cache);
+
+    return APR_SUCCESS;
+}
+
+/* This function creates the per-process cache of substituted regular
+ * expressions. It is called from the child_init hook.
+ *
+ * Parameters:
+ *  apr_pool_t *p       The child process pool.
+ *  server_rec *s       The server record.
+ *
+ * Returns:
+ *  APR_SUCCESS or an error status.
+ */
+apr_status_t am_cond_regex_cache_init(apr_pool_t *p, server_rec *s)
+{
+    am_regex_cache_t *cache;
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+
+    cache = apr_pcalloc(p, sizeof(*cache));
+
+    /*
+     * The cache has an allocator of its own, all allocations from it
+     * are serialized by the cache mutex.
+     */
+    if ((rv = apr_allocator_create(&allocator)) != APR_SUCCESS) {
+        return rv;
+    }
+    if ((rv = apr_pool_create_ex(&cache->pool, p, NULL,
+                                 allocator)) != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, cache->pool);
+
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create regex cache mutex: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+#endif
+
+    am_lru_init(&cache->lru, cache->pool);
+    am_regex_cache = cache;
+
+#if defined(HAVE_PCRE2) && APR_HAS_THREADS
+    rv = apr_threadkey_private_create(&am_match_data_key,
+                                      am_match_data_free, p);
+    if (rv != APR_SUCCESS) {
+        char error_buf[512];
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "failed to create regex match data key: %s",
+                     apr_strerror(rv, error_buf, sizeof(error_buf)));
+        return rv;
+    }
+#endif
+
+    return APR_SUCCESS;
+}
+
+/* This function returns a substituted regular expression, compiled
+ * with the flags, from the per-process cache. The expression is
+ * compiled and added to the cache if it isn't there yet.
+ *
+ * Parameters:
+ *  request_rec *r              The current request, which holds a
+ *                              reference on the expression until its
+ *                              pool is cleared.
+ *  const char *pattern         The regular expression.
+ *  int cflags                  The AP_REG_* flags.
+ *  const am_regex_jit_t **jit  Receives the expression compiled with
+ *                              the PCRE2 JIT, or NULL.
+ *
+ * Returns:
+ *  The compiled expression, or NULL if it is invalid.
+ */
+static ap_regex_t *am_cond_regex_get(request_rec *r, const char *pattern,
+                                     int cflags, const am_regex_jit_t **jit)
+{
+    am_regex_cache_t *cache = am_regex_cache;
+    am_regex_cache_entry_t *entry;
+    const char *key;
+    apr_pool_t *pool;
+
+    if (cache == NULL) {
+        *jit = am_regex_jit_compile(r->pool, pattern, cflags);
+        return ap_pregcomp(r->pool, pattern, cflags);
+    }
+
+    key = apr_psprintf(r->pool, "%d:%s", cflags, pattern);
+
+    am_regex_cache_lock(cache);
+
+    entry = am_lru_get(&cache->lru, key);
+    if (entry != NULL) {
+        am_lru_use(&cache->lru, entry);
+    } else {
+        while (cache->lru.count >= AM_COND_REGEX_CACHE_SIZE) {
+            am_regex_cache_evict(cache, am_lru_oldest(&cache->lru));
+        }
+
+        if (apr_pool_create(&pool, cache->pool) != APR_SUCCESS) {
+            am_regex_cache_unlock(cache);
+            return NULL;
+        }
+
+        entry = apr_pcalloc(pool, sizeof(*entry));
+        entry->pool = pool;
+        entry->regex = ap_pregcomp(pool, pattern, cflags);
+        if (entry->regex == NULL) {
+            apr_pool_destroy(pool);
+            am_regex_cache_unlock(cache);
+            return NULL;
+        }
+        entry->jit = am_regex_jit_compile(pool, pattern, cflags);
+
+        am_lru_add(&cache->lru, entry, apr_pstrdup(pool, key));
+    }
+
+    entry->refs++;
+
+    am_regex_cache_unlock(cache);
+
+    apr_pool_cleanup_register(r->pool, entry, am_regex_cache_release,
+                              apr_pool_cleanup_null);
+
+    *jit = entry->jit;
+    return entry->regex;
+}
+
 /* This function builds an array of regexp backreferences
  *
  * Parameters:
@@ -350,7 +916,7 @@ const am_cond_t *am_cond_substitue(request_rec *r, const am_cond_t *ce,
         if (ce->flags & AM_COND_FLAG_NC)
             regex_flags |= AP_REG_ICASE;
  
-        c->regex = ap_pregcomp(r->pool, outstr, regex_flags);
+        c->regex = am_cond_regex_get(r, outstr, regex_flags, &c->jit);
         if (c->regex == NULL) {
              AM_LOG_RERROR(APLOG_MARK, APLOG_WARNING, 0, r,
                            "Invalid regular expression \"%s\"", outstr);
@@ -361,67 +927,475 @@ const am_cond_t *am_cond_substitue(request_rec *r, const am_cond_t *ce,
     return (const am_cond_t *)c;
 }
 
-/* This function checks if the user has access according
- * to the MellonRequire and MellonCond directives.
+/* Minimum length of a run of [OR] conditions compiled into a set */
+#define AM_COND_SET_MIN_SIZE 4
+
+typedef struct am_cond_acm_node_t {
+    int edges;                  /* first edge, -1 if none */
+    int fail;                   /* longest proper suffix in the trie */
+    const am_cond_t *match;     /* condition matched when reached */
+} am_cond_acm_node_t;
+
+typedef struct am_cond_acm_edge_t {
+    unsigned char c;
+    int target;
+    int next;                   /* next edge of the same node, or -1 */
+} am_cond_acm_edge_t;
+
+struct am_cond_acm_t {
+    int root[256];              /* edges of the root node, -1 if none */
+    am_cond_acm_node_t *nodes;
+    am_cond_acm_edge_t *edges;
+    int nnodes;
+    int nedges;
+    bool nocase;
+};
+
+/* This function follows the edge labelled c of a node of the
+ * automaton.
  *
  * Parameters:
- *  request_rec *r              The current request.
- *  am_session_state_t *session The current session.
+ *  const am_cond_acm_t *acm    The automaton.
+ *  int node                    The node.
+ *  unsigned char c             The label.
  *
  * Returns:
- *  OK if the user has access and HTTP_FORBIDDEN if he doesn't.
+ *  The node the edge leads to, or -1 if there is none.
  */
-int am_check_permissions(request_rec *r, am_session_state_t *session)
+static int am_cond_acm_next(const am_cond_acm_t *acm, int node,
+                            unsigned char c)
+{
+    int e;
+
+    if (node == 0)
+        return acm->root[c];
+
+    for (e = acm->nodes[node].edges; e != -1; e = acm->edges[e].next) {
+        if (acm->edges[e].c == c)
+            return acm->edges[e].target;
+    }
+
+    return -1;
+}
+
+/* This function builds the Aho-Corasick automaton of a run of [SUB]
+ * conditions.
+ *
+ * Parameters:
+ *  apr_pool_t *p               The pool the automaton is allocated from.
+ *  const am_cond_t *conds      The first condition of the run.
+ *  int nconds                  The number of conditions in the run.
+ *  bool nocase                 Whether the run has the [NC] flag.
+ *
+ * Returns:
+ *  The automaton.
+ */
+static const am_cond_acm_t *am_cond_acm_build(apr_pool_t *p,
+                                              const am_cond_t *conds,
+                                              int nconds, bool nocase)
 {
-    am_dir_cfg_rec *dir_cfg;
+    am_cond_acm_t *acm;
+    apr_size_t total = 0;
+    int *queue;
+    int head, tail;
     int i;
-    int skip_or = 0;
-    const apr_array_header_t *backrefs = NULL;
 
-    dir_cfg = am_get_dir_cfg(r);
+    for (i = 0; i < nconds; i++)
+        total += strlen(conds[i].str);
+
+    acm = apr_pcalloc(p, sizeof(*acm));
+    acm->nodes = apr_palloc(p, (total + 1) * sizeof(*acm->nodes));
+    acm->edges = apr_palloc(p, (total + 1) * sizeof(*acm->edges));
+    acm->nocase = nocase;
+    for (i = 0; i < 256; i++)
+        acm->root[i] = -1;
+
+    acm->nodes[0].edges = -1;
+    acm->nodes[0].fail = 0;
+    acm->nodes[0].match = NULL;
+    acm->nnodes = 1;
+
+    /* Build the trie of the strings */
+    for (i = 0; i < nconds; i++) {
+        const unsigned char *s = (const unsigned char *)conds[i].str;
+        int node = 0;
+
+        for (; *s; s++) {
+            unsigned char c = nocase ? apr_tolower(*s) : *s;
+            int next = am_cond_acm_next(acm, node, c);
+
+            if (next == -1) {
+                next = acm->nnodes++;
+                acm->nodes[next].edges = -1;
+                acm->nodes[next].fail = 0;
+                acm->nodes[next].match = NULL;
+
+                if (node == 0) {
+                    acm->root[c] = next;
+                } else {
+                    acm->edges[acm->nedges].c = c;
+                    acm->edges[acm->nedges].target = next;
+                    acm->edges[acm->nedges].next = acm->nodes[node].edges;
+                    acm->nodes[node].edges = acm->nedges++;
+                }
+            }
+            node = next;
+        }
+
+        if (acm->nodes[node].match == NULL)
+            acm->nodes[node].match = &conds[i];
+    }
 
-    /* Iterate over all cond-directives */
-    for (i = 0; i < dir_cfg->cond->nelts; i++) {
-        const am_cond_t *ce;
-        const char *name = NULL;
-        const char *value = NULL;
-        int match = 0;
+    /*
+     * Compute the failure links breadth first, so the link of a node
+     * is known before those of its children. A node also matches
+     * whatever its failure link matches.
+     */
+    queue = apr_palloc(p, acm->nnodes * sizeof(*queue));
+    head = tail = 0;
+    for (i = 0; i < 256; i++) {
+        if (acm->root[i] != -1)
+            queue[tail++] = acm->root[i];
+    }
 
-        ce = &((am_cond_t *)(dir_cfg->cond->elts))[i];
+    while (head < tail) {
+        int node = queue[head++];
+        int e;
 
-        am_diag_printf(r, "%s processing condition %d of %d: %s ",
-                       __func__, i, dir_cfg->cond->nelts,
-                       am_diag_cond_str(r, ce));
+        for (e = acm->nodes[node].edges; e != -1; e = acm->edges[e].next) {
+            unsigned char c = acm->edges[e].c;
+            int child = acm->edges[e].target;
+            int fail = acm->nodes[node].fail;
+            int next;
+
+            while ((next = am_cond_acm_next(acm, fail, c)) == -1 && fail != 0)
+                fail = acm->nodes[fail].fail;
+
+            acm->nodes[child].fail = (next == -1) ? 0 : next;
+            if (acm->nodes[child].match == NULL)
+                acm->nodes[child].match =
+                    acm->nodes[acm->nodes[child].fail].match;
+
+            queue[tail++] = child;
+        }
+    }
+
+    return acm;
+}
+
+/* This function searches a value for the strings of an automaton.
+ *
+ * Parameters:
+ *  const am_cond_acm_t *acm    The automaton.
+ *  const char *value           The value searched.
+ *
+ * Returns:
+ *  The condition of a string found in the value, or NULL if none is.
+ */
+static const am_cond_t *am_cond_acm_search(const am_cond_acm_t *acm,
+                                           const char *value)
+{
+    const unsigned char *s = (const unsigned char *)value;
+    int node = 0;
+
+    /* An empty string is found in every value */
+    if (acm->nodes[0].match != NULL)
+        return acm->nodes[0].match;
+
+    for (; *s; s++) {
+        unsigned char c = acm->nocase ? apr_tolower(*s) : *s;
+        int next;
+
+        while ((next = am_cond_acm_next(acm, node, c)) == -1 && node != 0)
+            node = acm->nodes[node].fail;
+
+        node = (next == -1) ? 0 : next;
+        if (acm->nodes[node].match != NULL)
+            return acm->nodes[node].match;
+    }
+
+    return NULL;
+}
+
+/* This function returns the length of the run of conditions starting
+ * at a condition which can be compiled into a set: literal conditions
+ * on the same attribute with the same flags, all but the last with
+ * [OR], which makes them one part of an [OR] group.
+ *
+ * Parameters:
+ *  const am_cond_t *conds      The conditions.
+ *  int start                   The first condition of the run.
+ *  int nelts                   The number of conditions.
+ *
+ * Returns:
+ *  The length of the run, 1 if the condition starts none.
+ */
+static int am_cond_run_length(const am_cond_t *conds, int start, int nelts)
+{
+    const am_cond_t *first = &conds[start];
+    int flags = first->flags & ~(AM_COND_FLAG_OR|AM_COND_FLAG_REQ);
+    int i;
+
+    if (flags & ~(AM_COND_FLAG_NC|AM_COND_FLAG_SUB|AM_COND_FLAG_MAP))
+        return 1;
+
+    for (i = start; i < nelts - 1; i++) {
+        const am_cond_t *next = &conds[i + 1];
+
+        if (!(conds[i].flags & AM_COND_FLAG_OR))
+            break;
+
+        if ((next->flags & ~(AM_COND_FLAG_OR|AM_COND_FLAG_REQ)) != flags ||
+            strcmp(next->varname, first->varname) != 0)
+            break;
+    }
+
+    return i - start + 1;
+}
+
+/* This function turns an op into a set op testing a run of conditions.
+ *
+ * Parameters:
+ *  apr_pool_t *p               The pool the set is allocated from.
+ *  am_cond_op_t *op            The op, whose cond is the first
+ *                              condition of the run.
+ *  int nconds                  The length of the run.
+ *
+ * Returns:
+ *  Nothing.
+ */
+static void am_cond_compile_set(apr_pool_t *p, am_cond_op_t *op, int nconds)
+{
+    bool nocase = (op->cond->flags & AM_COND_FLAG_NC) != 0;
+    int i;
+
+    op->nconds = nconds;
+
+    if (op->cond->flags & AM_COND_FLAG_SUB) {
+        op->type = AM_COND_OP_SUBSTR_SET;
+        op->acm = am_cond_acm_build(p, op->cond, nconds, nocase);
+        return;
+    }
+
+    op->type = AM_COND_OP_EQUAL_SET;
+    op->set = apr_hash_make(p);
+    for (i = 0; i < nconds; i++) {
+        const am_cond_t *ce = &op->cond[i];
+        char *key = apr_pstrdup(p, ce->str);
+
+        if (nocase)
+            ap_str_tolower(key);
+
+        /* Keep the first of duplicates, it is the one which matched */
+        if (apr_hash_get(op->set, key, APR_HASH_KEY_STRING) == NULL)
+            apr_hash_set(op->set, key, APR_HASH_KEY_STRING, ce);
+    }
+}
+
+/* This function tests a value against the run of conditions of a set
+ * op.
+ *
+ * Parameters:
+ *  request_rec *r              The current request.
+ *  const am_cond_op_t *op      The set op.
+ *  const char *value           The value of the attribute, or NULL.
+ *
+ * Returns:
+ *  The condition which holds, or NULL if none does.
+ */
+static const am_cond_t *am_cond_set_match(request_rec *r,
+                                          const am_cond_op_t *op,
+                                          const char *value)
+{
+    const am_cond_t *ce;
+
+    if (value == NULL)
+        return NULL;
+
+    am_diag_printf(r, "evaluate value \"%s\" against %d values ",
+                   value, op->nconds);
+
+    if (op->type == AM_COND_OP_SUBSTR_SET) {
+        ce = am_cond_acm_search(op->acm, value);
+    } else if (op->cond->flags & AM_COND_FLAG_NC) {
+        char *key = apr_pstrdup(r->pool, value);
+
+        ap_str_tolower(key);
+        ce = apr_hash_get(op->set, key, APR_HASH_KEY_STRING);
+    } else {
+        ce = apr_hash_get(op->set, value, APR_HASH_KEY_STRING);
+    }
+
+    if (ce != NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "Evaluate %s vs \"%s\"",
+                      ce->directive, value);
+    }
+
+    am_diag_printf(r, "match=%s, ", ce ? "yes" : "no");
+
+    return ce;
+}
+
+/* This function compiles the MellonRequire and MellonCond conditions
+ * of a directory configuration into a program for
+ * am_evaluate_conditions().
+ *
+ * Ignored conditions are left out and the [OR] groups are resolved
+ * into jumps: a condition of a group which holds continues after the
+ * last condition of the group, one which fails continues with the next
+ * condition. A condition outside of a group which fails denies access.
+ * Runs of at least AM_COND_SET_MIN_SIZE literal conditions of an [OR]
+ * group are compiled into sets, see am_cond_run_length(). Attribute
+ * names are interned into slots, conditions with the MAP flag get
+ * slots of their own as their names are mapped through MellonSetEnv at
+ * request time.
+ *
+ * Parameters:
+ *  apr_pool_t *p                   The pool the program is allocated
+ *                                  from.
+ *  const apr_array_header_t *cond  The conditions.
+ *
+ * Returns:
+ *  The compiled program.
+ */
+const am_cond_program_t *am_cond_compile(apr_pool_t *p,
+                                         const apr_array_header_t *cond)
+{
+    const am_cond_t *conds = (const am_cond_t *)cond->elts;
+    am_cond_program_t *program;
+    am_cond_op_t *ops;
+    const char **names;
+    bool *mapped;
+    apr_hash_t *slots;
+    int group_end;
+    int i, n;
+
+    program = apr_pcalloc(p, sizeof(*program));
+    ops = apr_pcalloc(p, (cond->nelts + 1) * sizeof(*ops));
+    names = apr_pcalloc(p, (cond->nelts + 1) * sizeof(*names));
+    mapped = apr_pcalloc(p, (cond->nelts + 1) * sizeof(*mapped));
+    slots = apr_hash_make(p);
+
+    for (i = 0; i < cond->nelts; i++) {
+        const am_cond_t *ce = &conds[i];
+        bool map = (ce->flags & AM_COND_FLAG_MAP) != 0;
+        const char *key;
+        int *slot;
 
-        /*
-         * Rule with ignore flag?
-         */
         if (ce->flags & AM_COND_FLAG_IGN)
             continue;
 
-        /* 
-         * We matched a [OR] rule, skip the next rules
-         * until we have one without [OR]. 
-         */
-        if (skip_or) {
-            if (!(ce->flags & AM_COND_FLAG_OR))
-                skip_or = 0;
+        key = apr_pstrcat(p, map ? "M" : "-", ce->varname, NULL);
+        slot = apr_hash_get(slots, key, APR_HASH_KEY_STRING);
+        if (slot == NULL) {
+            slot = apr_palloc(p, sizeof(*slot));
+            *slot = program->nslots;
+            names[program->nslots] = ce->varname;
+            mapped[program->nslots] = map;
+            program->nslots++;
+            apr_hash_set(slots, key, APR_HASH_KEY_STRING, slot);
+        }
 
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                          "Skip %s, [OR] rule matched previously",
-                          ce->directive);
+        if (ce->flags & AM_COND_FLAG_FSTR)
+            program->has_fstr = true;
+
+        ops[program->nops].type = AM_COND_OP_TEST;
+        ops[program->nops].cond = ce;
+        ops[program->nops].nconds = 1;
+        ops[program->nops].slot = *slot;
+
+        n = am_cond_run_length(conds, i, cond->nelts);
+        if (n >= AM_COND_SET_MIN_SIZE) {
+            am_cond_compile_set(p, &ops[program->nops], n);
+            i += n - 1;
+        }
+
+        program->nops++;
+    }
+
+    /*
+     * Walk backwards, so the end of the [OR] group each condition
+     * belongs to is known: the group ends with the first condition
+     * without the OR flag. A set is part of a group if its last
+     * condition is.
+     */
+    group_end = program->nops;
+    for (i = program->nops - 1; i >= 0; i--) {
+        if (ops[i].cond[ops[i].nconds - 1].flags & AM_COND_FLAG_OR) {
+            ops[i].on_match = group_end;
+            ops[i].on_fail = i + 1;
+        } else {
+            ops[i].on_match = i + 1;
+            ops[i].on_fail = AM_COND_OP_DENY;
+            group_end = i + 1;
+        }
+    }
+
+    program->ops = ops;
+    program->names = names;
+    program->mapped = mapped;
+
+    return program;
+}
+
+/* This function runs the compiled MellonRequire and MellonCond
+ * conditions against the session.
+ *
+ * Parameters:
+ *  request_rec *r                      The current request.
+ *  am_session_state_t *session         The current session.
+ *  const am_cond_program_t *program    The compiled conditions.
+ *
+ * Returns:
+ *  OK if the user has access and HTTP_FORBIDDEN if he doesn't.
+ */
+static int am_evaluate_conditions(request_rec *r,
+                                  am_session_state_t *session,
+                                  const am_cond_program_t *program)
+{
+    const apr_array_header_t *backrefs = NULL;
+    const char **values;
+    bool *fetched;
+    int i = 0;
+
+    values = apr_pcalloc(r->pool, (program->nslots + 1) * sizeof(*values));
+    fetched = apr_pcalloc(r->pool, (program->nslots + 1) * sizeof(*fetched));
+
+    while (i < program->nops) {
+        const am_cond_op_t *op = &program->ops[i];
+        const am_cond_t *ce = op->cond;
+        const char *value = NULL;
+        int match = 0;
+
+        am_diag_printf(r, "%s processing condition %d of %d: %s ",
+                       __func__, i, program->nops,
+                       am_diag_cond_str(r, ce));
+        if (op->nconds > 1)
+            am_diag_printf(r, "and %d more [OR] values ", op->nconds - 1);
 
-            am_diag_printf(r, "Skip, [OR] rule matched previously\n");
-            continue;
-        }
-        
-        name = ce->varname;
-        /* If MAP flag is set, check for remapped  attribute name with mellonSetEnv */
-        if (ce->flags & AM_COND_FLAG_MAP) {
-            name = am_mapped_env_attr_name(r, name, NULL);
+        /* Each attribute is looked up once, and only when compared */
+        if (!fetched[op->slot]) {
+            const char *name = program->names[op->slot];
+
+            /* If MAP flag is set, check for remapped attribute name
+             * with MellonSetEnv */
+            if (program->mapped[op->slot])
+                name = am_mapped_env_attr_name(r, name, NULL);
+
+            values[op->slot] = am_session_get_first_env_attr_value(r, session,
+                                                                   name);
+            fetched[op->slot] = true;
         }
-        value = am_session_get_first_env_attr_value(r, session, name);
-        if (value) {
+        value = values[op->slot];
+
+        if (op->type != AM_COND_OP_TEST) {
+            ce = am_cond_set_match(r, op, value);
+            match = (ce != NULL);
+            if (ce == NULL)
+                ce = &op->cond[op->nconds - 1];
+
+        } else if (value) {
             /*
              * Substitute backrefs if available
              */
@@ -434,22 +1408,19 @@ int am_check_permissions(request_rec *r, am_session_state_t *session)
 
             am_diag_printf(r, "evaluate value \"%s\" ", value);
     
-            if (value == NULL) {
-                 match = 0;          /* can not happen */
-
-            } else if ((ce->flags & AM_COND_FLAG_REG) && (ce->flags & AM_COND_FLAG_REF)) {
+            if ((ce->flags & AM_COND_FLAG_REG) && (ce->flags & AM_COND_FLAG_REF)) {
                  int nsub = ce->regex->re_nsub + 1;
                  ap_regmatch_t *regmatch;
 
                  regmatch = (ap_regmatch_t *)apr_palloc(r->pool, 
                             nsub * sizeof(*regmatch));
 
-                 match = !ap_regexec(ce->regex, value, nsub, regmatch, 0);
+                 match = !am_cond_regexec(ce, value, nsub, regmatch);
                  if (match)
                      backrefs = am_cond_backrefs(r, ce, value, regmatch);
 
             } else if (ce->flags & AM_COND_FLAG_REG) {
-                 match = !ap_regexec(ce->regex, value, 0, NULL, 0);
+                 match = !am_cond_regexec(ce, value, 0, NULL);
 
             } else if ((ce->flags & AM_COND_FLAG_SUB) && (ce->flags & AM_COND_FLAG_NC)) {
                  match = (ap_strcasestr(value, ce->str) != NULL);
@@ -480,7 +1451,7 @@ int am_check_permissions(request_rec *r, am_session_state_t *session)
         /*
          * If no match, we stop here, except if it is an [OR] condition
          */
-        if (!match & !(ce->flags & AM_COND_FLAG_OR)) {
+        if (!match && op->on_fail == AM_COND_OP_DENY) {
             ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
                           "Client failed to match %s",
                           ce->directive);
@@ -490,14 +1461,23 @@ int am_check_permissions(request_rec *r, am_session_state_t *session)
             return HTTP_FORBIDDEN;
         }
 
+        am_diag_printf(r, "\n");
+
+        if (!match) {
+            i = op->on_fail;
+            continue;
+        }
+
         /*
-         * Match on [OR] condition means we skip until a rule
-         * without [OR], 
+         * Match on [OR] condition means we skip the rest of the group
          */
-        if (match && (ce->flags & AM_COND_FLAG_OR))
-            skip_or = 1;
+        for (i++; i < op->on_match; i++) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                          "Skip %s, [OR] rule matched previously",
+                          program->ops[i].cond->directive);
 
-        am_diag_printf(r, "\n");
+            am_diag_printf(r, "Skip, [OR] rule matched previously\n");
+        }
     }
 
     am_diag_printf(r, "%s succeeds\n", __func__);
@@ -505,6 +1485,165 @@ int am_check_permissions(request_rec *r, am_session_state_t *session)
     return OK;
 }
 
+/* This function computes the key of the authorization decision for the
+ * current location in the per-process authorization cache.
+ *
+ * The decision depends on the session, which is identified by its id
+ * and the generations it was created under, and on the conditions of
+ * the location. Merged directory configurations are copies, so the
+ * conditions are identified by the directive string of the first one,
+ * which is shared by every copy, and their number. The names conditions
+ * with the MAP flag resolve to through the MellonSetEnv mappings of the
+ * location are added. Conditions with the FSTR flag may depend on the
+ * request environment, their decision is not cached.
+ *
+ * Parameters:
+ *  request_rec *r                      The current request.
+ *  am_session_state_t *session         The current session.
+ *  const am_cond_program_t *program    The compiled conditions.
+ *
+ * Returns:
+ *  The key allocated from the request pool, or NULL if the decision
+ *  should not be cached.
+ */
+static const char *am_authz_cache_key(request_rec *r,
+                                      am_session_state_t *session,
+                                      const am_cond_program_t *program)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    const am_cond_t *conds;
+    const char *data;
+    int i;
+
+    if (mod_cfg->authz_cache_size <= 0 || session->session_id == NULL ||
+        program == NULL || program->nops == 0 || program->has_fstr) {
+        return NULL;
+    }
+
+    conds = (const am_cond_t *)dir_cfg->cond->elts;
+
+    data = apr_psprintf(r->pool, "%s\n%" APR_UINT64_T_FMT "\n%"
+                        APR_UINT64_T_FMT "\n%pp\n%d",
+                        session->session_id, session->generation,
+                        session->idp_generation, conds[0].directive,
+                        dir_cfg->cond->nelts);
+
+    for (i = 0; i < program->nslots; i++) {
+        if (program->mapped[i]) {
+            data = apr_pstrcat(r->pool, data, "\n",
+                               am_mapped_env_attr_name(r, program->names[i],
+                                                       NULL),
+                               NULL);
+        }
+    }
+
+    return am_sha256_sum(r, (const unsigned char *)data, strlen(data));
+}
+
+/* This function checks that "MellonAttributeFilter auto" kept the
+ * attributes the conditions of the current location refer to. The
+ * names were collected from every section of the configuration at
+ * startup, see am_attribute_filter_init(), but not from .htaccess
+ * files: a condition there on an attribute left out of the session
+ * would never match, or with [NOT] always match.
+ *
+ * Parameters:
+ *  request_rec *r              The current request.
+ *
+ * Returns:
+ *  true if every attribute the conditions refer to is kept.
+ */
+static bool am_cond_attributes_kept(request_rec *r)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    apr_hash_t *names = mod_cfg->attribute_filter_auto_names;
+    const char *name;
+    int i;
+
+    if (names == NULL || dir_cfg->attribute_names_known) {
+        return true;
+    }
+
+    for (i = 0; i < dir_cfg->cond->nelts; i++) {
+        const am_cond_t *ce = &((am_cond_t *)(dir_cfg->cond->elts))[i];
+
+        if (ce->flags & AM_COND_FLAG_IGN) {
+            continue;
+        }
+
+        name = ce->varname;
+        if (apr_hash_get(names, name, APR_HASH_KEY_STRING) != NULL &&
+            (ce->flags & AM_COND_FLAG_MAP)) {
+            name = am_mapped_env_attr_name(r, ce->varname, NULL);
+        }
+        if (apr_hash_get(names, name, APR_HASH_KEY_STRING) == NULL) {
+            AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                          "MellonCond on attribute \"%s\" in a .htaccess"
+                          " file, but MellonAttributeFilter auto does not"
+                          " keep it; list it after auto in the server"
+                          " configuration", name);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* This function checks if the user has access according
+ * to the MellonRequire and MellonCond directives.
+ *
+ * The decision is served from the authorization cache when it is
+ * enabled with MellonAuthzCacheSize, see am_authz_cache_key().
+ *
+ * Parameters:
+ *  request_rec *r              The current request.
+ *  am_session_state_t *session The current session.
+ *
+ * Returns:
+ *  OK if the user has access and HTTP_FORBIDDEN if he doesn't,
+ *  HTTP_INTERNAL_SERVER_ERROR if the conditions refer to attributes
+ *  left out of the session, see am_cond_attributes_kept().
+ */
+int am_check_permissions(request_rec *r, am_session_state_t *session)
+{
+    am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
+    const am_cond_program_t *program;
+    const char *key;
+    int decision;
+
+    /* No program means there are no conditions */
+    program = dir_cfg->cond_program;
+    if (program == NULL) {
+        am_diag_printf(r, "%s succeeds\n", __func__);
+        return OK;
+    }
+
+    if (!am_cond_attributes_kept(r)) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    key = am_authz_cache_key(r, session, program);
+    if (key != NULL && am_cache_authz_get(r, key, &decision)) {
+        if (decision != OK) {
+            ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
+                          "Client denied access by cached decision");
+        }
+        am_diag_printf(r, "%s cached decision, returning %d\n",
+                       __func__, decision);
+        return decision;
+    }
+
+    decision = am_evaluate_conditions(r, session, program);
+
+    if (key != NULL) {
+        am_cache_authz_put(r, key, decision);
+    }
+
+    return decision;
+}
+
 /* This function sets default Cache-Control headers.
  *
  * Parameters:
@@ -1026,6 +2165,307 @@ char *am_generate_id(request_rec *r)
     return ret;
 }
 
+/* This function computes the MAC of a session id with a secret from
+ * MellonSessionIdSecretFile, HMAC-SHA256 truncated to
+ * AM_SESSION_ID_MAC_LENGTH hexadecimal characters.
+ *
+ * Parameters:
+ *  const am_session_id_key_t *key  The secret.
+ *  const char *id                  The random part of the session id,
+ *                                  AM_ID_LENGTH characters.
+ *  char *mac                       Buffer receiving the MAC, at least
+ *                                  AM_SESSION_ID_MAC_LENGTH + 1 bytes.
+ *
+ * Returns:
+ *  true on success, false if the MAC could not be computed.
+ */
+static bool am_session_id_mac(const am_session_id_key_t *key,
+                              const char *id, char *mac)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    int i;
+
+    if (HMAC(EVP_sha256(), key->secret, (int)key->len,
+             (const unsigned char *)id, AM_ID_LENGTH,
+             digest, &digest_len) == NULL ||
+        digest_len * 2 < AM_SESSION_ID_MAC_LENGTH) {
+        return false;
+    }
+
+    for (i = 0; i < AM_SESSION_ID_MAC_LENGTH; i += 2) {
+        mac[i] = hex[digest[i / 2] >> 4];
+        mac[i + 1] = hex[digest[i / 2] & 0xf];
+    }
+    mac[AM_SESSION_ID_MAC_LENGTH] = '\0';
+
+    return true;
+}
+
+/* This function generates a new session id. Without
+ * MellonSessionIdSecretFile it is an id from am_generate_id(), with it
+ * the id is followed by its MAC under the first secret so that
+ * am_session_id_valid() can tell forged ids from real ones without
+ * looking them up.
+ *
+ * Parameters:
+ *  request_rec *r       The request we associate allocated memory with.
+ *
+ * Returns:
+ *  The session id, or NULL on failure.
+ */
+char *am_generate_session_id(request_rec *r)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    char *id;
+    char *ret;
+
+    id = am_generate_id(r);
+    if (id == NULL || mod_cfg->session_id_keys == NULL) {
+        return id;
+    }
+
+    ret = apr_palloc(r->pool, AM_SESSION_ID_LENGTH + 1);
+    memcpy(ret, id, AM_ID_LENGTH);
+    if (!am_session_id_mac(&APR_ARRAY_IDX(mod_cfg->session_id_keys, 0,
+                                          am_session_id_key_t),
+                           id, ret + AM_ID_LENGTH)) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Error computing session id MAC: %lu",
+                      ERR_get_error());
+        return NULL;
+    }
+
+    return ret;
+}
+
+/* This function checks whether a session id presented by a client can
+ * be one we generated, before it is looked up in the session store.
+ * The id must have the length and characters of the ids generated by
+ * am_generate_session_id(), and with MellonSessionIdSecretFile set
+ * carry a valid MAC under one of the secrets. The MAC is compared in
+ * constant time.
+ *
+ * Parameters:
+ *  request_rec *r          The current request.
+ *  const char *session_id  The session id, e.g. from the cookie.
+ *
+ * Returns:
+ *  true if the session id is well formed and authentic.
+ */
+bool am_session_id_valid(request_rec *r, const char *session_id)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    apr_array_header_t *keys = mod_cfg->session_id_keys;
+    char mac[AM_SESSION_ID_MAC_LENGTH + 1];
+    apr_size_t expected_len;
+    apr_size_t i;
+    bool valid = false;
+    int k;
+
+    expected_len = keys != NULL ? AM_SESSION_ID_LENGTH : AM_ID_LENGTH;
+
+    for (i = 0; i < expected_len; i++) {
+        char c = session_id[i];
+
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    if (session_id[expected_len] != '\0') {
+        return false;
+    }
+
+    if (keys == NULL) {
+        return true;
+    }
+
+    for (k = 0; k < keys->nelts; k++) {
+        if (am_session_id_mac(&APR_ARRAY_IDX(keys, k, am_session_id_key_t),
+                              session_id, mac) &&
+            CRYPTO_memcmp(mac, session_id + AM_ID_LENGTH,
+                          AM_SESSION_ID_MAC_LENGTH) == 0) {
+            valid = true;
+        }
+    }
+
+    return valid;
+}
+
+/* Sealed data is a version byte, the nonce, the AES-256-GCM ciphertext
+ * and the tag, base64 encoded.
+ */
+#define AM_SEALED_VERSION 1
+#define AM_SEALED_NONCE_LEN 12
+#define AM_SEALED_TAG_LEN 16
+#define AM_SEALED_OVERHEAD (1 + AM_SEALED_NONCE_LEN + AM_SEALED_TAG_LEN)
+
+/* This function derives the key data is sealed with from a secret of
+ * MellonSessionIdSecretFile, so that the secret is never used both as a
+ * MAC key and as a cipher key.
+ *
+ * Parameters:
+ *  const am_session_id_key_t *key  The secret.
+ *  unsigned char *out              Buffer receiving the 32 byte key.
+ *
+ * Returns:
+ *  true on success, false if the key could not be derived.
+ */
+static bool am_sealing_key(const am_session_id_key_t *key,
+                           unsigned char *out)
+{
+    static const char label[] = "mellon sealed session";
+    unsigned int out_len = 0;
+
+    return HMAC(EVP_sha256(), key->secret, (int)key->len,
+                (const unsigned char *)label, sizeof(label) - 1,
+                out, &out_len) != NULL && out_len == 32;
+}
+
+/* This function encrypts and authenticates data with AES-256-GCM under
+ * the first secret of MellonSessionIdSecretFile.
+ *
+ * Parameters:
+ *  request_rec *r       The current request.
+ *  const char *data     The data to seal.
+ *  apr_size_t len       The length of data.
+ *  const char *aad      Authenticated, but not encrypted, string the
+ *                       data is bound to. It must be given again to
+ *                       am_unseal_data().
+ *
+ * Returns:
+ *  The sealed data as a base64 string, or NULL on failure.
+ */
+char *am_seal_data(request_rec *r, const char *data, apr_size_t len,
+                   const char *aad)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    unsigned char key[32];
+    unsigned char *buf;
+    unsigned char *out;
+    EVP_CIPHER_CTX *ctx;
+    char *encoded;
+    int out_len;
+    bool ok;
+
+    if (mod_cfg->session_id_keys == NULL ||
+        !am_sealing_key(&APR_ARRAY_IDX(mod_cfg->session_id_keys, 0,
+                                       am_session_id_key_t), key)) {
+        return NULL;
+    }
+
+    buf = apr_palloc(r->pool, len + AM_SEALED_OVERHEAD);
+    buf[0] = AM_SEALED_VERSION;
+    if (am_generate_random_bytes(r, buf + 1, AM_SEALED_NONCE_LEN) != OK) {
+        return NULL;
+    }
+    out = buf + 1 + AM_SEALED_NONCE_LEN;
+
+    if ((ctx = EVP_CIPHER_CTX_new()) == NULL) {
+        return NULL;
+    }
+    ok = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, buf + 1) == 1 &&
+         EVP_EncryptUpdate(ctx, NULL, &out_len, (const unsigned char *)aad,
+                           (int)strlen(aad)) == 1 &&
+         EVP_EncryptUpdate(ctx, out, &out_len, (const unsigned char *)data,
+                           (int)len) == 1 &&
+         EVP_EncryptFinal_ex(ctx, out + out_len, &out_len) == 1 &&
+         EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AM_SEALED_TAG_LEN,
+                             out + len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_cleanse(key, sizeof(key));
+
+    if (!ok) {
+        AM_LOG_RERROR(APLOG_MARK, APLOG_ERR, 0, r,
+                      "Error sealing data: %lu", ERR_get_error());
+        return NULL;
+    }
+
+    encoded = apr_palloc(r->pool,
+                         apr_base64_encode_len(len + AM_SEALED_OVERHEAD));
+    apr_base64_encode_binary(encoded, buf, len + AM_SEALED_OVERHEAD);
+
+    return encoded;
+}
+
+/* This function verifies and decrypts data sealed by am_seal_data(),
+ * trying every secret of MellonSessionIdSecretFile.
+ *
+ * Parameters:
+ *  request_rec *r       The current request.
+ *  const char *sealed   The sealed data, as returned by am_seal_data().
+ *  const char *aad      The string the data was bound to when sealed.
+ *  apr_size_t *len_out  The length of the returned data.
+ *
+ * Returns:
+ *  The data, NUL-terminated, or NULL if it was not sealed by us, was
+ *  modified or was bound to another string.
+ */
+char *am_unseal_data(request_rec *r, const char *sealed, const char *aad,
+                     apr_size_t *len_out)
+{
+    am_mod_cfg_rec *mod_cfg = am_get_mod_cfg(r->server);
+    apr_array_header_t *keys = mod_cfg->session_id_keys;
+    unsigned char key[32];
+    unsigned char *buf;
+    const unsigned char *in;
+    char *out;
+    EVP_CIPHER_CTX *ctx;
+    int buf_len, in_len, out_len;
+    int k;
+    bool ok = false;
+
+    if (keys == NULL || sealed == NULL) {
+        return NULL;
+    }
+
+    buf = apr_palloc(r->pool, apr_base64_decode_len(sealed));
+    buf_len = apr_base64_decode_binary(buf, sealed);
+    if (buf_len < AM_SEALED_OVERHEAD || buf[0] != AM_SEALED_VERSION) {
+        return NULL;
+    }
+
+    in = buf + 1 + AM_SEALED_NONCE_LEN;
+    in_len = buf_len - AM_SEALED_OVERHEAD;
+    out = apr_palloc(r->pool, in_len + 1);
+
+    if ((ctx = EVP_CIPHER_CTX_new()) == NULL) {
+        return NULL;
+    }
+
+    for (k = 0; k < keys->nelts && !ok; k++) {
+        if (!am_sealing_key(&APR_ARRAY_IDX(keys, k, am_session_id_key_t),
+                            key)) {
+            continue;
+        }
+        ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key,
+                                buf + 1) == 1 &&
+             EVP_DecryptUpdate(ctx, NULL, &out_len,
+                               (const unsigned char *)aad,
+                               (int)strlen(aad)) == 1 &&
+             EVP_DecryptUpdate(ctx, (unsigned char *)out, &out_len,
+                               in, in_len) == 1 &&
+             EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG,
+                                 AM_SEALED_TAG_LEN,
+                                 (void *)(in + in_len)) == 1 &&
+             EVP_DecryptFinal_ex(ctx, (unsigned char *)out + out_len,
+                                 &out_len) == 1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_cleanse(key, sizeof(key));
+
+    if (!ok) {
+        return NULL;
+    }
+
+    out[in_len] = '\0';
+    *len_out = in_len;
+
+    return out;
+}
+
 /* This returns the directroy part of a path, a la dirname(3)
  *
  * Parameters:
@@ -2658,6 +4098,59 @@ apr_time_t am_parse_timestamp(request_rec *r, const char *timestamp)
  * element like this <FOO xsi:nil="true"/>.
  */
 
+/**
+ * Quote a string as a JSON string
+ *
+ * Quotes, backslashes and control characters are escaped, so the
+ * result is also safe to use in a header value. Other bytes are copied
+ * unchanged, so the input must be UTF-8.
+ *
+ * @param[in] pool Memory allocation pool
+ * @param[in] str  String to quote
+ *
+ * @returns New allocated string including the surrounding quotes
+ */
+char *
+am_json_quote(apr_pool_t *pool, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p;
+    apr_size_t len = 2;
+    char *out, *o;
+
+    for (p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            len += 2;
+        } else if (*p < 0x20 || *p == 0x7f) {
+            len += 6;
+        } else {
+            len++;
+        }
+    }
+
+    o = out = apr_palloc(pool, len + 1);
+    *o++ = '"';
+    for (p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            *o++ = '\\';
+            *o++ = *p;
+        } else if (*p < 0x20 || *p == 0x7f) {
+            *o++ = '\\';
+            *o++ = 'u';
+            *o++ = '0';
+            *o++ = '0';
+            *o++ = hex[*p >> 4];
+            *o++ = hex[*p & 0xf];
+        } else {
+            *o++ = *p;
+        }
+    }
+    *o++ = '"';
+    *o = '\0';
+
+    return out;
+}
+
 /**
  * Join each string in array with separator
  *
@@ -2777,33 +4270,81 @@ am_mapped_env_attr_name(request_rec *r, const char *attr_name,
 {
     am_dir_cfg_rec *dir_cfg = am_get_dir_cfg(r);
     am_envattr_conf_t *env_attr_conf = NULL;
-    const char *mapped_name = NULL;
-    const char *prefixed_name = NULL;
-    bool prefixed = true;
 
     env_attr_conf = (am_envattr_conf_t *)
         apr_hash_get(dir_cfg->envattr, attr_name, APR_HASH_KEY_STRING);
 
+    /* The names of renamed attributes are prepared with the configuration */
     if (env_attr_conf != NULL) {
-        mapped_name = env_attr_conf->name;
-        if (!env_attr_conf->prefixed) {
-            prefixed = false;
+        if (prefixed_out) {
+            *prefixed_out = env_attr_conf->prefixed_name;
         }
-    } else {
-        mapped_name = attr_name;
+        return env_attr_conf->name;
     }
 
     if (prefixed_out) {
-        if (prefixed) {
-            prefixed_name = apr_pstrcat(r->pool, ENV_ATTR_PREFIX,
-                                        mapped_name, NULL);
-        } else {
-            prefixed_name = mapped_name;
+        *prefixed_out = apr_pstrcat(r->pool, ENV_ATTR_PREFIX, attr_name, NULL);
+    }
+
+    return attr_name;
+}
+
+/**
+ * Get the start time of a process
+ *
+ * Only used to tell a process from an earlier one with the same pid,
+ * e.g. the owner of a lock in shared memory. On Linux this is the
+ * starttime field of /proc/<pid>/stat, truncated to 32 bits.
+ *
+ * @param[in] pid Process id
+ *
+ * @returns start time of the process, 0 if it is unknown.
+ */
+apr_uint32_t
+am_process_start_time(pid_t pid)
+{
+#ifdef __linux__
+    char path[64];
+    char buf[1024];
+    const char *p;
+    apr_uint64_t start = 0;
+    ssize_t len;
+    int fd;
+    int field;
+
+    apr_snprintf(path, sizeof(path), "/proc/%ld/stat", (long)pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    /* The command name may contain anything, fields follow its last ')'.
+     * The state is field 3, starttime field 22. */
+    p = strrchr(buf, ')');
+    if (p == NULL) {
+        return 0;
+    }
+    for (field = 2; field < 22 && *p; p++) {
+        if (*p == ' ') {
+            field++;
         }
-        *prefixed_out = prefixed_name;
     }
-    
-    return mapped_name;
+    while (*p >= '0' && *p <= '9') {
+        start = start * 10 + (apr_uint64_t)(*p++ - '0');
+    }
+
+    /* 0 means unknown, a start time truncated to 0 becomes 1 */
+    return (apr_uint32_t)start ? (apr_uint32_t)start : 1;
+#else
+    (void)pid;
+    return 0;
+#endif
 }
 
 /**
@@ -97,6 +97,17 @@ static int am_post_config_init(apr_pool_t *pool, apr_pool_t *log_pool,
         return OK;
     } 
 
+    if (am_get_mod_cfg(s)->session_storage == AM_SESSION_STORAGE_COOKIE &&
+        am_get_mod_cfg(s)->session_id_keys == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s,
+                     "MellonSessionStorage cookie requires "
+                     "MellonSessionIdSecretFile");
+        return !OK;
+    }
+
+    /* Collect the attributes "MellonAttributeFilter auto" keeps. */
+    am_attribute_filter_init(pool, s);
+
     /* Initialize the session cache. */
     apr_status = am_socache_init(pool, tmp_pool, s);
     if (apr_status != APR_SUCCESS) {
@@ -128,7 +139,7 @@ static void am_child_init(apr_pool_t *p, server_rec *s)
     const char *lockfile;
     CURLcode curl_res;
 
-    if (mod_cfg->socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+    if (mod_cfg->socache_lock != NULL) {
         /* Reinitialize the mutex for the child process. */
         lockfile = apr_global_mutex_lockfile(mod_cfg->socache_lock);
         rv = apr_global_mutex_child_init(&mod_cfg->socache_lock, lockfile, p);
@@ -138,6 +149,34 @@ static void am_child_init(apr_pool_t *p, server_rec *s)
         }
     }
 
+    /* Set up the per-process part of the session cache. */
+    rv = am_cache_child_init(p, s);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "Child process could not initialize session cache");
+    }
+
+    /* Set up the cache of substituted MellonCond regular expressions. */
+    rv = am_cond_regex_cache_init(p, s);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "Child process could not initialize regex cache");
+    }
+
+    /* Open the connection pool of the mellon_redis provider. */
+    rv = am_redis_child_init(p, s);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "Child process could not set up Redis connections");
+    }
+
+    /* Start the thread removing expired sessions from the socache. */
+    rv = am_cache_reaper_start(p, s);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "Child process could not start the session reaper");
+    }
+
     /* lasso_init() must be run before any other lasso-functions. */
     lasso_init();
 
@@ -162,6 +201,9 @@ static int am_create_request(request_rec *r)
     req_cfg = apr_pcalloc(r->pool, sizeof(am_req_cfg_rec));
 
     req_cfg->cookie_value = NULL;
+    req_cfg->sealed_cookie_value = NULL;
+    req_cfg->session_loaded = false;
+    req_cfg->session = NULL;
 #ifdef HAVE_ECP
     req_cfg->ecp_authn_req = false;
 #endif /* HAVE_ECP */
@@ -190,6 +232,10 @@ static void register_hooks(apr_pool_t *p)
     ap_hook_child_init(am_child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_create_request(am_create_request, NULL, NULL, APR_HOOK_MIDDLE);
 
+    /* Mellon's own socache providers, selectable with MellonSoCache. */
+    am_shm_register_provider(p);
+    am_redis_register_provider(p);
+
     /* Add the hook to handle requests to the mod_auth_mellon endpoint.
      *
      * This is APR_HOOK_FIRST because we do not expect nor require users